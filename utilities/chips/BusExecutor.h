@@ -0,0 +1,426 @@
+// Worker thread per physical bus, so operations on different buses run at
+// the same time while each bus still sees one transaction at a time.
+//
+// An operation is a function and an argument, typically a driver call on a
+// chip that lives on that bus. submit() queues it on the bus's worker and
+// returns at once; the result comes back through a completion callback,
+// run on the worker straight after the operation, or through a Future the
+// caller waits on. Operations on one bus run in the order submitted. The
+// drivers themselves are untouched: a driver instance is routed by giving
+// every operation on it the bus number of the device it was opened on.
+//
+// Buses are keyed by physical bus rather than device node: /dev/spidev0.0
+// and /dev/spidev0.1 are two chip selects on one controller and share a
+// worker, while /dev/i2c-1 and /dev/i2c-3 are separate adapters and get one
+// each.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef BUSEXECUTOR_H
+#define BUSEXECUTOR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <Timing.h>
+
+class BusExecutor
+{
+public:
+   static const int MAX_BUSES  = 8;
+   static const int QUEUE_SIZE = 256;  // Operations waiting per bus, a power of two
+
+   typedef bool (*Operation)(void *arg);
+   typedef void (*Completion)(void *context, bool ok);
+
+//=============================================================================
+// Future: Result of one submitted operation. Must stay put, and must not be
+//         submitted again, until it is ready.
+//
+   class Future
+   {
+   public:
+      Future() { state_ = 0; ok_ = false; }
+
+      bool ready() const { return __atomic_load_n(&state_, __ATOMIC_ACQUIRE) != 0; }
+
+//
+// Block until the operation has run and return whether it succeeded
+      bool wait()
+      {
+         while (__atomic_load_n(&state_, __ATOMIC_ACQUIRE) == 0)
+            syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+         return ok_;
+      }
+
+   private:
+      friend class BusExecutor;
+
+      void complete(bool ok)
+      {
+         ok_ = ok;
+         __atomic_store_n(&state_, 1, __ATOMIC_RELEASE);
+         syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+      }
+
+      int  state_;  // 0 queued or running, 1 done
+      bool ok_;
+   };
+
+   BusExecutor()
+   {
+      buses_ = 0;
+      running_ = false;
+   }
+
+//=============================================================================
+// addBus: Route a device to its bus worker, adding the bus if it is new.
+//         Returns the bus number to submit its operations to, or -1.
+//
+   int addBus(const char *device)
+   {
+      char key[sizeof(bus_[0].key)];
+      int b;
+
+      physicalBus(device, key, sizeof(key));
+      if ((b = find(key)) >= 0)
+         return b;
+      if (running_ || buses_ >= MAX_BUSES)
+      {
+         fputs("BusExecutor: Running or too many buses.\n", stderr);
+         return -1;
+      }
+
+      Bus &bus = bus_[buses_];
+      memset(bus.key, 0, sizeof(bus.key));
+      strncpy(bus.key, key, sizeof(bus.key) - 1);
+      bus.owner = this;
+      bus.head = bus.tail = 0;
+      bus.submitted = bus.completed = 0;
+      bus.failures = 0;
+      bus.busy = 0;
+      bus.waitTime.reset();
+      bus.runTime.reset();
+      pthread_mutex_init(&bus.lock, NULL);
+      pthread_cond_init(&bus.work, NULL);
+      pthread_cond_init(&bus.space, NULL);
+      pthread_cond_init(&bus.idle, NULL);
+      return buses_++;
+   }
+
+//
+// Bus number a device was routed to, or -1
+   int busOf(const char *device) const
+   {
+      char key[sizeof(bus_[0].key)];
+
+      physicalBus(device, key, sizeof(key));
+      return find(key);
+   }
+
+//=============================================================================
+// start: Start a worker per bus. pin puts worker b on CPU b modulo the CPUs
+//        online, so bus workers stop competing for a core where there are
+//        enough of them. realtime asks for SCHED_FIFO, falling back to
+//        normal priority if that is not allowed.
+//
+   bool start(bool pin = true, bool realtime = false)
+   {
+      if (running_)
+         return true;
+      stop_ = 0;
+      for (int b = 0 ; b < buses_ ; ++b)
+         if (!startThread(b, pin, realtime))
+         {
+            __atomic_store_n(&stop_, 1, __ATOMIC_RELAXED);
+            for (int j = 0 ; j < b ; ++j)
+            {
+               wake(bus_[j]);
+               pthread_join(bus_[j].thread, NULL);
+            }
+            return false;
+         }
+      running_ = true;
+      return true;
+   }
+
+//=============================================================================
+// stop: Run everything already queued, then stop the workers
+//
+   void stop()
+   {
+      if (!running_)
+         return;
+      __atomic_store_n(&stop_, 1, __ATOMIC_RELAXED);
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         wake(bus_[b]);
+         pthread_join(bus_[b].thread, NULL);
+      }
+      running_ = false;
+   }
+
+//=============================================================================
+// end: Stop the workers and forget the buses
+//
+   void end()
+   {
+      stop();
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         pthread_mutex_destroy(&bus_[b].lock);
+         pthread_cond_destroy(&bus_[b].work);
+         pthread_cond_destroy(&bus_[b].space);
+         pthread_cond_destroy(&bus_[b].idle);
+      }
+      buses_ = 0;
+   }
+
+//=============================================================================
+// submit: Queue an operation on a bus, blocking while its queue is full.
+//         done(context, ok) runs on the worker once the operation has. Must
+//         not be called from a completion on the same bus, which would wait
+//         on itself if that queue were full; use trySubmit() there.
+//
+   bool submit(int bus, Operation op, void *arg, Completion done = NULL, void *context = NULL)
+   {
+      return queue(bus, op, arg, done, context, NULL, true);
+   }
+
+   bool submit(int bus, Operation op, void *arg, Future &future)
+   {
+      future.state_ = 0;
+      return queue(bus, op, arg, NULL, NULL, &future, true);
+   }
+
+//
+// As submit() but false rather than waiting when the queue is full
+   bool trySubmit(int bus, Operation op, void *arg, Completion done = NULL, void *context = NULL)
+   {
+      return queue(bus, op, arg, done, context, NULL, false);
+   }
+
+//=============================================================================
+// drain: Wait until every operation submitted so far has completed
+//
+   void drain()
+   {
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         Bus &bus = bus_[b];
+
+         pthread_mutex_lock(&bus.lock);
+         while (bus.completed != bus.submitted)
+            pthread_cond_wait(&bus.idle, &bus.lock);
+         pthread_mutex_unlock(&bus.lock);
+      }
+   }
+
+   int buses() const                  { return buses_; }
+   const char *nameOf(int b) const    { return bus_[b].key; }
+
+//
+// Counters are only stable once drained or stopped
+   uint64_t getCompleted(int b) const { return bus_[b].completed; }
+   uint64_t getFailures(int b) const  { return bus_[b].failures; }
+   uint64_t getBusyTime(int b) const  { return bus_[b].busy; }      // Nanoseconds running operations
+   const LatencyStats &getWaitTime(int b) const { return bus_[b].waitTime; }  // Submit to start
+   const LatencyStats &getRunTime(int b) const  { return bus_[b].runTime; }
+   void resetStats()
+   {
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         bus_[b].failures = 0;
+         bus_[b].busy = 0;
+         bus_[b].waitTime.reset();
+         bus_[b].runTime.reset();
+      }
+   }
+
+//=============================================================================
+// physicalBus: Name of the bus a device node is on. A spidev node is named
+//              for controller and chip select, so the chip select is dropped.
+//
+   static void physicalBus(const char *device, char *key, size_t size)
+   {
+      const char *dot;
+
+      snprintf(key, size, "%s", device);
+      if (strncmp(device, "/dev/spidev", 11) == 0 && (dot = strchr(device + 11, '.')) != NULL &&
+          (size_t) (dot - device) < size)
+         key[dot - device] = '\0';
+   }
+
+private:
+   struct Job
+   {
+      Operation  op;
+      void      *arg;
+      Completion done;
+      void      *context;
+      Future    *future;
+      uint64_t   queued;
+   };
+
+   struct Bus
+   {
+      char            key[32];
+      BusExecutor    *owner;
+      Job             job[QUEUE_SIZE];
+      uint32_t        head;       // Next free slot, under lock
+      uint32_t        tail;       // Next to run, under lock
+      uint64_t        submitted;
+      uint64_t        completed;
+      uint64_t        failures;   // The rest are the worker's alone
+      uint64_t        busy;
+      LatencyStats    waitTime;
+      LatencyStats    runTime;
+      pthread_mutex_t lock;
+      pthread_cond_t  work;       // Queue no longer empty, or stopping
+      pthread_cond_t  space;      // Queue no longer full
+      pthread_cond_t  idle;       // Everything submitted has completed
+      pthread_t       thread;
+   };
+
+   int find(const char *key) const
+   {
+      for (int b = 0 ; b < buses_ ; ++b)
+         if (strcmp(bus_[b].key, key) == 0)
+            return b;
+      return -1;
+   }
+
+   static void wake(Bus &bus)
+   {
+      pthread_mutex_lock(&bus.lock);
+      pthread_cond_signal(&bus.work);
+      pthread_mutex_unlock(&bus.lock);
+   }
+
+   bool queue(int b, Operation op, void *arg, Completion done, void *context, Future *future,
+              bool block)
+   {
+      if (!running_ || b < 0 || b >= buses_)
+      {
+         fputs("BusExecutor: Not running or no such bus.\n", stderr);
+         return false;
+      }
+
+      Bus &bus = bus_[b];
+      pthread_mutex_lock(&bus.lock);
+      while (bus.head - bus.tail == (uint32_t) QUEUE_SIZE)
+      {
+         if (!block)
+         {
+            pthread_mutex_unlock(&bus.lock);
+            return false;
+         }
+         pthread_cond_wait(&bus.space, &bus.lock);
+      }
+
+      Job &job = bus.job[bus.head++ & (QUEUE_SIZE - 1)];
+      job.op = op;
+      job.arg = arg;
+      job.done = done;
+      job.context = context;
+      job.future = future;
+      job.queued = Timing::now();
+      bus.submitted++;
+      if (bus.head - bus.tail == 1) // Worker may be asleep on an empty queue
+         pthread_cond_signal(&bus.work);
+      pthread_mutex_unlock(&bus.lock);
+      return true;
+   }
+
+   bool startThread(int b, bool pin, bool realtime)
+   {
+      Bus &bus = bus_[b];
+      pthread_attr_t attr;
+      struct sched_param param;
+      cpu_set_t cpus;
+
+      pthread_attr_init(&attr);
+      if (pin)
+      {
+         CPU_ZERO(&cpus);
+         CPU_SET(b % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+         pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+      }
+      if (realtime)
+      {
+         param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+         pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+         pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+         pthread_attr_setschedparam(&attr, &param);
+      }
+      if (pthread_create(&bus.thread, &attr, worker, &bus) != 0)
+      {
+         if (!realtime)
+         {
+            pthread_attr_destroy(&attr);
+            fprintf(stderr, "BusExecutor: Unable to start worker for %s.\n", bus.key);
+            return false;
+         }
+         fputs("BusExecutor: No real-time priority, running at normal priority.\n", stderr);
+         pthread_attr_destroy(&attr);
+         return startThread(b, pin, false);
+      }
+      pthread_attr_destroy(&attr);
+      return true;
+   }
+
+//
+// Take the next operation, run it and report it, until stopped with nothing left
+   static void *worker(void *arg)
+   {
+      Bus &bus = *(Bus *) arg;
+      BusExecutor &x = *bus.owner;
+
+      pthread_mutex_lock(&bus.lock);
+      while (true)
+      {
+         while (bus.head == bus.tail && !__atomic_load_n(&x.stop_, __ATOMIC_RELAXED))
+            pthread_cond_wait(&bus.work, &bus.lock);
+         if (bus.head == bus.tail)
+            break;
+
+         Job job = bus.job[bus.tail++ & (QUEUE_SIZE - 1)];
+         if (bus.head - bus.tail == (uint32_t) QUEUE_SIZE - 1) // Was full
+            pthread_cond_broadcast(&bus.space);
+         pthread_mutex_unlock(&bus.lock);
+
+         uint64_t start = Timing::now();
+         bool ok = job.op(job.arg);
+         uint64_t end = Timing::now();
+
+         bus.waitTime.record(start - job.queued);
+         bus.runTime.record(end - start);
+         bus.busy += end - start;
+         if (!ok)
+            bus.failures++;
+         if (job.done != NULL)
+            job.done(job.context, ok);
+         if (job.future != NULL)
+            job.future->complete(ok);
+
+         pthread_mutex_lock(&bus.lock);
+         if (++bus.completed == bus.submitted)
+            pthread_cond_broadcast(&bus.idle);
+      }
+      pthread_mutex_unlock(&bus.lock);
+      return NULL;
+   }
+
+   Bus  bus_[MAX_BUSES];
+   int  buses_;
+   bool running_;
+   int  stop_;
+};
+
+#endif
@@ -0,0 +1,659 @@
+// Declarative chip configuration: which buses exist, which chips sit on them
+// and the register state each should start in.
+//
+// A configuration file is a list of lines; # starts a comment. A bus line
+// opens a bus and the chip lines after it are on that bus:
+//
+//    i2c /dev/i2c-1
+//    mcp23008 valves   0x20 iodir=0x0f gppu=0x0f olat=0x00
+//    tsl2561  daylight 0x29 gain=16 integ=101
+//    mcp4725  pump     0x62 value=2048
+//    spi /dev/spidev0.0 speed=1000000
+//    mcp3008  levels
+//
+// bringUp() opens every bus once and initialises every chip on an I2C bus
+// in one combined I2C_RDWR transaction, optionally reading registers back in
+// the same transaction to confirm each chip is there. Buses are brought up
+// in parallel, a thread each. Only if a bus's transaction fails is it redone
+// a chip at a time to find the chip at fault. The drivers then attach() to a
+// chip by name without touching the bus again.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef CHIPCONFIG_H
+#define CHIPCONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <I2CBus.h>
+#include <MCP3008.h>
+#include <MCP23008.h>
+#include <MCP4725.h>
+#include <TSL2561.h>
+#include <Timing.h>
+
+class ChipConfig
+{
+public:
+   static const int MAX_BUSES = 8;
+   static const int MAX_CHIPS = 64;
+
+   static const uint8_t BUS_I2C = 1;
+   static const uint8_t BUS_SPI = 2;
+
+   static const uint8_t CHIP_MCP23008 = 1;
+   static const uint8_t CHIP_TSL2561  = 2;
+   static const uint8_t CHIP_MCP4725  = 3;
+   static const uint8_t CHIP_MCP3008  = 4;
+
+//
+// MCP23008 register state, IODIR through GPPU at their register numbers, then OLAT
+   static const int REG_IODIR = MCP23008::Iodir::address, REG_IPOL = MCP23008::Ipol::address;
+   static const int REG_GPINTEN = MCP23008::Gpinten::address, REG_DEFVAL = MCP23008::Defval::address;
+   static const int REG_INTCON = MCP23008::Intcon::address, REG_IOCON = MCP23008::Iocon::address;
+   static const int REG_GPPU = MCP23008::Gppu::address, REG_OLAT = REG_GPPU + 1;
+
+   struct Chip
+   {
+      char     name[16];
+      uint8_t  kind;
+      uint8_t  bus;
+      uint8_t  addr;
+      bool     ok;        // Came up as configured
+      int      line;      // In the configuration file
+
+      uint8_t  reg[8];    // MCP23008, REG_IODIR to REG_GPPU then REG_OLAT
+      uint8_t  gain;      // TSL2561
+      uint8_t  integ;
+      bool     power;
+      uint16_t value;     // MCP4725
+      uint8_t  powerDown;
+
+      uint8_t  tx[3][9];  // Initialisation messages
+      uint8_t  rx[8];     // Read back
+   };
+
+   struct Bus
+   {
+      char     device[32];
+      uint8_t  type;
+      uint32_t speed;     // SPI clock
+      int      chips;
+      uint64_t openNanos; // Time to open the device
+      uint64_t initNanos; // Time to initialise its chips
+      int      messages;
+      int      transfers; // ioctls
+      bool     retried;   // The combined transaction failed and was redone per chip
+      bool     ok;
+
+      ChipConfig *config;
+      pthread_t   thread;
+      bool        threaded;
+      I2CBus      i2c;
+      int         spiFd;
+   };
+
+   ChipConfig()
+   {
+      buses_ = 0;
+      chips_ = 0;
+      startNanos_ = 0;
+   }
+
+//=============================================================================
+// load: Read a configuration file. Reports the first error with its line.
+//
+   bool load(const char *path)
+   {
+      FILE *fp;
+      char line[1024];
+      int number = 0;
+
+      if ((fp = fopen(path, "r")) == NULL)
+      {
+         fprintf(stderr, "ChipConfig: Unable to open %s.\n", path);
+         return false;
+      }
+      buses_ = 0;
+      chips_ = 0;
+      while (fgets(line, sizeof(line), fp) != NULL)
+         if ((strchr(line, '\n') == NULL && !feof(fp)) || !parseLine(line, ++number))
+         {
+            fprintf(stderr, "ChipConfig: Error at %s line %d.\n", path, number);
+            fclose(fp);
+            return false;
+         }
+      fclose(fp);
+      return true;
+   }
+
+//=============================================================================
+// bringUp: Open every bus and initialise every chip, a thread per bus. With
+//          verify each chip's registers are read back in the same
+//          transaction. True if every chip came up.
+//
+   bool bringUp(bool verify = true)
+   {
+      uint64_t start = Timing::now();
+      bool ok = true;
+
+      verify_ = verify;
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         bus_[b].config = this;
+         bus_[b].threaded = buses_ > 1 &&
+                            pthread_create(&bus_[b].thread, NULL, busThread, &bus_[b]) == 0;
+         if (!bus_[b].threaded) // Just the one bus, or no thread to spare
+            busThread(&bus_[b]);
+      }
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         if (bus_[b].threaded)
+            pthread_join(bus_[b].thread, NULL);
+         ok = ok && bus_[b].ok;
+      }
+      startNanos_ = Timing::now() - start;
+      return ok;
+   }
+
+//
+// Close the buses; drivers attached to chips keep their own descriptors
+   void end()
+   {
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         bus_[b].i2c.end();
+         if (bus_[b].spiFd >= 0)
+            close(bus_[b].spiFd);
+         bus_[b].spiFd = -1;
+      }
+   }
+
+   int buses() const                { return buses_; }
+   int chips() const                { return chips_; }
+   const Bus &bus(int b) const      { return bus_[b]; }
+   const Chip &chip(int c) const    { return chip_[c]; }
+   uint64_t getStartNanos() const   { return startNanos_; }
+
+//
+// Chip number for a name, or -1
+   int find(const char *name) const
+   {
+      for (int c = 0 ; c < chips_ ; ++c)
+         if (strcmp(chip_[c].name, name) == 0)
+            return c;
+      return -1;
+   }
+
+//=============================================================================
+// attach: Open a driver on a configured chip without touching the bus
+//
+   bool attach(MCP23008 &driver, const char *name) const
+   {
+      const Chip *c = lookup(name, CHIP_MCP23008);
+      return c != NULL && driver.attach(bus_[c->bus].device, c->addr, c->reg[REG_IODIR],
+                                        c->reg[REG_GPPU], c->reg[REG_OLAT]);
+   }
+
+   bool attach(TSL2561 &driver, const char *name) const
+   {
+      const Chip *c = lookup(name, CHIP_TSL2561);
+      return c != NULL && driver.attach(bus_[c->bus].device, c->addr, c->gain, c->integ);
+   }
+
+   bool attach(MCP4725 &driver, const char *name) const
+   {
+      const Chip *c = lookup(name, CHIP_MCP4725);
+      return c != NULL && driver.begin(bus_[c->bus].device, c->addr); // Never probes
+   }
+
+   bool attach(MCP3008 &driver, const char *name) const
+   {
+      const Chip *c = lookup(name, CHIP_MCP3008);
+      return c != NULL && driver.begin(bus_[c->bus].device, bus_[c->bus].speed);
+   }
+
+//=============================================================================
+// report: Startup time per bus and any chips that failed
+//
+   void report(FILE *fp) const
+   {
+      for (int b = 0 ; b < buses_ ; ++b)
+      {
+         const Bus &bus = bus_[b];
+         fprintf(fp, "%-16s %-3s %2d chips  open %8.1fus  init %8.1fus  %3d messages in %2d ioctls%s\n",
+                 bus.device, bus.type == BUS_I2C ? "i2c" : "spi", bus.chips, bus.openNanos / 1000.0,
+                 bus.initNanos / 1000.0, bus.messages, bus.transfers,
+                 bus.retried ? " (retried per chip)" : "");
+      }
+      for (int c = 0 ; c < chips_ ; ++c)
+         if (!chip_[c].ok)
+            fprintf(fp, "   %s (%s 0x%02x on %s, line %d) did not come up\n", chip_[c].name,
+                    kindName(chip_[c].kind), chip_[c].addr, bus_[chip_[c].bus].device, chip_[c].line);
+      fprintf(fp, "Startup %.1fus for %d chips on %d buses\n", startNanos_ / 1000.0, chips_, buses_);
+   }
+
+   static const char *kindName(uint8_t kind)
+   {
+      switch (kind)
+      {
+      case CHIP_MCP23008: return "mcp23008";
+      case CHIP_TSL2561:  return "tsl2561";
+      case CHIP_MCP4725:  return "mcp4725";
+      case CHIP_MCP3008:  return "mcp3008";
+      }
+      return "?";
+   }
+
+private:
+   static const int MSGS_PER_CHIP = 5;
+
+   const Chip *lookup(const char *name, uint8_t kind) const
+   {
+      int c = find(name);
+
+      if (c < 0 || chip_[c].kind != kind)
+      {
+         fprintf(stderr, "ChipConfig: No %s named %s.\n", kindName(kind), name);
+         return NULL;
+      }
+      if (!chip_[c].ok)
+      {
+         fprintf(stderr, "ChipConfig: %s did not come up.\n", name);
+         return NULL;
+      }
+      return &chip_[c];
+   }
+
+   static bool number(const char *text, long low, long high, long &value)
+   {
+      char *end;
+
+      value = strtol(text, &end, 0);
+      return *text != '\0' && *end == '\0' && value >= low && value <= high;
+   }
+
+   bool parseLine(char *line, int lineNumber)
+   {
+      char *save;
+      char *word;
+
+      if ((word = strchr(line, '#')) != NULL)
+         *word = '\0';
+      if ((word = strtok_r(line, " \t\r\n", &save)) == NULL)
+         return true; // Blank
+
+      if (strcmp(word, "i2c") == 0 || strcmp(word, "spi") == 0)
+         return parseBus(word, save);
+
+      if (chips_ >= MAX_CHIPS)
+      {
+         fprintf(stderr, "ChipConfig: Too many chips, at most %d.\n", MAX_CHIPS);
+         return false;
+      }
+      Chip &c = chip_[chips_];
+      memset(&c, 0, sizeof(c));
+      c.line = lineNumber;
+      if (strcmp(word, "mcp23008") == 0)
+         c.kind = CHIP_MCP23008;
+      else if (strcmp(word, "tsl2561") == 0)
+         c.kind = CHIP_TSL2561;
+      else if (strcmp(word, "mcp4725") == 0)
+         c.kind = CHIP_MCP4725;
+      else if (strcmp(word, "mcp3008") == 0)
+         c.kind = CHIP_MCP3008;
+      else
+      {
+         fprintf(stderr, "ChipConfig: Unknown keyword %s.\n", word);
+         return false;
+      }
+      return parseChip(c, save);
+   }
+
+   bool parseBus(const char *type, char *save)
+   {
+      char *device = strtok_r(NULL, " \t\r\n", &save);
+      char *word;
+      long value;
+
+      if (buses_ >= MAX_BUSES || device == NULL)
+      {
+         fputs("ChipConfig: Too many buses or no device.\n", stderr);
+         return false;
+      }
+      Bus &bus = bus_[buses_];
+      snprintf(bus.device, sizeof(bus.device), "%s", device);
+      bus.type = strcmp(type, "i2c") == 0 ? BUS_I2C : BUS_SPI;
+      bus.speed = 1000000;
+      bus.chips = 0;
+      bus.spiFd = -1;
+      while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+         if (bus.type == BUS_SPI && strncmp(word, "speed=", 6) == 0 &&
+             number(word + 6, 1, 100000000, value))
+            bus.speed = value;
+         else
+         {
+            fprintf(stderr, "ChipConfig: Bad bus setting %s.\n", word);
+            return false;
+         }
+      buses_++;
+      return true;
+   }
+
+   bool parseChip(Chip &c, char *save)
+   {
+      char *name = strtok_r(NULL, " \t\r\n", &save);
+      char *word;
+      long value;
+
+      if (buses_ == 0 || name == NULL || find(name) >= 0)
+      {
+         fputs("ChipConfig: No bus yet, or a missing or repeated name.\n", stderr);
+         return false;
+      }
+      snprintf(c.name, sizeof(c.name), "%s", name);
+      c.bus = buses_ - 1;
+      if ((c.kind == CHIP_MCP3008) != (bus_[c.bus].type == BUS_SPI))
+      {
+         fprintf(stderr, "ChipConfig: A %s cannot go on %s.\n", kindName(c.kind), bus_[c.bus].device);
+         return false;
+      }
+
+//
+// Reset states, so a chip line with no settings leaves the chip as it powers up
+      c.reg[REG_IODIR] = 0xff;
+      c.gain = TSL2561::GAIN_1X;
+      c.integ = TSL2561::INTEG_TIME_402MS;
+      c.power = true;
+
+      if (c.kind != CHIP_MCP3008)
+      {
+         word = strtok_r(NULL, " \t\r\n", &save);
+         if (word == NULL || !number(word, 0, 0x7f, value) || !validAddress(c.kind, value))
+         {
+            fprintf(stderr, "ChipConfig: Bad or missing %s address.\n", kindName(c.kind));
+            return false;
+         }
+         c.addr = value < 8 ? value | (c.kind == CHIP_MCP23008 ? 0x20 : 0x60) : value;
+         for (int o = 0 ; o < chips_ ; ++o)
+            if (chip_[o].bus == c.bus && chip_[o].addr == c.addr)
+            {
+               fprintf(stderr, "ChipConfig: Address 0x%02x already used by %s.\n", c.addr, chip_[o].name);
+               return false;
+            }
+      }
+
+      while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+      {
+         char *setting = strchr(word, '=');
+         if (setting == NULL || !parseSetting(c, word, setting + 1))
+         {
+            fprintf(stderr, "ChipConfig: Bad %s setting %s.\n", kindName(c.kind), word);
+            return false;
+         }
+      }
+      bus_[c.bus].chips++;
+      chips_++;
+      return true;
+   }
+
+   static bool validAddress(uint8_t kind, long a)
+   {
+      switch (kind)
+      {
+      case CHIP_MCP23008: return a < 8 || (a >= 0x20 && a <= 0x27);
+      case CHIP_MCP4725:  return a < 8 || (a >= 0x60 && a <= 0x67);
+      case CHIP_TSL2561:  return a == TSL2561::ADDR_29 || a == TSL2561::ADDR_39 || a == TSL2561::ADDR_49;
+      }
+      return false;
+   }
+
+   bool parseSetting(Chip &c, const char *key, const char *text)
+   {
+      static const char *MCP23008_KEYS[8] = {"iodir=", "ipol=", "gpinten=", "defval=",
+                                             "intcon=", "iocon=", "gppu=", "olat="};
+      long value;
+
+      switch (c.kind)
+      {
+      case CHIP_MCP23008:
+         for (int r = 0 ; r < 8 ; ++r)
+            if (strncmp(key, MCP23008_KEYS[r], strlen(MCP23008_KEYS[r])) == 0 &&
+                number(text, 0, 0xff, value))
+            {
+               c.reg[r] = value;
+               return true;
+            }
+         return false;
+
+      case CHIP_TSL2561:
+         if (strncmp(key, "gain=", 5) == 0)
+         {
+            c.gain = strcmp(text, "16") == 0 ? TSL2561::GAIN_16X : TSL2561::GAIN_1X;
+            return strcmp(text, "16") == 0 || strcmp(text, "1") == 0;
+         }
+         if (strncmp(key, "integ=", 6) == 0)
+         {
+            static const char *TIMES[4] = {"13", "101", "402", "manual"};
+            for (int t = 0 ; t < 4 ; ++t)
+               if (strcmp(text, TIMES[t]) == 0)
+               {
+                  c.integ = t;
+                  return true;
+               }
+            return false;
+         }
+         if (strncmp(key, "power=", 6) == 0)
+         {
+            c.power = strcmp(text, "on") == 0;
+            return c.power || strcmp(text, "off") == 0;
+         }
+         return false;
+
+      case CHIP_MCP4725:
+         if (strncmp(key, "value=", 6) == 0 && number(text, 0, 0x0fff, value))
+         {
+            c.value = value;
+            return true;
+         }
+         if (strncmp(key, "powerdown=", 10) == 0 && number(text, 0, 3, value))
+         {
+            c.powerDown = value;
+            return true;
+         }
+         return false;
+      }
+      return false;
+   }
+
+//
+// The messages that put one chip in its configured state, then those that
+// read it back; returns how many were added
+   int initMsgs(Chip &c, struct i2c_msg *msgs, bool verify)
+   {
+      int n = 0;
+
+      switch (c.kind)
+      {
+      case CHIP_MCP23008:
+//
+// Latches first so outputs come up at their level, then IODIR to GPPU in one
+// sequential write. A SEQOP IOCON stops the address moving, so it goes last.
+         c.tx[0][0] = MCP23008::Olat::address;
+         c.tx[0][1] = c.reg[REG_OLAT];
+         I2CBus::writeMsg(msgs[n++], c.addr, c.tx[0], 2);
+         c.tx[1][0] = MCP23008::Iodir::address;
+         memcpy(&c.tx[1][1], c.reg, 7);
+         c.tx[1][1 + REG_IOCON] = MCP23008::Seqop::insert(c.reg[REG_IOCON], 0);
+         I2CBus::writeMsg(msgs[n++], c.addr, c.tx[1], 8);
+         if (MCP23008::Seqop::extract(c.reg[REG_IOCON]))
+         {
+            c.tx[2][0] = MCP23008::Iocon::address;
+            c.tx[2][1] = c.reg[REG_IOCON];
+            I2CBus::writeMsg(msgs[n++], c.addr, c.tx[2], 2);
+         }
+         if (verify)
+         {
+            I2CBus::writeMsg(msgs[n++], c.addr, c.tx[1], 1);
+            I2CBus::readMsg(msgs[n++], c.addr, c.rx, verifyLength(c));
+         }
+         break;
+
+      case CHIP_TSL2561:
+         c.tx[0][0] = TSL2561::ControlRegister::address;
+         c.tx[0][1] = c.power ? TSL2561::CONTROL_POWERON : TSL2561::CONTROL_POWEROFF;
+         I2CBus::writeMsg(msgs[n++], c.addr, c.tx[0], 2);
+         c.tx[1][0] = TSL2561::TimingRegister::address;
+         c.tx[1][1] = c.gain | c.integ;
+         I2CBus::writeMsg(msgs[n++], c.addr, c.tx[1], 2);
+         if (verify)
+         {
+            I2CBus::writeMsg(msgs[n++], c.addr, c.tx[1], 1);
+            I2CBus::readMsg(msgs[n++], c.addr, c.rx, 1);
+         }
+         break;
+
+      case CHIP_MCP4725:
+         c.tx[0][0] = (c.powerDown << 4) | (c.value >> 8); // Fast write
+         c.tx[0][1] = c.value & 0xff;
+         I2CBus::writeMsg(msgs[n++], c.addr, c.tx[0], 2);
+         if (verify)
+            I2CBus::readMsg(msgs[n++], c.addr, c.rx, 3);
+         break;
+      }
+      return n;
+   }
+
+   static int verifyLength(const Chip &c)
+   {
+      return MCP23008::Seqop::extract(c.reg[REG_IOCON]) ? 1 : 7;
+   }
+
+//
+// Whether what was read back matches what was written
+   static bool verified(const Chip &c)
+   {
+      switch (c.kind)
+      {
+      case CHIP_MCP23008:
+         return memcmp(c.rx, c.reg, verifyLength(c)) == 0;
+      case CHIP_TSL2561:
+         return (c.rx[0] & (TSL2561::GAIN_MASK | TSL2561::INTEG_TIME_MASK)) == (c.gain | c.integ);
+      case CHIP_MCP4725:
+         return ((c.rx[0] >> 1) & 0x03) == c.powerDown &&
+                ((c.rx[1] << 4) | (c.rx[2] >> 4)) == c.value;
+      }
+      return true;
+   }
+
+   void bringUpI2C(Bus &bus, int b)
+   {
+      struct i2c_msg msgs[MAX_CHIPS * MSGS_PER_CHIP];
+      int first[MAX_CHIPS + 1];
+      int chip[MAX_CHIPS];
+      int n = 0, count = 0;
+
+      uint64_t start = Timing::now();
+      bus.ok = bus.i2c.begin(bus.device);
+      bus.openNanos = Timing::now() - start;
+      if (!bus.ok)
+         return;
+
+      start = Timing::now();
+      for (int c = 0 ; c < chips_ ; ++c)
+         if (chip_[c].bus == b)
+         {
+            chip[count] = c;
+            first[count++] = n;
+            n += initMsgs(chip_[c], msgs + n, verify_);
+         }
+      first[count] = n;
+      bus.messages = n;
+      bus.transfers = (n + I2CBus::MAX_MSGS - 1) / I2CBus::MAX_MSGS;
+
+      bool all = bus.i2c.transfer(msgs, n);
+      if (!all) // Find out which chips are at fault
+      {
+         bus.retried = true;
+         for (int k = 0 ; k < count ; ++k)
+         {
+            chip_[chip[k]].ok = bus.i2c.transfer(msgs + first[k], first[k + 1] - first[k]);
+            bus.transfers++;
+         }
+      }
+      for (int k = 0 ; k < count ; ++k)
+      {
+         Chip &c = chip_[chip[k]];
+         c.ok = (all || c.ok) && (!verify_ || verified(c));
+         bus.ok = bus.ok && c.ok;
+      }
+      bus.initNanos = Timing::now() - start;
+   }
+
+//
+// The MCP3008 has no registers; with verify, a conversion on channel 0 must
+// come back with its null bit low, which a missing chip's floating line won't
+   void bringUpSPI(Bus &bus, int b)
+   {
+      MCP3008 adc;
+
+      uint64_t start = Timing::now();
+      bus.ok = adc.begin(bus.device, bus.speed);
+      bus.openNanos = Timing::now() - start;
+
+      start = Timing::now();
+      for (int c = 0 ; c < chips_ ; ++c)
+         if (chip_[c].bus == b)
+         {
+            chip_[c].ok = bus.ok;
+            if (bus.ok && verify_)
+            {
+               struct spi_ioc_transfer msg;
+               uint8_t tx[3];
+
+               MCP3008::encodeCommand(0, MCP3008::INPUT_MODE_SINGLE, tx);
+               memset(&msg, 0, sizeof(msg));
+               msg.tx_buf = (unsigned long) tx;
+               msg.rx_buf = (unsigned long) chip_[c].rx;
+               msg.len = 3;
+               msg.speed_hz = bus.speed;
+               msg.bits_per_word = 8;
+               chip_[c].ok = ioctl(adc.getFd(), SPI_IOC_MESSAGE(1), &msg) >= 0 &&
+                             (chip_[c].rx[1] & 0x04) == 0;
+               bus.messages++;
+               bus.transfers++;
+            }
+            bus.ok = bus.ok && chip_[c].ok;
+         }
+      bus.initNanos = Timing::now() - start;
+      bus.spiFd = adc.getFd(); // Keep the bus open until end()
+   }
+
+   static void *busThread(void *arg)
+   {
+      Bus &bus = *(Bus *) arg;
+      int b = &bus - bus.config->bus_;
+
+      bus.messages = 0;
+      bus.transfers = 0;
+      bus.retried = false;
+      if (bus.type == BUS_I2C)
+         bus.config->bringUpI2C(bus, b);
+      else
+         bus.config->bringUpSPI(bus, b);
+      return NULL;
+   }
+
+   Bus      bus_[MAX_BUSES];
+   int      buses_;
+   Chip     chip_[MAX_CHIPS];
+   int      chips_;
+   bool     verify_;
+   uint64_t startNanos_;
+};
+
+#endif
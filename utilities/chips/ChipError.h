@@ -0,0 +1,349 @@
+// Error results for driver calls that must not block, and the log they feed.
+//
+// The try* entry points of the drivers return a Result<T>: the value, or a
+// ChipError naming the chip, the operation, what went wrong and the errno it
+// left. They print nothing and allocate nothing, so a read loop can meet a bus
+// full of errors and keep its timing, and decide for itself what to report.
+//
+// The older entry points keep their return conventions (-1, 0xff, false) and
+// report failures through ChipLog rather than writing stderr themselves. Until
+// ChipLog::start() is called that is straight to stderr, as before. After it,
+// lines go into a fixed ring that a writer thread drains to stderr, or to a
+// sink function, at no more than rate lines a second beyond an initial burst;
+// the rest are counted and reported as suppressed. A caller that finds the
+// ring busy or full drops its line rather than wait for it.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef CHIPERROR_H
+#define CHIPERROR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <Timing.h>
+
+struct ChipError
+{
+   static const uint8_t NONE     = 0;
+   static const uint8_t NOT_OPEN = 1;   // Device has not been opened
+   static const uint8_t INVALID  = 2;   // Argument out of range
+   static const uint8_t TRANSFER = 3;   // The bus transfer failed; see err
+
+   uint8_t     code;
+   int         err;     // errno from the failed call, 0 if none
+   const char *chip;    // String literals, so an error is copied freely
+   const char *op;
+
+   static ChipError make(uint8_t code, const char *chip, const char *op, int err = 0)
+   {
+      ChipError e;
+
+      e.code = code;
+      e.err = err;
+      e.chip = chip;
+      e.op = op;
+      return e;
+   }
+
+   const char *describe() const
+   {
+      switch (code)
+      {
+      case NONE:     return "no error";
+      case NOT_OPEN: return "device is not open";
+      case INVALID:  return "invalid argument";
+      case TRANSFER: return "transfer failed";
+      }
+      return "unknown error";
+   }
+
+//
+// As "MCP3008: getValue: transfer failed: Remote I/O error"
+   int format(char *buffer, int size) const
+   {
+      char text[64];
+
+      if (err == 0)
+         return snprintf(buffer, size, "%s: %s: %s", chip, op, describe());
+      return snprintf(buffer, size, "%s: %s: %s: %s", chip, op, describe(),
+                      strerror_r(err, text, sizeof(text)));
+   }
+};
+
+template <class T>
+class Result
+{
+public:
+   Result(T value)                { ok_ = true; value_ = value; error_ = ChipError::make(ChipError::NONE, "", ""); }
+   Result(const ChipError &error) { ok_ = false; value_ = T(); error_ = error; }
+
+   bool ok() const                { return ok_; }
+   explicit operator bool() const { return ok_; }
+   T    value() const             { return value_; }
+   T    valueOr(T fallback) const { return ok_ ? value_ : fallback; }
+   const ChipError &error() const { return error_; }
+
+private:
+   bool      ok_;
+   T         value_;
+   ChipError error_;
+};
+
+template <>
+class Result<void>
+{
+public:
+   Result()                       { ok_ = true; error_ = ChipError::make(ChipError::NONE, "", ""); }
+   Result(const ChipError &error) { ok_ = false; error_ = error; }
+
+   bool ok() const                { return ok_; }
+   explicit operator bool() const { return ok_; }
+   const ChipError &error() const { return error_; }
+
+private:
+   bool      ok_;
+   ChipError error_;
+};
+
+class ChipLog
+{
+public:
+   static const int LINES     = 64;
+   static const int LINE_SIZE = 128;
+
+   typedef void (*Sink)(const char *line, void *arg);
+
+//=============================================================================
+// start: Send lines through the ring from now on, to sink if given or stderr.
+//        rate is lines a second once burst lines have gone out.
+//
+   static bool start(uint32_t rate = 10, uint32_t burst = 20, Sink sink = NULL, void *arg = NULL)
+   {
+      State &s = state();
+
+      if (s.running)
+      {
+         fputs("ChipLog: Already started.\n", stderr);
+         return false;
+      }
+      s.head = s.tail = 0;
+      s.rate = rate;
+      s.burst = burst;
+      s.tokens = (uint64_t) burst * Timing::NSEC_PER_SEC;
+      s.last = Timing::now();
+      s.sink = sink;
+      s.arg = arg;
+      s.suppressed = s.dropped = s.reported = 0;
+      __atomic_store_n(&s.stop, 0, __ATOMIC_RELAXED);
+      if (pthread_create(&s.thread, NULL, writer, NULL) != 0)
+      {
+         fputs("ChipLog: Unable to start writer thread.\n", stderr);
+         return false;
+      }
+      __atomic_store_n(&s.running, 1, __ATOMIC_RELEASE);
+      return true;
+   }
+
+//
+// Flush what is queued and go back to writing stderr directly. The writer
+// switches posters over itself, under the lock, on its last pass, so every
+// line either went into the ring before that pass drains it or goes straight
+// out after.
+   static void stop()
+   {
+      State &s = state();
+
+      if (!isStarted())
+         return;
+      __atomic_store_n(&s.stop, 1, __ATOMIC_RELEASE);
+      pthread_join(s.thread, NULL);
+   }
+
+   static bool isStarted() { return __atomic_load_n(&state().running, __ATOMIC_ACQUIRE) != 0; }
+
+   static void report(const ChipError &error)
+   {
+      char line[LINE_SIZE];
+
+      error.format(line, sizeof(line));
+      post(line, true);
+   }
+
+//
+// A line of text as the drivers used to fputs it
+   static void puts(const char *text) { post(text, false); }
+
+   __attribute__((format(printf, 1, 2)))
+   static void printf(const char *format, ...)
+   {
+      char line[LINE_SIZE];
+      va_list args;
+
+      va_start(args, format);
+      vsnprintf(line, sizeof(line), format, args);
+      va_end(args);
+      post(line, false);
+   }
+
+//
+// Lines held back by the rate limit, and lost to a busy or full ring
+   static uint64_t getSuppressed() { return __atomic_load_n(&state().suppressed, __ATOMIC_RELAXED); }
+   static uint64_t getDropped()    { return __atomic_load_n(&state().dropped, __ATOMIC_RELAXED); }
+
+//
+// Report a failed result through the log; the value, or fallback on failure
+   template <class T>
+   static T check(const Result<T> &result, T fallback)
+   {
+      if (result.ok())
+         return result.value();
+      report(result.error());
+      return fallback;
+   }
+
+   static bool check(const Result<void> &result)
+   {
+      if (!result.ok())
+         report(result.error());
+      return result.ok();
+   }
+
+private:
+   static const uint64_t DRAIN_NANOS = 20000000;
+
+//
+// Plain data, zero initialised at load, so no guard on first use
+   struct State
+   {
+      char      line[LINES][LINE_SIZE];
+      uint32_t  head, tail;
+      char      lock;
+      int       running;
+      int       stop;
+      uint32_t  rate, burst;
+      uint64_t  tokens;        // Lines allowed, times NSEC_PER_SEC
+      uint64_t  last;
+      Sink      sink;
+      void     *arg;
+      uint64_t  suppressed, dropped, reported;
+      pthread_t thread;
+   };
+
+   static State &state()
+   {
+      static State s;
+      return s;
+   }
+
+   static void post(const char *text, bool newline)
+   {
+      State &s = state();
+
+      if (!__atomic_load_n(&s.running, __ATOMIC_ACQUIRE))
+      {
+         direct(text, newline);
+         return;
+      }
+
+      if (__atomic_test_and_set(&s.lock, __ATOMIC_ACQUIRE))
+      {
+         __atomic_add_fetch(&s.dropped, 1, __ATOMIC_RELAXED);
+         return;
+      }
+      if (!__atomic_load_n(&s.running, __ATOMIC_RELAXED)) // Stopped since
+      {
+         __atomic_clear(&s.lock, __ATOMIC_RELEASE);
+         direct(text, newline);
+         return;
+      }
+
+//
+// Token bucket: refill for the time since the last line, capped at the burst
+      uint64_t now = Timing::now();
+      uint64_t cap = (uint64_t) s.burst * Timing::NSEC_PER_SEC;
+      uint64_t elapsed = now - s.last < cap ? now - s.last : cap;
+      s.tokens += elapsed * s.rate;
+      if (s.tokens > cap)
+         s.tokens = cap;
+      s.last = now;
+
+      if (s.tokens < Timing::NSEC_PER_SEC)
+         __atomic_add_fetch(&s.suppressed, 1, __ATOMIC_RELAXED);
+      else if (s.head - s.tail >= (uint32_t) LINES)
+         __atomic_add_fetch(&s.dropped, 1, __ATOMIC_RELAXED);
+      else
+      {
+         s.tokens -= Timing::NSEC_PER_SEC;
+         char *line = s.line[s.head % LINES];
+         strncpy(line, text, LINE_SIZE - 1);
+         line[LINE_SIZE - 1] = '\0';
+         s.head++;
+      }
+      __atomic_clear(&s.lock, __ATOMIC_RELEASE);
+   }
+
+   static void direct(const char *text, bool newline)
+   {
+      fputs(text, stderr);
+      if (newline)
+         fputc('\n', stderr);
+   }
+
+   static void emit(State &s, char *line)
+   {
+      size_t n = strlen(line);
+
+      if (n > 0 && line[n - 1] == '\n')
+         line[--n] = '\0';
+      if (s.sink != NULL)
+         s.sink(line, s.arg);
+      else
+         fprintf(stderr, "%s\n", line);
+   }
+
+//
+// Copy the lines out under the lock and write them after, so a poster never
+// waits on the write
+   static void *writer(void *)
+   {
+      State &s = state();
+      static char lines[LINES][LINE_SIZE];  // Too big for the stack
+      bool last = false;
+
+      while (!last)
+      {
+         last = __atomic_load_n(&s.stop, __ATOMIC_ACQUIRE) != 0;
+         if (!last)
+            Timing::sleepUntil(Timing::now() + DRAIN_NANOS);
+
+         while (__atomic_test_and_set(&s.lock, __ATOMIC_ACQUIRE))
+            Timing::sleepUntil(Timing::now() + Timing::NSEC_PER_USEC * 100);
+         if (last)
+            __atomic_store_n(&s.running, 0, __ATOMIC_RELAXED);
+         int n = 0;
+         for ( ; s.tail != s.head ; s.tail++)
+            memcpy(lines[n++], s.line[s.tail % LINES], LINE_SIZE);
+         __atomic_clear(&s.lock, __ATOMIC_RELEASE);
+
+         for (int i = 0 ; i < n ; ++i)
+            emit(s, lines[i]);
+
+         uint64_t lost = getSuppressed() + getDropped();
+         if (lost != s.reported)
+         {
+            char line[LINE_SIZE];
+            snprintf(line, sizeof(line), "ChipLog: %llu lines suppressed or dropped",
+                     (unsigned long long) (lost - s.reported));
+            emit(s, line);
+            s.reported = lost;
+         }
+      }
+      return NULL;
+   }
+};
+
+#endif
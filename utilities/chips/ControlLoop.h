@@ -0,0 +1,267 @@
+// Fixed-rate closed-loop control engine coupling an A to D input to a D to A output.
+//
+// The loop samples the converter at absolute deadlines, runs an integer
+// fixed-point PID step and drives the output. When pipelined, the output
+// write is handed to a second thread so it overlaps the next input transfer
+// (the MCP3008 is on SPI and the MCP4725 on I2C so the two never contend).
+//
+// ADC must provide int getValue(uint8_t channel, int input_mode) (< 0 on failure)
+// DAC must provide bool setValue(uint16_t value)
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef CONTROLLOOP_H
+#define CONTROLLOOP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <Timing.h>
+
+template <class ADC, class DAC>
+class ControlLoop
+{
+public:
+   static const int Q_BITS = 16; // PID gains are Q16.16 fixed point
+   static const int32_t Q_ONE = 1 << Q_BITS;
+
+   ControlLoop(ADC &adc, DAC &dac) : adc_(adc), dac_(dac)
+   {
+      channel_ = 0;
+      inputMode_ = 0;
+      period_ = 1000000; // 1 kHz
+      pipelined_ = true;
+      kp_ = Q_ONE;
+      ki_ = 0;
+      kd_ = 0;
+      setpoint_ = 0;
+      outMin_ = 0;
+      outMax_ = 0x0fff;
+      reset();
+   }
+
+   void setInput(uint8_t channel, int input_mode) { channel_ = channel; inputMode_ = input_mode; }
+   void setPeriod(uint64_t nanos)                  { period_ = nanos; }
+   void setPipelined(bool p)                       { pipelined_ = p; }
+   void setSetpoint(int32_t counts)                { setpoint_ = counts; }
+   void setOutputLimits(int32_t lo, int32_t hi)    { outMin_ = lo; outMax_ = hi; }
+
+//
+// Gains are Q16.16, i.e. Q_ONE is a gain of 1.0 output counts per input count
+   void setGains(int32_t kp, int32_t ki, int32_t kd) { kp_ = kp; ki_ = ki; kd_ = kd; }
+
+//
+// Clear the controller state and statistics
+   void reset()
+   {
+      integral_ = 0;
+      lastError_ = 0;
+      haveLast_ = false;
+      output_ = outMin_;
+      lastInput_ = 0;
+      overruns_ = 0;
+      dropped_ = 0;
+      failures_ = 0;
+      writeFailures_ = 0;
+      latency_.reset();
+      jitter_.reset();
+   }
+
+   const LatencyStats &getLatency() const { return latency_; } // sample start to actuation done
+   const LatencyStats &getJitter() const  { return jitter_; }  // wake up relative to deadline
+   uint32_t getOverruns() const { return overruns_; }  // Deadlines already passed when reached
+   uint32_t getDropped() const  { return dropped_; }   // Outputs superseded before written
+   uint32_t getFailures() const { return failures_ + writeFailures_; } // Failed transfers
+   int32_t  getOutput() const   { return output_; }
+   int32_t  getInput() const    { return lastInput_; }
+
+//=============================================================================
+// step: Run the PID on a single input sample and return the new output
+//
+   int32_t step(int32_t input)
+   {
+      int32_t error = setpoint_ - input;
+      int64_t acc;
+
+      integral_ += (int64_t) ki_ * error;
+//
+// Clamp the integrator to the output range to keep it from winding up
+      if (integral_ > ((int64_t) outMax_ << Q_BITS))
+         integral_ = (int64_t) outMax_ << Q_BITS;
+      else if (integral_ < ((int64_t) outMin_ << Q_BITS))
+         integral_ = (int64_t) outMin_ << Q_BITS;
+
+      acc = (int64_t) kp_ * error + integral_;
+      if (haveLast_)
+         acc += (int64_t) kd_ * (error - lastError_);
+      lastError_ = error;
+      haveLast_ = true;
+
+      acc = (acc + (Q_ONE >> 1)) >> Q_BITS;
+      if (acc > outMax_) acc = outMax_;
+      if (acc < outMin_) acc = outMin_;
+      return (int32_t) acc;
+   }
+
+//=============================================================================
+// run: Run the loop for the indicated number of cycles (0 for ever) or until
+//      *stop becomes true. Returns false if the loop could not be started.
+//
+   bool run(uint32_t cycles, volatile bool *stop = NULL)
+   {
+      pthread_t actuator;
+
+      if (pipelined_)
+      {
+         if (sem_init(&ready_, 0, 0) != 0)
+         {
+            fputs("ControlLoop: Unable to create semaphore.\n", stderr);
+            return false;
+         }
+         pthread_mutex_init(&lock_, NULL);
+         pending_ = false;
+         quit_ = false;
+         if (pthread_create(&actuator, NULL, actuatorThread, this) != 0)
+         {
+            fputs("ControlLoop: Unable to start actuator thread.\n", stderr);
+            sem_destroy(&ready_);
+            pthread_mutex_destroy(&lock_);
+            return false;
+         }
+      }
+
+      uint64_t deadline = Timing::now() + period_;
+      for (uint32_t n = 0 ; cycles == 0 || n < cycles ; ++n)
+      {
+         if (stop != NULL && *stop)
+            break;
+
+         Timing::sleepUntil(deadline);
+         uint64_t start = Timing::now();
+         jitter_.record(start - deadline);
+
+         int value = adc_.getValue(channel_, inputMode_);
+         if (value < 0)
+            failures_++;
+         else
+         {
+            lastInput_ = value;
+            output_ = step(value);
+            if (pipelined_)
+               post(output_, start);
+            else
+               actuate(output_, start);
+         }
+
+//
+// Skip whole periods we have already missed rather than bursting to catch up
+         deadline += period_;
+         uint64_t now = Timing::now();
+         if (now > deadline)
+         {
+            uint64_t behind = (now - deadline) / period_ + 1;
+            overruns_ += behind;
+            deadline += behind * period_;
+         }
+      }
+
+      if (pipelined_)
+      {
+         pthread_mutex_lock(&lock_);
+         quit_ = true;
+         pthread_mutex_unlock(&lock_);
+         sem_post(&ready_);
+         pthread_join(actuator, NULL);
+         sem_destroy(&ready_);
+         pthread_mutex_destroy(&lock_);
+      }
+      return true;
+   }
+
+private:
+   void actuate(int32_t value, uint64_t start)
+   {
+      if (dac_.setValue((uint16_t) value))
+         latency_.record(Timing::now() - start);
+      else
+         writeFailures_++; // Kept apart from failures_ as the actuator thread owns it
+   }
+
+//
+// Hand an output to the actuator. If it has not picked up the previous one yet
+// that output is stale and is replaced.
+   void post(int32_t value, uint64_t start)
+   {
+      bool wake;
+
+      pthread_mutex_lock(&lock_);
+      if (pending_)
+         dropped_++;
+      wake = !pending_;
+      pending_ = true;
+      pendingValue_ = value;
+      pendingStart_ = start;
+      pthread_mutex_unlock(&lock_);
+      if (wake)
+         sem_post(&ready_);
+   }
+
+   static void *actuatorThread(void *arg)
+   {
+      ControlLoop *loop = (ControlLoop *) arg;
+
+      while (true)
+      {
+         sem_wait(&loop->ready_);
+
+         pthread_mutex_lock(&loop->lock_);
+         bool have = loop->pending_;
+         bool quit = loop->quit_;
+         int32_t value = loop->pendingValue_;
+         uint64_t start = loop->pendingStart_;
+         loop->pending_ = false;
+         pthread_mutex_unlock(&loop->lock_);
+
+         if (have)
+            loop->actuate(value, start);
+         if (quit)
+            break;
+      }
+      return NULL;
+   }
+
+   ADC &adc_;
+   DAC &dac_;
+
+   uint8_t  channel_;
+   int      inputMode_;
+   uint64_t period_;
+   bool     pipelined_;
+
+   int32_t kp_, ki_, kd_;
+   int32_t setpoint_;
+   int32_t outMin_, outMax_;
+   int64_t integral_;
+   int32_t lastError_;
+   bool    haveLast_;
+   int32_t output_;
+   int32_t lastInput_;
+
+   uint32_t overruns_;
+   uint32_t dropped_;
+   uint32_t failures_;
+   uint32_t writeFailures_;
+   LatencyStats latency_;
+   LatencyStats jitter_;
+
+   sem_t           ready_;
+   pthread_mutex_t lock_;
+   bool            pending_;
+   bool            quit_;
+   int32_t         pendingValue_;
+   uint64_t        pendingStart_;
+};
+
+#endif
@@ -0,0 +1,126 @@
+// Shared I2C bus access using combined (I2C_RDWR) transfers.
+//
+// The chip drivers each bind their own descriptor to one slave address with
+// I2C_SLAVE. Classes that drive several chips on one bus use this instead: a
+// single descriptor with the address carried in every message, so many chips
+// can be read or written in one ioctl.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef I2CBUS_H
+#define I2CBUS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <unistd.h>
+#include <ChipError.h>
+
+class I2CBus
+{
+public:
+   static const int MAX_MSGS = I2C_RDWR_IOCTL_MAX_MSGS; // Kernel limit per transfer
+
+   I2CBus() { fd_ = -1; }
+
+   bool begin(const char *device)
+   {
+      if (fd_ >= 0)
+      {
+         ChipLog::puts("I2CBus: Device already open.\n");
+         return false;
+      }
+      if ((fd_ = open(device, O_RDWR)) < 0)
+      {
+         ChipLog::printf("I2CBus: Unable to open device %s.\n", device);
+         return false;
+      }
+      return true;
+   }
+
+   void end()
+   {
+      if (fd_ >= 0)
+         close(fd_);
+      fd_ = -1;
+   }
+
+   bool isOpen() { return fd_ >= 0; }
+   int  getFd()  { return fd_; }
+
+//=============================================================================
+// transfer: Run a set of messages as one combined transaction. Counts over
+//           MAX_MSGS are split into several; MAX_MSGS is even so register
+//           write/read pairs are never separated.
+//
+   bool transfer(struct i2c_msg *msgs, int count)
+   {
+      struct i2c_rdwr_ioctl_data data;
+
+      if (fd_ < 0)
+      {
+         ChipLog::puts("I2CBus: Device is not open.\n");
+         return false;
+      }
+
+      while (count > 0)
+      {
+         data.msgs = msgs;
+         data.nmsgs = count < MAX_MSGS ? count : MAX_MSGS;
+         if (ioctl(fd_, I2C_RDWR, &data) < 0)
+            return false;
+         msgs += data.nmsgs;
+         count -= data.nmsgs;
+      }
+      return true;
+   }
+
+//
+// Helpers for filling in message arrays
+   static void writeMsg(struct i2c_msg &msg, uint8_t addr, uint8_t *buffer, int len)
+   {
+      msg.addr = addr;
+      msg.flags = 0;
+      msg.len = len;
+      msg.buf = buffer;
+   }
+
+   static void readMsg(struct i2c_msg &msg, uint8_t addr, uint8_t *buffer, int len)
+   {
+      msg.addr = addr;
+      msg.flags = I2C_M_RD;
+      msg.len = len;
+      msg.buf = buffer;
+   }
+
+//=============================================================================
+// readRegs: Write a register address then read len bytes back, without
+//           releasing the bus in between.
+//
+   bool readRegs(uint8_t addr, uint8_t reg, uint8_t *buffer, int len)
+   {
+      struct i2c_msg msgs[2];
+
+      writeMsg(msgs[0], addr, &reg, 1);
+      readMsg(msgs[1], addr, buffer, len);
+      return transfer(msgs, 2);
+   }
+
+   bool writeReg(uint8_t addr, uint8_t reg, uint8_t value)
+   {
+      struct i2c_msg msg;
+      uint8_t buffer[2] = {reg, value};
+
+      writeMsg(msg, addr, buffer, 2);
+      return transfer(&msg, 1);
+   }
+
+private:
+   int fd_;
+};
+
+#endif
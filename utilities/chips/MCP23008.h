@@ -5,6 +5,9 @@
 // Adapted for RaspberryPi by Ignus Porkus/Gray Lorig
 // License: LGPL
 
+#ifndef MCP23008_H
+#define MCP23008_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -14,6 +17,8 @@
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
 #include <unistd.h>
+#include <RegisterMap.h>
+#include <ChipError.h>
 
 class MCP23008
 {
@@ -25,11 +30,29 @@ public:
    static const uint8_t PULLDOWN = 0;
    static const uint8_t PULLUP   = 1;
 
+//
+// The register map, for code that sets chips up in its own transfers
+   typedef Register<0x00> Iodir;
+   typedef Register<0x01> Ipol;
+   typedef Register<0x02> Gpinten;
+   typedef Register<0x03> Defval;
+   typedef Register<0x04> Intcon;
+   typedef Register<0x05> Iocon;
+   typedef Register<0x06> Gppu;
+   typedef Register<0x07> Intf;
+   typedef Register<0x08> Intcap;
+   typedef Register<0x09> Gpio;
+   typedef Register<0x0A> Olat;
+   static const int       REGISTERS = 11;
+   typedef Bit<Iocon, 5>  Seqop;    // Set, the address pointer doesn't advance
+
    bool begin(const char *device_name, uint8_t addr);
    bool begin() { return begin("/dev/i2c-1", 0); }
+   bool attach(const char *device_name, uint8_t addr, uint8_t iodir, uint8_t gppu, uint8_t olat);
    void end();
    bool isOpen() { return deviceFd_ >= 0; }
    int  getFd()  { return deviceFd_; }
+   uint8_t getLatch() { return olat_; }  // Output latch as last written
 
    bool setupPins(uint8_t iodir, uint8_t pullup = 0, uint8_t invert = 0);
    bool writePins(uint8_t bits);
@@ -40,6 +63,29 @@ public:
    bool pullUp(uint8_t p, uint8_t d);
    uint8_t digitalRead(uint8_t p);
 
+//
+// The same for a read loop: a failure comes back as a ChipError, nothing is
+// logged and the device is left open
+   Result<uint8_t> tryReadPins();
+   Result<void>    tryWritePins(uint8_t bits);
+   Result<uint8_t> tryDigitalRead(uint8_t p);
+   Result<void>    tryDigitalWrite(uint8_t p, uint8_t d);
+   Result<void>    trySetupPins(uint8_t iodir, uint8_t pullup = 0, uint8_t invert = 0);
+   Result<void>    tryPinMode(uint8_t p, uint8_t d);
+   Result<void>    tryPullUp(uint8_t p, uint8_t d);
+
+//
+// The same for a pin fixed at compile time, checked there instead of on
+// every call
+   template <uint8_t P> bool pinMode(uint8_t d)      { return pinBit<Iodir, P>(iodir_, d == INPUT, "pinMode"); }
+   template <uint8_t P> bool digitalWrite(uint8_t d) { return pinBit<Olat, P>(olat_, d == HIGH, "digitalWrite"); }
+   template <uint8_t P> bool pullUp(uint8_t d)       { return pinBit<Gppu, P>(gppu_, d == PULLUP, "pullUp"); }
+   template <uint8_t P> uint8_t digitalRead()
+   {
+      uint8_t bits;
+      return readPins(bits) ? Bit<Gpio, checkedPin<P>()>::extract(bits) : 0xff;
+   }
+
    MCP23008()
    {
       i2caddr_ = 0;
@@ -51,30 +97,40 @@ public:
 
 private:
    static const uint8_t MCP23008_ADDRESS = 0x20;
-   static const uint8_t MCP23008_IODIR   = 0x00;
-   static const uint8_t MCP23008_IPOL    = 0x01;
-   static const uint8_t MCP23008_GPINTEN = 0x02;
-   static const uint8_t MCP23008_DEFVAL  = 0x03;
-   static const uint8_t MCP23008_INTCON  = 0x04;
-   static const uint8_t MCP23008_IOCON   = 0x05;
-   static const uint8_t MCP23008_GPPU    = 0x06;
-   static const uint8_t MCP23008_INTF    = 0x07;
-   static const uint8_t MCP23008_INTCAP  = 0x08;
-   static const uint8_t MCP23008_GPIO    = 0x09;
-   static const uint8_t MCP23008_OLAT    = 0x0A;
-
-   uint8_t i2caddr_;
-   int     deviceFd_;
-   uint8_t iodir_;
-   uint8_t gppu_;
-   uint8_t olat_;
+
+   template <uint8_t P> static constexpr int checkedPin()
+   {
+      static_assert(P < 8, "MCP23008 has pins 0 - 7");
+      return P;
+   }
+
+   template <class T>
+   bool checked(const Result<T> &result);
+   template <class REG>
+   Result<void> tryMask(uint8_t &shadow, uint8_t mask, uint8_t bits, const char *op);
+   template <class REG, uint8_t P>
+   bool pinBit(uint8_t &shadow, bool set, const char *op)
+   {
+      typedef Bit<REG, checkedPin<P>()> PinBit;
+      return checked(tryMask<REG>(shadow, PinBit::mask, PinBit::make(set), op));
+   }
+
+   uint8_t      i2caddr_;
+   int          deviceFd_;
+   RegisterPort port_;
+   uint8_t      iodir_;
+   uint8_t      gppu_;
+   uint8_t      olat_;
 };
 
 
 //=============================================================================
-// begin: Open the device and initialize it.
+// attach: Open the device without touching the chip, taking the direction,
+//         pullup and latch registers as already set to the values given
+//         (by ChipConfig, say). begin() is attach() plus reading them back.
 //
-inline bool MCP23008::begin(const char *device, uint8_t addr)
+inline bool MCP23008::attach(const char *device, uint8_t addr, uint8_t iodir,
+                             uint8_t gppu, uint8_t olat)
 {
 //
 // Remember chip only supports three bits of addressing
@@ -87,13 +143,13 @@ inline bool MCP23008::begin(const char *device, uint8_t addr)
 // Attempt to open socket connection
    if (deviceFd_ >= 0) // Connection is already open
    {
-      fputs("MCP23008: Device already open", stderr);
+      ChipLog::puts("MCP23008: Device already open");
       return false;
    }
 
    if ((deviceFd_ = open(device, O_RDWR)) < 0)
    {
-      fprintf (stderr, "MCP23008: Unable to open device %s", device);
+      ChipLog::printf("MCP23008: Unable to open device %s", device);
       return false;
    }
 
@@ -102,34 +158,47 @@ inline bool MCP23008::begin(const char *device, uint8_t addr)
    if (ioctl(deviceFd_, I2C_SLAVE, i2caddr_) < 0)
    {
       end();
-      fprintf(stderr, "MCP23008: Unable to ioctl %s.", device);
+      ChipLog::printf("MCP23008: Unable to ioctl %s.", device);
       return false;
    }
-//
-// Gather in the current state of the device
-   uint8_t buffer[1];
-
-   buffer[0] = MCP23008_IODIR;
-   write(deviceFd_, buffer, 1);
-   read(deviceFd_, &iodir_, 1);
+   port_.bind(deviceFd_, i2caddr_);
 
-   buffer[0] = MCP23008_GPPU;
-   write(deviceFd_, buffer, 1);
-   read(deviceFd_, &gppu_, 1);
+   iodir_ = iodir;
+   gppu_ = gppu;
+   olat_ = olat;
+   return true;
+}
 
-   buffer[0] = MCP23008_OLAT;
-   if (write(deviceFd_, buffer, 1) != 1)
-   {
-      end();
-      fputs("MCP23008: Unable to write register on device.\n", stderr);
+//=============================================================================
+// begin: Open the device and initialize it.
+//
+inline bool MCP23008::begin(const char *device, uint8_t addr)
+{
+   if (!attach(device, addr, 0xff, 0x00, 0x00))
       return false;
-   }
-   if (read(deviceFd_, &olat_, 1) != 1)
+
+//
+// Gather in the current state of the device, the whole register map in one
+// sequential read unless IOCON has sequential addressing turned off, when
+// each register has to be asked for separately
+   uint8_t iocon;
+   uint8_t regs[REGISTERS];
+   bool ok = port_.read<Iocon>(iocon);
+
+   if (ok && !Seqop::extract(iocon))
+      ok = port_.readBlock<Iodir>(regs, REGISTERS);
+   else if (ok)
+      ok = port_.read<Iodir>(regs[Iodir::address]) && port_.read<Gppu>(regs[Gppu::address]) &&
+           port_.read<Olat>(regs[Olat::address]);
+   if (!ok)
    {
       end();
-      fputs("MCP23008: Unable to read register from device.\n", stderr);
+      ChipLog::puts("MCP23008: Unable to read registers from device.\n");
       return false;
    }
+   iodir_ = regs[Iodir::address];
+   gppu_ = regs[Gppu::address];
+   olat_ = regs[Olat::address];
    return true;
 }
 
@@ -143,244 +212,160 @@ inline void MCP23008::end()
    deviceFd_ = -1;
 }
 
-//====================================================================
-// setupPins: Initialize the GPIO pins on the device.
 //
-inline bool MCP23008::setupPins(uint8_t iodir, uint8_t pullup, uint8_t invert)
+// Log a failure the way the calls that don't return a Result always have. As
+// ever a failed transfer closes the device.
+template <class T>
+inline bool MCP23008::checked(const Result<T> &result)
 {
-   uint8_t buffer[2];
-
-   if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP23008: Device is not open\n", stderr);
-       return false;
-   }
+   if (result.ok())
+      return true;
+   ChipLog::report(result.error());
+   if (result.error().code == ChipError::TRANSFER)
+      end();
+   return false;
+}
 
-   buffer[0] = MCP23008_IODIR;
-   buffer[1] = iodir_ = ~iodir;
-   write(deviceFd_, buffer, 2);
+//
+// Change the masked bits of a register through its cached copy; nothing is
+// sent if they already hold those values
+template <class REG>
+inline Result<void> MCP23008::tryMask(uint8_t &shadow, uint8_t mask, uint8_t bits, const char *op)
+{
+   if (deviceFd_ < 0)
+      return ChipError::make(ChipError::NOT_OPEN, "MCP23008", op);
+   if (!port_.updateBits<REG>(shadow, mask, bits))
+      return ChipError::make(ChipError::TRANSFER, "MCP23008", op, errno);
+   return Result<void>();
+}
 
-   buffer[0] = MCP23008_IPOL;
-   buffer[1] = invert;
-   write(deviceFd_, buffer, 2);
+//====================================================================
+// setupPins: Initialize the GPIO pins on the device.
+//
+inline Result<void> MCP23008::trySetupPins(uint8_t iodir, uint8_t pullup, uint8_t invert)
+{
+   if (deviceFd_ < 0)
+      return ChipError::make(ChipError::NOT_OPEN, "MCP23008", "setupPins");
+   if (!port_.write<Iodir>((uint8_t) ~iodir))
+      return ChipError::make(ChipError::TRANSFER, "MCP23008", "setupPins", errno);
+   iodir_ = ~iodir;
+   if (!port_.write<Ipol>(invert) || !port_.write<Gppu>(pullup))
+      return ChipError::make(ChipError::TRANSFER, "MCP23008", "setupPins", errno);
+   gppu_ = pullup;
+   return Result<void>();
+}
 
-   buffer[0] = MCP23008_GPPU;
-   buffer[1] = gppu_ = pullup;
-   if (write(deviceFd_, buffer, 2) != 2)
-   {
-      end();
-      fputs("MCP23008: Unable to write control registers.\n", stderr);
-      return false;
-   }
-   return true;
+inline bool MCP23008::setupPins(uint8_t iodir, uint8_t pullup, uint8_t invert)
+{
+   return checked(trySetupPins(iodir, pullup, invert));
 }
 
 //====================================================================
 // writePins: Write all output pins in one fell swoop.
 //
-inline bool MCP23008::writePins(uint8_t bits)
+inline Result<void> MCP23008::tryWritePins(uint8_t bits)
 {
-   uint8_t buffer[2];
-
-   if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP23008: Device is not open\n", stderr);
-       return false;
-   }
+   if (deviceFd_ < 0)
+      return ChipError::make(ChipError::NOT_OPEN, "MCP23008", "writePins");
+   if (!port_.write<Olat>(bits))
+      return ChipError::make(ChipError::TRANSFER, "MCP23008", "writePins", errno);
+   olat_ = bits;
+   return Result<void>();
+}
 
-   buffer[0] = MCP23008_OLAT;
-   buffer[1] = olat_ = bits;
-   if (write(deviceFd_, buffer, 2) != 2)
-   {
-      end();
-      fputs("MCP23008: Unable to write output latch register.\n", stderr);
-      return false;
-   }
-   return true;
+inline bool MCP23008::writePins(uint8_t bits)
+{
+   return checked(tryWritePins(bits));
 }
 
 //====================================================================
 // readPins: Read all of the inputs in one go.
 //
-inline bool MCP23008::readPins(uint8_t &bits)
+inline Result<uint8_t> MCP23008::tryReadPins()
 {
-   uint8_t buffer[1];
+   uint8_t bits;
 
-   if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP23008: Device is not open\n", stderr);
-       return false;
-   }
+   if (deviceFd_ < 0)
+      return ChipError::make(ChipError::NOT_OPEN, "MCP23008", "readPins");
+   if (!port_.read<Gpio>(bits))
+      return ChipError::make(ChipError::TRANSFER, "MCP23008", "readPins", errno);
+   return bits;
+}
 
-   buffer[0] = MCP23008_GPIO;
-   if (write(deviceFd_, buffer, 1) != 1)
-   {
-      end();
-      fputs("MCP23008: Unable to initiate GPIO read.\n", stderr);
-      return false;
-   }
-   if (read(deviceFd_, &bits, 1) != 1)
-   {
-      end();
-      fputs("MCP23008: Read of GPIO registered failed.\n", stderr);
+inline bool MCP23008::readPins(uint8_t &bits)
+{
+   Result<uint8_t> result = tryReadPins();
+
+   if (!checked(result))
       return false;
-   }
+   bits = result.value();
    return true;
 }
 
 //====================================================================
 // pinMode: Set whether a pin is an input or an output.
 //
-inline bool MCP23008::pinMode(uint8_t p, uint8_t d)
+inline Result<void> MCP23008::tryPinMode(uint8_t p, uint8_t d)
 {
-   if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP23008: Device is not open\n", stderr);
-       return false;
-   }
-
    if (p > 7) // We only have 8 pins
-   {
-      fputs ("MCP23008: Invalid pin specified\n", stderr);
-      return false;
-   }
-
-//
-// Set the direction
-   if (d == MCP23008::INPUT)
-     iodir_ |= 1 << p; 
-   else
-     iodir_ &= ~(1 << p);
-
-// write the new IODIR
-   uint8_t buffer[2];
-
-   buffer[0] = MCP23008::MCP23008_IODIR;
-   buffer[1] = iodir_;
-
-   if (write(deviceFd_, buffer, 2) != 2)
-   {
-      end();
-      fputs("MCP23008: Unable to write iodir register\n", stderr);
-      return false;
-   }
+      return ChipError::make(ChipError::INVALID, "MCP23008", "pinMode");
+   return tryMask<Iodir>(iodir_, 1 << p, d == MCP23008::INPUT ? 0xff : 0, "pinMode");
+}
 
-   return true;
+inline bool MCP23008::pinMode(uint8_t p, uint8_t d)
+{
+   return checked(tryPinMode(p, d));
 }
 
 //==============================================================
 // digitalWrite: Set the state of an output pin
 //
-inline bool MCP23008::digitalWrite(uint8_t p, uint8_t d)
+inline Result<void> MCP23008::tryDigitalWrite(uint8_t p, uint8_t d)
 {
-   if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP23008: Device is not open\n", stderr);
-       return false;
-   }
-
    if (p > 7) // We only have 8 pins
-   {
-      fputs ("MCP23008: Invalid pin specified\n", stderr);
-      return false;
-   }
-//
-// Set the appropriate pin  
-   if (d == MCP23008::HIGH)
-      olat_ |= 1 << p; 
-   else
-      olat_ &= ~(1 << p);
-
-// write the new output latch values
-   uint8_t buffer[2];
-
-   buffer[0] = MCP23008::MCP23008_OLAT;
-   buffer[1] = olat_;
-
-   if (write(deviceFd_, buffer, 2) != 2)
-   {
-      end();
-      fputs("MCP23008: Unable to write olat\n", stderr);
-      return false;
-   }
+      return ChipError::make(ChipError::INVALID, "MCP23008", "digitalWrite");
+   return tryMask<Olat>(olat_, 1 << p, d == MCP23008::HIGH ? 0xff : 0, "digitalWrite");
+}
 
-   return true;
+inline bool MCP23008::digitalWrite(uint8_t p, uint8_t d)
+{
+   return checked(tryDigitalWrite(p, d));
 }
 
 //============================================================
 // pullUp: Set the pullup resister on a pin
 //
-inline bool MCP23008::pullUp(uint8_t p, uint8_t d)
+inline Result<void> MCP23008::tryPullUp(uint8_t p, uint8_t d)
 {
-   if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP23008: Device is not open\n", stderr);
-       return false;
-   }
-
    if (p > 7) // We only have 8 pins
-   {
-      fputs ("MCP23008: Invalid pin specified\n", stderr);
-      return false;
-   }
-  
-// Set the pullup state
-   if (d == MCP23008::PULLUP)
-      gppu_ |= 1 << p; 
-   else
-      gppu_ &= ~(1 << p);
-
-// write the new pull up state
-   uint8_t buffer[2];
-
-   buffer[0] = MCP23008::MCP23008_GPPU;
-   buffer[1] = gppu_;
-
-   if (write(deviceFd_, buffer, 2) != 2)
-   {
-      end();
-      fputs("MCP23008: Unable to write gppu\n", stderr);
-      return false;
-   }
+      return ChipError::make(ChipError::INVALID, "MCP23008", "pullUp");
+   return tryMask<Gppu>(gppu_, 1 << p, d == MCP23008::PULLUP ? 0xff : 0, "pullUp");
+}
 
-   return true;
+inline bool MCP23008::pullUp(uint8_t p, uint8_t d)
+{
+   return checked(tryPullUp(p, d));
 }
 
 //=========================================================
 // digitalRead: Pull in the value of an input pin
 //
-inline uint8_t MCP23008::digitalRead(uint8_t p)
+inline Result<uint8_t> MCP23008::tryDigitalRead(uint8_t p)
 {
-   if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP23008: Device is not open\n", stderr);
-       return 0xff;
-   }
-
    if (p > 7) // We only have 8 pins
-   {
-      fputs ("MCP23008: Invalid pin specified\n", stderr);
-      return 0xff;
-   }
+      return ChipError::make(ChipError::INVALID, "MCP23008", "digitalRead");
 
-//
-// Read back the GPIO register
-   uint8_t buffer[1];
-   buffer[0] = MCP23008::MCP23008_GPIO;
-
-   if (write(deviceFd_, buffer, 1) != 1)
-   {
-      end();
-      fputs ("MCP23008: Unable to write gpio\n", stderr);
-      return 0xff;
-   }
+   Result<uint8_t> bits = tryReadPins();
+   if (!bits)
+      return bits;
+   return (uint8_t) ((bits.value() >> p) & 0x01);
+}
 
-   if (read(deviceFd_, buffer, 1) != 1)
-   {
-      end();
-      fputs ("MCP23008: Unable to read back gpio\n", stderr);
-      return 0xff;
-   }
+inline uint8_t MCP23008::digitalRead(uint8_t p)
+{
+   Result<uint8_t> result = tryDigitalRead(p);
 
-   return (buffer[0] >> p) & 0x01;
+   return checked(result) ? result.value() : 0xff;
 }
+
+#endif
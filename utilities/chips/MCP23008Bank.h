@@ -0,0 +1,306 @@
+// Bank of up to eight MCP23008s (addresses 0x20 - 0x27) run as one 64-bit port.
+//
+// Device n supplies bits 8n - 8n+7 of the port. All devices share a single
+// bus descriptor; reading the port is one combined transfer of a register
+// write and a GPIO read per device, and writing the port only touches the
+// devices whose output latches actually change.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP23008BANK_H
+#define MCP23008BANK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ChipError.h>
+#include <I2CBus.h>
+
+class MCP23008Bank
+{
+public:
+   static const uint8_t INPUT    = 0;
+   static const uint8_t OUTPUT   = 1;
+   static const uint8_t LOW      = 0;
+   static const uint8_t HIGH     = 1;
+   static const int     DEVICES  = 8;
+
+   MCP23008Bank()
+   {
+      present_ = 0;
+      count_ = 0;
+      iodir_ = ~0ULL; // All inputs
+      gppu_ = 0;
+      olat_ = 0;
+   }
+
+//=============================================================================
+// begin: Open the bus and pick up the state of each device in present (bit n
+//        for address 0x20 + n). IOCON of every device comes back in one
+//        transfer, then the rest of the registers of every device with
+//        sequential addressing in a second using the chip's sequential read
+//        mode. A device with IOCON.SEQOP set doesn't advance its address
+//        pointer, so its IODIR, GPPU and OLAT are read one at a time.
+//
+   bool begin(const char *device, uint8_t present = 0xff)
+   {
+      if (present == 0)
+      {
+         ChipLog::puts("MCP23008Bank: No devices specified.\n");
+         return false;
+      }
+      if (!bus_.begin(device))
+         return false;
+
+      present_ = present;
+      count_ = 0;
+      for (int d = 0 ; d < DEVICES ; ++d)
+         if (present_ & (1 << d))
+            index_[count_++] = d;
+
+      struct i2c_msg msgs[2 * DEVICES];
+      uint8_t start[2] = {MCP23008_IOCON, MCP23008_IODIR};
+      uint8_t iocon[DEVICES];
+      uint8_t regs[DEVICES][REGISTERS];
+      bool ok;
+      int n = 0;
+
+      for (int i = 0 ; i < count_ ; ++i)
+      {
+         I2CBus::writeMsg(msgs[2*i], ADDRESS | index_[i], &start[0], 1);
+         I2CBus::readMsg(msgs[2*i+1], ADDRESS | index_[i], &iocon[i], 1);
+      }
+      ok = bus_.transfer(msgs, 2 * count_);
+
+      for (int i = 0 ; ok && i < count_ ; ++i)
+         if (!(iocon[i] & MCP23008_IOCON_SEQOP))
+         {
+            I2CBus::writeMsg(msgs[n++], ADDRESS | index_[i], &start[1], 1);
+            I2CBus::readMsg(msgs[n++], ADDRESS | index_[i], regs[i], REGISTERS);
+         }
+      if (ok && n > 0)
+         ok = bus_.transfer(msgs, n);
+
+      for (int i = 0 ; ok && i < count_ ; ++i)
+         if (iocon[i] & MCP23008_IOCON_SEQOP)
+         {
+            uint8_t addr = ADDRESS | index_[i];
+            ok = bus_.readRegs(addr, MCP23008_IODIR, &regs[i][MCP23008_IODIR], 1) &&
+                 bus_.readRegs(addr, MCP23008_GPPU, &regs[i][MCP23008_GPPU], 1) &&
+                 bus_.readRegs(addr, MCP23008_OLAT, &regs[i][MCP23008_OLAT], 1);
+         }
+      if (!ok)
+      {
+         end();
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP23008Bank", "begin", errno));
+         return false;
+      }
+
+      iodir_ = gppu_ = olat_ = 0;
+      for (int i = 0 ; i < count_ ; ++i)
+      {
+         int shift = 8 * index_[i];
+         iodir_ |= (uint64_t) regs[i][MCP23008_IODIR] << shift;
+         gppu_ |= (uint64_t) regs[i][MCP23008_GPPU] << shift;
+         olat_ |= (uint64_t) regs[i][MCP23008_OLAT] << shift;
+      }
+      return true;
+   }
+
+   void end() { bus_.end(); }
+   bool isOpen() { return bus_.isOpen(); }
+
+//=============================================================================
+// setupPins: Set direction (1 = output), pullups and input polarity for the
+//            whole port in one transfer.
+//
+   bool setupPins(uint64_t iodir, uint64_t pullup = 0, uint64_t invert = 0)
+   {
+      struct i2c_msg msgs[2 * DEVICES];
+      uint8_t dirpol[DEVICES][3];
+      uint8_t pu[DEVICES][2];
+
+      for (int i = 0 ; i < count_ ; ++i)
+      {
+         int shift = 8 * index_[i];
+         dirpol[i][0] = MCP23008_IODIR; // IODIR and IPOL are adjacent
+         dirpol[i][1] = ~(iodir >> shift);
+         dirpol[i][2] = invert >> shift;
+         pu[i][0] = MCP23008_GPPU;
+         pu[i][1] = pullup >> shift;
+         I2CBus::writeMsg(msgs[2*i], ADDRESS | index_[i], dirpol[i], 3);
+         I2CBus::writeMsg(msgs[2*i+1], ADDRESS | index_[i], pu[i], 2);
+      }
+      if (!bus_.transfer(msgs, 2 * count_))
+      {
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP23008Bank", "setupPins", errno));
+         return false;
+      }
+      iodir_ = ~iodir;
+      gppu_ = pullup;
+      return true;
+   }
+
+//=============================================================================
+// readPort: Read the GPIO register of every device in one transfer. Bits for
+//           absent devices read as zero.
+//
+   bool readPort(uint64_t &bits)
+   {
+      struct i2c_msg msgs[2 * DEVICES];
+      uint8_t reg = MCP23008_GPIO;
+      uint8_t gpio[DEVICES];
+
+      for (int i = 0 ; i < count_ ; ++i)
+      {
+         I2CBus::writeMsg(msgs[2*i], ADDRESS | index_[i], &reg, 1);
+         I2CBus::readMsg(msgs[2*i+1], ADDRESS | index_[i], &gpio[i], 1);
+      }
+      if (!bus_.transfer(msgs, 2 * count_))
+      {
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP23008Bank", "readPort", errno));
+         return false;
+      }
+
+      bits = 0;
+      for (int i = 0 ; i < count_ ; ++i)
+         bits |= (uint64_t) gpio[i] << (8 * index_[i]);
+      return true;
+   }
+
+//=============================================================================
+// writePort: Set all output latches. Devices whose latch byte is unchanged
+//            are left alone; the rest are written in one transfer.
+//
+   bool writePort(uint64_t bits)
+   {
+      struct i2c_msg msgs[DEVICES];
+      uint8_t buffer[DEVICES][2];
+      uint64_t changed = bits ^ olat_;
+      int n = 0;
+
+      for (int i = 0 ; i < count_ ; ++i)
+      {
+         int shift = 8 * index_[i];
+         if (((changed >> shift) & 0xff) == 0)
+            continue;
+         buffer[n][0] = MCP23008_OLAT;
+         buffer[n][1] = bits >> shift;
+         I2CBus::writeMsg(msgs[n], ADDRESS | index_[i], buffer[n], 2);
+         n++;
+      }
+      if (n == 0)
+         return true;
+
+      if (!bus_.transfer(msgs, n))
+      {
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP23008Bank", "writePort", errno));
+         return false;
+      }
+      olat_ = bits;
+      return true;
+   }
+
+//
+// Port state as last read or written: output latches, directions (1 = output)
+// and pullups, and the devices in the bank
+   uint64_t getOutputs() const    { return olat_; }
+   uint64_t getDirections() const { return ~iodir_ & presentMask(); }
+   uint64_t getPullups() const    { return gppu_; }
+   uint8_t  getPresent() const    { return present_; }
+
+//
+// Single pin conveniences; pins are numbered 0 - 63 across the bank
+   bool digitalWrite(uint8_t p, uint8_t d)
+   {
+      if (!validPin(p))
+         return false;
+      return writePort(d == HIGH ? olat_ | (1ULL << p) : olat_ & ~(1ULL << p));
+   }
+
+   uint8_t digitalRead(uint8_t p)
+   {
+      uint64_t bits;
+
+      if (!validPin(p))
+         return 0xff;
+      if (!readPort(bits))
+         return 0xff;
+      return (bits >> p) & 0x01;
+   }
+
+//
+// Direction and pullup of one pin, written to its own device only, and only
+// if they change
+   bool pinMode(uint8_t p, uint8_t d)
+   {
+      return validPin(p) && updatePin(iodir_, MCP23008_IODIR, p, d == INPUT);
+   }
+
+   bool pullUp(uint8_t p, uint8_t d)
+   {
+      return validPin(p) && updatePin(gppu_, MCP23008_GPPU, p, d == HIGH);
+   }
+
+private:
+   static const uint8_t ADDRESS        = 0x20;
+   static const uint8_t MCP23008_IODIR = 0x00;
+   static const uint8_t MCP23008_IOCON = 0x05;
+   static const uint8_t MCP23008_GPPU  = 0x06;
+   static const uint8_t MCP23008_GPIO  = 0x09;
+   static const uint8_t MCP23008_OLAT  = 0x0A;
+   static const uint8_t MCP23008_IOCON_SEQOP = 0x20;
+   static const int     REGISTERS      = 11;
+
+   uint64_t presentMask() const
+   {
+      uint64_t mask = 0;
+
+      for (int d = 0 ; d < DEVICES ; ++d)
+         if (present_ & (1 << d))
+            mask |= 0xffULL << (8 * d);
+      return mask;
+   }
+
+   bool validPin(uint8_t p)
+   {
+      if (p > 63 || !(present_ & (1 << (p / 8))))
+      {
+         ChipLog::puts("MCP23008Bank: Invalid pin, or its device is not in the bank.\n");
+         return false;
+      }
+      return true;
+   }
+
+   bool updatePin(uint64_t &shadow, uint8_t reg, uint8_t p, bool set)
+   {
+      uint64_t next = set ? shadow | (1ULL << p) : shadow & ~(1ULL << p);
+      uint8_t buffer[2];
+      struct i2c_msg msg;
+
+      if (next == shadow)
+         return true;
+      buffer[0] = reg;
+      buffer[1] = next >> (8 * (p / 8));
+      I2CBus::writeMsg(msg, ADDRESS | (p / 8), buffer, 2);
+      if (!bus_.transfer(&msg, 1))
+      {
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP23008Bank", "updatePin", errno));
+         return false;
+      }
+      shadow = next;
+      return true;
+   }
+
+   I2CBus   bus_;
+   uint8_t  present_;
+   int      count_;
+   uint8_t  index_[DEVICES];
+   uint64_t iodir_;
+   uint64_t gppu_;
+   uint64_t olat_;
+};
+
+#endif
@@ -0,0 +1,205 @@
+// Debounced button and switch inputs on MCP23008 expanders.
+//
+// Each tick takes one read of the whole GPIO register (or a whole bank's port)
+// and debounces every pin at once with a vertical counter: two bit-planes hold
+// a 2-bit counter per pin, so a pin must read differently from its debounced
+// state for four ticks in a row before it flips, and all 64 pins cost a few
+// logical operations. Press, release and long-press events go into a single
+// producer/single consumer ring so the sampling thread never blocks.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP23008INPUT_H
+#define MCP23008INPUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <MCP23008.h>
+#include <MCP23008Bank.h>
+
+class MCP23008Input
+{
+public:
+   static const uint8_t EVENT_PRESS      = 1;
+   static const uint8_t EVENT_RELEASE    = 2;
+   static const uint8_t EVENT_LONG_PRESS = 3;
+
+   static const int QUEUE_SIZE = 256; // Must be a power of two
+
+   struct Event
+   {
+      uint64_t time;   // When the tick that produced it was sampled
+      uint8_t  pin;
+      uint8_t  type;
+   };
+
+   MCP23008Input()
+   {
+      configure(0, 0);
+   }
+
+//=============================================================================
+// configure: activeLow marks the pins that read low when pressed (a button to
+//            ground with the pullup on). A pin held for longTicks ticks also
+//            reports a long press; zero turns that off.
+//
+   void configure(uint64_t activeLow, uint32_t longTicks)
+   {
+      activeLow_ = activeLow;
+      longTicks_ = longTicks;
+      reset();
+   }
+
+   void reset()
+   {
+      primed_ = false;
+      state_ = 0;
+      cnt0_ = cnt1_ = 0;
+      held_ = 0;
+      longDone_ = 0;
+      nextLong_ = UINT64_MAX;
+      ticks_ = 0;
+      head_ = tail_ = 0;
+      dropped_ = 0;
+   }
+
+//
+// Debounced state with pressed pins as ones
+   uint64_t getPressed() const { return state_ ^ activeLow_; }
+   uint64_t getDropped() const { return dropped_; }
+
+//=============================================================================
+// tick: Feed one raw sample of the inputs taken at time
+//
+   void tick(uint64_t raw, uint64_t time)
+   {
+      ticks_++;
+      if (!primed_) // Take whatever is there at start up as settled
+      {
+         state_ = raw;
+         primed_ = true;
+         return;
+      }
+
+//
+// Vertical counter: pins that match the debounced state hold the counter at
+// zero, the rest count up and flip the state when the counter wraps.
+      uint64_t delta = raw ^ state_;
+      cnt1_ = (cnt1_ ^ cnt0_) & delta;
+      cnt0_ = ~cnt0_ & delta;
+      uint64_t toggle = delta & ~(cnt0_ | cnt1_);
+      state_ ^= toggle;
+
+      if (toggle != 0)
+      {
+         uint64_t pressed = getPressed();
+         uint64_t down = toggle & pressed;
+         uint64_t up = toggle & ~pressed;
+
+         for (uint64_t m = down ; m != 0 ; m &= m - 1)
+         {
+            int p = __builtin_ctzll(m);
+            pressTick_[p] = ticks_;
+            if (ticks_ + longTicks_ < nextLong_)
+               nextLong_ = ticks_ + longTicks_;
+            post(time, p, EVENT_PRESS);
+         }
+         for (uint64_t m = up ; m != 0 ; m &= m - 1)
+            post(time, __builtin_ctzll(m), EVENT_RELEASE);
+         held_ = (held_ | down) & ~up;
+         longDone_ &= ~toggle;
+      }
+
+//
+// Only walk the held pins when the earliest pending long press is due
+      if (longTicks_ != 0 && ticks_ >= nextLong_)
+      {
+         nextLong_ = UINT64_MAX;
+         for (uint64_t m = held_ & ~longDone_ ; m != 0 ; m &= m - 1)
+         {
+            int p = __builtin_ctzll(m);
+            uint64_t due = pressTick_[p] + longTicks_;
+            if (ticks_ >= due)
+            {
+               longDone_ |= 1ULL << p;
+               post(time, p, EVENT_LONG_PRESS);
+            }
+            else if (due < nextLong_)
+               nextLong_ = due;
+         }
+      }
+   }
+
+//
+// Sample a single expander or a bank and feed it through tick()
+   bool sample(MCP23008 &chip, uint64_t time)
+   {
+      uint8_t bits;
+
+      if (!chip.readPins(bits))
+         return false;
+      tick(bits, time);
+      return true;
+   }
+
+   bool sample(MCP23008Bank &bank, uint64_t time)
+   {
+      uint64_t bits;
+
+      if (!bank.readPort(bits))
+         return false;
+      tick(bits, time);
+      return true;
+   }
+
+//=============================================================================
+// nextEvent: Consumer side of the queue. Returns false when it is empty.
+//
+   bool nextEvent(Event &e)
+   {
+      uint32_t tail = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+
+      if (tail == __atomic_load_n(&head_, __ATOMIC_ACQUIRE))
+         return false;
+      e = queue_[tail & (QUEUE_SIZE - 1)];
+      __atomic_store_n(&tail_, tail + 1, __ATOMIC_RELEASE);
+      return true;
+   }
+
+private:
+   void post(uint64_t time, int pin, uint8_t type)
+   {
+      uint32_t head = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+
+      if (head - __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) >= (uint32_t) QUEUE_SIZE)
+      {
+         dropped_++; // Consumer is not keeping up
+         return;
+      }
+      Event &e = queue_[head & (QUEUE_SIZE - 1)];
+      e.time = time;
+      e.pin = pin;
+      e.type = type;
+      __atomic_store_n(&head_, head + 1, __ATOMIC_RELEASE);
+   }
+
+   uint64_t activeLow_;
+   uint32_t longTicks_;
+   bool     primed_;
+   uint64_t state_;      // Debounced raw levels
+   uint64_t cnt0_;       // Low and high bit planes of the per-pin counters
+   uint64_t cnt1_;
+   uint64_t held_;       // Pins pressed since start up and not yet released
+   uint64_t longDone_;   // Pins whose long press has been reported
+   uint64_t nextLong_;   // Tick at which the next long press may be due
+   uint64_t ticks_;
+   uint64_t pressTick_[64];
+   uint64_t dropped_;
+
+   Event    queue_[QUEUE_SIZE];
+   uint32_t head_;
+   uint32_t tail_;
+};
+
+#endif
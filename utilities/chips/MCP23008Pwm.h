@@ -0,0 +1,263 @@
+// Software PWM for the outputs of an MCP23008 using bit angle modulation.
+//
+// With n bits of duty resolution each period is split into n slices lasting
+// 1, 2, 4 ... 2^(n-1) time units. During slice b a pin is on if bit b of its
+// duty is set, so one writePins() per slice drives all eight pins and a
+// period costs n bus writes rather than 2^n. The per-slice latch patterns are
+// only rebuilt when a duty cycle changes, and slices whose pattern matches the
+// one already latched are not written at all.
+//
+// The engine runs in its own thread, paced with absolute deadlines, and can
+// ask for SCHED_FIFO. EXPANDER needs bool writePins(uint8_t bits), so the
+// engine also drives test doubles.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP23008PWM_H
+#define MCP23008PWM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <Timing.h>
+
+template <class EXPANDER>
+class MCP23008Pwm
+{
+public:
+   static const int MAX_BITS = 12;
+
+   MCP23008Pwm(EXPANDER &chip) : chip_(chip)
+   {
+      bits_ = 8;
+      unit_ = 0;
+      mask_ = 0xff;
+      fixed_ = 0;
+      running_ = false;
+      stop_ = 0;
+      dirty_ = 1;
+      memset(duty_, 0, sizeof(duty_));
+      resetStats();
+   }
+
+//=============================================================================
+// configure: Set the duty resolution in bits and the PWM frequency. Fails if
+//            the shortest slice would be under a microsecond. Only call while
+//            the engine is stopped.
+//
+   bool configure(int bits, uint32_t frequency)
+   {
+      if (running_)
+      {
+         fputs("MCP23008Pwm: Engine is running.\n", stderr);
+         return false;
+      }
+      if (bits < 1 || bits > MAX_BITS || frequency == 0)
+      {
+         fputs("MCP23008Pwm: Invalid resolution or frequency.\n", stderr);
+         return false;
+      }
+
+      uint64_t unit = Timing::NSEC_PER_SEC / frequency / ((1 << bits) - 1);
+      if (unit < Timing::NSEC_PER_USEC)
+      {
+         fputs("MCP23008Pwm: Frequency too high for the resolution.\n", stderr);
+         return false;
+      }
+      bits_ = bits;
+      unit_ = unit;
+      __atomic_store_n(&dirty_, 1, __ATOMIC_RELEASE);
+      return true;
+   }
+
+//
+// Pins outside mask are not modulated and are held at their value in fixed
+   void setMask(uint8_t mask, uint8_t fixed = 0)
+   {
+      __atomic_store_n(&mask_, mask, __ATOMIC_RELAXED);
+      __atomic_store_n(&fixed_, fixed, __ATOMIC_RELAXED);
+      __atomic_store_n(&dirty_, 1, __ATOMIC_RELEASE);
+   }
+
+//
+// Duty runs from 0 (off) to 2^bits - 1 (on); anything larger is on, here or
+// after a configure() to fewer bits. Safe to call while running; the new value
+// takes effect at the start of the next period.
+   bool setDuty(uint8_t p, uint16_t duty)
+   {
+      if (p > 7) // We only have 8 pins
+      {
+         fputs("MCP23008Pwm: Invalid pin specified\n", stderr);
+         return false;
+      }
+      __atomic_store_n(&duty_[p], duty, __ATOMIC_RELAXED);
+      __atomic_store_n(&dirty_, 1, __ATOMIC_RELEASE);
+      return true;
+   }
+
+   uint64_t getPeriodNanos() const { return unit_ * ((1 << bits_) - 1); }
+
+//=============================================================================
+// start: Launch the engine thread, at SCHED_FIFO priority if asked and allowed
+//
+   bool start(bool realtime = false)
+   {
+      pthread_attr_t attr;
+      struct sched_param param;
+
+      if (running_ || unit_ == 0)
+      {
+         fputs("MCP23008Pwm: Engine running or not configured.\n", stderr);
+         return false;
+      }
+
+      __atomic_store_n(&stop_, 0, __ATOMIC_RELAXED);
+      pthread_attr_init(&attr);
+      if (realtime)
+      {
+         param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+         pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+         pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+         pthread_attr_setschedparam(&attr, &param);
+      }
+      if (pthread_create(&thread_, &attr, engineThread, this) != 0)
+      {
+         if (!realtime)
+         {
+            pthread_attr_destroy(&attr);
+            fputs("MCP23008Pwm: Unable to start engine thread.\n", stderr);
+            return false;
+         }
+         fputs("MCP23008Pwm: No real-time priority, running at normal priority.\n", stderr);
+         pthread_attr_destroy(&attr);
+         pthread_attr_init(&attr);
+         if (pthread_create(&thread_, &attr, engineThread, this) != 0)
+         {
+            pthread_attr_destroy(&attr);
+            fputs("MCP23008Pwm: Unable to start engine thread.\n", stderr);
+            return false;
+         }
+      }
+      pthread_attr_destroy(&attr);
+      running_ = true;
+      return true;
+   }
+
+   void stop()
+   {
+      if (!running_)
+         return;
+      __atomic_store_n(&stop_, 1, __ATOMIC_RELAXED);
+      pthread_join(thread_, NULL);
+      running_ = false;
+   }
+
+   void resetStats()
+   {
+      periods_ = 0;
+      writes_ = 0;
+      skipped_ = 0;
+      overruns_ = 0;
+      failed_ = false;
+   }
+
+//
+// Statistics; only meaningful once the engine has been stopped
+   uint64_t getPeriods() const  { return periods_; }
+   uint64_t getWrites() const   { return writes_; }
+   uint64_t getSkipped() const  { return skipped_; }  // Slices needing no write
+   uint64_t getOverruns() const { return overruns_; } // Slices that started late
+   bool     getFailed() const   { return failed_; }
+
+private:
+//
+// Rebuild the latch pattern of every slice from the duty cycles
+   void buildPatterns()
+   {
+      uint8_t mask = __atomic_load_n(&mask_, __ATOMIC_RELAXED);
+      uint8_t fixed = __atomic_load_n(&fixed_, __ATOMIC_RELAXED);
+      uint16_t full = (1 << bits_) - 1;
+      uint16_t duty[8];
+
+      for (int p = 0 ; p < 8 ; ++p)
+      {
+         duty[p] = __atomic_load_n(&duty_[p], __ATOMIC_RELAXED);
+         if (duty[p] > full) // Past full scale, not wrapped to some other duty
+            duty[p] = full;
+      }
+
+      for (int b = 0 ; b < bits_ ; ++b)
+      {
+         uint8_t pattern = 0;
+         for (int p = 0 ; p < 8 ; ++p)
+            pattern |= ((duty[p] >> b) & 1) << p;
+         patterns_[b] = (pattern & mask) | (fixed & ~mask);
+      }
+   }
+
+   static void *engineThread(void *arg)
+   {
+      MCP23008Pwm *pwm = (MCP23008Pwm *) arg;
+      int latched = -1; // Nothing known to be latched yet
+      uint64_t deadline = Timing::now();
+
+      while (!__atomic_load_n(&pwm->stop_, __ATOMIC_RELAXED))
+      {
+         if (__atomic_exchange_n(&pwm->dirty_, 0, __ATOMIC_ACQUIRE))
+            pwm->buildPatterns();
+
+         for (int b = 0 ; b < pwm->bits_ ; ++b)
+         {
+            if (pwm->patterns_[b] == latched)
+               pwm->skipped_++;
+            else if (pwm->chip_.writePins(pwm->patterns_[b]))
+            {
+               latched = pwm->patterns_[b];
+               pwm->writes_++;
+            }
+            else
+            {
+               pwm->failed_ = true; // The driver has dropped the connection
+               return NULL;
+            }
+
+//
+// A late slice is stretched rather than making the following ones short
+            deadline += pwm->unit_ << b;
+            uint64_t now = Timing::now();
+            if (now > deadline)
+            {
+               pwm->overruns_++;
+               deadline = now;
+            }
+            else
+               Timing::sleepUntil(deadline);
+         }
+         pwm->periods_++;
+      }
+      return NULL;
+   }
+
+   EXPANDER &chip_;
+   int       bits_;
+   uint64_t  unit_;      // Nanoseconds in the shortest slice
+   uint8_t   mask_;
+   uint8_t   fixed_;
+   uint16_t  duty_[8];
+   int       dirty_;
+   int       stop_;
+   bool      running_;
+   pthread_t thread_;
+   uint8_t   patterns_[MAX_BITS];
+
+   uint64_t  periods_;
+   uint64_t  writes_;
+   uint64_t  skipped_;
+   uint64_t  overruns_;
+   bool      failed_;
+};
+
+#endif
@@ -5,19 +5,64 @@
  * License: LGPL
  */
 
+#ifndef MCP3008_H
+#define MCP3008_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 #include <unistd.h>
+#include <Timing.h>
+#include <RegisterMap.h>
+#include <ChipError.h>
 
 class MCP3008
 {
 private:
    int fd_;
    uint32_t speed_;  // Connection speed
+   int framing_;
+   uint64_t nullErrors_;
+
+//
+// One conversion, channel and mode already checked
+   Result<int> convert(uint8_t channel, int input_mode, TransferStamp &stamp)
+   {
+      uint32_t rx_data[1];  // Room, and alignment, for any framing
+      uint32_t tx_data[1];
+      uint16_t value;
+      struct spi_ioc_transfer msg;
+
+      if (fd_ < 0)
+         return ChipError::make(ChipError::NOT_OPEN, "MCP3008", "getValue");
+
+//
+// Fill the transfer in by name. The field order of spi_ioc_transfer puts
+// speed_hz ahead of delay_usecs, so a positional initializer ends up asking
+// for a delay of (speed & 0xffff) microseconds after every conversion.
+      memset(&msg, 0, sizeof(msg));
+      msg.tx_buf = (unsigned long) tx_data;   // Transmit buffer
+      msg.rx_buf = (unsigned long) rx_data;   // Receive buffer
+      msg.len = frameBytes(framing_);         // Data length
+      msg.speed_hz = speed_;                  // Transmission speed
+      msg.bits_per_word = frameWordBits(framing_); // Bits per word
+
+      encodeFrame(framing_, channel, input_mode, (uint8_t *) tx_data);
+
+      stamp.start = Timing::raw();
+      int result = ioctl(fd_, SPI_IOC_MESSAGE(1), &msg);
+      stamp.end = Timing::raw();
+      if (result < 0)
+         return ChipError::make(ChipError::TRANSFER, "MCP3008", "getValue", errno);
+
+      nullErrors_ += decodeFrames(framing_, (const uint8_t *) rx_data, &value, 1);
+      return (int) value;
+   }
 
 public:
    const static int MODE_LOOP = SPI_LOOP;
@@ -33,7 +78,13 @@ public:
    {
       fd_ = -1;
       speed_ = 0;
+      framing_ = FRAME_BYTES;
+      nullErrors_ = 0;
    }
+
+   bool isOpen()        { return fd_ >= 0; }
+   int  getFd()         { return fd_; }
+   uint32_t getSpeed()  { return speed_; }
 //==============================================================================
 // begin: Open access to the chip
 //
@@ -41,13 +92,13 @@ public:
    {
       if (fd_ >= 0)
       {
-         fputs("MCP3008: Device already open.\n", stderr);
+         ChipLog::puts("MCP3008: Device already open.\n");
          return false;
       }
 
       if ((fd_ = open(device, O_RDWR)) < 0)
       {
-         fprintf (stderr, "MCP3008: Unable to open device %s.\n", device);
+         ChipLog::printf("MCP3008: Unable to open device %s.\n", device);
          return false;
       }
 
@@ -55,14 +106,17 @@ public:
       uint8_t bits = 8;
       speed_ = speed;
 
+//
+// Write the speed before reading it back; the other way round replaced the
+// speed asked for with whatever the device was last left at
       if (ioctl(fd_, SPI_IOC_RD_MODE, &mode) < 0 ||
           ioctl(fd_, SPI_IOC_WR_MODE, &mode) < 0 ||
           ioctl(fd_, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0 ||
           ioctl(fd_, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
-          ioctl(fd_, SPI_IOC_RD_MAX_SPEED_HZ, &speed_) < 0 ||
-          ioctl(fd_, SPI_IOC_WR_MAX_SPEED_HZ, &speed_) < 0)
+          ioctl(fd_, SPI_IOC_WR_MAX_SPEED_HZ, &speed_) < 0 ||
+          ioctl(fd_, SPI_IOC_RD_MAX_SPEED_HZ, &speed_) < 0)
       {
-         fprintf (stderr, "MCP3008: Unable to configure device %s properly.", device);
+         ChipLog::printf("MCP3008: Unable to configure device %s properly.", device);
          close(fd_);
          fd_ = -1;
          return false;
@@ -71,6 +125,25 @@ public:
       return true;
    }
 //====================================================================================
+// setSpeed: Change the SPI clock used from the next conversion on
+//
+   bool setSpeed(uint32_t speed)
+   {
+      if (fd_ < 0)
+      {
+         ChipLog::puts("MCP3008: Device has not been opened.\n");
+         return false;
+      }
+      if (ioctl(fd_, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+      {
+         ChipLog::printf("MCP3008: Unable to set speed %u.\n", speed);
+         return false;
+      }
+      speed_ = speed;
+      return true;
+   }
+
+//====================================================================================
 // end: Close access to the chip
 //
    void end()
@@ -89,40 +162,279 @@ public:
    const static int INPUT_MODE_SINGLE = 0;
    const static int INPUT_MODE_DIFFERENTIAL = 1;
 
-   int getValue(uint8_t channel, int input_mode)
+//
+// The command bits, placed by the bit of the frame word the start bit lands
+// on. SGL/DIFF and the channel select bits follow it. Note SGL/DIFF is set for
+// a single ended conversion and clear for differential.
+   template <int START>
+   struct Command
+   {
+      typedef Word<uint32_t>             Frame;
+      typedef Field<Frame, START>        Start;
+      typedef Field<Frame, START - 1>    Single;
+      typedef Field<Frame, START - 4, 3> Channel;
+
+      static uint32_t encode(uint8_t channel, int input_mode)
+      {
+         return Start::make(1) | Single::make(input_mode == INPUT_MODE_SINGLE) | Channel::make(channel);
+      }
+   };
+
+//
+// Build the three byte command frame for a conversion. The start bit is the
+// last bit of the first byte.
+   static void encodeCommand(uint8_t channel, int input_mode, uint8_t *tx_data)
+   {
+      Command<16>::Frame::store(Command<16>::encode(channel, input_mode), tx_data, 3);
+   }
+
+//
+// Pull the 10-bit result out of the three bytes received
+   static int decodeResult(const uint8_t *rx_data)
+   {
+      return ((((int) rx_data[1]) & 0x03) << 8) | ((int) rx_data[2]);
+   }
+
+//======================================================================================
+// Framing: How a conversion is laid out on the wire. The chip needs 17 clocks
+// from the start bit to B0, and chip select has to rise between conversions,
+// so each conversion is its own transfer whatever the framing.
+//
+//    FRAME_BYTES   Three 8-bit words, the start bit last in the first: 24 clocks.
+//    FRAME_WORD17  One 17-bit word, nothing wasted: 17 clocks, 29% fewer. Needs
+//                  a controller that takes wide words; the BCM2835 does not.
+//    FRAME_SHORT   Two 8-bit words, the start bit first: 16 clocks, but B0
+//                  falls after the end, so results are 9 bits (even codes).
+//
+   const static int FRAME_BYTES  = 0;
+   const static int FRAME_WORD17 = 1;
+   const static int FRAME_SHORT  = 2;
+
+   static int frameBytes(int framing)     // Buffer bytes per conversion
+   {
+      return framing == FRAME_WORD17 ? 4 : framing == FRAME_SHORT ? 2 : 3;
+   }
+   static int frameWordBits(int framing)  { return framing == FRAME_WORD17 ? 17 : 8; }
+   static int frameClocks(int framing)
+   {
+      return framing == FRAME_WORD17 ? 17 : framing == FRAME_SHORT ? 16 : 24;
+   }
+
+//
+// Fill in the frameBytes() bytes of a command
+   static void encodeFrame(int framing, uint8_t channel, int input_mode, uint8_t *tx_data)
+   {
+      uint32_t word;
+
+      switch (framing)
+      {
+      case FRAME_WORD17: // Native byte order, as spidev holds words over 16 bits
+         word = Command<16>::encode(channel, input_mode);
+         memcpy(tx_data, &word, 4);
+         break;
+      case FRAME_SHORT:
+         Command<15>::Frame::store(Command<15>::encode(channel, input_mode), tx_data, 2);
+         break;
+      default:
+         encodeCommand(channel, input_mode, tx_data);
+         break;
+      }
+   }
+
+//
+// Decode n frames held back to back at frameBytes() apiece. Returns how many
+// had their null bit high, the sign of a missing chip or too fast a clock.
+// Each loop is straight line code over arrays, so at -O2 -ftree-vectorize or
+// -O3 GCC turns it into de-interleaving loads (vld2/vld3 on NEON) and works on
+// a register of frames at a time.
+   static int decodeFrames(int framing, const uint8_t *rx, uint16_t *values, int n)
    {
-      uint8_t rx_data[3];
-      uint8_t tx_data[3];
-      struct spi_ioc_transfer msg = {(unsigned long) tx_data,   // Transmit buffer
-                                     (unsigned long) rx_data,   // Receive buffer
-                                     3,                         // Data length
-                                     0,                         // Delay
-                                     speed_,                    // Transmission speed
-                                     8};                        // Bits per word
+      int bad = 0;
 
-      if (channel >= 8)
+      if (framing == FRAME_WORD17)
       {
-         fputs("MCP3008: Invalid input channel specified.\n", stderr);
-         return -1;
+         const uint32_t *w = (const uint32_t *) rx;
+         for (int i = 0 ; i < n ; ++i)
+         {
+            values[i] = w[i] & 0x3ff;
+            bad += (w[i] >> 10) & 1;
+         }
       }
-      if (input_mode < 0 || input_mode > 1)
+      else if (framing == FRAME_SHORT)
       {
-         fputs("MCP3008: Invalid input mode specified.\n", stderr);
-         return -1;
+         for (int i = 0 ; i < n ; ++i)
+         {
+            values[i] = ((rx[2*i] & 0x01) << 9) | (rx[2*i+1] << 1);
+            bad += (rx[2*i] >> 1) & 1;
+         }
+      }
+      else
+      {
+         for (int i = 0 ; i < n ; ++i)
+         {
+            values[i] = ((rx[3*i+1] & 0x03) << 8) | rx[3*i+2];
+            bad += (rx[3*i+1] >> 2) & 1;
+         }
+      }
+      return bad;
+   }
+
+//
+// Choose the framing for getValue() and getValues(). FRAME_WORD17 falls back
+// to FRAME_BYTES, returning false, if the controller refuses 17-bit words.
+   bool setFraming(int framing)
+   {
+      uint8_t bits = 17;
+
+      if (framing != FRAME_BYTES && framing != FRAME_WORD17 && framing != FRAME_SHORT)
+      {
+         ChipLog::puts("MCP3008: Invalid framing specified.\n");
+         return false;
       }
       if (fd_ < 0)
       {
-         fputs("MCP3008: Device has not been opened.\n", stderr);
-         return -1;
+         ChipLog::puts("MCP3008: Device has not been opened.\n");
+         return false;
+      }
+      if (framing == FRAME_WORD17)
+      {
+         bool wide = ioctl(fd_, SPI_IOC_WR_BITS_PER_WORD, &bits) >= 0;
+         bits = 8; // Transfers give their own word size; leave the default alone
+         ioctl(fd_, SPI_IOC_WR_BITS_PER_WORD, &bits);
+         if (!wide)
+         {
+            ChipLog::puts("MCP3008: Controller only takes 8-bit words, keeping 3 byte frames.\n");
+            framing_ = FRAME_BYTES;
+            return false;
+         }
       }
+      framing_ = framing;
+      return true;
+   }
 
-      tx_data[0] = 1; // Nothing but start bit
-      tx_data[1] = (input_mode == INPUT_MODE_DIFFERENTIAL ? 0x80 : 0x00) | (channel << 4);
-      tx_data[2] = 0;
+   int getFraming()            { return framing_; }
+   uint64_t getNullErrors()    { return nullErrors_; }  // Conversions whose null bit was high
 
-      if (ioctl(fd_, SPI_IOC_MESSAGE(1), &msg) < 0)
-         return -1;
+   int getValue(uint8_t channel, int input_mode)
+   {
+      TransferStamp stamp;
 
-      return ((((int) rx_data[1]) & 0x03) << 8) | ((int) rx_data[2]);
+      return getValue(channel, input_mode, stamp);
+   }
+
+//
+// As above, also bracketing the SPI transfer on the raw clock. The chip samples
+// its input during the transfer, between stamp.start and stamp.end.
+   int getValue(uint8_t channel, int input_mode, TransferStamp &stamp)
+   {
+      return ChipLog::check(tryGetValue(channel, input_mode, stamp), -1);
+   }
+
+//
+// As above, but a failure comes back as a ChipError and nothing is logged
+   Result<int> tryGetValue(uint8_t channel, int input_mode, TransferStamp &stamp)
+   {
+      if (channel >= 8 || input_mode < 0 || input_mode > 1)
+         return ChipError::make(ChipError::INVALID, "MCP3008", "getValue");
+      return convert(channel, input_mode, stamp);
+   }
+
+//
+// The same for a channel and mode fixed at compile time, checked there rather
+// than on every conversion
+   template <uint8_t CHANNEL, int MODE = INPUT_MODE_SINGLE>
+   int getValue(TransferStamp &stamp)
+   {
+      static_assert(CHANNEL < 8, "MCP3008 has channels 0 - 7");
+      static_assert(MODE == INPUT_MODE_SINGLE || MODE == INPUT_MODE_DIFFERENTIAL,
+                    "Invalid input mode");
+      return ChipLog::check(convert(CHANNEL, MODE, stamp), -1);
+   }
+
+   template <uint8_t CHANNEL, int MODE = INPUT_MODE_SINGLE>
+   int getValue()
+   {
+      TransferStamp stamp;
+
+      return getValue<CHANNEL, MODE>(stamp);
+   }
+
+//======================================================================================
+// getValues: Retrieve a block of conversions from a single channel. Conversions are
+//            queued BLOCK_TRANSFERS at a time into one SPI message, with chip select
+//            dropped between them, so a block costs one ioctl per batch rather than
+//            one per sample. Returns the number of values read or -1 on failure.
+//            If stamps is given each value gets its share of its batch's
+//            transfer time, the conversions being evenly spaced by the clock.
+//
+   const static int BLOCK_TRANSFERS = 64;
+
+//
+// SPI_IOC_MESSAGE() wants a constant; this is the same request for a run time count
+   static unsigned long messageRequest(int n)
+   {
+      return _IOC(_IOC_WRITE, SPI_IOC_MAGIC, 0, n * sizeof(struct spi_ioc_transfer));
+   }
+
+   int getValues(uint8_t channel, int input_mode, uint16_t *values, int count,
+                 TransferStamp *stamps = NULL)
+   {
+      return ChipLog::check(tryGetValues(channel, input_mode, values, count, stamps), -1);
+   }
+
+   Result<int> tryGetValues(uint8_t channel, int input_mode, uint16_t *values, int count,
+                            TransferStamp *stamps = NULL)
+   {
+      uint32_t tx_data[1];
+      uint32_t rx_data[BLOCK_TRANSFERS];  // Frames back to back, at most 4 bytes each
+      struct spi_ioc_transfer msgs[BLOCK_TRANSFERS];
+      int size = frameBytes(framing_);
+      int done = 0;
+
+      if (channel >= 8 || input_mode < 0 || input_mode > 1)
+         return ChipError::make(ChipError::INVALID, "MCP3008", "getValues");
+      if (fd_ < 0)
+         return ChipError::make(ChipError::NOT_OPEN, "MCP3008", "getValues");
+
+      encodeFrame(framing_, channel, input_mode, (uint8_t *) tx_data);
+
+//
+// Every transfer sends the same command so they can all share one transmit buffer
+      memset(msgs, 0, sizeof(msgs));
+      for (int i = 0 ; i < BLOCK_TRANSFERS ; ++i)
+      {
+         msgs[i].tx_buf = (unsigned long) tx_data;
+         msgs[i].rx_buf = (unsigned long) ((uint8_t *) rx_data + i * size);
+         msgs[i].len = size;
+         msgs[i].speed_hz = speed_;
+         msgs[i].bits_per_word = frameWordBits(framing_);
+         msgs[i].cs_change = 1; // Each conversion needs its own chip select cycle
+      }
+
+      while (done < count)
+      {
+         int n = count - done < BLOCK_TRANSFERS ? count - done : BLOCK_TRANSFERS;
+
+         msgs[n-1].cs_change = 0; // Release chip select at the end of the message
+         uint64_t start = Timing::raw();
+         int result = ioctl(fd_, messageRequest(n), msgs);
+         uint64_t width = Timing::raw() - start;
+         if (result < 0)
+            return ChipError::make(ChipError::TRANSFER, "MCP3008", "getValues", errno);
+         msgs[n-1].cs_change = 1;
+
+         nullErrors_ += decodeFrames(framing_, (const uint8_t *) rx_data, values + done, n);
+         if (stamps != NULL)
+            for (int i = 0 ; i < n ; ++i)
+            {
+               stamps[done + i].start = start + width * i / n;
+               stamps[done + i].end = start + width * (i + 1) / n;
+            }
+         done += n;
+      }
+
+      return done;
    }
 };
+
+#endif
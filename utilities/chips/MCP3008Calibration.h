@@ -0,0 +1,382 @@
+// Per-channel calibration for MCP3008 codes: offset, gain and nonlinearity
+// correction folded into one 1024-entry table per channel.
+//
+// A channel is calibrated from reference points, each a known input (in
+// whatever integer unit the caller works in, microvolts say) and the mean
+// code measured for it. Two points give a straight line; more give a
+// piecewise-linear curve through them, so a bowed front end is straightened
+// too. Beyond the outermost points the end segments are extended. A channel
+// can also be given fixed-point coefficients directly, value = code * gain /
+// 2^16 + offset, e.g. from a datasheet divider ratio.
+//
+// Either way the result is expanded once into a table of int32_t values, so
+// correcting a block of samples is one masked load per sample with no floating
+// point and no branches. Uncalibrated channels pass codes through unchanged.
+//
+// Calibrations are saved as text, one line per calibrated channel:
+//
+//    points channel code value [code value ...]
+//    linear channel gain offset
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP3008CALIBRATION_H
+#define MCP3008CALIBRATION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <MCP3008.h>
+
+class MCP3008Calibration
+{
+public:
+   static const int CODES      = 1024;
+   static const int MAX_POINTS = 16;
+
+   struct Point
+   {
+      double  code;   // Mean code measured
+      int32_t value;  // Reference input that produced it
+   };
+
+   MCP3008Calibration()
+   {
+      for (int c = 0 ; c < 8 ; ++c)
+         clear(c);
+   }
+
+//
+// Back to passing codes through
+   void clear(uint8_t channel)
+   {
+      Channel &ch = channel_[channel & 7];
+      int32_t *t = table_ + (channel & 7) * CODES;
+
+      ch.kind = KIND_NONE;
+      ch.points = 0;
+      for (int code = 0 ; code < CODES ; ++code)
+         t[code] = code;
+   }
+
+//=============================================================================
+// setPoints: Calibrate a channel from two or more reference points, which
+//            need not be in order but must be at distinct codes
+//
+   bool setPoints(uint8_t channel, const Point *points, int count)
+   {
+      Point sorted[MAX_POINTS];
+
+      if (channel >= 8 || count < 2 || count > MAX_POINTS)
+      {
+         fputs("MCP3008Calibration: Need a channel and 2 to 16 reference points.\n", stderr);
+         return false;
+      }
+      memcpy(sorted, points, count * sizeof(Point));
+      sortPoints(sorted, count);
+      for (int i = 1 ; i < count ; ++i)
+         if (sorted[i].code - sorted[i-1].code < 0.5)
+         {
+            fputs("MCP3008Calibration: Reference points too close together.\n", stderr);
+            return false;
+         }
+
+      Channel &ch = channel_[channel];
+      memcpy(ch.point, sorted, count * sizeof(Point));
+      ch.kind = KIND_POINTS;
+      ch.points = count;
+
+//
+// Each code goes on the segment covering it, or the nearest end segment
+      int32_t *t = table_ + channel * CODES;
+      int s = 0;
+      for (int code = 0 ; code < CODES ; ++code)
+      {
+         while (s < count - 2 && code > ch.point[s+1].code)
+            s++;
+         const Point &a = ch.point[s];
+         const Point &b = ch.point[s+1];
+         t[code] = (int32_t) lround(a.value + (code - a.code) * (b.value - a.value) / (b.code - a.code));
+      }
+      return true;
+   }
+
+//=============================================================================
+// addPoint: Add one reference point to a channel's others. The first point is
+//           held until a second arrives; the channel is rebuilt from then on.
+//
+   bool addPoint(uint8_t channel, const Point &point)
+   {
+      Point points[MAX_POINTS];
+
+      if (channel >= 8)
+      {
+         fputs("MCP3008Calibration: Invalid channel.\n", stderr);
+         return false;
+      }
+
+      Channel &ch = channel_[channel];
+      int count = ch.kind == KIND_LINEAR ? 0 : ch.points;
+      if (count >= MAX_POINTS)
+      {
+         fputs("MCP3008Calibration: Too many reference points.\n", stderr);
+         return false;
+      }
+      memcpy(points, ch.point, count * sizeof(Point));
+      points[count++] = point;
+      if (count >= 2)
+         return setPoints(channel, points, count);
+      clear(channel);
+      ch.point[0] = point;
+      ch.points = 1;
+      return true;
+   }
+
+   int getPoints(uint8_t channel, Point *points) const
+   {
+      const Channel &ch = channel_[channel & 7];
+      int count = ch.kind == KIND_LINEAR ? 0 : ch.points;
+
+      memcpy(points, ch.point, count * sizeof(Point));
+      return count;
+   }
+
+//=============================================================================
+// setLinear: Calibrate a channel with fixed-point coefficients, value =
+//            (code * gain >> 16) + offset
+//
+   bool setLinear(uint8_t channel, int32_t gain, int32_t offset)
+   {
+      if (channel >= 8)
+      {
+         fputs("MCP3008Calibration: Invalid channel.\n", stderr);
+         return false;
+      }
+
+      Channel &ch = channel_[channel];
+      int32_t *t = table_ + channel * CODES;
+      ch.kind = KIND_LINEAR;
+      ch.points = 0;
+      ch.gain = gain;
+      ch.offset = offset;
+      for (int code = 0 ; code < CODES ; ++code)
+         t[code] = (int32_t) (((int64_t) code * gain) >> 16) + offset;
+      return true;
+   }
+
+//=============================================================================
+// measure: Mean code of count conversions on a channel, for a reference
+//          point. Returns a negative number on failure.
+//
+   static double measure(MCP3008 &adc, uint8_t channel, int input_mode, int count)
+   {
+      uint16_t block[MCP3008::BLOCK_TRANSFERS];
+      uint64_t sum = 0;
+      int done = 0;
+
+      while (done < count)
+      {
+         int n = count - done < MCP3008::BLOCK_TRANSFERS ? count - done : MCP3008::BLOCK_TRANSFERS;
+         if (adc.getValues(channel, input_mode, block, n) != n)
+            return -1;
+         for (int i = 0 ; i < n ; ++i)
+            sum += block[i];
+         done += n;
+      }
+      return count > 0 ? (double) sum / count : -1;
+   }
+
+//=============================================================================
+// correct: Corrected value of one code
+//
+   int32_t correct(uint8_t channel, uint16_t code) const
+   {
+      return table_[((channel & 7) << 10) | (code & 0x3ff)];
+   }
+
+//=============================================================================
+// apply: Correct a block of codes from one channel, or from a mix of channels
+//        with each code's channel alongside it (as a scan plan delivers).
+//        Codes are masked to 10 bits so any input indexes inside the table.
+//
+   void apply(uint8_t channel, const uint16_t *codes, int32_t *values, int count) const
+   {
+      const int32_t *t = table_ + (channel & 7) * CODES;
+
+      for (int i = 0 ; i < count ; ++i)
+         values[i] = t[codes[i] & 0x3ff];
+   }
+
+   void apply(const uint8_t *channels, const uint16_t *codes, int32_t *values, int count) const
+   {
+      for (int i = 0 ; i < count ; ++i)
+         values[i] = table_[((channels[i] & 7) << 10) | (codes[i] & 0x3ff)];
+   }
+
+//=============================================================================
+// read: getValues() and apply() in one, through a block at a time. Returns
+//       the number of values read or -1.
+//
+   int read(MCP3008 &adc, uint8_t channel, int input_mode, int32_t *values, int count) const
+   {
+      uint16_t block[MCP3008::BLOCK_TRANSFERS];
+      int done = 0;
+
+      while (done < count)
+      {
+         int n = count - done < MCP3008::BLOCK_TRANSFERS ? count - done : MCP3008::BLOCK_TRANSFERS;
+         if (adc.getValues(channel, input_mode, block, n) != n)
+            return -1;
+         apply(channel, block, values + done, n);
+         done += n;
+      }
+      return done;
+   }
+
+   bool isCalibrated(uint8_t channel) const { return channel_[channel & 7].kind != KIND_NONE; }
+   const int32_t *table(uint8_t channel) const { return table_ + (channel & 7) * CODES; }
+
+//=============================================================================
+// save, load: The calibration file. load() replaces only the channels it
+//             finds. A lone reference point is saved too, so points can be
+//             measured one run at a time.
+//
+   bool save(const char *path) const
+   {
+      FILE *fp;
+
+      if ((fp = fopen(path, "w")) == NULL)
+      {
+         fprintf(stderr, "MCP3008Calibration: Unable to write %s.\n", path);
+         return false;
+      }
+      fputs("# MCP3008 calibration: points channel code value ... | linear channel gain offset\n", fp);
+      for (int c = 0 ; c < 8 ; ++c)
+      {
+         const Channel &ch = channel_[c];
+         if (ch.kind == KIND_LINEAR)
+            fprintf(fp, "linear %d %d %d\n", c, ch.gain, ch.offset);
+         else if (ch.points > 0)
+         {
+            fprintf(fp, "points %d", c);
+            for (int i = 0 ; i < ch.points ; ++i)
+               fprintf(fp, " %.3f %d", ch.point[i].code, ch.point[i].value);
+            fputc('\n', fp);
+         }
+      }
+      if (fclose(fp) != 0)
+      {
+         fprintf(stderr, "MCP3008Calibration: Unable to write %s.\n", path);
+         return false;
+      }
+      return true;
+   }
+
+   bool load(const char *path)
+   {
+      char line[1024];
+      int number = 0;
+      FILE *fp;
+
+      if ((fp = fopen(path, "r")) == NULL)
+      {
+         fprintf(stderr, "MCP3008Calibration: Unable to read %s.\n", path);
+         return false;
+      }
+      while (fgets(line, sizeof(line), fp) != NULL)
+      {
+         char kind[16];
+         int channel, used;
+         bool ok = false;
+
+         number++;
+         if (line[0] == '#' || sscanf(line, "%15s", kind) != 1)
+            continue;
+         if (sscanf(line, "%15s %d%n", kind, &channel, &used) == 2 && channel >= 0 && channel < 8)
+         {
+            if (strcmp(kind, "linear") == 0)
+            {
+               int gain, offset;
+               ok = sscanf(line + used, "%d %d", &gain, &offset) == 2 && setLinear(channel, gain, offset);
+            }
+            else if (strcmp(kind, "points") == 0)
+            {
+               Point points[MAX_POINTS];
+               const char *p = line + used;
+               int count = 0, n;
+
+               while (count < MAX_POINTS &&
+                      sscanf(p, "%lf %d%n", &points[count].code, &points[count].value, &n) == 2)
+               {
+                  count++;
+                  p += n;
+               }
+               clear(channel);
+               ok = count > 0;
+               for (int i = 0 ; ok && i < count ; ++i)
+                  ok = addPoint(channel, points[i]);
+            }
+         }
+         if (!ok)
+         {
+            fprintf(stderr, "MCP3008Calibration: %s line %d is not a calibration.\n", path, number);
+            fclose(fp);
+            return false;
+         }
+      }
+      fclose(fp);
+      return true;
+   }
+
+   void report(FILE *fp) const
+   {
+      for (int c = 0 ; c < 8 ; ++c)
+      {
+         const Channel &ch = channel_[c];
+         const int32_t *t = table(c);
+
+         if (ch.kind == KIND_NONE)
+         {
+            if (ch.points > 0)
+               fprintf(fp, "Channel %d: one point, code %.1f = %d, needs another\n", c,
+                       ch.point[0].code, ch.point[0].value);
+            continue;
+         }
+         fprintf(fp, "Channel %d: %s, code 0 -> %d, 512 -> %d, 1023 -> %d\n", c,
+                 ch.kind == KIND_LINEAR ? "linear" : "points", t[0], t[512], t[1023]);
+      }
+   }
+
+private:
+   static const int KIND_NONE   = 0;
+   static const int KIND_POINTS = 1;
+   static const int KIND_LINEAR = 2;
+
+   struct Channel
+   {
+      int     kind;
+      int     points;
+      Point   point[MAX_POINTS];
+      int32_t gain;
+      int32_t offset;
+   };
+
+   static void sortPoints(Point *p, int n)
+   {
+      for (int i = 1 ; i < n ; ++i)
+         for (int j = i ; j > 0 && p[j].code < p[j-1].code ; --j)
+         {
+            Point t = p[j];
+            p[j] = p[j-1];
+            p[j-1] = t;
+         }
+   }
+
+   Channel channel_[8];
+   int32_t table_[8 * CODES];
+};
+
+#endif
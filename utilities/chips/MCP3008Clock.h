@@ -0,0 +1,310 @@
+// SPI clock tuning for the MCP3008: find the fastest clock a board's supply
+// and wiring read reliably, and remember it per device.
+//
+// The clock is stepped up from a speed every MCP3008 manages. At each step a
+// reference channel, which must be held at a steady level, is read many times
+// with four byte frames. Each frame is checked three ways:
+//
+//    The null bit ahead of B9 must be low. DOUT is floating until then, so a
+//    late DOUT shows up here first.
+//    Clocked on past B0 the chip sends B1..B8 again LSB first; that copy must
+//    match the first.
+//    The value must be within tolerance of the reading at the slowest step.
+//
+// The highest step that passed, with every step below it passing too, is then
+// read again four times over to confirm it. The result is kept in a small text
+// file of "device hz" lines so later runs open at that speed straight away.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP3008CLOCK_H
+#define MCP3008CLOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <MCP3008.h>
+
+class MCP3008Clock
+{
+public:
+   static const int MAX_STEPS = 32;
+
+   struct Step
+   {
+      uint32_t hz;
+      int      reads;
+      int      nullErrors;    // Null bit high
+      int      mirrorErrors;  // LSB first copy disagrees
+      int      rangeErrors;   // Too far from the reference
+      int      low, high;     // Spread of the values read
+      bool     ok;
+   };
+
+   MCP3008Clock()
+   {
+      setRange(250000, 8000000, 1.25);
+      setCheck(0, 512, 2);
+      steps_ = 0;
+      chosen_ = 0;
+   }
+
+//=============================================================================
+// setRange: Speeds to try, from low up to high multiplying by factor each step
+//
+   void setRange(uint32_t low, uint32_t high, double factor)
+   {
+      low_ = low;
+      high_ = high;
+      factor_ = factor > 1.01 ? factor : 1.01;
+   }
+
+//=============================================================================
+// setCheck: Reference channel (single ended), reads per step, and the codes a
+//           read may stray from the slowest step's median
+//
+   void setCheck(uint8_t channel, int reads, int tolerance)
+   {
+      channel_ = channel & 7;
+      reads_ = reads > 0 ? reads : 1;
+      tolerance_ = tolerance;
+   }
+
+//=============================================================================
+// tune: Step the clock up and leave the chip at the fastest reliable speed.
+//       Returns that speed, or 0 if even the lowest step failed, in which
+//       case the chip is left at its original speed.
+//
+   uint32_t tune(MCP3008 &adc)
+   {
+      uint32_t original = adc.getSpeed();
+      int best = -1;
+
+      steps_ = 0;
+      chosen_ = 0;
+      reference_ = -1;
+      for (double hz = low_ ; hz <= high_ * 1.0001 && steps_ < MAX_STEPS ; hz *= factor_)
+      {
+         Step &step = step_[steps_++];
+         if (!check(adc, (uint32_t) hz, reads_, step))
+            break;
+         if (reference_ < 0) // The slowest step sets the level the others must match
+         {
+            reference_ = median_;
+            step.rangeErrors = countRange(step);
+            step.ok = step.nullErrors == 0 && step.mirrorErrors == 0 && step.rangeErrors == 0;
+         }
+         if (!step.ok)
+            break;
+         best = steps_ - 1;
+      }
+
+//
+// Confirm with a longer run, falling back a step at a time
+      for ( ; best >= 0 ; --best)
+      {
+         Step confirm;
+         if (check(adc, step_[best].hz, reads_ * 4, confirm) && confirm.ok)
+         {
+            chosen_ = step_[best].hz;
+            return chosen_;
+         }
+         step_[best].ok = false;
+      }
+      adc.setSpeed(original);
+      return 0;
+   }
+
+   int steps() const               { return steps_; }
+   const Step &step(int s) const   { return step_[s]; }
+   uint32_t chosen() const         { return chosen_; }
+
+   void report(FILE *fp) const
+   {
+      fprintf(fp, "%10s %6s %6s %6s %6s %9s\n", "hz", "reads", "null", "mirror", "range", "values");
+      for (int s = 0 ; s < steps_ ; ++s)
+      {
+         const Step &st = step_[s];
+         fprintf(fp, "%10u %6d %6d %6d %6d %4d-%-4d %s\n", st.hz, st.reads, st.nullErrors,
+                 st.mirrorErrors, st.rangeErrors, st.low, st.high, st.ok ? "ok" : "FAILED");
+      }
+      if (chosen_ != 0)
+         fprintf(fp, "Fastest reliable clock %u Hz\n", chosen_);
+      else
+         fputs("No reliable clock found\n", fp);
+   }
+
+//=============================================================================
+// load: Speed saved for a device, or 0 if there is none
+//
+   static uint32_t load(const char *path, const char *device)
+   {
+      char line[256];
+      char name[200];
+      unsigned long hz;
+      uint32_t found = 0;
+      FILE *fp;
+
+      if ((fp = fopen(path, "r")) == NULL)
+         return 0;
+      while (fgets(line, sizeof(line), fp) != NULL)
+         if (line[0] != '#' && sscanf(line, "%199s %lu", name, &hz) == 2 && strcmp(name, device) == 0)
+            found = (uint32_t) hz;
+      fclose(fp);
+      return found;
+   }
+
+//=============================================================================
+// save: Record a device's speed, replacing any it had. The file is rewritten
+//       under a temporary name and renamed over, so it is never left half
+//       written.
+//
+   static bool save(const char *path, const char *device, uint32_t hz)
+   {
+      char temp[512];
+      char line[256];
+      char name[200];
+      FILE *in, *out;
+
+      snprintf(temp, sizeof(temp), "%s.tmp", path);
+      if ((out = fopen(temp, "w")) == NULL)
+      {
+         fprintf(stderr, "MCP3008Clock: Unable to write %s.\n", temp);
+         return false;
+      }
+      if ((in = fopen(path, "r")) != NULL)
+      {
+         while (fgets(line, sizeof(line), in) != NULL)
+            if (line[0] == '#' || sscanf(line, "%199s", name) != 1 || strcmp(name, device) != 0)
+               fputs(line, out);
+         fclose(in);
+      }
+      else
+         fputs("# MCP3008 SPI clocks found by MCP3008Clock: device hz\n", out);
+      fprintf(out, "%s %u\n", device, hz);
+      if (fclose(out) != 0 || rename(temp, path) != 0)
+      {
+         fprintf(stderr, "MCP3008Clock: Unable to update %s.\n", path);
+         remove(temp);
+         return false;
+      }
+      return true;
+   }
+
+//=============================================================================
+// begin: Open a device at its saved speed, or at fallback if none is saved
+//
+   static bool begin(MCP3008 &adc, const char *device, const char *path, uint32_t fallback = 1000000)
+   {
+      uint32_t hz = load(path, device);
+      return adc.begin(device, hz != 0 ? hz : fallback);
+   }
+
+private:
+   static const int FRAMES = 64;  // Frames per SPI message
+
+//
+// Bits 7..0 of b in the opposite order
+   static uint8_t reverse(uint8_t b)
+   {
+      b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+      b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+      return (b & 0xaa) >> 1 | (b & 0x55) << 1;
+   }
+
+//
+// Read the reference channel count times at hz and fill in a step. False if
+// the transfers themselves failed.
+   bool check(MCP3008 &adc, uint32_t hz, int count, Step &step)
+   {
+      uint8_t tx[4];
+      uint8_t rx[FRAMES][4];
+      struct spi_ioc_transfer msgs[FRAMES];
+
+      memset(&step, 0, sizeof(step));
+      step.hz = hz;
+      step.low = 1023;
+      if (!adc.setSpeed(hz))
+         return false;
+
+      MCP3008::encodeCommand(channel_, MCP3008::INPUT_MODE_SINGLE, tx);
+      tx[3] = 0;
+      memset(msgs, 0, sizeof(msgs));
+      for (int i = 0 ; i < FRAMES ; ++i)
+      {
+         msgs[i].tx_buf = (unsigned long) tx;
+         msgs[i].rx_buf = (unsigned long) rx[i];
+         msgs[i].len = 4;
+         msgs[i].speed_hz = hz;
+         msgs[i].bits_per_word = 8;
+         msgs[i].cs_change = 1;
+      }
+      memset(histogram_, 0, sizeof(histogram_));
+
+      while (step.reads < count)
+      {
+         int n = count - step.reads < FRAMES ? count - step.reads : FRAMES;
+
+         msgs[n-1].cs_change = 0;
+         int result = ioctl(adc.getFd(), MCP3008::messageRequest(n), msgs);
+         msgs[n-1].cs_change = 1;
+         if (result < 0)
+         {
+            fprintf(stderr, "MCP3008Clock: Transfer failed at %u Hz.\n", hz);
+            return false;
+         }
+
+         for (int i = 0 ; i < n ; ++i)
+         {
+            int v = MCP3008::decodeResult(rx[i]);
+            if (rx[i][1] & 0x04)
+               step.nullErrors++;
+            if (reverse(rx[i][3]) != ((v >> 1) & 0xff))
+               step.mirrorErrors++;
+            if (reference_ >= 0 && abs(v - reference_) > tolerance_)
+               step.rangeErrors++;
+            if (v < step.low) step.low = v;
+            if (v > step.high) step.high = v;
+            histogram_[v]++;
+         }
+         step.reads += n;
+      }
+
+      int seen = 0;
+      for (median_ = 0 ; median_ < 1023 ; ++median_)
+         if ((seen += histogram_[median_]) * 2 >= step.reads)
+            break;
+      step.ok = step.nullErrors == 0 && step.mirrorErrors == 0 && step.rangeErrors == 0;
+      return true;
+   }
+
+//
+// The slowest step's range check, once its median is known
+   int countRange(const Step &step) const
+   {
+      int errors = 0;
+
+      for (int v = step.low ; v <= step.high ; ++v)
+         if (abs(v - reference_) > tolerance_)
+            errors += histogram_[v];
+      return errors;
+   }
+
+   uint32_t low_, high_;
+   double   factor_;
+   uint8_t  channel_;
+   int      reads_;
+   int      tolerance_;
+   int      reference_;   // Median code at the slowest step
+   int      median_;      // Of the last check
+   int      histogram_[1024];
+   Step     step_[MAX_STEPS];
+   int      steps_;
+   uint32_t chosen_;
+};
+
+#endif
@@ -0,0 +1,285 @@
+// Streaming oversample and decimate filter for MCP3008 sample blocks.
+//
+// Each output is built from 4^extra_bits raw 10-bit conversions and carries
+// 10 + extra_bits bits of resolution. The decimator is either a plain moving
+// average (boxcar) or a CIC of order 2 to 4 for better alias rejection, and can
+// be preceded by a sliding median of 3, 5 or 7 samples to knock out spikes.
+//
+// Everything is integer arithmetic on caller supplied blocks; no allocation.
+// The median and averaging kernels use GCC vector extensions so they compile
+// to NEON on the Pi and SSE on a desktop from the same source.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP3008FILTER_H
+#define MCP3008FILTER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+class MCP3008Filter
+{
+public:
+   static const int FILTER_AVERAGE = 0;
+   static const int FILTER_CIC     = 1;
+
+   static const int MAX_EXTRA_BITS = 6;  // 4096x oversampling, 16-bit output
+   static const int MAX_MEDIAN     = 7;
+
+   MCP3008Filter()
+   {
+      configure(2, FILTER_AVERAGE);
+   }
+
+//=============================================================================
+// configure: Select the filter. extra_bits of resolution are gained by
+//            decimating by 4^extra_bits. median is 0 (off), 3, 5 or 7.
+//            cic_order only applies to FILTER_CIC.
+//
+   bool configure(int extra_bits, int filter, int median = 0, int cic_order = 3)
+   {
+      if (extra_bits < 0 || extra_bits > MAX_EXTRA_BITS)
+      {
+         fputs("MCP3008Filter: Unsupported number of extra bits.\n", stderr);
+         return false;
+      }
+      if (filter != FILTER_AVERAGE && filter != FILTER_CIC)
+      {
+         fputs("MCP3008Filter: Unknown filter type.\n", stderr);
+         return false;
+      }
+      if (median != 0 && median != 1 && (median < 3 || median > MAX_MEDIAN || (median & 1) == 0))
+      {
+         fputs("MCP3008Filter: Median length must be 3, 5 or 7.\n", stderr);
+         return false;
+      }
+//
+// CIC registers wrap modulo 2^32, which is harmless as long as the full gain fits
+      if (filter == FILTER_CIC &&
+          (cic_order < 2 || cic_order > 4 || 10 + 2 * extra_bits * cic_order > 32))
+      {
+         fputs("MCP3008Filter: CIC order too high for the decimation ratio.\n", stderr);
+         return false;
+      }
+
+      extraBits_ = extra_bits;
+      log2Ratio_ = 2 * extra_bits;
+      ratio_ = 1 << log2Ratio_;
+      filter_ = filter;
+      median_ = median > 1 ? median : 0;
+      order_ = filter == FILTER_CIC ? cic_order : 1;
+      shift_ = log2Ratio_ * order_ - extraBits_;
+      reset();
+      return true;
+   }
+
+//
+// Forget all stream history
+   void reset()
+   {
+      primed_ = false;
+      phase_ = 0;
+      sum_ = 0;
+      memset(integ_, 0, sizeof(integ_));
+      memset(comb_, 0, sizeof(comb_));
+   }
+
+   int ratio() const      { return ratio_; }
+   int outputBits() const { return 10 + extraBits_; }
+
+//=============================================================================
+// process: Feed a block of raw conversions through the filter. Outputs are
+//          written to out, which must have room for count / ratio() + 1
+//          values. Returns the number of outputs produced.
+//
+   int process(const uint16_t *in, int count, uint16_t *out)
+   {
+      int produced = 0;
+
+      while (count > 0)
+      {
+         int n = count < CHUNK ? count : CHUNK;
+         const uint16_t *src = in;
+
+         if (median_ != 0)
+         {
+            medianBlock(in, n);
+            src = filtered_;
+         }
+         if (filter_ == FILTER_CIC)
+            produced += cicBlock(src, n, out + produced);
+         else
+            produced += averageBlock(src, n, out + produced);
+
+         in += n;
+         count -= n;
+      }
+      return produced;
+   }
+
+private:
+   typedef uint16_t v8u16 __attribute__((vector_size(16)));
+   typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+   static const int CHUNK = 512;
+
+   static v8u16 load(const uint16_t *p)
+   {
+      v8u16 v;
+      memcpy(&v, p, sizeof(v)); // Unaligned load
+      return v;
+   }
+
+   static v8u16 vmin(v8u16 a, v8u16 b) { return a < b ? a : b; }
+   static v8u16 vmax(v8u16 a, v8u16 b) { return a < b ? b : a; }
+
+//=============================================================================
+// medianBlock: Sliding median over the stream, eight outputs per step. The
+//              window is sorted with an odd-even transposition network of
+//              min/max pairs, so there are no data dependent branches.
+//
+   void medianBlock(const uint16_t *in, int n)
+   {
+      int keep = median_ - 1;
+
+      if (!primed_) // Pad the start of the stream with the first sample
+      {
+         for (int i = 0 ; i < keep ; ++i)
+            history_[i] = in[0];
+         primed_ = true;
+      }
+
+      memcpy(history_ + keep, in, n * sizeof(uint16_t));
+
+      int i = 0;
+      for ( ; i + 8 <= n ; i += 8)
+      {
+         v8u16 w[MAX_MEDIAN];
+
+         for (int k = 0 ; k < median_ ; ++k)
+            w[k] = load(history_ + i + k);
+         for (int pass = 0 ; pass < median_ ; ++pass)
+            for (int k = pass & 1 ; k + 1 < median_ ; k += 2)
+            {
+               v8u16 lo = vmin(w[k], w[k+1]);
+               w[k+1] = vmax(w[k], w[k+1]);
+               w[k] = lo;
+            }
+         memcpy(filtered_ + i, &w[median_ >> 1], sizeof(v8u16));
+      }
+      for ( ; i < n ; ++i) // Scalar tail
+      {
+         uint16_t w[MAX_MEDIAN];
+
+         memcpy(w, history_ + i, median_ * sizeof(uint16_t));
+         for (int pass = 0 ; pass < median_ ; ++pass)
+            for (int k = pass & 1 ; k + 1 < median_ ; k += 2)
+            {
+               uint16_t lo = w[k] < w[k+1] ? w[k] : w[k+1];
+               w[k+1] = w[k] < w[k+1] ? w[k+1] : w[k];
+               w[k] = lo;
+            }
+         filtered_[i] = w[median_ >> 1];
+      }
+
+      memmove(history_, history_ + n, keep * sizeof(uint16_t));
+   }
+
+//
+// Sum a run of samples eight lanes at a time in 32-bit accumulators
+   static uint32_t sumRun(const uint16_t *p, int n)
+   {
+      v8u32 acc = {0, 0, 0, 0, 0, 0, 0, 0};
+      uint32_t total = 0;
+      int i = 0;
+
+      for ( ; i + 8 <= n ; i += 8)
+         acc += __builtin_convertvector(load(p + i), v8u32);
+      for (int k = 0 ; k < 8 ; ++k)
+         total += acc[k];
+      for ( ; i < n ; ++i)
+         total += p[i];
+      return total;
+   }
+
+//=============================================================================
+// averageBlock: Boxcar decimation; sum ratio_ samples and drop the bits that
+//               are not gained by oversampling.
+//
+   int averageBlock(const uint16_t *in, int n, uint16_t *out)
+   {
+      int produced = 0;
+      uint32_t round = shift_ > 0 ? 1u << (shift_ - 1) : 0;
+
+      while (n > 0)
+      {
+         int take = ratio_ - phase_;
+         if (take > n)
+            take = n;
+
+         sum_ += sumRun(in, take);
+         phase_ += take;
+         in += take;
+         n -= take;
+
+         if (phase_ == ratio_)
+         {
+            out[produced++] = (uint16_t) ((sum_ + round) >> shift_);
+            sum_ = 0;
+            phase_ = 0;
+         }
+      }
+      return produced;
+   }
+
+//=============================================================================
+// cicBlock: Cascaded integrator-comb decimator. Integrators run at the input
+//           rate, combs at the output rate; gain is ratio^order.
+//
+   int cicBlock(const uint16_t *in, int n, uint16_t *out)
+   {
+      int produced = 0;
+      uint32_t round = shift_ > 0 ? 1u << (shift_ - 1) : 0;
+
+      for (int i = 0 ; i < n ; ++i)
+      {
+         uint32_t x = in[i];
+
+         for (int k = 0 ; k < order_ ; ++k)
+            x = integ_[k] += x;
+
+         if (++phase_ == ratio_)
+         {
+            phase_ = 0;
+            for (int k = 0 ; k < order_ ; ++k)
+            {
+               uint32_t y = x - comb_[k];
+               comb_[k] = x;
+               x = y;
+            }
+            out[produced++] = (uint16_t) ((x + round) >> shift_);
+         }
+      }
+      return produced;
+   }
+
+   int extraBits_;
+   int log2Ratio_;
+   int ratio_;
+   int filter_;
+   int median_;
+   int order_;
+   int shift_;
+
+   bool     primed_;
+   int      phase_;
+   uint32_t sum_;
+   uint32_t integ_[4];
+   uint32_t comb_[4];
+   uint16_t history_[CHUNK + MAX_MEDIAN];
+   uint16_t filtered_[CHUNK];
+};
+
+#endif
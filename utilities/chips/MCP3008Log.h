@@ -0,0 +1,582 @@
+// Memory-mapped ring log for high-rate MCP3008 captures.
+//
+// The log is a preallocated file made of a 4k header page followed by a ring
+// of variable length records. Each record holds one block of conversions from
+// one channel: the first value, then the rest as zig-zag deltas packed at the
+// narrowest bit width that fits the block (at most 11 bits). The block carries
+// the time of its first and last conversion; readers interpolate between them.
+//
+// The writer encodes straight into the shared mapping, so logging costs no
+// system calls; the kernel writes the pages back in the background. After a
+// record is complete the writer publishes the new ring position into one of
+// two checksummed header slots, alternating between them, so a crash or torn
+// header write always leaves the previous position readable.
+//
+// MCP3008Log:       Writer side
+// MCP3008LogReader: Reader side, safe to run alongside a live writer
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP3008LOG_H
+#define MCP3008LOG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Timing.h>
+
+class MCP3008LogFormat
+{
+public:
+   static const uint32_t VERSION      = 1;
+   static const uint32_t HEADER_SIZE  = 4096;
+   static const uint32_t RECORD_MAGIC = 0x52383033; // "308R"
+   static const uint32_t PAD_MAGIC    = 0x50383033; // "308P"
+   static const int      MAX_BLOCK    = 4096;       // Conversions per record
+
+   struct Slot
+   {
+      uint64_t seq;      // Publication count, the newest valid slot wins
+      uint64_t head;     // Ring offset of the next record to be written
+      uint64_t tail;     // Ring offset of the oldest record still present
+      uint64_t records;  // Records written over the life of the file
+      uint32_t check;
+      uint32_t spare;
+   };
+
+   struct FileHeader
+   {
+      char     magic[8];
+      uint32_t version;
+      uint32_t headerSize;
+      uint64_t dataSize;
+      uint64_t created;
+      uint8_t  pad[32];
+      Slot     slots[2];
+   };
+
+//
+// Ring offsets only ever grow; the position in the data area is offset % dataSize
+   struct Record
+   {
+      uint32_t magic;
+      uint32_t length;    // Bytes including this header, multiple of 8
+      uint64_t seq;
+      uint64_t firstTime; // CLOCK_MONOTONIC nanoseconds of the first conversion
+      uint64_t lastTime;  // and of the last one
+      uint16_t count;
+      uint8_t  channel;
+      uint8_t  width;     // Bits per packed delta
+      uint16_t first;     // First value, stored raw
+      uint16_t spare;
+      uint32_t check;     // Over header (with check zero) and payload
+      uint32_t spare2;
+   };
+
+   static uint32_t checksum(const void *data, size_t len, uint32_t h = 2166136261u)
+   {
+      const uint8_t *p = (const uint8_t *) data;
+
+      for (size_t i = 0 ; i < len ; ++i) // FNV-1a
+         h = (h ^ p[i]) * 16777619u;
+      return h;
+   }
+
+   static uint32_t slotCheck(const Slot &s)
+   {
+      return checksum(&s, offsetof(Slot, check));
+   }
+
+   static uint32_t recordCheck(const Record &header, const void *payload)
+   {
+      Record copy = header;
+      copy.check = 0;
+      return checksum(payload, header.length - sizeof(Record), checksum(&copy, sizeof(copy)));
+   }
+
+   static uint32_t recordCheck(const Record *r) { return recordCheck(*r, r + 1); }
+
+   static uint32_t payloadBytes(int count, int width)
+   {
+      uint32_t bits = (uint32_t) (count > 0 ? count - 1 : 0) * width;
+      return ((bits + 63) / 64) * 8;
+   }
+
+//
+// Pick the newest slot whose checksum holds up
+   static bool readSlot(const FileHeader *h, Slot &out)
+   {
+      for (int attempt = 0 ; attempt < 4 ; ++attempt)
+      {
+         Slot a = h->slots[0];
+         Slot b = h->slots[1];
+         bool va = slotCheck(a) == a.check;
+         bool vb = slotCheck(b) == b.check;
+
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         if (va && (!vb || a.seq > b.seq))
+         {
+            out = a;
+            return true;
+         }
+         if (vb)
+         {
+            out = b;
+            return true;
+         }
+      }
+      return false;
+   }
+};
+
+class MCP3008Log : public MCP3008LogFormat
+{
+public:
+   MCP3008Log()
+   {
+      fd_ = -1;
+      map_ = NULL;
+      mapSize_ = 0;
+   }
+
+//=============================================================================
+// begin: Open (or create) a log file with a ring of dataSize bytes. The whole
+//        file is allocated and faulted in up front so appends never wait on
+//        block allocation. An existing log of the same size is appended to.
+//
+   bool begin(const char *path, uint64_t dataSize)
+   {
+      if (fd_ >= 0)
+      {
+         fputs("MCP3008Log: Log already open.\n", stderr);
+         return false;
+      }
+      dataSize = (dataSize + 4095) & ~4095ULL;
+      if (dataSize < 2 * (sizeof(Record) + payloadBytes(MAX_BLOCK, 11)))
+      {
+         fputs("MCP3008Log: Ring too small.\n", stderr);
+         return false;
+      }
+
+      if ((fd_ = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+      {
+         fprintf(stderr, "MCP3008Log: Unable to open %s.\n", path);
+         return false;
+      }
+
+//
+// A filesystem without fallocate gets a sparse file instead. Anything else,
+// ENOSPC above all, fails here rather than as a SIGBUS on a later append.
+      mapSize_ = HEADER_SIZE + dataSize;
+      int err = posix_fallocate(fd_, 0, mapSize_);
+      if (err == EOPNOTSUPP)
+         err = ftruncate(fd_, mapSize_) == 0 ? 0 : errno;
+      if (err != 0)
+      {
+         fprintf(stderr, "MCP3008Log: Unable to allocate %s: %s.\n", path, strerror(err));
+         end();
+         return false;
+      }
+
+      map_ = (uint8_t *) mmap(NULL, mapSize_, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd_, 0);
+      if (map_ == MAP_FAILED)
+      {
+         map_ = NULL;
+         fprintf(stderr, "MCP3008Log: Unable to map %s.\n", path);
+         end();
+         return false;
+      }
+
+      header_ = (FileHeader *) map_;
+      data_ = map_ + HEADER_SIZE;
+      dataSize_ = dataSize;
+
+      Slot s;
+      if (memcmp(header_->magic, "MCP3008L", 8) == 0 && header_->version == VERSION &&
+          header_->dataSize == dataSize && readSlot(header_, s))
+      {
+         seq_ = s.seq;
+         head_ = s.head;
+         tail_ = s.tail;
+         records_ = s.records;
+      }
+      else
+      {
+         memset(header_, 0, HEADER_SIZE);
+         memcpy(header_->magic, "MCP3008L", 8);
+         header_->version = VERSION;
+         header_->headerSize = HEADER_SIZE;
+         header_->dataSize = dataSize;
+         header_->created = Timing::now(CLOCK_REALTIME);
+         seq_ = 0;
+         head_ = tail_ = records_ = 0;
+         publish();
+         publish(); // Both slots valid from the start
+      }
+      return true;
+   }
+
+//=============================================================================
+// end: Flush and close the log
+//
+   void end()
+   {
+      if (map_ != NULL)
+      {
+         msync(map_, mapSize_, MS_SYNC);
+         munmap(map_, mapSize_);
+         map_ = NULL;
+      }
+      if (fd_ >= 0)
+      {
+         close(fd_);
+         fd_ = -1;
+      }
+   }
+
+//
+// Ask the kernel to start writing back what has been logged so far
+   void sync() { if (map_ != NULL) msync(map_, mapSize_, MS_ASYNC); }
+
+   uint64_t getRecords() const { return records_; }
+   uint64_t getHead() const    { return head_; }
+
+//=============================================================================
+// append: Log a block of conversions taken from one channel between firstTime
+//         and lastTime. Blocks over MAX_BLOCK are split.
+//
+   bool append(uint8_t channel, const uint16_t *values, int count,
+               uint64_t firstTime, uint64_t lastTime)
+   {
+      if (map_ == NULL)
+      {
+         fputs("MCP3008Log: Log is not open.\n", stderr);
+         return false;
+      }
+
+      while (count > MAX_BLOCK)
+      {
+         uint64_t split = firstTime + (lastTime - firstTime) * MAX_BLOCK / count;
+         appendBlock(channel, values, MAX_BLOCK, firstTime, split);
+         values += MAX_BLOCK;
+         count -= MAX_BLOCK;
+         firstTime = split;
+      }
+      if (count > 0)
+         appendBlock(channel, values, count, firstTime, lastTime);
+      return true;
+   }
+
+private:
+   Record *at(uint64_t offset) { return (Record *) (data_ + offset % dataSize_); }
+
+//
+// Move the tail past every record the next length bytes will overwrite
+   void reserve(uint32_t length)
+   {
+      while (head_ + length - tail_ > dataSize_)
+         tail_ += at(tail_)->length;
+   }
+
+   void appendBlock(uint8_t channel, const uint16_t *values, int count,
+                    uint64_t firstTime, uint64_t lastTime)
+   {
+//
+// Find the width needed for the biggest delta in the block
+      uint32_t all = 0;
+      for (int i = 1 ; i < count ; ++i)
+         all |= zigzag(values[i] - values[i-1]);
+      int width = all == 0 ? 0 : 32 - __builtin_clz(all);
+      uint32_t length = sizeof(Record) + payloadBytes(count, width);
+
+//
+// Records never wrap; pad out the end of the ring instead
+      uint64_t oldTail = tail_;
+      uint32_t room = dataSize_ - head_ % dataSize_;
+      if (room < length)
+      {
+         reserve(room);
+         Record *pad = at(head_);
+         pad->length = room;
+         pad->magic = PAD_MAGIC;
+         head_ += room;
+      }
+      reserve(length);
+//
+// Let readers know what is about to be overwritten before touching it
+      if (tail_ != oldTail)
+         publish();
+
+      Record *r = at(head_);
+      r->magic = 0; // Not valid until it is complete
+      r->length = length;
+      r->seq = records_;
+      r->firstTime = firstTime;
+      r->lastTime = lastTime;
+      r->count = count;
+      r->channel = channel;
+      r->width = width;
+      r->first = values[0];
+      r->spare = 0;
+      r->spare2 = 0;
+
+      uint64_t *out = (uint64_t *) (r + 1);
+      uint64_t acc = 0;
+      int bits = 0;
+      if (width > 0)
+         for (int i = 1 ; i < count ; ++i)
+         {
+            uint32_t z = zigzag(values[i] - values[i-1]);
+            acc |= (uint64_t) z << bits;
+            bits += width;
+            if (bits >= 64)
+            {
+               *out++ = acc;
+               bits -= 64;
+               acc = (uint64_t) z >> (width - bits);
+            }
+         }
+      if (bits > 0)
+         *out = acc;
+
+      r->magic = RECORD_MAGIC;
+      r->check = 0;
+      r->check = recordCheck(r);
+
+      head_ += length;
+      records_++;
+      publish();
+   }
+
+   void publish()
+   {
+      Slot s;
+
+      __atomic_thread_fence(__ATOMIC_RELEASE); // Record contents before its position
+      seq_++;
+      s.seq = seq_;
+      s.head = head_;
+      s.tail = tail_;
+      s.records = records_;
+      s.spare = 0;
+      s.check = slotCheck(s);
+      header_->slots[seq_ & 1] = s;
+   }
+
+   static uint32_t zigzag(int d) { return (uint32_t) ((d << 1) ^ (d >> 31)); }
+
+   int         fd_;
+   uint8_t    *map_;
+   size_t      mapSize_;
+   FileHeader *header_;
+   uint8_t    *data_;
+   uint64_t    dataSize_;
+   uint64_t    seq_;
+   uint64_t    head_;
+   uint64_t    tail_;
+   uint64_t    records_;
+};
+
+class MCP3008LogReader : public MCP3008LogFormat
+{
+public:
+   MCP3008LogReader()
+   {
+      fd_ = -1;
+      map_ = NULL;
+      mapSize_ = 0;
+      pos_ = 0;
+      lost_ = 0;
+   }
+
+   bool begin(const char *path)
+   {
+      struct stat st;
+
+      if ((fd_ = open(path, O_RDONLY)) < 0)
+      {
+         fprintf(stderr, "MCP3008LogReader: Unable to open %s.\n", path);
+         return false;
+      }
+      if (fstat(fd_, &st) < 0 || (size_t) st.st_size < HEADER_SIZE)
+      {
+         fprintf(stderr, "MCP3008LogReader: %s is not a log.\n", path);
+         end();
+         return false;
+      }
+      mapSize_ = st.st_size;
+      map_ = (uint8_t *) mmap(NULL, mapSize_, PROT_READ, MAP_SHARED, fd_, 0);
+      if (map_ == MAP_FAILED)
+      {
+         map_ = NULL;
+         fprintf(stderr, "MCP3008LogReader: Unable to map %s.\n", path);
+         end();
+         return false;
+      }
+
+      header_ = (const FileHeader *) map_;
+      if (memcmp(header_->magic, "MCP3008L", 8) != 0 || header_->version != VERSION ||
+          header_->headerSize < sizeof(FileHeader) || header_->headerSize % 8 != 0 ||
+          header_->headerSize > mapSize_ || header_->dataSize == 0 ||
+          header_->dataSize % 8 != 0 || header_->dataSize > mapSize_ - header_->headerSize)
+      {
+         fprintf(stderr, "MCP3008LogReader: %s is not a log.\n", path);
+         end();
+         return false;
+      }
+      data_ = map_ + header_->headerSize;
+      dataSize_ = header_->dataSize;
+
+      Slot s;
+      pos_ = readSlot(header_, s) ? s.tail : 0;
+      return true;
+   }
+
+   void end()
+   {
+      if (map_ != NULL)
+         munmap((void *) map_, mapSize_);
+      map_ = NULL;
+      if (fd_ >= 0)
+         close(fd_);
+      fd_ = -1;
+   }
+
+//
+// Start from the newest data rather than the oldest (for tailing)
+   void seekEnd()
+   {
+      Slot s;
+      if (readSlot(header_, s))
+         pos_ = s.head;
+   }
+
+   bool getSlot(Slot &s) const { return readSlot(header_, s); }
+   uint64_t getLost() const    { return lost_; } // Bytes overwritten before they were read
+
+//=============================================================================
+// next: Decode the next record into values (room for MAX_BLOCK). Returns 1
+//       with a record, 0 when caught up with the writer, -1 on corruption.
+//
+   int next(Record &rec, uint16_t *values)
+   {
+      Slot s;
+
+      while (true)
+      {
+         if (!readSlot(header_, s))
+            return -1;
+         if (pos_ < s.tail) // The writer lapped us
+         {
+            lost_ += s.tail - pos_;
+            pos_ = s.tail;
+         }
+         if (pos_ >= s.head)
+            return 0;
+
+//
+// Only the magic and length words are sure to be in the ring: a pad at the
+// end can be as short as 8 bytes. The header is copied once it is known to
+// fit, and everything after works from the copy, as the writer may be
+// overwriting the original.
+         uint64_t offset = pos_ % dataSize_;
+         const uint32_t *words = (const uint32_t *) (data_ + offset);
+         uint32_t magic = __atomic_load_n(&words[0], __ATOMIC_RELAXED);
+         uint32_t length = __atomic_load_n(&words[1], __ATOMIC_RELAXED);
+         bool valid;
+
+         if (magic == PAD_MAGIC)
+            valid = length >= 8 && length % 8 == 0 && length <= dataSize_ - offset;
+         else
+         {
+            valid = magic == RECORD_MAGIC && length >= sizeof(Record) &&
+                    length <= dataSize_ - offset;
+            if (valid)
+            {
+               rec = *(const Record *) words;
+               valid = rec.length == length && rec.count >= 1 && rec.count <= MAX_BLOCK &&
+                       rec.width <= 16 && length >= sizeof(Record) + payloadBytes(rec.count, rec.width) &&
+                       recordCheck(rec, data_ + offset + sizeof(Record)) == rec.check;
+            }
+         }
+         if (!valid)
+         {
+//
+// Either overwritten while we looked or genuinely bad; if the tail moved
+// past us it was the former and we just go round again.
+            Slot again;
+            if (readSlot(header_, again) && again.tail > pos_)
+               continue;
+            return -1;
+         }
+         if (magic == PAD_MAGIC)
+         {
+            pos_ += length;
+            continue;
+         }
+
+         decode(rec, (const uint64_t *) (data_ + offset + sizeof(Record)), values);
+
+         Slot after;
+         if (!readSlot(header_, after) || after.tail > pos_) // Overwritten mid decode
+            continue;
+
+         pos_ += rec.length;
+         return 1;
+      }
+   }
+
+//
+// Timestamp of value i of a record, interpolated across the block
+   static uint64_t timeOf(const Record &rec, int i)
+   {
+      if (rec.count < 2)
+         return rec.firstTime;
+      return rec.firstTime + (rec.lastTime - rec.firstTime) * i / (rec.count - 1);
+   }
+
+private:
+   static void decode(const Record &rec, const uint64_t *in, uint16_t *values)
+   {
+      int width = rec.width;
+      uint64_t mask = (1ULL << width) - 1;
+      int v = rec.first;
+      uint32_t bit = 0;
+
+      values[0] = v;
+      for (int i = 1 ; i < rec.count ; ++i)
+      {
+         uint32_t z = 0;
+         if (width > 0)
+         {
+            uint32_t w = bit >> 6, off = bit & 63;
+            uint64_t x = in[w] >> off;
+            if (off + width > 64)
+               x |= in[w+1] << (64 - off);
+            z = (uint32_t) (x & mask);
+            bit += width;
+         }
+         v += (int) (z >> 1) ^ -(int) (z & 1);
+         values[i] = (uint16_t) v;
+      }
+   }
+
+   int                fd_;
+   const uint8_t     *map_;
+   size_t             mapSize_;
+   const FileHeader  *header_;
+   const uint8_t     *data_;
+   uint64_t           dataSize_;
+   uint64_t           pos_;
+   uint64_t           lost_;
+};
+
+#endif
@@ -0,0 +1,202 @@
+// Multi-rate channel scan plans for the MCP3008.
+//
+// A plan lists the channel/mode pairs to sample and their relative rates.
+// compile() lays the conversions out as a repeating schedule with each
+// entry's slots spread evenly (smooth weighted round robin), encodes the
+// command for every slot once, and builds the spi_ioc_transfer array. The
+// schedule is repeated to fill a message so acquire() is a single ioctl
+// followed by a straight decode, with no per-sample decisions.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP3008SCANPLAN_H
+#define MCP3008SCANPLAN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <MCP3008.h>
+
+class MCP3008ScanPlan
+{
+public:
+   static const int MAX_ENTRIES = 16;
+   static const int MAX_SLOTS   = 256; // Transfers in one replayed message
+
+   MCP3008ScanPlan() { clear(); }
+
+   void clear()
+   {
+      entries_ = 0;
+      cycle_ = 0;
+      slots_ = 0;
+   }
+
+//=============================================================================
+// add: Add a channel to the plan. rate is relative to the other entries, so
+//      rates of 4 and 1 sample the first entry four times as often.
+//      Returns the entry number or -1.
+//
+   int add(uint8_t channel, int input_mode, int rate)
+   {
+      if (entries_ >= MAX_ENTRIES)
+      {
+         ChipLog::puts("MCP3008ScanPlan: Too many entries.\n");
+         return -1;
+      }
+      if (channel >= 8)
+      {
+         ChipLog::puts("MCP3008ScanPlan: Invalid input channel specified.\n");
+         return -1;
+      }
+      if (input_mode < 0 || input_mode > 1)
+      {
+         ChipLog::puts("MCP3008ScanPlan: Invalid input mode specified.\n");
+         return -1;
+      }
+      if (rate < 1)
+      {
+         ChipLog::puts("MCP3008ScanPlan: Rate must be at least 1.\n");
+         return -1;
+      }
+
+      channel_[entries_] = channel;
+      mode_[entries_] = input_mode;
+      rate_[entries_] = rate;
+      latest_[entries_] = 0;
+      slots_ = 0; // Needs compiling again
+      return entries_++;
+   }
+
+//=============================================================================
+// compile: Build the schedule for transfers at the indicated clock speed
+//
+   bool compile(uint32_t speed)
+   {
+      int weight[MAX_ENTRIES];
+      int current[MAX_ENTRIES];
+      int g = 0;
+
+      if (entries_ == 0)
+      {
+         ChipLog::puts("MCP3008ScanPlan: Plan is empty.\n");
+         return false;
+      }
+
+      for (int e = 0 ; e < entries_ ; ++e)
+         g = gcd(g, rate_[e]);
+      cycle_ = 0;
+      for (int e = 0 ; e < entries_ ; ++e)
+      {
+         weight[e] = rate_[e] / g;
+         current[e] = 0;
+         cycle_ += weight[e];
+      }
+      if (cycle_ > MAX_SLOTS)
+      {
+         ChipLog::puts("MCP3008ScanPlan: Rates too finely divided for one schedule.\n");
+         cycle_ = 0;
+         return false;
+      }
+
+//
+// Smooth weighted round robin: every slot goes to the entry with the most
+// accumulated credit, which spaces each entry's slots as evenly as possible.
+      for (int s = 0 ; s < cycle_ ; ++s)
+      {
+         int best = 0;
+         for (int e = 0 ; e < entries_ ; ++e)
+         {
+            current[e] += weight[e];
+            if (current[e] > current[best])
+               best = e;
+         }
+         current[best] -= cycle_;
+         entry_[s] = best;
+      }
+
+      slots_ = (MAX_SLOTS / cycle_) * cycle_;
+      for (int s = cycle_ ; s < slots_ ; ++s)
+         entry_[s] = entry_[s - cycle_];
+
+      memset(msgs_, 0, sizeof(msgs_));
+      for (int s = 0 ; s < slots_ ; ++s)
+      {
+         MCP3008::encodeCommand(channel_[entry_[s]], mode_[entry_[s]], tx_[s]);
+         msgs_[s].tx_buf = (unsigned long) tx_[s];
+         msgs_[s].rx_buf = (unsigned long) rx_[s];
+         msgs_[s].len = 3;
+         msgs_[s].speed_hz = speed;
+         msgs_[s].bits_per_word = 8;
+         msgs_[s].cs_change = s + 1 < slots_; // Fresh chip select per conversion
+      }
+      return true;
+   }
+
+   int entries() const        { return entries_; }
+   int slotsPerCycle() const  { return cycle_; }
+   int slots() const          { return slots_; }  // Values produced per acquire()
+   int entryOf(int slot) const { return entry_[slot]; }
+   uint8_t channelOf(int entry) const { return channel_[entry]; }
+   int modeOf(int entry) const        { return mode_[entry]; }
+   uint16_t latest(int entry) const   { return latest_[entry]; }
+
+//=============================================================================
+// acquire: Replay the compiled schedule once. values receives slots() values
+//          in schedule order (entryOf() maps them back). Returns the number of
+//          values or -1 on failure.
+//
+   int acquire(MCP3008 &adc, uint16_t *values)
+   {
+      if (slots_ == 0)
+      {
+         ChipLog::puts("MCP3008ScanPlan: Plan has not been compiled.\n");
+         return -1;
+      }
+      if (!adc.isOpen())
+      {
+         ChipLog::puts("MCP3008ScanPlan: Device has not been opened.\n");
+         return -1;
+      }
+
+      if (ioctl(adc.getFd(), MCP3008::messageRequest(slots_), msgs_) < 0)
+      {
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP3008ScanPlan", "acquire", errno));
+         return -1;
+      }
+
+      for (int s = 0 ; s < slots_ ; ++s)
+         values[s] = (uint16_t) MCP3008::decodeResult(rx_[s]);
+      for (int s = slots_ - cycle_ ; s < slots_ ; ++s) // The last cycle has the newest
+         latest_[entry_[s]] = values[s];
+      return slots_;
+   }
+
+private:
+   static int gcd(int a, int b)
+   {
+      while (b != 0)
+      {
+         int t = a % b;
+         a = b;
+         b = t;
+      }
+      return a;
+   }
+
+   int     entries_;
+   uint8_t channel_[MAX_ENTRIES];
+   int     mode_[MAX_ENTRIES];
+   int     rate_[MAX_ENTRIES];
+   uint16_t latest_[MAX_ENTRIES];
+
+   int     cycle_;
+   int     slots_;
+   uint8_t entry_[MAX_SLOTS];
+   uint8_t tx_[MAX_SLOTS][3];
+   uint8_t rx_[MAX_SLOTS][3];
+   struct spi_ioc_transfer msgs_[MAX_SLOTS];
+};
+
+#endif
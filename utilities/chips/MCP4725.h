@@ -3,6 +3,9 @@
 // Code by Ignus Porkus/Gray Lorig
 // License: LGPL
 
+#ifndef MCP4725_H
+#define MCP4725_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -12,6 +15,8 @@
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
 #include <unistd.h>
+#include <RegisterMap.h>
+#include <ChipError.h>
 
 class MCP4725
 {
@@ -30,6 +35,11 @@ public:
    bool powerDown(uint8_t mode, bool persist=false);
    bool setValue(uint16_t value, bool persist=false);
 
+//
+// setValue() for an output loop: a failure comes back as a ChipError, nothing
+// is logged and the device is left open
+   Result<void> trySetValue(uint16_t value, bool persist=false);
+
    MCP4725()
    {
       i2caddr_ = 0;
@@ -39,9 +49,27 @@ public:
 private:
    static const uint8_t MCP4725_ADDRESS      = 0x60;
    static const uint8_t MCP4725_FAST_WRITE   = 0x00;
-   static const uint8_t MCP4725_DAC_WRITE    = 0x40;
-   static const uint8_t MCP4725_EEPROM_WRITE = 0x60;
-   static const uint16_t MCP4725_MAX_VALUE   = 0x0fff; // We are a 12-bit DAC
+   static const uint8_t MCP4725_DAC_WRITE    = 0x02;
+   static const uint8_t MCP4725_EEPROM_WRITE = 0x03;
+   static const uint16_t MCP4725_MID_SCALE   = 0x0800;
+
+//
+// Fast write: C1 C0 PD1 PD0 D11..D8, D7..D0
+   typedef Word<uint16_t>          FastFrame;
+   typedef Field<FastFrame, 14, 2> FastCommand;
+   typedef Field<FastFrame, 12, 2> FastPowerDown;
+   typedef Field<FastFrame, 0, 12> FastValue;
+
+//
+// DAC and EEPROM writes: C2 C1 C0 x x PD1 PD0 x, D11..D4, D3..D0 x x x x
+   typedef Word<uint32_t>          LongFrame;
+   typedef Field<LongFrame, 21, 3> LongCommand;
+   typedef Field<LongFrame, 17, 2> LongPowerDown;
+   typedef Field<LongFrame, 4, 12> LongValue;
+
+   static const uint16_t MCP4725_MAX_VALUE   = FastValue::mask; // We are a 12-bit DAC
+
+   bool send(uint8_t mode, uint16_t value, bool persist);
 
    uint8_t i2caddr_;
    int     deviceFd_;
@@ -64,13 +92,13 @@ inline bool MCP4725::begin(const char *device, uint8_t addr)
 // Attempt to open the i2c device driver
    if (deviceFd_ >= 0) // Connection is already open
    {
-      fputs("MCP4725: Device already open", stderr);
+      ChipLog::puts("MCP4725: Device already open");
       return false;
    }
 
    if ((deviceFd_ = open(device, O_RDWR)) < 0)
    {
-      fprintf (stderr, "MCP4725: Unable to open device %s", device);
+      ChipLog::printf("MCP4725: Unable to open device %s", device);
       return false;
    }
 
@@ -79,7 +107,7 @@ inline bool MCP4725::begin(const char *device, uint8_t addr)
    if (ioctl(deviceFd_, I2C_SLAVE, i2caddr_) < 0)
    {
       end();
-      fprintf(stderr, "MCP4725: Unable to ioctl %s.", device);
+      ChipLog::printf("MCP4725: Unable to ioctl %s.", device);
       return false;
    }
 
@@ -102,12 +130,9 @@ inline void MCP4725::end()
 //
 inline bool MCP4725::powerDown(uint8_t mode, bool persist)
 {
-   uint8_t buffer[3];
-   int size;
-
    if (deviceFd_ < 0) // Make sure the device is open
    {
-       fputs ("MCP4725: Device is not open\n", stderr);
+       ChipLog::puts("MCP4725: Device is not open\n");
        return false;
    }
 
@@ -115,30 +140,14 @@ inline bool MCP4725::powerDown(uint8_t mode, bool persist)
        mode != MODE_POWERDOWN_100K &&
        mode != MODE_POWERDOWN_500K) // Only supported powerdown modes
    {
-      fputs ("MCP4725: Unsupported powerdown mode\n", stderr);
+      ChipLog::puts("MCP4725: Unsupported powerdown mode\n");
       return false;
    }
 
-   if (persist)
-   {
-      buffer[0] = MCP4725_EEPROM_WRITE | (mode << 1);
-      buffer[1] = 0x80; // Set to mid scale
-      buffer[2] = 0x00;
-
-      size = 3;
-   }
-   else // If we are not persisting use a fast write
-   {
-      buffer[0] = MCP4725_FAST_WRITE | (mode << 4) | 0x08;
-      buffer[1] = 0;
-
-      size = 2;
-   }
-
-   if (write(deviceFd_, buffer, size) != size)
+   if (!send(mode, MCP4725_MID_SCALE, persist))
    {
       end();
-      fputs("MCP4725: Unable to write power down command\n", stderr);
+      ChipLog::puts("MCP4725: Unable to write power down command\n");
       return false;
    }
 
@@ -148,45 +157,57 @@ inline bool MCP4725::powerDown(uint8_t mode, bool persist)
 //====================================================================
 // setValue: Set the output value as indicated.
 //
-inline bool MCP4725::setValue(uint16_t value, bool persist)
+inline Result<void> MCP4725::trySetValue(uint16_t value, bool persist)
 {
-   uint8_t buffer[3];
-   int size;
-
    if (deviceFd_ < 0) // Make sure the device is open
-   {
-       fputs ("MCP4725: Device is not open\n", stderr);
-       return false;
-   }
+      return ChipError::make(ChipError::NOT_OPEN, "MCP4725", "setValue");
 
    if (value > MCP4725_MAX_VALUE) // Make sure we are not out of range
+      return ChipError::make(ChipError::INVALID, "MCP4725", "setValue");
+
+   if (!send(MODE_NORMAL, value, persist))
+      return ChipError::make(ChipError::TRANSFER, "MCP4725", "setValue", errno);
+
+   return Result<void>();
+}
+
+inline bool MCP4725::setValue(uint16_t value, bool persist)
+{
+   Result<void> result = trySetValue(value, persist);
+
+   if (!ChipLog::check(result))
    {
-      fputs ("MCP4725: Value is out of range\n", stderr);
+      if (result.error().code == ChipError::TRANSFER)
+         end();
       return false;
    }
 
+   return true;
+}
+
+//====================================================================
+// send: Write a mode and value, to the DAC register and EEPROM if persisting
+//       or as a fast write if not.
+//
+inline bool MCP4725::send(uint8_t mode, uint16_t value, bool persist)
+{
+   uint8_t buffer[3];
+   int size;
+
    if (persist)
    {
-      buffer[0] = MCP4725_EEPROM_WRITE | (MODE_NORMAL << 1);
-      buffer[1] = (value >> 4) & 0xff; // Top 8 bits
-      buffer[2] = (value << 4) & 0xff; // Bottom 4 bits
-
+      LongFrame::store(LongCommand::make(MCP4725_EEPROM_WRITE) | LongPowerDown::make(mode) |
+                       LongValue::make(value), buffer, 3);
       size = 3;
    }
    else // If we are not persisting use a fast write
    {
-      buffer[0] = MCP4725_FAST_WRITE | (MODE_NORMAL << 4) | (value >> 8);
-      buffer[1] = value & 0xff;
-
+      FastFrame::store(FastCommand::make(MCP4725_FAST_WRITE) | FastPowerDown::make(mode) |
+                       FastValue::make(value), buffer);
       size = 2;
    }
 
-   if (write(deviceFd_, buffer, size) != size)
-   {
-      end();
-      fputs("MCP4725: Unable to write value command\n", stderr);
-      return false;
-   }
-
-   return true;
+   return write(deviceFd_, buffer, size) == size;
 }
+
+#endif
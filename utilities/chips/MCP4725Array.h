@@ -0,0 +1,210 @@
+// Array of up to eight MCP4725 DACs (addresses 0x60 - 0x67) updated together.
+//
+// DAC n is the one at 0x60 + n. All share a single bus descriptor, and an
+// update is one combined transfer carrying a two byte fast write per DAC, so
+// the outputs change within a few bytes' bus time of each other rather than a
+// system call apart. DACs whose value is unchanged since the last update are
+// left out of the transfer.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef MCP4725ARRAY_H
+#define MCP4725ARRAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ChipError.h>
+#include <I2CBus.h>
+
+class MCP4725Array
+{
+public:
+   static const uint8_t  MODE_NORMAL         = 0x00;
+   static const uint8_t  MODE_POWERDOWN_1K   = 0x01;
+   static const uint8_t  MODE_POWERDOWN_100K = 0x02;
+   static const uint8_t  MODE_POWERDOWN_500K = 0x03;
+   static const int      DEVICES             = 8;
+   static const uint16_t MAX_VALUE           = 0x0fff;
+
+   MCP4725Array()
+   {
+      present_ = 0;
+      count_ = 0;
+      writes_ = 0;
+      skipped_ = 0;
+      memset(value_, 0, sizeof(value_));
+      memset(mode_, 0, sizeof(mode_));
+      memset(stale_, 0, sizeof(stale_));
+   }
+
+//=============================================================================
+// begin: Open the bus and pick up the DAC register of each device in present
+//        (bit n for address 0x60 + n), all in one transfer, so the first
+//        update already knows what it can skip.
+//
+   bool begin(const char *device, uint8_t present = 0xff)
+   {
+      if (present == 0)
+      {
+         ChipLog::puts("MCP4725Array: No devices specified.\n");
+         return false;
+      }
+      if (!bus_.begin(device))
+         return false;
+
+      present_ = present;
+      count_ = 0;
+      for (int d = 0 ; d < DEVICES ; ++d)
+         if (present_ & (1 << d))
+            index_[count_++] = d;
+
+      struct i2c_msg msgs[DEVICES];
+      uint8_t status[DEVICES][3];
+
+      for (int i = 0 ; i < count_ ; ++i)
+         I2CBus::readMsg(msgs[i], ADDRESS | index_[i], status[i], 3);
+      if (!bus_.transfer(msgs, count_))
+      {
+         end();
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP4725Array", "begin", errno));
+         return false;
+      }
+
+      for (int i = 0 ; i < count_ ; ++i)
+      {
+         int d = index_[i];
+         mode_[d] = (status[i][0] >> 1) & 0x03;
+         value_[d] = (status[i][1] << 4) | (status[i][2] >> 4);
+      }
+      return true;
+   }
+
+   void end() { bus_.end(); }
+   bool isOpen() { return bus_.isOpen(); }
+
+//=============================================================================
+// setValues: Set DAC n to values[n] for every present n in mask, in one
+//            transfer. DACs already at their value are skipped; a DAC that
+//            was powered down is always written, which wakes it.
+//
+   bool setValues(const uint16_t *values, uint8_t mask = 0xff)
+   {
+      uint16_t next[DEVICES];
+      uint8_t modes[DEVICES];
+
+      for (int d = 0 ; d < DEVICES ; ++d)
+      {
+         bool set = (mask & present_ & (1 << d)) != 0;
+         if (set && values[d] > MAX_VALUE)
+         {
+            ChipLog::puts("MCP4725Array: Value is out of range.\n");
+            return false;
+         }
+         next[d] = set ? values[d] : value_[d];
+         modes[d] = set ? MODE_NORMAL : mode_[d];
+      }
+      return update(next, modes);
+   }
+
+   bool setValue(uint8_t n, uint16_t value)
+   {
+      uint16_t values[DEVICES];
+
+      if (n >= DEVICES || (present_ & (1 << n)) == 0)
+      {
+         ChipLog::puts("MCP4725Array: Invalid DAC specified.\n");
+         return false;
+      }
+      values[n] = value;
+      return setValues(values, 1 << n);
+   }
+
+//=============================================================================
+// powerDown: Power down the DACs in mask with the given pull down resistor.
+//            Each keeps its value, which comes back on the next update.
+//
+   bool powerDown(uint8_t mask, uint8_t mode)
+   {
+      uint8_t modes[DEVICES];
+
+      if (mode != MODE_POWERDOWN_1K &&
+          mode != MODE_POWERDOWN_100K &&
+          mode != MODE_POWERDOWN_500K)
+      {
+         ChipLog::puts("MCP4725Array: Unsupported powerdown mode.\n");
+         return false;
+      }
+      for (int d = 0 ; d < DEVICES ; ++d)
+         modes[d] = mask & (1 << d) ? mode : mode_[d];
+      return update(value_, modes);
+   }
+
+//
+// Forget what was last written so the next update writes every DAC, e.g.
+// after something else on the bus may have changed them
+   void invalidate() { memset(stale_, 1, sizeof(stale_)); }
+
+   uint16_t getValue(uint8_t n) const { return value_[n & 7]; }
+   uint8_t  getPresent() const        { return present_; }
+
+//
+// Fast writes sent and skipped as unchanged, over all updates
+   uint64_t getWrites() const  { return writes_; }
+   uint64_t getSkipped() const { return skipped_; }
+
+private:
+   static const uint8_t ADDRESS            = 0x60;
+   static const uint8_t MCP4725_FAST_WRITE = 0x00;
+
+//
+// One fast write for each present DAC whose value or mode differs
+   bool update(const uint16_t *values, const uint8_t *modes)
+   {
+      struct i2c_msg msgs[DEVICES];
+      uint8_t buffer[DEVICES][2];
+      int n = 0;
+
+      for (int i = 0 ; i < count_ ; ++i)
+      {
+         int d = index_[i];
+         if (values[d] == value_[d] && modes[d] == mode_[d] && !stale_[d])
+         {
+            skipped_++;
+            continue;
+         }
+         buffer[n][0] = MCP4725_FAST_WRITE | (modes[d] << 4) | (values[d] >> 8);
+         buffer[n][1] = values[d] & 0xff;
+         I2CBus::writeMsg(msgs[n], ADDRESS | d, buffer[n], 2);
+         n++;
+      }
+      if (n == 0)
+         return true;
+
+      if (!bus_.transfer(msgs, n))
+      {
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "MCP4725Array", "update", errno));
+         invalidate(); // Some may have landed
+         return false;
+      }
+      memmove(value_, values, sizeof(value_));
+      memmove(mode_, modes, sizeof(mode_));
+      memset(stale_, 0, sizeof(stale_));
+      writes_ += n;
+      return true;
+   }
+
+   I2CBus   bus_;
+   uint8_t  present_;
+   int      count_;
+   uint8_t  index_[DEVICES];
+   uint16_t value_[DEVICES];
+   uint8_t  mode_[DEVICES];
+   uint8_t  stale_[DEVICES];     // Written state unknown
+   uint64_t writes_;
+   uint64_t skipped_;
+};
+
+#endif
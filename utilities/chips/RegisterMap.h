@@ -0,0 +1,163 @@
+// Compile-time descriptors for chip registers, command words and the fields
+// within them, and typed transfers built from them.
+//
+// A register is a type carrying its address byte (with any command bits the
+// chip wants on it, like the TSL2561's COMMAND_BIT) and its width. A word is
+// the same without an address, for command frames such as the MCP4725's or the
+// MCP3008's. A field is a type naming its register or word, shift and width.
+// Masks and shifts are then constants, a field that does not fit its register
+// fails to compile, and an accessor templated on a constant pin or channel
+// needs no runtime range check.
+//
+// RegisterPort does the transfers for chips addressed the usual I2C way, a
+// register address byte then data, least significant byte first:
+//
+//    write<REG>(value)            One write() of address and data
+//    read<REG>(value)             One combined transfer: address, then data
+//    readBlock<REG>(data, len)    The same over consecutive registers
+//    update<FIELD>(shadow, v)     Read-modify-write against a cached copy of
+//                                 the register: no read, and no write at all
+//                                 when nothing changes
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef REGISTERMAP_H
+#define REGISTERMAP_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <unistd.h>
+
+template <class T>
+struct Word
+{
+   typedef T type;
+   static constexpr int bytes = sizeof(T);
+
+//
+// The low count bytes of a word, most significant first, as frames go out
+   static void store(T value, uint8_t *buffer, int count = sizeof(T))
+   {
+      for (int i = 0 ; i < count ; ++i)
+         buffer[i] = value >> (8 * (count - 1 - i));
+   }
+};
+
+template <uint8_t ADDRESS, class T = uint8_t>
+struct Register : Word<T>
+{
+   static constexpr uint8_t address = ADDRESS;
+};
+
+template <class REG, int SHIFT, int BITS = 1>
+struct Field
+{
+   typedef REG reg;
+   typedef typename REG::type type;
+
+   static_assert(SHIFT >= 0 && BITS > 0 && SHIFT + BITS <= 8 * (int) sizeof(type),
+                 "Field does not fit its register");
+
+   static constexpr int  shift = SHIFT;
+   static constexpr int  bits = BITS;
+   static constexpr type mask = (type) ((((uint64_t) 1 << BITS) - 1) << SHIFT);
+
+   static constexpr type insert(type word, uint32_t value)
+   {
+      return (type) ((word & ~mask) | (((type) value << SHIFT) & mask));
+   }
+   static constexpr type make(uint32_t value) { return insert(0, value); }
+   static constexpr uint32_t extract(type word) { return (word & mask) >> SHIFT; }
+};
+
+//
+// One bit of a register picked by a constant, a pin say
+template <class REG, int BIT>
+struct Bit : Field<REG, BIT, 1>
+{
+};
+
+class RegisterPort
+{
+public:
+   RegisterPort() { fd_ = -1; addr_ = 0; }
+
+//
+// Use a descriptor already bound to the chip with I2C_SLAVE
+   void bind(int fd, uint8_t addr) { fd_ = fd; addr_ = addr; }
+
+   template <class REG>
+   bool write(typename REG::type value)
+   {
+      uint8_t buffer[1 + REG::bytes];
+
+      buffer[0] = REG::address;
+      for (int i = 0 ; i < REG::bytes ; ++i)
+         buffer[1 + i] = value >> (8 * i);
+      return ::write(fd_, buffer, sizeof(buffer)) == (ssize_t) sizeof(buffer);
+   }
+
+   template <class REG>
+   bool read(typename REG::type &value)
+   {
+      uint8_t data[REG::bytes];
+
+      if (!readBlock<REG>(data, REG::bytes))
+         return false;
+      value = 0;
+      for (int i = 0 ; i < REG::bytes ; ++i)
+         value |= (typename REG::type) data[i] << (8 * i);
+      return true;
+   }
+
+   template <class REG>
+   bool readBlock(uint8_t *data, int len)
+   {
+      uint8_t reg = REG::address;
+      struct i2c_msg msgs[2];
+      struct i2c_rdwr_ioctl_data xfer;
+
+      msgs[0].addr = addr_;
+      msgs[0].flags = 0;
+      msgs[0].len = 1;
+      msgs[0].buf = &reg;
+      msgs[1].addr = addr_;
+      msgs[1].flags = I2C_M_RD;
+      msgs[1].len = len;
+      msgs[1].buf = data;
+      xfer.msgs = msgs;
+      xfer.nmsgs = 2;
+      return ioctl(fd_, I2C_RDWR, &xfer) >= 0;
+   }
+
+//
+// Set the bits of mask in a register to those of bits, writing only if that
+// changes the cached copy, which follows the write
+   template <class REG>
+   bool updateBits(typename REG::type &shadow, typename REG::type mask, typename REG::type bits)
+   {
+      typename REG::type next = (shadow & ~mask) | (bits & mask);
+
+      if (next == shadow)
+         return true;
+      if (!write<REG>(next))
+         return false;
+      shadow = next;
+      return true;
+   }
+
+   template <class FIELD>
+   bool update(typename FIELD::type &shadow, uint32_t value)
+   {
+      return updateBits<typename FIELD::reg>(shadow, FIELD::mask, FIELD::make(value));
+   }
+
+private:
+   int     fd_;
+   uint8_t addr_;
+};
+
+#endif
@@ -0,0 +1,247 @@
+// Synchronised sampling of a set of MCP3008 channels and TSL2561s, with every
+// reading stamped on CLOCK_MONOTONIC_RAW and the skew across the set measured.
+//
+// Neither chip has a trigger input, so synchronising them means triggering
+// them back to back with nothing in between. The transfers are all built when
+// members are added; sample() is then one SPI message per MCP3008, holding
+// every channel asked of it, and one combined I2C transfer per TSL2561, each
+// bracketed by raw clock reads. Channels within an SPI message are evenly
+// spaced by the clock, so each gets its own share of the bracket.
+//
+// A TSL2561 integrates continuously and the transfer only fetches the last
+// finished cycle, so its stamp says when the counts were read, not when the
+// light fell on the chip.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef SAMPLEGROUP_H
+#define SAMPLEGROUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <MCP3008.h>
+#include <TSL2561.h>
+#include <Timing.h>
+
+class SampleGroup
+{
+public:
+   static const int MAX_MEMBERS = 16;
+
+   struct Sample
+   {
+      TransferStamp stamp;
+      int           value;     // ADC code, or TSL2561 ir_vis
+      int           infrared;  // TSL2561 ir
+      bool          ok;
+   };
+
+   SampleGroup()
+   {
+      members_ = 0;
+      reads_ = 0;
+      resetStats();
+   }
+
+//=============================================================================
+// add: Add a member, returning its number or -1. Drivers must be open. Channels
+//      of an MCP3008 that is already in the group join its SPI message.
+//
+   int add(MCP3008 &adc, uint8_t channel, int input_mode = MCP3008::INPUT_MODE_SINGLE)
+   {
+      int r;
+
+      if (channel >= 8 || (input_mode != MCP3008::INPUT_MODE_SINGLE &&
+                           input_mode != MCP3008::INPUT_MODE_DIFFERENTIAL))
+      {
+         fputs("SampleGroup: Invalid channel or input mode.\n", stderr);
+         return -1;
+      }
+      for (r = 0 ; r < reads_ ; ++r)
+         if (read_[r].adc == &adc)
+            break;
+      if ((r == reads_ && !newRead(&adc, NULL)) || !newMember(r))
+         return -1;
+
+      Read &read = read_[r];
+      int k = read.count - 1;
+      MCP3008::encodeCommand(channel, input_mode, read.tx[k]);
+      memset(&read.msgs[k], 0, sizeof(read.msgs[k]));
+      read.msgs[k].tx_buf = (unsigned long) read.tx[k];
+      read.msgs[k].rx_buf = (unsigned long) read.rx[k];
+      read.msgs[k].len = 3;
+      read.msgs[k].speed_hz = adc.getSpeed();
+      read.msgs[k].bits_per_word = 8;
+      if (k > 0)
+         read.msgs[k-1].cs_change = 1; // Each conversion needs its own chip select cycle
+      return members_ - 1;
+   }
+
+   int add(TSL2561 &light)
+   {
+      if (!newRead(NULL, &light) || !newMember(reads_ - 1))
+         return -1;
+      return members_ - 1;
+   }
+
+   int members() const { return members_; }
+
+//=============================================================================
+// sample: Read every member back to back. Returns false if any failed; the
+//         rest are still valid and marked ok.
+//
+   bool sample()
+   {
+      bool ok = true;
+
+      for (int r = 0 ; r < reads_ ; ++r)
+      {
+         Read &read = read_[r];
+         Sample &first = sample_[read.first];
+
+         if (read.light != NULL)
+         {
+            first.ok = read.light->getReading(first.value, first.infrared, first.stamp);
+            ok = ok && first.ok;
+            continue;
+         }
+
+         uint64_t start = Timing::raw();
+         int result = ioctl(read.adc->getFd(), MCP3008::messageRequest(read.count), read.msgs);
+         uint64_t width = Timing::raw() - start;
+         for (int k = 0 ; k < read.count ; ++k)
+         {
+            Sample &s = sample_[read.member[k]];
+            s.ok = result >= 0;
+            s.stamp.start = start + width * k / read.count;
+            s.stamp.end = start + width * (k + 1) / read.count;
+            s.value = s.ok ? MCP3008::decodeResult(read.rx[k]) : -1;
+            s.infrared = 0;
+         }
+         ok = ok && result >= 0;
+      }
+      account();
+      return ok;
+   }
+
+   const Sample &get(int member) const { return sample_[member]; }
+
+//
+// One time for the whole group: the middle of the spread of its members
+   uint64_t time() const
+   {
+      uint64_t first = UINT64_MAX, last = 0;
+
+      for (int m = 0 ; m < members_ ; ++m)
+      {
+         uint64_t t = sample_[m].stamp.mid();
+         if (t < first) first = t;
+         if (t > last) last = t;
+      }
+      return first + (last - first) / 2;
+   }
+
+//=============================================================================
+// Skew statistics: the spread of member midpoints within each group, and
+// each member's average offset from member 0 and bracket width
+//
+   const LatencyStats &getSkew() const { return skew_; }
+   uint64_t getGroups() const          { return groups_; }
+
+   double meanOffset(int member) const { return groups_ ? (double) offset_[member] / groups_ : 0; }
+   double meanWidth(int member) const  { return groups_ ? (double) width_[member] / groups_ : 0; }
+
+   void resetStats()
+   {
+      skew_.reset();
+      groups_ = 0;
+      memset(offset_, 0, sizeof(offset_));
+      memset(width_, 0, sizeof(width_));
+   }
+
+   void report(FILE *fp) const
+   {
+      fprintf(fp, "%llu groups of %d members in %d transfers\n", (unsigned long long) groups_,
+              members_, reads_);
+      skew_.print(fp, "skew");
+      for (int m = 0 ; m < members_ ; ++m)
+         fprintf(fp, "   member %2d: offset %9.1fus  width %7.1fus\n", m, meanOffset(m) / 1000.0,
+                 meanWidth(m) / 1000.0);
+   }
+
+private:
+   struct Read
+   {
+      MCP3008 *adc;
+      TSL2561 *light;
+      int      first;                    // Member of the first transfer
+      int      count;                    // Transfers in the message
+      int      member[MAX_MEMBERS];
+      uint8_t  tx[MAX_MEMBERS][3];
+      uint8_t  rx[MAX_MEMBERS][3];
+      struct spi_ioc_transfer msgs[MAX_MEMBERS];
+   };
+
+   bool newRead(MCP3008 *adc, TSL2561 *light)
+   {
+      if (members_ >= MAX_MEMBERS)
+      {
+         fputs("SampleGroup: Too many members.\n", stderr);
+         return false;
+      }
+      Read &read = read_[reads_++];
+      read.adc = adc;
+      read.light = light;
+      read.first = members_;
+      read.count = 0;
+      return true;
+   }
+
+   bool newMember(int r)
+   {
+      if (members_ >= MAX_MEMBERS)
+      {
+         fputs("SampleGroup: Too many members.\n", stderr);
+         return false;
+      }
+      read_[r].member[read_[r].count++] = members_;
+      memset(&sample_[members_], 0, sizeof(Sample));
+      members_++;
+      return true;
+   }
+
+   void account()
+   {
+      uint64_t first = UINT64_MAX, last = 0;
+      uint64_t base = sample_[0].stamp.mid();
+
+      for (int m = 0 ; m < members_ ; ++m)
+      {
+         uint64_t t = sample_[m].stamp.mid();
+         if (t < first) first = t;
+         if (t > last) last = t;
+         offset_[m] += (int64_t) (t - base);
+         width_[m] += sample_[m].stamp.width();
+      }
+      if (members_ > 0)
+      {
+         skew_.record(last - first);
+         groups_++;
+      }
+   }
+
+   Read         read_[MAX_MEMBERS];
+   int          reads_;
+   Sample       sample_[MAX_MEMBERS];
+   int          members_;
+   LatencyStats skew_;
+   uint64_t     groups_;
+   int64_t      offset_[MAX_MEMBERS];
+   uint64_t     width_[MAX_MEMBERS];
+};
+
+#endif
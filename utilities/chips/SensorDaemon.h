@@ -0,0 +1,411 @@
+// Sampling engine for a process that owns the buses and publishes every
+// chip's readings into a SensorRing for other processes to share.
+//
+// Each source is one chip read at its own rate: an MCP3008 (any set of
+// single ended channels, all converted in one SPI message), a TSL2561 (both
+// channels and the lux figure) or an MCP23008 (the pin levels). Sources on
+// the same bus device are served by one thread, earliest deadline first, so
+// the daemon never has two transactions racing on a bus and a slow chip only
+// delays its bus neighbours. Each thread is the only writer of its sources'
+// rings.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef SENSORDAEMON_H
+#define SENSORDAEMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <MCP3008.h>
+#include <MCP23008.h>
+#include <TSL2561.h>
+#include <TSL2561Lux.h>
+#include <SensorRing.h>
+#include <Timing.h>
+
+class SensorDaemon : public SensorRingFormat
+{
+public:
+   SensorDaemon()
+   {
+      entries_ = 0;
+      buses_ = 0;
+      running_ = false;
+   }
+
+//=============================================================================
+// addSource: Add a chip to sample rate times a second. address is the I2C
+//            address for KIND_LIGHT and KIND_GPIO, and the mask of channels
+//            to convert for KIND_ADC. name defaults to kind and number, e.g.
+//            "adc0". Returns the source number or -1.
+//
+   int addSource(uint8_t kind, const char *device, uint16_t address, double rate,
+                 const char *name = NULL)
+   {
+      if (running_ || entries_ >= MAX_SOURCES)
+      {
+         fputs("SensorDaemon: Running or too many sources.\n", stderr);
+         return -1;
+      }
+      if (kind != KIND_ADC && kind != KIND_LIGHT && kind != KIND_GPIO)
+      {
+         fputs("SensorDaemon: Unknown source kind.\n", stderr);
+         return -1;
+      }
+      if (kind == KIND_ADC && (address == 0 || address > 0xff))
+      {
+         fputs("SensorDaemon: ADC channel mask must be 0x01 to 0xff.\n", stderr);
+         return -1;
+      }
+      if (rate <= 0 || rate > 100000)
+      {
+         fputs("SensorDaemon: Rate must be above 0 and at most 100000.\n", stderr);
+         return -1;
+      }
+
+      Entry &e = entry_[entries_];
+      int same = 0;
+      for (int i = 0 ; i < entries_ ; ++i)
+         same += entry_[i].kind == kind;
+      if (name != NULL)
+         snprintf(e.name, sizeof(e.name), "%s", name);
+      else
+         snprintf(e.name, sizeof(e.name), "%s%d", kindName(kind), same);
+      snprintf(e.device, sizeof(e.device), "%s", device);
+      e.kind = kind;
+      e.address = address;
+      e.rate = rate;
+      e.period = (uint64_t) (Timing::NSEC_PER_SEC / rate);
+      return entries_++;
+   }
+
+//=============================================================================
+// start: Create the ring, open every chip and start a thread per bus, at
+//        SCHED_FIFO priority if asked and allowed
+//
+   bool start(const char *ring_name, uint32_t slots = 1024, bool realtime = false)
+   {
+      if (running_ || entries_ == 0)
+      {
+         fputs("SensorDaemon: Running or no sources.\n", stderr);
+         return false;
+      }
+      if (!ring_.begin(ring_name, entries_, slots))
+         return false;
+
+      buses_ = 0;
+      for (int i = 0 ; i < entries_ ; ++i)
+      {
+         if (!open(entry_[i]))
+         {
+            closeAll();
+            ring_.end();
+            return false;
+         }
+         ring_.describe(i, entry_[i].name, entry_[i].device, entry_[i].kind,
+                        entry_[i].count, entry_[i].address, entry_[i].rate);
+         assign(i);
+      }
+
+      __atomic_store_n(&stop_, 0, __ATOMIC_RELAXED);
+      uint64_t now = Timing::now();
+      for (int i = 0 ; i < entries_ ; ++i)
+      {
+         entry_[i].due = now;
+         entry_[i].samples = 0;
+         entry_[i].failures = 0;
+         entry_[i].late = 0;
+         entry_[i].readTime.reset();
+      }
+      for (int b = 0 ; b < buses_ ; ++b)
+         if (!startThread(bus_[b], realtime))
+         {
+            __atomic_store_n(&stop_, 1, __ATOMIC_RELAXED);
+            for (int j = 0 ; j < b ; ++j)
+               pthread_join(bus_[j].thread, NULL);
+            closeAll();
+            ring_.end();
+            return false;
+         }
+      running_ = true;
+      return true;
+   }
+
+   void stop()
+   {
+      if (!running_)
+         return;
+      __atomic_store_n(&stop_, 1, __ATOMIC_RELAXED);
+      for (int b = 0 ; b < buses_ ; ++b)
+         pthread_join(bus_[b].thread, NULL);
+      closeAll();
+      ring_.end();
+      running_ = false;
+   }
+
+   int sources() const { return entries_; }
+   int buses() const   { return buses_; }
+   const char *nameOf(int s) const { return entry_[s].name; }
+
+//
+// Statistics; only meaningful once the daemon has been stopped
+   uint64_t getSamples(int s) const  { return entry_[s].samples; }
+   uint64_t getFailures(int s) const { return entry_[s].failures; }
+   uint64_t getLate(int s) const     { return entry_[s].late; }  // Deadlines missed and skipped
+   const LatencyStats &getReadTime(int s) const { return entry_[s].readTime; }
+
+private:
+   static const uint64_t MAX_SLEEP = 50000000ULL; // Longest wait before checking for stop
+
+   struct Entry
+   {
+      char     name[16];
+      char     device[32];
+      uint8_t  kind;
+      uint8_t  count;
+      uint16_t address;
+      double   rate;
+      uint64_t period;
+      uint64_t due;
+
+      MCP3008  adc;
+      MCP23008 gpio;
+      TSL2561  light;
+
+      uint8_t  channel[8];   // ADC channels in conversion order
+      uint8_t  tx[8][3];
+      uint8_t  rx[8][3];
+      struct spi_ioc_transfer msgs[8];
+
+      uint64_t samples;
+      uint64_t failures;
+      uint64_t late;
+      LatencyStats readTime;
+      Reading  last;
+   };
+
+   struct Bus
+   {
+      SensorDaemon *daemon;
+      const char   *device;
+      int           entries;
+      int           entry[MAX_SOURCES];
+      pthread_t     thread;
+   };
+
+   bool open(Entry &e)
+   {
+      switch (e.kind)
+      {
+      case KIND_ADC:
+         if (!e.adc.begin(e.device))
+            return false;
+//
+// Every channel converted in one message, a chip select cycle each
+         e.count = 0;
+         memset(e.msgs, 0, sizeof(e.msgs));
+         for (int c = 0 ; c < 8 ; ++c)
+            if (e.address & (1 << c))
+            {
+               int m = e.count++;
+               e.channel[m] = c;
+               MCP3008::encodeCommand(c, MCP3008::INPUT_MODE_SINGLE, e.tx[m]);
+               e.msgs[m].tx_buf = (unsigned long) e.tx[m];
+               e.msgs[m].rx_buf = (unsigned long) e.rx[m];
+               e.msgs[m].len = 3;
+               e.msgs[m].speed_hz = e.adc.getSpeed();
+               e.msgs[m].bits_per_word = 8;
+               e.msgs[m].cs_change = 1;
+            }
+         e.msgs[e.count - 1].cs_change = 0;
+         return true;
+
+      case KIND_LIGHT:
+         if (!e.light.begin(e.device, e.address))
+            return false;
+//
+// The longest integration that completes within the sampling period
+         if (e.period >= 402 * 1000000ULL)
+            e.light.setIntegrationTime(TSL2561::INTEG_TIME_402MS);
+         else if (e.period >= 101 * 1000000ULL)
+            e.light.setIntegrationTime(TSL2561::INTEG_TIME_101MS);
+         else
+            e.light.setIntegrationTime(TSL2561::INTEG_TIME_13_7MS);
+         e.count = 3;
+         return true;
+
+      case KIND_GPIO:
+         if (!e.gpio.begin(e.device, e.address))
+            return false;
+         e.count = 1;
+         return true;
+      }
+      return false;
+   }
+
+   void closeAll()
+   {
+      for (int i = 0 ; i < entries_ ; ++i)
+      {
+         entry_[i].adc.end();
+         entry_[i].gpio.end();
+         entry_[i].light.end();
+      }
+   }
+
+//
+// Put a source on the thread for its bus device, starting one if need be
+   void assign(int i)
+   {
+      int b;
+
+      for (b = 0 ; b < buses_ ; ++b)
+         if (strcmp(bus_[b].device, entry_[i].device) == 0)
+            break;
+      if (b == buses_)
+      {
+         bus_[b].daemon = this;
+         bus_[b].device = entry_[i].device;
+         bus_[b].entries = 0;
+         buses_++;
+      }
+      bus_[b].entry[bus_[b].entries++] = i;
+   }
+
+   bool startThread(Bus &bus, bool realtime)
+   {
+      pthread_attr_t attr;
+      struct sched_param param;
+
+      pthread_attr_init(&attr);
+      if (realtime)
+      {
+         param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+         pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+         pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+         pthread_attr_setschedparam(&attr, &param);
+      }
+      if (pthread_create(&bus.thread, &attr, busThread, &bus) != 0)
+      {
+         if (!realtime)
+         {
+            pthread_attr_destroy(&attr);
+            fprintf(stderr, "SensorDaemon: Unable to start thread for %s.\n", bus.device);
+            return false;
+         }
+         fputs("SensorDaemon: No real-time priority, running at normal priority.\n", stderr);
+         pthread_attr_destroy(&attr);
+         pthread_attr_init(&attr);
+         if (pthread_create(&bus.thread, &attr, busThread, &bus) != 0)
+         {
+            pthread_attr_destroy(&attr);
+            fprintf(stderr, "SensorDaemon: Unable to start thread for %s.\n", bus.device);
+            return false;
+         }
+      }
+      pthread_attr_destroy(&attr);
+      return true;
+   }
+
+//
+// Read one chip into a reading; false if the chip did not answer. Lux is
+// TSL2561Lux::LUX_SATURATED when either channel is at full scale. Failures
+// are counted, not logged, and leave the chip open for the next period.
+   static bool sample(Entry &e, Reading &r)
+   {
+      int ir_vis, ir;
+      TransferStamp stamp;
+
+      r.count = e.count;
+      switch (e.kind)
+      {
+      case KIND_ADC:
+         if (ioctl(e.adc.getFd(), MCP3008::messageRequest(e.count), e.msgs) < 0)
+            return false;
+         for (int m = 0 ; m < e.count ; ++m)
+            r.value[m] = MCP3008::decodeResult(e.rx[m]);
+         return true;
+
+      case KIND_LIGHT:
+         if (!e.light.tryGetReading(ir_vis, ir, stamp))
+            return false;
+         r.value[0] = ir_vis;
+         r.value[1] = ir;
+         r.value[2] = TSL2561Lux::calculate(ir_vis, ir, e.light.getGain(),
+                                            e.light.getIntegrationTime());
+         return true;
+
+      case KIND_GPIO:
+      {
+         Result<uint8_t> bits = e.gpio.tryReadPins();
+         if (!bits)
+            return false;
+         r.value[0] = bits.value();
+         return true;
+      }
+      }
+      return false;
+   }
+
+   static void *busThread(void *arg)
+   {
+      Bus &bus = *(Bus *) arg;
+      SensorDaemon &d = *bus.daemon;
+
+      for (int k = 0 ; k < bus.entries ; ++k)
+         memset(&d.entry_[bus.entry[k]].last, 0, sizeof(Reading));
+      while (!__atomic_load_n(&d.stop_, __ATOMIC_RELAXED))
+      {
+         int i = bus.entry[0];
+         for (int k = 1 ; k < bus.entries ; ++k)
+            if (d.entry_[bus.entry[k]].due < d.entry_[i].due)
+               i = bus.entry[k];
+
+         Entry &e = d.entry_[i];
+         Reading &r = e.last;
+         uint64_t now = Timing::now();
+         if (e.due > now)
+         {
+            Timing::sleepUntil(e.due - now > MAX_SLEEP ? now + MAX_SLEEP : e.due);
+            continue;
+         }
+
+//
+// A failed read still publishes, marked failed, with the last good values
+         r.time = now;
+         if (sample(e, r))
+            r.status = STATUS_OK;
+         else
+         {
+            r.status = STATUS_FAILED;
+            e.failures++;
+         }
+         d.ring_.publish(i, r);
+         e.samples++;
+
+         uint64_t done = Timing::now();
+         e.readTime.record(done - now);
+         e.due += e.period;
+         if (e.due <= done) // Overran a whole period; skip rather than burst
+         {
+            e.late++;
+            e.due = done;
+         }
+      }
+      return NULL;
+   }
+
+   SensorRing ring_;
+   Entry      entry_[MAX_SOURCES];
+   int        entries_;
+   Bus        bus_[MAX_SOURCES];
+   int        buses_;
+   bool       running_;
+   int        stop_;
+};
+
+#endif
@@ -0,0 +1,482 @@
+// Shared-memory rings of chip readings, one writer process and any number of
+// readers.
+//
+// A ring is a POSIX shared memory object: a header page describing each
+// source (one chip sampled at one rate) followed by a ring of slots per
+// source. A slot is one cache line holding a sequence word and a Reading.
+// The writer makes the sequence odd, fills the reading and then sets it to
+// 2n + 2 for the nth reading of that source, so a reader copies a slot,
+// checks the sequence did not move, and knows it has reading n intact
+// (a seqlock). Readers never write to the mapping and never make a system
+// call once attached; they only need the head count of a source to find
+// its newest reading.
+//
+// SensorRingFormat: Shared layout and the slot protocol
+// SensorRing:       Writer side, creates and owns the shared memory object
+// SensorRingClient: Reader side, latest values and streams with loss counts
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef SENSORRING_H
+#define SENSORRING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Timing.h>
+
+class SensorRingFormat
+{
+public:
+   static const uint32_t VERSION     = 1;
+   static const uint32_t HEADER_SIZE = 4096;
+   static const int      MAX_SOURCES = 16;
+   static const int      MAX_VALUES  = 8;
+
+   static const uint8_t KIND_ADC   = 1;   // MCP3008, a value per channel read
+   static const uint8_t KIND_LIGHT = 2;   // TSL2561, ir_vis, ir and lux
+   static const uint8_t KIND_GPIO  = 3;   // MCP23008, the pin levels
+
+   static const uint16_t STATUS_OK     = 0;
+   static const uint16_t STATUS_FAILED = 1; // Chip did not answer; values are stale
+
+   struct Reading
+   {
+      uint64_t time;       // CLOCK_MONOTONIC when the chip was read
+      uint64_t published;  // CLOCK_MONOTONIC when the reading went into the ring
+      uint16_t count;      // Values in use
+      uint16_t status;
+      uint32_t spare;
+      uint32_t value[MAX_VALUES];
+   };
+
+   struct Slot
+   {
+      uint64_t seq;        // 2n + 1 while reading n is written, 2n + 2 once it is complete
+      Reading  reading;
+   };                      // 64 bytes, one cache line
+
+//
+// A source description and, on a cache line of its own, the writer's count
+   struct Source
+   {
+      char     name[16];
+      char     device[32];
+      uint8_t  kind;
+      uint8_t  count;      // Values per reading
+      uint16_t address;    // I2C address or MCP3008 channel mask
+      uint32_t rate;       // Readings per second, x1000
+      uint8_t  pad1[8];
+      uint64_t head;       // Readings published
+      uint8_t  pad2[56];
+   };
+
+   struct Header
+   {
+      char     magic[8];
+      uint32_t version;
+      uint32_t sources;
+      uint32_t slots;      // Per source, a power of two
+      uint32_t pid;        // Writer process
+      uint64_t created;    // CLOCK_REALTIME nanoseconds
+      uint32_t running;    // Cleared when the writer shuts down
+      uint8_t  pad[28];
+      Source   source[MAX_SOURCES];
+   };
+
+//
+// What a slot held when read
+   static const int SLOT_OK      = 0;
+   static const int SLOT_NOT_YET = 1; // Reading n has not been completed
+   static const int SLOT_LAPPED  = 2; // The writer has moved on past reading n
+
+   static const char *magic() { return "SENSRING"; }
+
+   static size_t mapSize(uint32_t sources, uint32_t slots)
+   {
+      return HEADER_SIZE + (size_t) sources * slots * sizeof(Slot);
+   }
+
+   static const char *kindName(uint8_t kind)
+   {
+      switch (kind)
+      {
+      case KIND_ADC:   return "adc";
+      case KIND_LIGHT: return "light";
+      case KIND_GPIO:  return "gpio";
+      }
+      return "?";
+   }
+
+protected:
+//
+// Readings are copied a word at a time with relaxed atomics; the sequence
+// checks either side are what make the copy consistent
+   static void copyOut(Reading &r, const Slot *slot)
+   {
+      const uint64_t *from = (const uint64_t *) &slot->reading;
+      uint64_t *to = (uint64_t *) &r;
+
+      for (size_t i = 0 ; i < sizeof(Reading) / 8 ; ++i)
+         to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+   }
+
+   static void copyIn(Slot *slot, const Reading &r)
+   {
+      const uint64_t *from = (const uint64_t *) &r;
+      uint64_t *to = (uint64_t *) &slot->reading;
+
+      for (size_t i = 0 ; i < sizeof(Reading) / 8 ; ++i)
+         __atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+   }
+};
+
+//=============================================================================
+// SensorRing: Writer side. Only one thread may publish to a given source.
+//
+class SensorRing : public SensorRingFormat
+{
+public:
+   SensorRing()
+   {
+      map_ = NULL;
+      header_ = NULL;
+      name_[0] = '\0';
+   }
+
+//=============================================================================
+// begin: Create the shared memory object (a name like "/chips") with room for
+//        sources sources of slots readings each. A leftover object of the same
+//        name is replaced; readers still attached to it see running cleared.
+//
+   bool begin(const char *name, int sources, uint32_t slots)
+   {
+      int fd;
+
+      if (map_ != NULL)
+      {
+         fputs("SensorRing: Ring already open.\n", stderr);
+         return false;
+      }
+      if (sources < 1 || sources > MAX_SOURCES)
+      {
+         fprintf(stderr, "SensorRing: Source count must be 1 to %d.\n", MAX_SOURCES);
+         return false;
+      }
+      if (slots < 2 || (slots & (slots - 1)) != 0)
+      {
+         fputs("SensorRing: Slot count must be a power of two.\n", stderr);
+         return false;
+      }
+
+      retire(name);
+      shm_unlink(name);
+      if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+      {
+         fprintf(stderr, "SensorRing: Unable to create %s.\n", name);
+         return false;
+      }
+      mapSize_ = mapSize(sources, slots);
+      if (ftruncate(fd, mapSize_) != 0)
+      {
+         close(fd);
+         shm_unlink(name);
+         fprintf(stderr, "SensorRing: Unable to size %s.\n", name);
+         return false;
+      }
+      map_ = (uint8_t *) mmap(NULL, mapSize_, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, 0);
+      close(fd);
+      if (map_ == MAP_FAILED)
+      {
+         map_ = NULL;
+         shm_unlink(name);
+         fprintf(stderr, "SensorRing: Unable to map %s.\n", name);
+         return false;
+      }
+
+      snprintf(name_, sizeof(name_), "%s", name);
+      header_ = (Header *) map_;
+      header_->version = VERSION;
+      header_->sources = sources;
+      header_->slots = slots;
+      header_->pid = getpid();
+      header_->created = Timing::now(CLOCK_REALTIME);
+      header_->running = 1;
+      slots_ = (Slot *) (map_ + HEADER_SIZE);
+      mask_ = slots - 1;
+//
+// Readers check the magic first, so it goes in last
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      memcpy(header_->magic, magic(), sizeof(header_->magic));
+      return true;
+   }
+
+//=============================================================================
+// end: Tell readers the writer has gone and remove the name
+//
+   void end()
+   {
+      if (map_ == NULL)
+         return;
+      __atomic_store_n(&header_->running, 0, __ATOMIC_RELEASE);
+      munmap(map_, mapSize_);
+      shm_unlink(name_);
+      map_ = NULL;
+      header_ = NULL;
+   }
+
+   bool isOpen() const { return map_ != NULL; }
+
+//
+// Describe a source before publishing to it
+   void describe(int source, const char *name, const char *device, uint8_t kind,
+                 uint8_t count, uint16_t address, double rate)
+   {
+      Source &s = header_->source[source];
+
+      snprintf(s.name, sizeof(s.name), "%s", name);
+      snprintf(s.device, sizeof(s.device), "%s", device);
+      s.kind = kind;
+      s.count = count;
+      s.address = address;
+      s.rate = (uint32_t) (rate * 1000 + 0.5);
+   }
+
+//=============================================================================
+// publish: Add a reading to a source's ring, stamping when it was published
+//
+   void publish(int source, Reading &r)
+   {
+      uint64_t *head = &header_->source[source].head;
+      uint64_t n = *head; // Only this thread writes it
+      Slot *slot = &slots_[((size_t) source * (mask_ + 1)) + (n & mask_)];
+
+      __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE); // Odd sequence before any of the data
+      r.published = Timing::now();
+      copyIn(slot, r);
+      __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+      __atomic_store_n(head, n + 1, __ATOMIC_RELEASE);
+   }
+
+private:
+//
+// Let readers of a ring left behind by a writer that died know it is dead
+   static void retire(const char *name)
+   {
+      int fd = shm_open(name, O_RDWR, 0);
+      if (fd < 0)
+         return;
+
+      void *old = mmap(NULL, sizeof(Header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (old == MAP_FAILED)
+         return;
+      __atomic_store_n(&((Header *) old)->running, 0, __ATOMIC_RELEASE);
+      munmap(old, sizeof(Header));
+   }
+
+   uint8_t *map_;
+   size_t   mapSize_;
+   Header  *header_;
+   Slot    *slots_;
+   uint32_t mask_;
+   char     name_[64];
+};
+
+//=============================================================================
+// SensorRingClient: Reader side. Any number of clients, in any processes,
+// can read a ring without affecting the writer or each other.
+//
+class SensorRingClient : public SensorRingFormat
+{
+public:
+//
+// A reader's place in one source's stream
+   struct Cursor
+   {
+      int      source;
+      uint64_t next;   // Reading number to return next
+      uint64_t lost;   // Readings overwritten before they were read
+   };
+
+   SensorRingClient()
+   {
+      map_ = NULL;
+      header_ = NULL;
+   }
+
+   bool begin(const char *name)
+   {
+      struct stat st;
+      int fd;
+
+      if (map_ != NULL)
+      {
+         fputs("SensorRingClient: Ring already open.\n", stderr);
+         return false;
+      }
+      if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+      {
+         fprintf(stderr, "SensorRingClient: Unable to open %s.\n", name);
+         return false;
+      }
+      if (fstat(fd, &st) != 0 || st.st_size < (off_t) HEADER_SIZE)
+      {
+         close(fd);
+         fprintf(stderr, "SensorRingClient: %s is not ready.\n", name);
+         return false;
+      }
+      mapSize_ = st.st_size;
+      map_ = (uint8_t *) mmap(NULL, mapSize_, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+      close(fd);
+      if (map_ == MAP_FAILED)
+      {
+         map_ = NULL;
+         fprintf(stderr, "SensorRingClient: Unable to map %s.\n", name);
+         return false;
+      }
+
+      header_ = (const Header *) map_;
+      if (memcmp(header_->magic, magic(), sizeof(header_->magic)) != 0)
+      {
+         fprintf(stderr, "SensorRingClient: %s is not a sensor ring.\n", name);
+         end();
+         return false;
+      }
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (header_->version != VERSION || mapSize(header_->sources, header_->slots) > mapSize_)
+      {
+         fprintf(stderr, "SensorRingClient: %s has an unknown layout.\n", name);
+         end();
+         return false;
+      }
+      slots_ = (const Slot *) (map_ + HEADER_SIZE);
+      mask_ = header_->slots - 1;
+      return true;
+   }
+
+   void end()
+   {
+      if (map_ != NULL)
+         munmap(map_, mapSize_);
+      map_ = NULL;
+      header_ = NULL;
+   }
+
+   bool isOpen() const      { return map_ != NULL; }
+   int  sources() const     { return header_->sources; }
+   uint32_t slots() const   { return header_->slots; }
+   const Source &source(int s) const { return header_->source[s]; }
+
+//
+// False once the writer has shut down; reattach to pick up a new one
+   bool isRunning() const { return __atomic_load_n(&header_->running, __ATOMIC_ACQUIRE) != 0; }
+
+//
+// Source number for a name, or -1
+   int find(const char *name) const
+   {
+      for (int s = 0 ; s < sources() ; ++s)
+         if (strncmp(header_->source[s].name, name, sizeof(header_->source[s].name)) == 0)
+            return s;
+      return -1;
+   }
+
+   uint64_t head(int source) const
+   {
+      return __atomic_load_n(&header_->source[source].head, __ATOMIC_ACQUIRE);
+   }
+
+//=============================================================================
+// read: Copy reading n of a source. Returns SLOT_OK, SLOT_NOT_YET or
+//       SLOT_LAPPED.
+//
+   int read(int source, uint64_t n, Reading &r) const
+   {
+      const Slot *slot = &slots_[((size_t) source * (mask_ + 1)) + (n & mask_)];
+      uint64_t want = 2 * n + 2;
+      uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+      if (seq != want)
+         return seq < want ? SLOT_NOT_YET : SLOT_LAPPED;
+      copyOut(r, slot);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE); // Data before the second look
+      return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == want ? SLOT_OK : SLOT_LAPPED;
+   }
+
+//=============================================================================
+// latest: Newest reading of a source. False if there is none yet.
+//
+   bool latest(int source, Reading &r) const
+   {
+      while (true)
+      {
+         uint64_t h = head(source);
+         if (h == 0)
+            return false;
+         if (read(source, h - 1, r) == SLOT_OK)
+            return true;
+         // Lapped between reading the head and the slot: the head has moved on
+      }
+   }
+
+//
+// Start a stream at the oldest reading still held, or only new ones
+   Cursor follow(int source, bool history) const
+   {
+      Cursor c;
+      uint64_t h = head(source);
+
+      c.source = source;
+      c.next = h;
+      if (history)
+         c.next = h > mask_ ? h - mask_ : 0;
+      c.lost = 0;
+      return c;
+   }
+
+//=============================================================================
+// next: Next reading of a cursor's stream. Returns 1 with a reading, 0 when
+//       the stream is caught up. Readings the writer overwrote first are
+//       skipped and counted in the cursor.
+//
+   int next(Cursor &c, Reading &r) const
+   {
+      while (true)
+      {
+         uint64_t h = head(c.source);
+         if (c.next >= h)
+            return 0;
+//
+// The writer may already be filling the slot of reading h - slots
+         if (h - c.next > mask_)
+         {
+            c.lost += h - mask_ - c.next;
+            c.next = h - mask_;
+         }
+         if (read(c.source, c.next, r) == SLOT_OK)
+         {
+            c.next++;
+            return 1;
+         }
+         c.lost++;
+         c.next++;
+      }
+   }
+
+private:
+   uint8_t      *map_;
+   size_t        mapSize_;
+   const Header *header_;
+   const Slot   *slots_;
+   uint32_t      mask_;
+};
+
+#endif
@@ -0,0 +1,226 @@
+// Support for the TCA9548A 8-channel I2C switch, for more chips of one address
+// than the address pins allow (three TSL2561s per channel, say).
+//
+// Channel selection costs a transfer of its own: the switch only changes over
+// at a stop condition, so it can't ride in the same combined transfer as the
+// chip access that follows. The driver remembers what is switched in and drops
+// selects that would change nothing, and it can run a queue of chip
+// operations grouped by channel, so sweeping an array selects each channel
+// once instead of once per chip.
+//
+// The chip drivers on the far side are opened on the same bus device as usual;
+// they just need their channel selected before they are touched, beginning
+// included. With more than one switch on a bus, deselect() one before
+// selecting on another if their chips share addresses.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef TCA9548A_H
+#define TCA9548A_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ChipError.h>
+#include <I2CBus.h>
+
+class TCA9548A
+{
+public:
+   static const uint8_t ADDRESS   = 0x70;   // A2..A0 low, up to 0x77
+   static const int     CHANNELS  = 8;
+   static const int     MAX_QUEUE = 256;
+
+   typedef bool (*Operation)(void *arg);
+
+   TCA9548A()
+   {
+      addr_ = ADDRESS;
+      selected_ = 0;
+      known_ = false;
+      queued_ = 0;
+      resetStats();
+   }
+
+//=============================================================================
+// begin: Open the bus and read back what the switch has selected, so the
+//        first select can be skipped if it is already in place.
+//
+   bool begin(const char *device, uint8_t addr = ADDRESS)
+   {
+      if (addr < ADDRESS || addr > (ADDRESS | 0x07))
+      {
+         ChipLog::printf("TCA9548A: Invalid i2c address specified: %02x\n", addr);
+         return false;
+      }
+      if (!bus_.begin(device))
+         return false;
+      addr_ = addr;
+
+      struct i2c_msg msg;
+      I2CBus::readMsg(msg, addr_, &selected_, 1);
+      if (!bus_.transfer(&msg, 1))
+      {
+         end();
+         ChipLog::printf("TCA9548A: No switch at address %02x.\n", addr);
+         return false;
+      }
+      known_ = true;
+      return true;
+   }
+
+   void end() { bus_.end(); }
+   bool isOpen() { return bus_.isOpen(); }
+
+//
+// The switch's own descriptor, for combined transfers to chips behind it
+   I2CBus &getBus() { return bus_; }
+
+//=============================================================================
+// select: Switch in one channel, or any set of them, and nothing else. A
+//         select matching what is already switched in sends nothing.
+//
+   bool select(uint8_t channel)
+   {
+      if (channel >= CHANNELS)
+      {
+         ChipLog::puts("TCA9548A: Invalid channel specified.\n");
+         return false;
+      }
+      return selectMask(1 << channel);
+   }
+
+   bool selectMask(uint8_t mask)
+   {
+      if (known_ && mask == selected_)
+      {
+         skipped_++;
+         return true;
+      }
+
+      struct i2c_msg msg;
+      I2CBus::writeMsg(msg, addr_, &mask, 1);
+      if (!bus_.transfer(&msg, 1))
+      {
+         known_ = false; // It may or may not have switched
+         ChipLog::report(ChipError::make(ChipError::TRANSFER, "TCA9548A", "selectMask", errno));
+         return false;
+      }
+      selected_ = mask;
+      known_ = true;
+      selects_++;
+      return true;
+   }
+
+   bool deselect() { return selectMask(0); }
+
+//
+// Forget the selection, e.g. after something else has written the switch, so
+// the next select is sent whatever it is
+   void invalidate() { known_ = false; }
+
+   uint8_t getSelected() const { return selected_; }
+
+//=============================================================================
+// queue: Add an operation to run with a channel selected. Returns its slot,
+//        for result(), or -1 if the queue is full.
+//
+   int queue(uint8_t channel, Operation op, void *arg)
+   {
+      if (channel >= CHANNELS || queued_ >= MAX_QUEUE)
+      {
+         ChipLog::puts("TCA9548A: Invalid channel or queue full.\n");
+         return -1;
+      }
+      op_[queued_].channel = channel;
+      op_[queued_].op = op;
+      op_[queued_].arg = arg;
+      op_[queued_].ok = false;
+      return queued_++;
+   }
+
+//=============================================================================
+// run: Run every queued operation, one select per channel. Channels go in
+//      order starting from the one already selected; within a channel the
+//      operations keep the order they were queued in. The queue is kept, so a
+//      sweep can be queued once and run over and over. Returns false if a
+//      select or an operation failed; the rest still run.
+//
+   bool run()
+   {
+      int order[MAX_QUEUE];
+      int start[CHANNELS + 1];
+      int first = 0;
+      bool ok = true;
+
+//
+// Counting sort by channel, which is stable
+      memset(start, 0, sizeof(start));
+      for (int i = 0 ; i < queued_ ; ++i)
+         start[op_[i].channel + 1]++;
+      for (int c = 0 ; c < CHANNELS ; ++c)
+         start[c + 1] += start[c];
+      int fill[CHANNELS];
+      memcpy(fill, start, sizeof(fill));
+      for (int i = 0 ; i < queued_ ; ++i)
+         order[fill[op_[i].channel]++] = i;
+
+      if (known_)
+         for (int c = 0 ; c < CHANNELS ; ++c)
+            if (selected_ == (1 << c))
+               first = c;
+
+      for (int k = 0 ; k < CHANNELS ; ++k)
+      {
+         int c = (first + k) % CHANNELS;
+         if (start[c] == start[c + 1])
+            continue;
+         if (!select(c))
+         {
+            ok = false;
+            for (int j = start[c] ; j < start[c + 1] ; ++j)
+               op_[order[j]].ok = false;
+            continue;
+         }
+         for (int j = start[c] ; j < start[c + 1] ; ++j)
+         {
+            Queued &q = op_[order[j]];
+            q.ok = q.op(q.arg);
+            ok = ok && q.ok;
+         }
+      }
+      return ok;
+   }
+
+   bool result(int slot) const { return slot >= 0 && slot < queued_ && op_[slot].ok; }
+   int  queued() const         { return queued_; }
+   void clear()                { queued_ = 0; }
+
+//
+// Selects sent and selects saved by the cache
+   uint64_t getSelects() const { return selects_; }
+   uint64_t getSkipped() const { return skipped_; }
+   void resetStats()           { selects_ = skipped_ = 0; }
+
+private:
+   struct Queued
+   {
+      uint8_t   channel;
+      Operation op;
+      void     *arg;
+      bool      ok;
+   };
+
+   I2CBus   bus_;
+   uint8_t  addr_;
+   uint8_t  selected_;
+   bool     known_;
+   Queued   op_[MAX_QUEUE];
+   int      queued_;
+   uint64_t selects_;
+   uint64_t skipped_;
+};
+
+#endif
@@ -4,14 +4,22 @@
 // Code by Ignus Porkus/Gray Lorig
 // License: LGPL
 
+#ifndef TSL2561_H
+#define TSL2561_H
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <unistd.h>
+#include <Timing.h>
+#include <RegisterMap.h>
+#include <ChipError.h>
 
 class TSL2561
 {
@@ -30,25 +38,55 @@ public:
     static const uint8_t  INTEG_TIME_MANUAL = 0x03;
     static const uint8_t  INTEG_TIME_MASK = 0x03;
 
+    static const uint32_t NOMINAL_MICROS = 402000;   // Manual counts are normalised to this
+    static const int      SATURATED = 0x7fffffff;    // Normalised count of a saturated channel
+
+/**
+ * Control and timing registers, for code that sets chips up in its own
+ * transfers
+ */
+    static const uint8_t  COMMAND_BIT = 0x80;
+    static const uint8_t  CONTROL_POWERON  = 0x03;
+    static const uint8_t  CONTROL_POWEROFF = 0x00;
+
+    typedef Register<COMMAND_BIT | 0x00> ControlRegister;
+    typedef Register<COMMAND_BIT | 0x01> TimingRegister;
+
 private:
     uint8_t i2caddr_;
     int     deviceFd_;
+    RegisterPort port_;
     uint8_t gain_;
     uint8_t integTime_;
+    uint64_t manualStart_;
+    bool     running_;     // Free running, cycle phase tracked
+    uint64_t epoch_;       // When cycle base_ latched
+    uint64_t base_;
+    uint64_t period_;      // Cycle length followed, kept a little short
+    uint64_t cycle_;       // Last cycle waited for
+    uint64_t missed_;
+    uint64_t fixTime_;     // Last latch readCycle() pinned down, and its cycle
+    uint64_t fixCycle_;
+    uint64_t early_;       // Reads readCycle() caught before the latch
+    int      lastIrVis_;   // Counts of the cycle last read by readCycle()
+    int      lastIr_;
+    bool     changing_;    // They differed from the cycle before
 
-    static const uint8_t COMMAND_BIT = 0x80;
     static const uint8_t CLEAR_BIT = 0x40;
     static const uint8_t WORD_BIT = 0x20;
     static const uint8_t BLOCK_BIT = 0x10;
+    static const int     MANUAL_FULL_SCALE = 65535;
+    static const uint64_t GUARD_NANOS = 1000000;  // Past the end of a cycle before reading
+    static const uint64_t DRIFT_PPM = 10000;      // Oscillator error the phase tracking covers
+    static const uint64_t MARGIN = 4096;          // Followed period 1/MARGIN short of measured
 
-    static const uint8_t CONTROL_POWERON  = 0x03;
-    static const uint8_t CONTROL_POWEROFF = 0x00;
+    static const uint8_t REG_ID = 0x0A;        // Read by begin() without COMMAND_BIT
 
-    static const uint8_t REG_CONTROL = 0x00;
-    static const uint8_t REG_TIMING = 0x01;
-    static const uint8_t REG_ID = 0x0A;
-    static const uint8_t REG_CHAN_0 = 0x0C;
-    static const uint8_t REG_CHAN_1 = 0x0E;
+    typedef Field<TimingRegister, 4>     GainField;
+    typedef Field<TimingRegister, 3>     ManualField;  // Integrate while set
+    typedef Field<TimingRegister, 0, 2>  IntegField;
+    typedef Register<COMMAND_BIT | WORD_BIT | 0x0C, uint16_t> Chan0Register;
+    typedef Register<COMMAND_BIT | WORD_BIT | 0x0E, uint16_t> Chan1Register;
 
 public:
 /**
@@ -60,21 +98,30 @@ public:
          deviceFd_ = -1;
          gain_ = GAIN_1X;
          integTime_ = INTEG_TIME_13_7MS;
+         manualStart_ = 0;
+         running_ = false;
+         epoch_ = base_ = period_ = cycle_ = missed_ = 0;
+         fixTime_ = fixCycle_ = early_ = 0;
+         lastIrVis_ = lastIr_ = 0;
+         changing_ = false;
      }
 
 /**
- * Open up communication with the chip.
+ * Open the device without touching the chip, taking it as already powered up
+ * with the gain and integration time given (by ChipConfig, say).
  * @param	device	The device on which i2c communications can be initiated
  * @param	addr	i2c address at which the chip resides
- * @return	true is initialization was successful
+ * @param	gain	Gain the chip has been set to
+ * @param	integ	Integration time the chip has been set to
+ * @return	true if the device could be opened
  */
-    bool begin(const char *device, uint8_t addr)
+    bool attach(const char *device, uint8_t addr, uint8_t gain, uint8_t integ)
     {
 //
 // Insure we are reaching out on a valid address
         if (addr != ADDR_29 && addr != ADDR_39 && addr != ADDR_49)
         {
-           fprintf(stderr, "TSL2561: Invalid i2c address specified: %02x\n", addr);
+           ChipLog::printf("TSL2561: Invalid i2c address specified: %02x\n", addr);
            return false;
         }
         i2caddr_ = addr;
@@ -83,13 +130,13 @@ public:
 // Attempt to open the i2c device
         if (deviceFd_ >= 0) // The connection is already open
         {
-           fputs ("TSL2561: Device already open", stderr);
+           ChipLog::puts("TSL2561: Device already open");
            return false;
         }
 
         if ((deviceFd_ = open(device, O_RDWR)) < 0)
         {
-            fprintf (stderr, "TSL2561: Unable to open device %s\n", device);
+            ChipLog::printf("TSL2561: Unable to open device %s\n", device);
             return false;
         }
 
@@ -98,9 +145,27 @@ public:
         if (ioctl(deviceFd_, I2C_SLAVE, i2caddr_) < 0)
         {
             end(); // Close connection down
-            fprintf (stderr, "TSL2561: Unable to ioctl %s\n", device);
+            ChipLog::printf("TSL2561: Unable to ioctl %s\n", device);
             return false;
         }
+        port_.bind(deviceFd_, i2caddr_);
+
+        gain_ = gain & GAIN_MASK;
+        integTime_ = integ & INTEG_TIME_MASK;
+        running_ = false;
+        return true;
+    }
+
+/**
+ * Open up communication with the chip.
+ * @param	device	The device on which i2c communications can be initiated
+ * @param	addr	i2c address at which the chip resides
+ * @return	true is initialization was successful
+ */
+    bool begin(const char *device, uint8_t addr)
+    {
+        if (!attach(device, addr, gain_, integTime_))
+            return false;
 
 //
 // Now make sure there is an actual device out there
@@ -108,21 +173,19 @@ public:
 
         uint8_t buffer[2];
         buffer[0] = REG_ID;
-        write(deviceFd_, buffer, 1);
-        read(deviceFd_, buffer, 1);
+        if (write(deviceFd_, buffer, 1) != 1 || read(deviceFd_, buffer, 1) != 1)
+            buffer[0] = 0; // Nothing answered
         if ((buffer[0] & 0x0f) != 0x0a)
         {
-           fprintf(stderr, "TSL2561: Unable to find chip address at address %02x (id = 0x%02x)\n",
-                   i2caddr_, buffer[0]);
+           ChipLog::printf("TSL2561: Unable to find chip address at address %02x (id = 0x%02x)\n",
+                           i2caddr_, buffer[0]);
            end();
            return false;
         }
 
 //
 // Set the timing mode
-        buffer[0] = COMMAND_BIT | REG_TIMING;
-        buffer[1] = gain_ | integTime_;
-        write (deviceFd_, buffer, 2);
+        writeTiming();
 
         return true;
     }
@@ -143,16 +206,9 @@ public:
  */
     void enable(bool e)
     {
-        uint8_t buffer[2];
-
         if (deviceFd_ < 0) return; // We are not yet initialized
 
-        buffer[0] = COMMAND_BIT | REG_CONTROL;
-        if (e)
-           buffer[1] = CONTROL_POWERON;
-        else
-           buffer[1] = CONTROL_POWEROFF;
-        write(deviceFd_, buffer, 2);
+        port_.write<ControlRegister>(e ? CONTROL_POWERON : CONTROL_POWEROFF);
     }
 
 /**
@@ -165,10 +221,9 @@ public:
 
         if (deviceFd_ < 0) return;
 
-        uint8_t buffer[2];
-        buffer[0] = COMMAND_BIT | REG_TIMING;
-        buffer[1] = gain_ | integTime_;
-        write (deviceFd_, buffer, 2);
+        writeTiming();
+        if (running_)
+            retime();
     }
 /**
  * Get the current integration time setting.
@@ -191,10 +246,9 @@ public:
 
         if (deviceFd_ < 0) return;
 
-        uint8_t buffer[2];
-        buffer[0] = COMMAND_BIT | REG_TIMING;
-        buffer[1] = gain_ | integTime_;
-        write (deviceFd_, buffer, 2);
+        writeTiming();
+        if (running_)
+            retime();
     }
 
 /**
@@ -202,22 +256,20 @@ public:
  * @param ir_vis Combined visible and infrared reading
  * @param ir     Just the infrared component
  * @param agc    Automatically adjust the gain and integration time
+ * @return false if the chip did not answer, reported through ChipLog
  */
-    void getReading(int &ir_vis, int &ir, bool agc = false)
+    bool getReading(int &ir_vis, int &ir, bool agc = false)
     {
-        uint8_t buffer[2];
-        
-        if (deviceFd_ < 0) return;
+        if (deviceFd_ < 0) return failed(ChipError::NOT_OPEN);
 //
 // Grab an initial visible reading
-        buffer[0] = COMMAND_BIT | WORD_BIT | REG_CHAN_0;
-        write(deviceFd_, buffer, 1);
-        read(deviceFd_, buffer, 2);
-        ir_vis = buffer[0] + ((int)buffer[1]<<8);
+        if (!readChannel<Chan0Register>(ir_vis))
+            return failed(ChipError::TRANSFER);
   
 //
-// If we are adjusting the gain automatically check how we are doing
-        if (agc)
+// If we are adjusting the gain automatically check how we are doing. Manual
+// integrations pick their own length instead; see exposureFor().
+        if (agc && integTime_ != INTEG_TIME_MANUAL)
         {
 //            static const double AGC_SCALES[] = {1.0000, 7.2723, 16.0000, 29.3431, 117.95620, 469.4891};
             static const int AGC_GAINS[] = {GAIN_1X, GAIN_1X, GAIN_16X, GAIN_1X, GAIN_16X, GAIN_16X};
@@ -245,29 +297,396 @@ public:
 // Set the gain and integration time. Then we will need to wait for another reading
                 gain_ = AGC_GAINS[factor];
                 integTime_ = AGC_INTEG_TIMES[factor];
-                buffer[0] = COMMAND_BIT | REG_TIMING;
-                buffer[1] = gain_ | integTime_;
-                write (deviceFd_, buffer, 2);
+                writeTiming();
 
-                enable(false); // Force a new integration to start
-                enable(true);
+                if (running_) // Take the first full cycle at the new settings
+                {
+                    if (!retime() || !waitCycle())
+                        return false;
+                }
+                else
+                {
+                    enable(false); // Force a new integration to start
+                    enable(true);
 
-                usleep(INTEG_MICROS[integTime_]);
+                    usleep(INTEG_MICROS[integTime_]);
+                }
 //
 // Grab an initial visible reading
-                buffer[0] = COMMAND_BIT | WORD_BIT | REG_CHAN_0;
-                write(deviceFd_, buffer, 1);
-                read(deviceFd_, buffer, 2);
-                ir_vis = buffer[0] + ((int)buffer[1]<<8);
+                if (!readChannel<Chan0Register>(ir_vis))
+                    return failed(ChipError::TRANSFER);
             }
         }
        
 //
 // Now fetch the ir reading
-        buffer[0] = COMMAND_BIT | WORD_BIT | REG_CHAN_1;
-        write(deviceFd_, buffer, 1);
-        read(deviceFd_, buffer, 2);
-        ir = buffer[0] + ((int)buffer[1]<<8);
+        if (!readChannel<Chan1Register>(ir))
+            return failed(ChipError::TRANSFER);
+        return true;
+    }
+
+/**
+ * Retrieve both channels in one combined transfer, bracketed on the raw clock.
+ * The counts are from the last integration cycle to finish before stamp.start.
+ * @param ir_vis Combined visible and infrared reading
+ * @param ir     Just the infrared component
+ * @param stamp  When the transfer ran
+ * @return false if the chip did not answer, reported through ChipLog
+ */
+    bool getReading(int &ir_vis, int &ir, TransferStamp &stamp)
+    {
+        return ChipLog::check(tryGetReading(ir_vis, ir, stamp));
+    }
+
+/**
+ * As getReading() with a stamp, for a read loop: nothing is logged, and the
+ * counts are only written if the read went through.
+ * @return The ChipError on failure
+ */
+    Result<void> tryGetReading(int &ir_vis, int &ir, TransferStamp &stamp)
+    {
+        uint8_t reg[2] = {Chan0Register::address, Chan1Register::address};
+        uint8_t data[4];
+        struct i2c_msg msgs[4];
+        struct i2c_rdwr_ioctl_data xfer;
+
+        if (deviceFd_ < 0)
+            return ChipError::make(ChipError::NOT_OPEN, "TSL2561", "getReading");
+
+        for (int i = 0 ; i < 2 ; ++i)
+        {
+            msgs[2*i].addr = i2caddr_;
+            msgs[2*i].flags = 0;
+            msgs[2*i].len = 1;
+            msgs[2*i].buf = &reg[i];
+            msgs[2*i+1].addr = i2caddr_;
+            msgs[2*i+1].flags = I2C_M_RD;
+            msgs[2*i+1].len = 2;
+            msgs[2*i+1].buf = &data[2*i];
+        }
+        xfer.msgs = msgs;
+        xfer.nmsgs = 4;
+
+        stamp.start = Timing::raw();
+        int result = ioctl(deviceFd_, I2C_RDWR, &xfer);
+        stamp.end = Timing::raw();
+        if (result < 0)
+            return ChipError::make(ChipError::TRANSFER, "TSL2561", "getReading", errno);
+
+        ir_vis = data[0] + ((int)data[1]<<8);
+        ir = data[2] + ((int)data[3]<<8);
+        return Result<void>();
+    }
+
+/**
+ * Start a manual integration. The chip stops its own timed cycles and counts
+ * until stopIntegration(); the integration time reads back as
+ * INTEG_TIME_MANUAL from then on.
+ * @return false if the chip did not take the command
+ */
+    bool startIntegration()
+    {
+        if (deviceFd_ < 0) return false;
+
+        integTime_ = INTEG_TIME_MANUAL;
+        running_ = false;
+        if (!writeTiming(false) || !writeTiming(true)) // Stop anything still running first
+            return false;
+        manualStart_ = Timing::now();
+        return true;
+    }
+
+/**
+ * Stop a manual integration and read its counts.
+ * @param ir_vis Combined visible and infrared count
+ * @param ir     Just the infrared count
+ * @param micros How long the integration ran, timed between the two commands
+ * @return false if the chip did not answer
+ */
+    bool stopIntegration(int &ir_vis, int &ir, uint32_t &micros)
+    {
+        TransferStamp stamp;
+
+        if (deviceFd_ < 0 || manualStart_ == 0) return false;
+
+        if (!writeTiming(false))
+            return false;
+        micros = (Timing::now() - manualStart_) / 1000;
+        manualStart_ = 0;
+        return getReading(ir_vis, ir, stamp);
+    }
+
+/**
+ * Run one manual integration of any length and return its counts normalised
+ * to a 402ms cycle at the current gain, the form TSL2561Lux takes for
+ * INTEG_TIME_MANUAL. A channel that reached full scale comes back as
+ * SATURATED. Blocks for the integration.
+ * @param micros Integration length wanted
+ * @param ir_vis Normalised combined visible and infrared count
+ * @param ir     Normalised infrared count
+ * @return false if the chip did not answer
+ */
+    bool integrate(uint32_t micros, int &ir_vis, int &ir)
+    {
+        uint32_t actual;
+
+        if (!startIntegration())
+            return false;
+        Timing::sleepUntil(manualStart_ + (uint64_t) micros * 1000);
+        if (!stopIntegration(ir_vis, ir, actual))
+            return false;
+        ir_vis = normalise(ir_vis, actual);
+        ir = normalise(ir, actual);
+        return true;
+    }
+
+/**
+ * Scale a raw manual count to what a 402ms cycle would have counted.
+ * @param count  Raw count
+ * @param micros Integration length it took
+ * @return The normalised count, or SATURATED
+ */
+    static int normalise(int count, uint32_t micros)
+    {
+        if (count >= MANUAL_FULL_SCALE || micros == 0)
+            return SATURATED;
+        uint64_t scaled = ((uint64_t) count * NOMINAL_MICROS + micros / 2) / micros;
+        return scaled < SATURATED ? (int) scaled : SATURATED;
+    }
+
+/**
+ * Integration length that should bring a channel to a target count, from a
+ * normalised reading taken at the same gain. This is the manual counterpart
+ * of the AGC steps: aim at half scale, say, and clamp to the latency allowed.
+ * @param normalised A normalised count, e.g. from integrate()
+ * @param target     Raw count wanted
+ * @param low        Shortest integration allowed, in microseconds
+ * @param high       Longest integration allowed, in microseconds
+ * @return Integration length in microseconds
+ */
+    static uint32_t exposureFor(int normalised, int target, uint32_t low, uint32_t high)
+    {
+        if (normalised >= SATURATED)
+            return low;
+        if (normalised <= 0)
+            return high;
+        uint64_t micros = (uint64_t) target * NOMINAL_MICROS / normalised;
+        return micros < low ? low : micros > high ? high : (uint32_t) micros;
+    }
+
+/**
+ * Nominal length of an integration cycle.
+ * @param integ One of the fixed integration times
+ * @return Nanoseconds, or 0 for INTEG_TIME_MANUAL
+ */
+    static uint64_t cycleNanos(uint8_t integ)
+    {
+        static const uint64_t NANOS[3] = {13700000ULL, 101000000ULL, 402000000ULL};
+        return (integ & INTEG_TIME_MASK) < 3 ? NANOS[integ & INTEG_TIME_MASK] : 0;
+    }
+
+/**
+ * Start free running: restart integration once, then follow the chip's cycle
+ * from there so waitCycle() can wake just after each cycle's data is latched.
+ * Steady state reads never restart the chip; only a change of gain or
+ * integration time does, so its first cycle starts straight away.
+ * The chip's oscillator may be off its nominal period by up to 1%, so the
+ * phase is tracked from what readCycle() reads back; see readCycle().
+ * @return false if the device is not open, is in manual integration or did
+ *         not take the restart
+ */
+    bool startCycles()
+    {
+        if (deviceFd_ < 0 || integTime_ == INTEG_TIME_MANUAL) return false;
+
+        running_ = true;
+        missed_ = early_ = 0;
+        return retime();
+    }
+
+    void stopCycles() { running_ = false; }
+    bool isFreeRunning() { return running_; }
+
+/**
+ * Override the cycle length used to follow the chip, e.g. one measured against
+ * a scope on the INT pin. readCycle() goes on refining it.
+ * @param nanos Actual length of a cycle at the current integration time
+ */
+    void setCyclePeriod(uint64_t nanos) { period_ = nanos - nanos / MARGIN; }
+    uint64_t getCyclePeriod() { return period_; }
+
+/**
+ * Sleep until the next cycle not yet waited for has finished. If the caller
+ * fell more than a cycle behind, the latest finished cycle is taken and the
+ * ones passed over are counted as missed.
+ * @return false if not free running
+ */
+    bool waitCycle()
+    {
+        if (!running_) return false;
+
+        uint64_t guard = guardNanos();
+        uint64_t now = Timing::now();
+        uint64_t done = base_ + (now > epoch_ + guard ? (now - epoch_ - guard) / period_ : 0);
+        uint64_t next = cycle_ + 1;
+
+        if (done > next)
+        {
+            missed_ += done - next;
+            next = done;
+        }
+        Timing::sleepUntil(epoch_ + (next - base_) * period_ + guard);
+        cycle_ = next;
+        return true;
+    }
+
+/**
+ * Wait for the next cycle and read both channels as it finishes, keeping the
+ * phase in step with the chip as it goes.
+ *
+ * The period followed is kept a little short of the chip's, so any error
+ * brings reads earlier, never later: a read that came too early comes back
+ * with the last cycle's counts again, where one that came too late would
+ * quietly skip a cycle. While the light is changing, counts that repeat
+ * exactly are taken as such a read, as are counts left over from before a
+ * restart on the first read after it. It is tried again after half the guard,
+ * up to the whole guard, and the latch placed between the last two tries. Two
+ * latches placed that way give the chip's real period, and the period
+ * followed from then on is that less its uncertainty. Under light steady
+ * enough to give the same counts, an early read can't be seen, and costs
+ * nothing either: it returns the counts the cycle would have.
+ * @param ir_vis Combined visible and infrared reading
+ * @param ir     Just the infrared component
+ * @param stamp  When the transfer ran
+ * @return false if not free running or the chip did not answer
+ */
+    bool readCycle(int &ir_vis, int &ir, TransferStamp &stamp)
+    {
+        if (!waitCycle())
+            return false;
+
+        uint64_t step = guardNanos() / 2;
+        uint64_t tried = Timing::now();
+        uint64_t early = 0;
+        bool repeat;
+
+        for (int retry = 0 ; ; ++retry)
+        {
+            if (!getReading(ir_vis, ir, stamp))
+                return false;
+            repeat = ir_vis == lastIrVis_ && ir == lastIr_;
+            if (!changing_ || !repeat || retry == 2)
+                break;
+            early = tried;
+            Timing::sleepUntil(tried + step);
+            tried = Timing::now();
+        }
+        if (early != 0 && !repeat)
+        {
+            early_++;
+            fixPhase((early + tried) / 2, step);
+        }
+        changing_ = !repeat;
+        lastIrVis_ = ir_vis;
+        lastIr_ = ir;
+        return true;
+    }
+
+/**
+ * Cycles waited for since startCycles() or the last change of settings,
+ * cycles passed over because the caller came late, and reads readCycle() made
+ * before the latch and took again.
+ */
+    uint64_t getCycle() { return cycle_; }
+    uint64_t getMissed() { return missed_; }
+    uint64_t getEarly() { return early_; }
+
+private:
+/**
+ * Write the gain and integration time settings, with the manual integration
+ * bit as given
+ */
+    bool writeTiming(bool manual = false)
+    {
+        return port_.write<TimingRegister>((gain_ & GainField::mask) | IntegField::make(integTime_) |
+                                           ManualField::make(manual));
+    }
+
+/**
+ * One channel's count, in a single combined transfer
+ */
+    template <class CHANNEL>
+    bool readChannel(int &count)
+    {
+        uint16_t value;
+
+        if (!port_.read<CHANNEL>(value))
+            return false;
+        count = value;
+        return true;
+    }
+
+    bool failed(uint8_t code)
+    {
+        ChipLog::report(ChipError::make(code, "TSL2561", "getReading",
+                                        code == ChipError::TRANSFER ? errno : 0));
+        return false;
+    }
+
+/**
+ * Follow a change of gain or integration time. The chip restarts integration
+ * so the first cycle at the new settings starts now, rather than after the one
+ * in progress (up to 402ms later) in whatever state that leaves it. Until
+ * readCycle() has measured it the period is taken as short as the oscillator
+ * could make it.
+ * @return false, and free running stopped, if the chip did not take the restart
+ */
+    bool retime()
+    {
+        if (integTime_ == INTEG_TIME_MANUAL)
+        {
+            running_ = false;
+            return false;
+        }
+        if (!port_.write<ControlRegister>(CONTROL_POWEROFF) ||
+            !port_.write<ControlRegister>(CONTROL_POWERON))
+        {
+            running_ = false;
+            ChipLog::report(ChipError::make(ChipError::TRANSFER, "TSL2561", "retime", errno));
+            return false;
+        }
+        epoch_ = Timing::now();
+        period_ = cycleNanos(integTime_);
+        period_ -= period_ / (1000000 / DRIFT_PPM);
+        cycle_ = base_ = fixCycle_ = 0;
+        changing_ = true; // The first cycle read early still holds what was there before
+        return true;
+    }
+
+    uint64_t guardNanos() { return GUARD_NANOS + period_ / 64; }
+
+/**
+ * Take latch as when cycle_ latched, give or take step, and from the last
+ * latch so taken work out the period
+ */
+    void fixPhase(uint64_t latch, uint64_t step)
+    {
+        if (fixCycle_ != 0 && cycle_ > fixCycle_)
+        {
+            uint64_t nominal = cycleNanos(integTime_);
+            uint64_t slack = nominal / (1000000 / DRIFT_PPM);
+            uint64_t cycles = cycle_ - fixCycle_;
+            uint64_t measured = (latch - fixTime_) / cycles;
+
+            if (measured < nominal - slack)
+                measured = nominal - slack;
+            else if (measured > nominal + slack)
+                measured = nominal + slack;
+            period_ = measured - step / cycles - measured / MARGIN;
+        }
+        fixTime_ = epoch_ = latch;
+        fixCycle_ = base_ = cycle_;
     }
 };
 
+#endif
@@ -0,0 +1,249 @@
+// Integer lux calculation for TSL2561 readings, one at a time or in batches.
+//
+// Both paths follow the fixed-point CalculateLux() algorithm from the TSL2561
+// datasheet: scale the two channels to 402ms/16x, take the IR/broadband ratio,
+// and look up a slope and offset for it in a piecewise table. The scalar
+// version is the datasheet's code (with its unsigned underflow fixed); the
+// batch version works on arrays of readings four at a time with GCC vector
+// extensions, a 128-bit NEON or SSE register each step, and gives bit for bit
+// the same results.
+//
+// The batch kernel needs no division: with ratio = round(ch1 * 512 / ch0),
+// ratio <= K is the same as ch1 * 1024 < (2K + 1) * ch0, so each table step is
+// a multiply and a compare, and the table is walked with selects, not branches.
+//
+// Readings at the full scale count of their integration time are saturated and
+// give LUX_SATURATED. Keeping inputs below full scale also bounds every
+// intermediate below 2^32.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef TSL2561LUX_H
+#define TSL2561LUX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <TSL2561.h>
+
+class TSL2561Lux
+{
+public:
+   static const int PACKAGE_T  = 0;    // T, FN and CL packages
+   static const int PACKAGE_CS = 1;    // ChipScale package
+
+   static const uint32_t LUX_SATURATED = 0xffffffff;
+
+//=============================================================================
+// calculate: Lux for a single reading. gain and integ are the TSL2561 codes;
+//            INTEG_TIME_MANUAL readings are taken as already normalised to
+//            402ms.
+//
+   static uint32_t calculate(uint16_t ch0, uint16_t ch1, uint8_t gain, uint8_t integ,
+                             int package = PACKAGE_T)
+   {
+      uint32_t chScale;
+      uint32_t limit = fullScale(integ);
+
+      if (ch0 >= limit || ch1 >= limit)
+         return LUX_SATURATED;
+
+      switch (integ & TSL2561::INTEG_TIME_MASK)
+      {
+      case TSL2561::INTEG_TIME_13_7MS: chScale = CHSCALE_TINT0; break;
+      case TSL2561::INTEG_TIME_101MS:  chScale = CHSCALE_TINT1; break;
+      default:                         chScale = 1 << CH_SCALE; break;
+      }
+      if ((gain & TSL2561::GAIN_MASK) == TSL2561::GAIN_1X)
+         chScale <<= 4; // Scale 1x to 16x
+
+      uint32_t channel0 = (ch0 * chScale) >> CH_SCALE;
+      uint32_t channel1 = (ch1 * chScale) >> CH_SCALE;
+
+      uint32_t ratio1 = 0;
+      if (channel0 != 0)
+         ratio1 = (channel1 << (RATIO_SCALE + 1)) / channel0;
+      uint32_t ratio = (ratio1 + 1) >> 1; // Round
+
+      const Segment *table = segments(package);
+      int s = 0;
+      while (s < SEGMENT_COUNT - 1 && ratio > table[s].k)
+         s++;
+
+      uint32_t pos = channel0 * table[s].b;
+      uint32_t neg = channel1 * table[s].m;
+      if (pos <= neg) // Lux can't go negative
+         return 0;
+      return (pos - neg + (1 << (LUX_SCALE - 1))) >> LUX_SCALE;
+   }
+
+//=============================================================================
+// calculateManual: Lux for counts normalised to 402ms by TSL2561::integrate().
+//                  A short exposure of a bright scene can normalise past 16
+//                  bits. Lux is linear in the counts, so those are halved
+//                  until they fit and the result doubled back.
+//
+   static uint32_t calculateManual(int ch0, int ch1, uint8_t gain, int package = PACKAGE_T)
+   {
+      int shift = 0;
+
+      if (ch0 >= TSL2561::SATURATED || ch1 >= TSL2561::SATURATED || ch0 < 0 || ch1 < 0)
+         return LUX_SATURATED;
+      while (ch0 >= (int) FULL_SCALE || ch1 >= (int) FULL_SCALE)
+      {
+         ch0 >>= 1;
+         ch1 >>= 1;
+         shift++;
+      }
+
+      uint64_t lux = calculate(ch0, ch1, gain, TSL2561::INTEG_TIME_MANUAL, package);
+      lux <<= shift;
+      return lux < LUX_SATURATED ? (uint32_t) lux : LUX_SATURATED;
+   }
+
+//=============================================================================
+// calculate: Lux for count readings held as parallel arrays
+//
+   static void calculate(const uint16_t *ch0, const uint16_t *ch1, const uint8_t *gain,
+                         const uint8_t *integ, uint32_t *lux, int count, int package = PACKAGE_T)
+   {
+      int done;
+
+//
+// A kernel per package lets the compiler fold the table into constants
+      if (package == PACKAGE_T)
+         done = batch<PACKAGE_T>(ch0, ch1, gain, integ, lux, count);
+      else
+         done = batch<PACKAGE_CS>(ch0, ch1, gain, integ, lux, count);
+      for (int i = done ; i < count ; ++i) // Scalar tail
+         lux[i] = calculate(ch0[i], ch1[i], gain[i], integ[i], package);
+   }
+
+//
+// Count at which a channel saturates for an integration time
+   static uint32_t fullScale(uint8_t integ)
+   {
+      switch (integ & TSL2561::INTEG_TIME_MASK)
+      {
+      case TSL2561::INTEG_TIME_13_7MS: return FULL_SCALE_TINT0;
+      case TSL2561::INTEG_TIME_101MS:  return FULL_SCALE_TINT1;
+      }
+      return FULL_SCALE;
+   }
+
+private:
+   typedef uint8_t  v4u8  __attribute__((vector_size(4)));
+   typedef uint16_t v4u16 __attribute__((vector_size(8)));
+   typedef uint32_t v4u32 __attribute__((vector_size(16)));  // One NEON or SSE register
+   typedef int32_t  v4i32 __attribute__((vector_size(16)));
+
+   static const int LUX_SCALE   = 14;  // Scale by 2^14
+   static const int RATIO_SCALE = 9;   // Scale ratio by 2^9
+   static const int CH_SCALE    = 10;  // Scale channel values by 2^10
+
+   static const uint32_t CHSCALE_TINT0 = 0x7517; // 322/11 * 2^CH_SCALE
+   static const uint32_t CHSCALE_TINT1 = 0x0fe7; // 322/81 * 2^CH_SCALE
+
+   static const uint32_t FULL_SCALE_TINT0 = 5047;
+   static const uint32_t FULL_SCALE_TINT1 = 37177;
+   static const uint32_t FULL_SCALE       = 65535;
+
+   static const int SEGMENT_COUNT = 8;
+
+//
+// Lux = (ch0 * b - ch1 * m) / 2^LUX_SCALE for ratios up to k / 2^RATIO_SCALE
+   struct Segment
+   {
+      uint32_t k;
+      uint32_t b;
+      uint32_t m;
+   };
+
+//
+// Coefficients from the datasheet
+   static const Segment *segments(int package)
+   {
+      static const Segment TABLE[2][SEGMENT_COUNT] =
+      {
+         {{0x0040, 0x01f2, 0x01be}, {0x0080, 0x0214, 0x02d1}, {0x00c0, 0x023f, 0x037b},
+          {0x0100, 0x0270, 0x03fe}, {0x0138, 0x016f, 0x01fc}, {0x019a, 0x00d2, 0x00fb},
+          {0x029a, 0x0018, 0x0012}, {0x029a, 0x0000, 0x0000}},
+         {{0x0043, 0x0204, 0x01ad}, {0x0085, 0x0228, 0x02c1}, {0x00c8, 0x0253, 0x0363},
+          {0x010a, 0x0282, 0x03df}, {0x014d, 0x0177, 0x01dd}, {0x019a, 0x0101, 0x0127},
+          {0x029a, 0x0037, 0x002b}, {0x029a, 0x0000, 0x0000}}
+      };
+      return TABLE[package != PACKAGE_T];
+   }
+
+//
+// Four readings per step, one per 32-bit lane; returns how many it converted
+   template <int PACKAGE>
+   static int batch(const uint16_t *ch0, const uint16_t *ch1, const uint8_t *gain,
+                    const uint8_t *integ, uint32_t *lux, int count)
+   {
+      const Segment *table = segments(PACKAGE);
+      int i = 0;
+
+      for ( ; i + 4 <= count ; i += 4)
+      {
+         v4u32 c0 = __builtin_convertvector(load16(ch0 + i), v4u32);
+         v4u32 c1 = __builtin_convertvector(load16(ch1 + i), v4u32);
+         v4u32 g = widen(load8(gain + i)) & TSL2561::GAIN_MASK;
+         v4u32 t = widen(load8(integ + i)) & TSL2561::INTEG_TIME_MASK;
+
+         v4u32 scale = t == TSL2561::INTEG_TIME_13_7MS ? CHSCALE_TINT0 :
+                       t == TSL2561::INTEG_TIME_101MS ? CHSCALE_TINT1 : (v4u32) {} + (1 << CH_SCALE);
+         scale = g == TSL2561::GAIN_1X ? scale << 4 : scale;
+         v4u32 limit = t == TSL2561::INTEG_TIME_13_7MS ? FULL_SCALE_TINT0 :
+                       t == TSL2561::INTEG_TIME_101MS ? FULL_SCALE_TINT1 : (v4u32) {} + FULL_SCALE;
+         v4i32 saturated = (c0 >= limit) | (c1 >= limit);
+
+         c0 = (c0 * scale) >> CH_SCALE;
+         c1 = (c1 * scale) >> CH_SCALE;
+
+//
+// Walk the table from the top so the lowest segment that fits wins
+         v4u32 scaled1 = c1 << (RATIO_SCALE + 1);
+         v4u32 b = (v4u32) {} + table[SEGMENT_COUNT - 1].b;
+         v4u32 m = (v4u32) {} + table[SEGMENT_COUNT - 1].m;
+#pragma GCC unroll 8
+         for (int s = SEGMENT_COUNT - 2 ; s >= 0 ; --s)
+         {
+            v4i32 fits = scaled1 < c0 * (2 * table[s].k + 1);
+            b = fits ? table[s].b : b;
+            m = fits ? table[s].m : m;
+         }
+
+         v4u32 pos = c0 * b;
+         v4u32 neg = c1 * m;
+         v4u32 result = pos > neg ? (pos - neg + (1 << (LUX_SCALE - 1))) >> LUX_SCALE : 0;
+         result = saturated ? LUX_SATURATED : result;
+         memcpy(lux + i, &result, sizeof(result));
+      }
+      return i;
+   }
+
+   static v4u16 load16(const uint16_t *p)
+   {
+      v4u16 v;
+      memcpy(&v, p, sizeof(v)); // Unaligned load
+      return v;
+   }
+
+//
+// Bytes to 32 bits in two steps; straight across GCC moves lanes one by one
+   static v4u32 widen(v4u8 v)
+   {
+      return __builtin_convertvector(__builtin_convertvector(v, v4u16), v4u32);
+   }
+
+   static v4u8 load8(const uint8_t *p)
+   {
+      v4u8 v;
+      memcpy(&v, p, sizeof(v));
+      return v;
+   }
+};
+
+#endif
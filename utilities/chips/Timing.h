@@ -0,0 +1,169 @@
+// Timing support shared by the sampling and control utilities.
+//
+// Timing:        Clock reads and absolute-deadline sleeps in nanoseconds
+// TransferStamp: When a bus transfer ran, bracketed on CLOCK_MONOTONIC_RAW
+// LatencyStats:  Fixed-size latency histogram with percentile reporting
+
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+class Timing
+{
+public:
+   static const uint64_t NSEC_PER_USEC = 1000ULL;
+   static const uint64_t NSEC_PER_SEC  = 1000000000ULL;
+
+//=============================================================================
+// now: Current time of the indicated clock in nanoseconds
+//
+   static uint64_t now(clockid_t clock = CLOCK_MONOTONIC)
+   {
+      struct timespec ts;
+
+      clock_gettime(clock, &ts);
+      return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+   }
+
+//
+// CLOCK_MONOTONIC_RAW is never slewed by NTP, so intervals between readings
+// from different chips are exact oscillator time
+   static uint64_t raw() { return now(CLOCK_MONOTONIC_RAW); }
+
+//=============================================================================
+// sleepUntil: Sleep until an absolute deadline on the indicated clock. Using
+//             absolute deadlines keeps a periodic loop from accumulating drift.
+//
+   static void sleepUntil(uint64_t deadline, clockid_t clock = CLOCK_MONOTONIC)
+   {
+      struct timespec ts;
+
+      ts.tv_sec = deadline / NSEC_PER_SEC;
+      ts.tv_nsec = deadline % NSEC_PER_SEC;
+      while (clock_nanosleep(clock, TIMER_ABSTIME, &ts, NULL) == EINTR)
+         ;
+   }
+};
+
+//=============================================================================
+// TransferStamp: Raw clock read either side of the ioctl that moved a reading.
+// The chip sampled somewhere in between, so the midpoint is the best single
+// time and the width bounds its error.
+//
+struct TransferStamp
+{
+   uint64_t start;
+   uint64_t end;
+
+   uint64_t mid() const   { return start + (end - start) / 2; }
+   uint64_t width() const { return end - start; }
+};
+
+//=============================================================================
+// LatencyStats: Latency histogram in nanoseconds. Each power of two is split
+// into SUB_BUCKETS linear buckets so percentiles are good to about 6% with
+// no allocation and constant time recording.
+//
+class LatencyStats
+{
+public:
+   LatencyStats() { reset(); }
+
+   void reset()
+   {
+      memset(buckets_, 0, sizeof(buckets_));
+      count_ = 0;
+      sum_ = 0;
+      min_ = UINT64_MAX;
+      max_ = 0;
+   }
+
+   void record(uint64_t nanos)
+   {
+      buckets_[bucketOf(nanos)]++;
+      count_++;
+      sum_ += nanos;
+      if (nanos < min_) min_ = nanos;
+      if (nanos > max_) max_ = nanos;
+   }
+
+   uint64_t count() const { return count_; }
+   uint64_t min() const   { return count_ ? min_ : 0; }
+   uint64_t max() const   { return max_; }
+   uint64_t mean() const  { return count_ ? sum_ / count_ : 0; }
+
+//
+// Return the upper bound of the bucket holding the requested percentile
+   uint64_t percentile(double pct) const
+   {
+      if (count_ == 0)
+         return 0;
+
+      uint64_t target = (uint64_t) (pct / 100.0 * count_ + 0.5);
+      uint64_t seen = 0;
+      if (target < 1) target = 1;
+      if (target > count_) target = count_;
+
+      for (int i = 0 ; i < NUM_BUCKETS ; ++i)
+      {
+         seen += buckets_[i];
+         if (seen >= target)
+         {
+            uint64_t bound = bucketLimit(i);
+            return bound < max_ ? bound : max_;
+         }
+      }
+      return max_;
+   }
+
+//
+// Print a one line summary in microseconds
+   void print(FILE *fp, const char *label) const
+   {
+      fprintf(fp, "%s: n=%llu min=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+              label, (unsigned long long) count_,
+              min() / 1000.0, percentile(50.0) / 1000.0, percentile(90.0) / 1000.0,
+              percentile(99.0) / 1000.0, percentile(99.9) / 1000.0, max() / 1000.0);
+   }
+
+private:
+   static const int SUB_BITS = 4;
+   static const int SUB_BUCKETS = 1 << SUB_BITS;
+   static const int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+   static int bucketOf(uint64_t v)
+   {
+      if (v < (uint64_t) SUB_BUCKETS)
+         return (int) v;
+
+      int msb = 63 - __builtin_clzll(v);
+      int shift = msb - SUB_BITS;
+      return (shift + 1) * SUB_BUCKETS + (int) ((v >> shift) & (SUB_BUCKETS - 1));
+   }
+
+   static uint64_t bucketLimit(int b)
+   {
+      if (b < SUB_BUCKETS)
+         return (uint64_t) b;
+
+      int shift = b / SUB_BUCKETS - 1;
+      uint64_t base = (uint64_t) (SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+      return base + ((1ULL << shift) - 1);
+   }
+
+   uint32_t buckets_[NUM_BUCKETS];
+   uint64_t count_;
+   uint64_t sum_;
+   uint64_t min_;
+   uint64_t max_;
+};
+
+#endif
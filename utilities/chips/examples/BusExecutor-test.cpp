@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <MCP23008.h>
+#include <MCP3008.h>
+#include <BusExecutor.h>
+
+//
+// One chip per bus, each read as fast as its bus allows
+struct Chip
+{
+   const char *device;
+   MCP23008    gpio;
+   MCP3008     adc;
+   uint8_t     bits;
+   int         value;
+};
+
+static Chip chips[BusExecutor::MAX_BUSES];
+static BusExecutor executor; // Too big for the stack
+static BusExecutor::Future futures[BusExecutor::MAX_BUSES][BusExecutor::QUEUE_SIZE];
+static uint64_t completed = 0;
+static uint64_t failed = 0;
+static double elapsed = 0;   // Seconds the last executor run took, drained
+
+static bool readGpio(void *arg)
+{
+   Chip &chip = *(Chip *) arg;
+   return chip.gpio.readPins(chip.bits);
+}
+
+static bool readAdc(void *arg)
+{
+   Chip &chip = *(Chip *) arg;
+   return (chip.value = chip.adc.getValue(0, MCP3008::INPUT_MODE_SINGLE)) >= 0;
+}
+
+static void counted(void *context, bool ok)
+{
+   __atomic_add_fetch(ok ? &completed : &failed, 1, __ATOMIC_RELAXED);
+}
+
+static bool openChips(int n, bool adc, uint8_t addr, uint32_t speed)
+{
+   for (int c = 0 ; c < n ; ++c)
+      if (!(adc ? chips[c].adc.begin(chips[c].device, speed) : chips[c].gpio.begin(chips[c].device, addr)))
+         return false;
+   return true;
+}
+
+static void closeChips(int n)
+{
+   for (int c = 0 ; c < n ; ++c)
+   {
+      chips[c].adc.end();
+      chips[c].gpio.end();
+   }
+}
+
+//
+// All the chips read in turn from this thread, the way a program without the
+// executor would do it
+static double serial(int n, BusExecutor::Operation op, double seconds)
+{
+   uint64_t count = 0;
+   uint64_t start = Timing::now();
+   uint64_t end = start + (uint64_t) (seconds * Timing::NSEC_PER_SEC);
+
+   while (Timing::now() < end)
+      for (int c = 0 ; c < n ; ++c)
+         count += op(&chips[c]) ? 1 : 0;
+   return count / ((Timing::now() - start) / 1e9);
+}
+
+//
+// Keep every bus worker's queue topped up, counting completions in a callback
+static double callbacks(int n, BusExecutor::Operation op, double seconds)
+{
+   uint64_t start = Timing::now();
+   uint64_t end = start + (uint64_t) (seconds * Timing::NSEC_PER_SEC);
+
+   completed = failed = 0;
+   while (Timing::now() < end)
+      for (int c = 0 ; c < n ; ++c)
+         executor.submit(c, op, &chips[c], counted, NULL);
+   executor.drain();
+   elapsed = (Timing::now() - start) / 1e9;
+   return completed / elapsed;
+}
+
+//
+// Submit depth reads on every bus, then wait for all of their futures
+static double waitFutures(int n, BusExecutor::Operation op, double seconds, int depth)
+{
+   uint64_t count = 0;
+   uint64_t start = Timing::now();
+   uint64_t end = start + (uint64_t) (seconds * Timing::NSEC_PER_SEC);
+
+   failed = 0;
+   while (Timing::now() < end)
+   {
+      for (int c = 0 ; c < n ; ++c)
+         for (int d = 0 ; d < depth ; ++d)
+            executor.submit(c, op, &chips[c], futures[c][d]);
+      for (int c = 0 ; c < n ; ++c)
+         for (int d = 0 ; d < depth ; ++d)
+         {
+            if (futures[c][d].wait())
+               count++;
+            else
+               failed++;
+         }
+   }
+   elapsed = (Timing::now() - start) / 1e9;
+   return count / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *devices = NULL;
+   const char *list[BusExecutor::MAX_BUSES];
+   char buffer[256];
+   bool adc = false;
+   bool useFutures = false;
+   bool pin = true;
+   uint8_t addr = 0x20;
+   uint32_t speed = 1000000;
+   double seconds = 2;
+   int depth = 16;
+   int n = 0;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "devices", 1, 0, 'd' },
+                  { "adc",     0, 0, 'a' },
+                  { "address", 1, 0, 'A' },
+                  { "speed",   1, 0, 's' },
+                  { "time",    1, 0, 't' },
+                  { "futures", 1, 0, 'F' },
+                  { "no-pin",  0, 0, 'P' },
+                  { "help",    0, 0, '?' },
+                  { NULL,      0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:aA:s:t:F:P?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': devices = optarg; break;
+      case 'a': adc = true; break;
+      case 'A': addr = strtol(optarg, NULL, 0); break;
+      case 's': speed = strtoul(optarg, NULL, 0); break;
+      case 't': seconds = atof(optarg); break;
+      case 'F': useFutures = true; depth = atoi(optarg); break;
+      case 'P': pin = false; break;
+
+      case '?':
+      default:
+         puts("Usage: BusExecutor-test [options]");
+         puts("   Reads one chip per bus on 1, 2 ... N buses, from one thread and through");
+         puts("   a worker per bus, and prints the aggregate reads per second.");
+         puts("   Options: -d --devices list         Comma separated bus devices, one chip on each");
+         puts("                                      (default /dev/i2c-1,/dev/i2c-3,/dev/i2c-4,/dev/i2c-5,");
+         puts("                                      or /dev/spidev0.0,/dev/spidev1.0 with -a)");
+         puts("            -a --adc                  Read MCP3008s rather than MCP23008s");
+         puts("            -A --address addr         MCP23008 address (default 0x20)");
+         puts("            -s --speed hz             MCP3008 SPI clock (default 1000000)");
+         puts("            -t --time seconds         Time per measurement (default 2)");
+         puts("            -F --futures depth        Wait on futures, depth per bus at a time,");
+         puts("                                      instead of counting in a callback");
+         puts("            -P --no-pin               Don't pin bus workers to CPUs");
+         puts("            -? --help");
+         puts("   Under the simulator, with bus wire time charged:");
+         puts("      CHIPSIM_I2C_HZ=400000 CHIPSIM_DEVICES=\"i2c-1:0x20=MCP23008;i2c-3:0x20=MCP23008;\\");
+         puts("      i2c-4:0x20=MCP23008;i2c-5:0x20=MCP23008\" LD_PRELOAD=../sim/ChipSim.so ./BusExecutor-test");
+         puts("      CHIPSIM_SPI_WIRE=1 CHIPSIM_DEVICES=\"spidev0.0=MCP3008;spidev1.0=MCP3008\" \\");
+         puts("      LD_PRELOAD=../sim/ChipSim.so ./BusExecutor-test -a");
+         exit(1);
+      }
+   }
+
+   if (devices == NULL)
+      devices = adc ? "/dev/spidev0.0,/dev/spidev1.0" : "/dev/i2c-1,/dev/i2c-3,/dev/i2c-4,/dev/i2c-5";
+   snprintf(buffer, sizeof(buffer), "%s", devices);
+   for (char *d = strtok(buffer, ",") ; d != NULL && n < BusExecutor::MAX_BUSES ; d = strtok(NULL, ","))
+      list[n++] = d;
+   if (useFutures && (depth < 1 || depth > BusExecutor::QUEUE_SIZE))
+   {
+      fprintf (stderr, "ERROR: Future depth must be 1 to %d.\n", BusExecutor::QUEUE_SIZE);
+      exit(1);
+   }
+
+   BusExecutor::Operation op = adc ? readAdc : readGpio;
+   double base = 0;
+
+   printf ("buses   serial/s  executor/s  scaling  busy%%  wait p50/p99\n");
+   for (int buses = 1 ; buses <= n ; ++buses)
+   {
+      for (int c = 0 ; c < buses ; ++c)
+      {
+         chips[c].device = list[c];
+         if (executor.addBus(list[c]) != c)
+         {
+            fprintf (stderr, "ERROR: %s is on the same bus as another device.\n", list[c]);
+            exit(1);
+         }
+      }
+      if (!openChips(buses, adc, addr, speed) || !executor.start(pin))
+         exit(1);
+
+      double one = serial(buses, op, seconds);
+      double many = useFutures ? waitFutures(buses, op, seconds, depth) : callbacks(buses, op, seconds);
+      if (buses == 1)
+         base = many;
+
+      double busy = 0;
+      for (int b = 0 ; b < buses ; ++b)
+         busy += executor.getBusyTime(b);
+      printf ("%5d %10.0f %11.0f %7.2fx %5.0f%%  %.1f/%.1fus%s\n", buses, one, many, many / base,
+              100.0 * busy / buses / (elapsed * 1e9),
+              executor.getWaitTime(buses - 1).percentile(50) / 1000.0,
+              executor.getWaitTime(buses - 1).percentile(99) / 1000.0,
+              failed ? " (failures)" : "");
+      fflush(stdout);
+
+      executor.end();
+      closeChips(buses);
+   }
+}
@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <Timing.h>
+#include <sim/BusTrace.h>
+
+typedef BusTraceFormat::Record Record;
+
+static const int MAX_KEYS = 64;
+
+//
+// Traffic to one device in one direction
+struct Key
+{
+   char         path[32];
+   uint16_t     addr;
+   uint8_t      type;
+   uint64_t     messages;
+   uint64_t     bytes;
+   LatencyStats latency;   // Whole calls, attributed to their first message
+};
+
+struct Summary
+{
+   char path[BusTraceWriter::MAX_STREAMS][32];
+   int  keys;
+   Key  key[MAX_KEYS];
+};
+
+static Summary sa, sb; // Too big for the stack
+
+static void streamPaths(const BusTraceReader &trace, char (*path)[32])
+{
+   for (int s = 0 ; s < BusTraceWriter::MAX_STREAMS ; ++s)
+      strcpy(path[s], "?");
+   for (uint32_t i = 0 ; i < trace.count() ; ++i)
+      if (trace.record(i).type == BusTraceFormat::TYPE_OPEN)
+         trace.pathOf(i, path[trace.record(i).stream], sizeof(path[0]));
+}
+
+static Key *findKey(Summary &sum, const char *path, uint16_t addr, uint8_t type)
+{
+   for (int k = 0 ; k < sum.keys ; ++k)
+      if (sum.key[k].addr == addr && sum.key[k].type == type && strcmp(sum.key[k].path, path) == 0)
+         return &sum.key[k];
+   if (sum.keys >= MAX_KEYS)
+      return NULL;
+
+   Key *key = &sum.key[sum.keys++];
+   strcpy(key->path, path);
+   key->addr = addr;
+   key->type = type;
+   key->messages = 0;
+   key->bytes = 0;
+   key->latency.reset();
+   return key;
+}
+
+static void summarize(const BusTraceReader &trace, Summary &sum)
+{
+   bool more[BusTraceWriter::MAX_STREAMS] = {false};
+
+   streamPaths(trace, sum.path);
+   sum.keys = 0;
+   for (uint32_t i = 0 ; i < trace.count() ; ++i)
+   {
+      const Record &rec = trace.record(i);
+      if (rec.type == BusTraceFormat::TYPE_OPEN || rec.type == BusTraceFormat::TYPE_CLOSE)
+         continue;
+
+      Key *key = findKey(sum, sum.path[rec.stream], rec.addr, rec.type);
+      if (key == NULL)
+         continue;
+      key->messages++;
+      key->bytes += rec.len;
+      if (!more[rec.stream])
+         key->latency.record(rec.latency);
+      more[rec.stream] = rec.flags & BusTraceFormat::FLAG_MORE;
+   }
+}
+
+static void printTrace(const BusTraceReader &trace)
+{
+   char path[BusTraceWriter::MAX_STREAMS][32];
+
+   streamPaths(trace, path);
+   for (uint32_t i = 0 ; i < trace.count() ; ++i)
+   {
+      const Record &rec = trace.record(i);
+      const uint8_t *data = trace.payload(i);
+
+      printf ("%12.3f %3d %-14s %-5s", rec.time / 1000.0, rec.stream, path[rec.stream],
+              BusTraceFormat::typeName(rec.type));
+      if (rec.type == BusTraceFormat::TYPE_OPEN || rec.type == BusTraceFormat::TYPE_CLOSE)
+      {
+         if (rec.flags & BusTraceFormat::FLAG_FAILED)
+            printf (" failed: %s", strerror(rec.error));
+         putchar('\n');
+         continue;
+      }
+      if (rec.type == BusTraceFormat::TYPE_SPI)
+         printf (" %7u Hz", rec.speed);
+      else
+         printf (" 0x%02x", rec.addr);
+      printf (" %8.1fus %c%c", rec.latency / 1000.0,
+              rec.flags & BusTraceFormat::FLAG_MORE ? '+' : ' ',
+              rec.flags & BusTraceFormat::FLAG_FAILED ? '!' : ' ');
+
+      int shown = rec.len < 16 ? rec.len : 16;
+      for (int b = 0 ; b < shown ; ++b)
+         printf (" %02x", data[b]);
+      if (rec.type == BusTraceFormat::TYPE_SPI)
+      {
+         fputs(" ->", stdout);
+         for (int b = 0 ; b < shown ; ++b)
+            printf (" %02x", data[rec.len + b]);
+      }
+      puts(rec.len > shown ? " ..." : "");
+   }
+}
+
+static void printStats(const BusTraceReader &trace)
+{
+   Summary &sum = sa;
+
+   summarize(trace, sum);
+   printf ("%u records over %.3f ms\n", trace.count(),
+           trace.count() ? trace.record(trace.count() - 1).time / 1e6 : 0.0);
+   for (int k = 0 ; k < sum.keys ; ++k)
+   {
+      Key &key = sum.key[k];
+      printf ("%-14s 0x%02x %-5s %8llu messages %10llu bytes\n", key.path, key.addr,
+              BusTraceFormat::typeName(key.type), (unsigned long long) key.messages,
+              (unsigned long long) key.bytes);
+      key.latency.print(stdout, "   calls");
+   }
+}
+
+//
+// Same message, comparing what the driver sent; what came back may differ
+static bool sameMessage(const BusTraceReader &a, uint32_t i, const BusTraceReader &b, uint32_t j)
+{
+   const Record &ra = a.record(i);
+   const Record &rb = b.record(j);
+
+   if (ra.type != rb.type || ra.addr != rb.addr || ra.len != rb.len)
+      return false;
+   if (ra.type == BusTraceFormat::TYPE_I2C_READ)
+      return true;
+   return memcmp(a.payload(i), b.payload(j), ra.len) == 0;
+}
+
+static uint32_t nextOf(const BusTraceReader &trace, uint32_t i, int stream)
+{
+   for ( ; i < trace.count() ; ++i)
+   {
+      const Record &rec = trace.record(i);
+      if (rec.stream == stream && rec.type != BusTraceFormat::TYPE_OPEN)
+         return i;
+   }
+   return i;
+}
+
+static void describe(const char *label, const BusTraceReader &trace, uint32_t i)
+{
+   if (i >= trace.count() || trace.record(i).type == BusTraceFormat::TYPE_CLOSE)
+   {
+      printf ("      %s: (end of stream)\n", label);
+      return;
+   }
+   const Record &rec = trace.record(i);
+   printf ("      %s: %s 0x%02x len %u:", label, BusTraceFormat::typeName(rec.type), rec.addr, rec.len);
+   for (int b = 0 ; b < rec.len && b < 16 ; ++b)
+      printf (" %02x", trace.payload(i)[b]);
+   putchar('\n');
+}
+
+static int diffTraces(const BusTraceReader &a, const BusTraceReader &b)
+{
+   int differences = 0;
+
+   summarize(a, sa);
+   summarize(b, sb);
+
+//
+// Traffic totals per device and direction
+   puts("Device                Type   Messages (old -> new)        Bytes (old -> new)");
+   for (int pass = 0 ; pass < 2 ; ++pass)
+   {
+      Summary &from = pass == 0 ? sa : sb;
+      Summary &other = pass == 0 ? sb : sa;
+
+      for (int k = 0 ; k < from.keys ; ++k)
+      {
+         Key &key = from.key[k];
+         Key *match = findKey(other, key.path, key.addr, key.type);
+         if (match == NULL || (pass == 1 && match->messages != 0))
+            continue; // Already reported in the first pass
+
+         Key &old = pass == 0 ? key : *match;
+         Key &now = pass == 0 ? *match : key;
+         if (old.messages == now.messages && old.bytes == now.bytes)
+            continue;
+         differences++;
+         printf ("%-14s 0x%02x  %-5s %8llu -> %-8llu (%+lld) %8llu -> %-8llu (%+lld)\n",
+                 key.path, key.addr, BusTraceFormat::typeName(key.type),
+                 (unsigned long long) old.messages, (unsigned long long) now.messages,
+                 (long long) (now.messages - old.messages),
+                 (unsigned long long) old.bytes, (unsigned long long) now.bytes,
+                 (long long) (now.bytes - old.bytes));
+      }
+   }
+   if (differences == 0)
+      puts("   (same traffic)");
+
+//
+// First divergence in each stream, pairing the nth open of a path in one
+// trace with the nth open of it in the other
+   for (uint32_t i = 0 ; i < a.count() ; ++i)
+   {
+      if (a.record(i).type != BusTraceFormat::TYPE_OPEN)
+         continue;
+
+      int nth = 0;
+      for (uint32_t k = 0 ; k < i ; ++k)
+         if (a.record(k).type == BusTraceFormat::TYPE_OPEN && strcmp(sa.path[a.record(k).stream],
+                                                                     sa.path[a.record(i).stream]) == 0)
+            nth++;
+
+      uint32_t j;
+      for (j = 0 ; j < b.count() ; ++j)
+         if (b.record(j).type == BusTraceFormat::TYPE_OPEN &&
+             strcmp(sb.path[b.record(j).stream], sa.path[a.record(i).stream]) == 0 && nth-- == 0)
+            break;
+      if (j == b.count())
+      {
+         printf ("Stream %d (%s): no matching open in the new trace\n", a.record(i).stream,
+                 sa.path[a.record(i).stream]);
+         differences++;
+         continue;
+      }
+
+      int streamA = a.record(i).stream, streamB = b.record(j).stream;
+      uint32_t ia = nextOf(a, i + 1, streamA), ib = nextOf(b, j + 1, streamB);
+      for (uint64_t m = 0 ; ; ++m)
+      {
+         bool endA = ia >= a.count() || a.record(ia).type == BusTraceFormat::TYPE_CLOSE;
+         bool endB = ib >= b.count() || b.record(ib).type == BusTraceFormat::TYPE_CLOSE;
+         if (endA && endB)
+            break;
+         if (endA || endB || !sameMessage(a, ia, b, ib))
+         {
+            printf ("Stream %d (%s): first difference at message %llu\n", streamA,
+                    sa.path[streamA], (unsigned long long) m);
+            describe("old", a, ia);
+            describe("new", b, ib);
+            differences++;
+            break;
+         }
+         ia = nextOf(a, ia + 1, streamA);
+         ib = nextOf(b, ib + 1, streamB);
+      }
+   }
+   return differences;
+}
+
+//
+// Run this program again under the shim to open path, returning the errno
+// the open failed with, 0 if it worked, or -1 if the child didn't get that far
+static int probeOpen(const char *shim, const char *mode,
+                     const char *trace, const char *path)
+{
+   int status;
+
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid == 0)
+   {
+      setenv(mode, trace, 1);
+      setenv("LD_PRELOAD", shim, 1);
+      execl("/proc/self/exe", "BusTrace-test", "--probe-open", path, (char *) NULL);
+      _exit(255);
+   }
+   if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+       WEXITSTATUS(status) == 255)
+      return -1;
+   return WEXITSTATUS(status);
+}
+
+//
+// A bus node that can't be opened is recorded as a failed open, and replay
+// fails the open the same way rather than finding nothing there
+static bool checkFailedOpen(const char *shim, const char *trace)
+{
+   static const char *PATH = "/dev/spidev99.99";
+   BusTraceReader recorded;
+
+   int recordError = probeOpen(shim, "BUSTRACE_RECORD", trace, PATH);
+   if (recordError <= 0 || !recorded.begin(trace))
+   {
+      printf ("Recording the open of %s failed (%d)\n", PATH, recordError);
+      return false;
+   }
+   printTrace(recorded);
+   bool ok = recorded.count() == 1 &&
+             recorded.record(0).type == BusTraceFormat::TYPE_OPEN &&
+             (recorded.record(0).flags & BusTraceFormat::FLAG_FAILED) &&
+             recorded.record(0).error == recordError;
+
+   int replayError = probeOpen(shim, "BUSTRACE_REPLAY", trace, PATH);
+   printf ("Open of %s: recorded %s, replayed %s\n", PATH, strerror(recordError),
+           replayError > 0 ? strerror(replayError) : replayError == 0 ? "success" : "no result");
+   return ok && replayError == recordError;
+}
+
+int main(int argc, char *argv[])
+{
+   enum { NONE, PRINT, STATS, DIFF, OPEN_CHECK, PROBE } action = NONE;
+   BusTraceReader trace, other;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "print", 0, 0, 'p' },
+                  { "stats", 0, 0, 's' },
+                  { "diff",  0, 0, 'D' },
+                  { "open-check", 0, 0, 'O' },
+                  { "probe-open", 0, 0, 'P' },
+                  { "help",  0, 0, '?' },
+                  { NULL,    0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "psDO?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'p': action = PRINT; break;
+      case 's': action = STATS; break;
+      case 'D': action = DIFF; break;
+      case 'O': action = OPEN_CHECK; break;
+      case 'P': action = PROBE; break;
+
+      case '?':
+      default:
+         action = NONE;
+         optind = argc;
+         break;
+      }
+   }
+
+   if (action == NONE || optind + (action == DIFF || action == OPEN_CHECK ? 2 : 1) != argc)
+   {
+      puts("Usage: BusTrace-test action trace [new_trace]");
+      puts("   Actions: -p --print                Every record, one per line");
+      puts("            -s --stats                Traffic and call latency per device");
+      puts("            -D --diff old new         Traffic changes and first divergence per stream");
+      puts("            -O --open-check shim trace");
+      puts("                                      Record then replay a failed open through the");
+      puts("                                      shim (sim/BusTrace.so), using trace as scratch");
+      puts("            -? --help");
+      puts("   Traces are recorded with BUSTRACE_RECORD=file LD_PRELOAD=sim/BusTrace.so program");
+      exit(1);
+   }
+
+   if (action == PROBE) // Child of --open-check
+   {
+      int fd = open(argv[optind], O_RDWR);
+      if (fd < 0)
+         exit(errno < 255 ? errno : 254);
+      close(fd);
+      exit(0);
+   }
+   if (action == OPEN_CHECK)
+   {
+      bool ok = checkFailedOpen(argv[optind], argv[optind + 1]);
+      puts(ok ? "Failed open round trip passed" : "Failed open round trip FAILED");
+      exit(ok ? 0 : 2);
+   }
+
+   if (!trace.begin(argv[optind]))
+      exit(1);
+
+   switch (action)
+   {
+   case PRINT:
+      printTrace(trace);
+      break;
+
+   case STATS:
+      printStats(trace);
+      break;
+
+   case DIFF:
+      if (!other.begin(argv[optind + 1]))
+         exit(1);
+      exit(diffTraces(trace, other) != 0 ? 2 : 0);
+
+   default:
+      break;
+   }
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <ChipConfig.h>
+
+static ChipConfig config; // Too big for the stack
+
+static MCP23008 expanders[ChipConfig::MAX_CHIPS];
+static TSL2561  lights[ChipConfig::MAX_CHIPS];
+static MCP4725  dacs[ChipConfig::MAX_CHIPS];
+static MCP3008  adcs[ChipConfig::MAX_CHIPS];
+
+static void list()
+{
+   for (int c = 0 ; c < config.chips() ; ++c)
+   {
+      const ChipConfig::Chip &chip = config.chip(c);
+      printf ("%-16s %-8s %-16s", chip.name, ChipConfig::kindName(chip.kind),
+              config.bus(chip.bus).device);
+      if (chip.kind != ChipConfig::CHIP_MCP3008)
+         printf (" 0x%02x", chip.addr);
+      putchar('\n');
+   }
+}
+
+//
+// Bring the same chips up the way each driver's begin() does, one at a time,
+// for comparison
+static bool serial()
+{
+   bool ok = true;
+   uint64_t start = Timing::now();
+
+   for (int c = 0 ; c < config.chips() ; ++c)
+   {
+      const ChipConfig::Chip &chip = config.chip(c);
+      const char *device = config.bus(chip.bus).device;
+      bool up = false;
+
+      switch (chip.kind)
+      {
+      case ChipConfig::CHIP_MCP23008:
+         up = expanders[c].begin(device, chip.addr) &&
+              expanders[c].writePins(chip.reg[ChipConfig::REG_OLAT]) &&
+              expanders[c].setupPins(chip.reg[ChipConfig::REG_IODIR], chip.reg[ChipConfig::REG_GPPU],
+                                     chip.reg[ChipConfig::REG_IPOL]);
+         break;
+      case ChipConfig::CHIP_TSL2561:
+         up = lights[c].begin(device, chip.addr);
+         lights[c].setGain(chip.gain);
+         lights[c].setIntegrationTime(chip.integ);
+         break;
+      case ChipConfig::CHIP_MCP4725:
+         up = dacs[c].begin(device, chip.addr) && dacs[c].setValue(chip.value);
+         break;
+      case ChipConfig::CHIP_MCP3008:
+         up = adcs[c].begin(device, config.bus(chip.bus).speed);
+         break;
+      }
+      if (!up)
+         printf ("   %s did not come up\n", chip.name);
+      ok = ok && up;
+   }
+   printf ("Serial startup %.1fus for %d chips\n", (Timing::now() - start) / 1000.0, config.chips());
+   return ok;
+}
+
+//
+// What a program does after bringUp(): attach drivers by name, no bus traffic
+static bool attachAll()
+{
+   bool ok = true;
+   uint64_t start = Timing::now();
+
+   for (int c = 0 ; c < config.chips() ; ++c)
+   {
+      const char *name = config.chip(c).name;
+
+      switch (config.chip(c).kind)
+      {
+      case ChipConfig::CHIP_MCP23008: ok = config.attach(expanders[c], name) && ok; break;
+      case ChipConfig::CHIP_TSL2561:  ok = config.attach(lights[c], name) && ok; break;
+      case ChipConfig::CHIP_MCP4725:  ok = config.attach(dacs[c], name) && ok; break;
+      case ChipConfig::CHIP_MCP3008:  ok = config.attach(adcs[c], name) && ok; break;
+      }
+   }
+   printf ("Drivers attached in %.1fus\n", (Timing::now() - start) / 1000.0);
+   return ok;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *file = "chips.conf";
+   bool verify = true;
+   bool check = false;
+   bool compare = false;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "file",      1, 0, 'f' },
+                  { "no-verify", 0, 0, 'n' },
+                  { "check",     0, 0, 'c' },
+                  { "serial",    0, 0, 'S' },
+                  { "help",      0, 0, '?' },
+                  { NULL,        0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "f:ncS?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'f': file = optarg; break;
+      case 'n': verify = false; break;
+      case 'c': check = true; break;
+      case 'S': compare = true; break;
+
+      case '?':
+      default:
+         puts("Usage: ChipConfig-test [options]");
+         puts("   Options: -f --file config         Configuration file (default chips.conf)");
+         puts("            -n --no-verify            Don't read registers back");
+         puts("            -c --check                Only parse the file and list the chips");
+         puts("            -S --serial               Also bring the chips up one by one with begin()");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   uint64_t start = Timing::now();
+   if (!config.load(file))
+      exit(1);
+   printf ("Loaded %d chips on %d buses in %.1fus\n", config.chips(), config.buses(),
+           (Timing::now() - start) / 1000.0);
+   if (check)
+   {
+      list();
+      exit(0);
+   }
+
+   bool ok = config.bringUp(verify);
+   config.report(stdout);
+   ok = attachAll() && ok;
+   config.end();
+
+   if (compare)
+   {
+      for (int c = 0 ; c < config.chips() ; ++c)
+      {
+         expanders[c].end();
+         lights[c].end();
+         dacs[c].end();
+         adcs[c].end();
+      }
+      ok = serial() && ok;
+   }
+   exit(ok ? 0 : 2);
+}
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <MCP3008.h>
+#include <MCP4725.h>
+#include <ControlLoop.h>
+
+//
+// Simulated plant: a first order lag driven by the DAC and observed by the ADC.
+// Time is taken from the real clock so loop timing shows up in the response.
+// Pipelined, the ADC side runs on the control thread and the DAC side on the
+// actuator thread, so the state is kept under a lock.
+class SimPlant
+{
+public:
+   SimPlant(double tau, double gain)
+   {
+      tau_ = tau;
+      gain_ = gain;
+      input_ = 0.0;
+      output_ = 0.0;
+      last_ = Timing::now();
+      pthread_mutex_init(&lock_, NULL);
+   }
+
+   double read()
+   {
+      pthread_mutex_lock(&lock_);
+      advance();
+      double output = output_;
+      pthread_mutex_unlock(&lock_);
+      return output;
+   }
+
+   void drive(double input)
+   {
+      pthread_mutex_lock(&lock_);
+      advance();
+      input_ = input;
+      pthread_mutex_unlock(&lock_);
+   }
+
+private:
+   void advance()
+   {
+      uint64_t now = Timing::now();
+      double dt = (now - last_) / 1e9;
+      last_ = now;
+      output_ += (gain_ * input_ - output_) * (dt / (tau_ + dt));
+   }
+
+   double tau_, gain_;
+   double input_, output_;
+   uint64_t last_;
+   pthread_mutex_t lock_;
+};
+
+class SimADC
+{
+public:
+   SimADC(SimPlant &plant) : plant_(plant) {}
+
+   int getValue(uint8_t channel, int input_mode)
+   {
+      int v = (int) (plant_.read() + (rand() % 3) - 1); // +-1 count of noise
+      return v < 0 ? 0 : v > 1023 ? 1023 : v;
+   }
+
+   SimPlant &plant_;
+};
+
+class SimDAC
+{
+public:
+   SimDAC(SimPlant &plant) : plant_(plant) {}
+
+   bool setValue(uint16_t value)
+   {
+      plant_.drive(value * (1023.0 / 4095.0)); // Same reference for both converters
+      return true;
+   }
+
+   SimPlant &plant_;
+};
+
+static volatile bool stop = false;
+
+static void onSignal(int sig)
+{
+   stop = true;
+}
+
+template <class ADC, class DAC>
+static void runLoop(ADC &adc, DAC &dac, int channel, int input_mode, int rate, int cycles,
+                    int setpoint, double kp, double ki, double kd, bool pipelined)
+{
+   ControlLoop<ADC, DAC> loop(adc, dac);
+
+   loop.setInput(channel, input_mode);
+   loop.setPeriod(Timing::NSEC_PER_SEC / rate);
+   loop.setSetpoint(setpoint);
+   loop.setGains((int32_t) (kp * ControlLoop<ADC, DAC>::Q_ONE),
+                 (int32_t) (ki * ControlLoop<ADC, DAC>::Q_ONE),
+                 (int32_t) (kd * ControlLoop<ADC, DAC>::Q_ONE));
+   loop.setPipelined(pipelined);
+
+   if (!loop.run(cycles, &stop))
+      exit(1);
+
+   printf ("Setpoint %d, final input %d, final output %d\n",
+           setpoint, loop.getInput(), loop.getOutput());
+   printf ("Overruns %u, dropped outputs %u, failures %u\n",
+           loop.getOverruns(), loop.getDropped(), loop.getFailures());
+   loop.getLatency().print(stdout, "Sample to actuate");
+   loop.getJitter().print(stdout, "Wake up jitter   ");
+}
+
+int main(int argc, char *argv[])
+{
+   const char *spi_device = "/dev/spidev0.0";
+   const char *i2c_device = "/dev/i2c-1";
+   int address = 2;
+   int channel = 0;
+   int input_mode = MCP3008::INPUT_MODE_SINGLE;
+   int rate = 1000;
+   int cycles = 5000;
+   int setpoint = 512;
+   double kp = 1.0, ki = 0.05, kd = 0.0;
+   bool pipelined = true;
+   bool simulate = false;
+   int log_rate = 10;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "spi-device",   1, 0, 'd' },
+                  { "i2c-device",   1, 0, 'i' },
+                  { "address",      1, 0, 'a' },
+                  { "channel",      1, 0, 'c' },
+                  { "differential", 0, 0, 'D' },
+                  { "rate",         1, 0, 'r' },
+                  { "cycles",       1, 0, 'n' },
+                  { "setpoint",     1, 0, 't' },
+                  { "kp",           1, 0, 'P' },
+                  { "ki",           1, 0, 'I' },
+                  { "kd",           1, 0, 'K' },
+                  { "sequential",   0, 0, 'q' },
+                  { "simulate",     0, 0, 'S' },
+                  { "log-rate",     1, 0, 'L' },
+                  { "help",         0, 0, '?' },
+                  { NULL,           0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:i:a:c:Dr:n:t:P:I:K:qSL:?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': spi_device = optarg; break;
+      case 'i': i2c_device = optarg; break;
+      case 'a': address = strtol(optarg, NULL, 0); break;
+      case 'c': channel = atoi(optarg); break;
+      case 'D': input_mode = MCP3008::INPUT_MODE_DIFFERENTIAL; break;
+      case 'r': rate = atoi(optarg); break;
+      case 'n': cycles = atoi(optarg); break;
+      case 't': setpoint = atoi(optarg); break;
+      case 'P': kp = atof(optarg); break;
+      case 'I': ki = atof(optarg); break;
+      case 'K': kd = atof(optarg); break;
+      case 'q': pipelined = false; break;
+      case 'S': simulate = true; break;
+      case 'L': log_rate = atoi(optarg); break;
+
+      case '?':
+      default:
+         puts("Usage: ControlLoop-test [options]");
+         puts("   Options: -d --spi-device device_name     MCP3008 device");
+         puts("            -i --i2c-device device_name     MCP4725 bus");
+         puts("            -a --address i2c_address        MCP4725 address");
+         puts("            -c --channel input_channel");
+         puts("            -D --differential");
+         puts("            -r --rate hz                    Loop rate");
+         puts("            -n --cycles count               Cycles to run (0 for ever)");
+         puts("            -t --setpoint counts");
+         puts("            -P --kp gain, -I --ki gain, -K --kd gain");
+         puts("            -q --sequential                 Write the output inline");
+         puts("            -S --simulate                   Run against a simulated plant");
+         puts("            -L --log-rate lines             Driver errors per second written from the log");
+         puts("                                            thread (default 10); 0 writes them inline");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   if (rate <= 0)
+   {
+      fputs("ERROR: Rate must be positive.\n", stderr);
+      exit(1);
+   }
+   signal(SIGINT, onSignal);
+
+   if (simulate)
+   {
+      SimPlant plant(0.05, 1.0);
+      SimADC adc(plant);
+      SimDAC dac(plant);
+
+      runLoop(adc, dac, channel, input_mode, rate, cycles, setpoint, kp, ki, kd, pipelined);
+   }
+   else
+   {
+      MCP3008 adc;
+      MCP4725 dac;
+
+      if (!adc.begin(spi_device) || !dac.begin(i2c_device, address))
+         exit(1);
+
+//
+// From here driver errors are queued and written by the log thread, so a
+// failing bus can't hold the loop up on stderr
+      if (log_rate > 0 && !ChipLog::start(log_rate, 2 * log_rate))
+         exit(1);
+
+      runLoop(adc, dac, channel, input_mode, rate, cycles, setpoint, kp, ki, kd, pipelined);
+
+      ChipLog::stop();
+      if (ChipLog::getSuppressed() + ChipLog::getDropped() != 0)
+         printf ("Driver errors not logged: %llu over the rate, %llu with the log busy\n",
+                 (unsigned long long) ChipLog::getSuppressed(), (unsigned long long) ChipLog::getDropped());
+
+      dac.end();
+      adc.end();
+   }
+}
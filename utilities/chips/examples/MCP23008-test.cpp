@@ -1,240 +1,496 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <MCP23008.h>
+#include <Timing.h>
 
-int main(int argc, char *argv[])
+static const int MAX_WORDS = 64;      // Per batch line
+static const int LINE_SIZE = 1024;
+
+//
+// Batch state: output writes held back for coalescing, and command timing
+static bool coalesce = false;
+static bool timed = false;
+static bool pending = false;
+static uint8_t pendingLatch = 0;
+static LatencyStats commandTime;
+
+static void usage()
+{
+   puts ("Usage: MCP23008-test [options] [commands]");
+   puts ("   Options: -d device_name                    Specify device bus");
+   puts ("            -a address                        Specify device address on bus");
+   puts ("            -b file                           Run commands from file (- for stdin), any number");
+   puts ("                                              to a line, on one open connection");
+   puts ("            -coalesce                         Merge runs of -w/-W into one output latch write");
+   puts ("            -time                             Print each command's latency and a summary");
+   puts ("            -help                             Print message");
+   puts ("  Commands: -w pin HIGH|LOW|TRUE|FALSE|1|0    Write single output line");
+   puts ("            -W bits                           Write all eight output lines at once");
+   puts ("            -r pin                            Read single input line");
+   puts ("            -R                                Read all eight input lines at once");
+   puts ("            -io pin INPUT|OUTPUT              Set direction of line");
+   puts ("            -pullup pin UP|DOWN               Set pullup resister on individual input line");
+   puts ("            -pins I|O[p-]...                  Set pin direction (I|O), pullup (p), and polarity(-)");
+   puts ("            -sleep ms                         Pause, e.g. between steps of a batch");
+   puts ("            -check                            Drive each pin high and low and read it back,");
+   puts ("                                              leaving all eight unloaded inputs");
+   puts ("   In a batch the leading - of a command may be left off, # starts a comment,");
+   puts ("   and a failed command skips the rest of its line.");
+}
+
+//
+// Match a command word; batch lines may leave the dash off
+static bool is(const char *word, const char *command)
+{
+   return strcmp(word, command) == 0 || (word[0] != '-' && strcmp(word, command + 1) == 0);
+}
+
+//
+// Send any held back output writes as a single write of the latch
+static bool flush(MCP23008 &chip)
+{
+   if (!pending)
+      return true;
+   pending = false;
+   if (pendingLatch == chip.getLatch())
+      return true;
+
+   uint64_t start = Timing::now();
+   Result<void> result = chip.tryWritePins(pendingLatch);
+   uint64_t elapsed = Timing::now() - start;
+   if (!result)
+   {
+      ChipLog::report(result.error());
+      return false;
+   }
+   if (timed)
+   {
+      commandTime.record(elapsed);
+      printf ("%9.3f ms  (write latch 0x%02x)\n", elapsed / 1e6, pendingLatch);
+   }
+   return true;
+}
+
+//
+// Drive pin P high then low as an output, reading it back each time, then
+// leave it an input without pullup, and go on to the next pin. The pins are
+// constants, so this goes through the accessors checked at compile time.
+// Those close the device on a transfer error, as the plain calls do.
+template <uint8_t P>
+static int checkPins(MCP23008 &chip)
+{
+   int bad = 0;
+
+   if (!chip.pinMode<P>(MCP23008::OUTPUT) ||
+       !chip.digitalWrite<P>(MCP23008::HIGH) || chip.digitalRead<P>() != MCP23008::HIGH ||
+       !chip.digitalWrite<P>(MCP23008::LOW) || chip.digitalRead<P>() != MCP23008::LOW)
+   {
+      printf ("Pin %d does not follow its output latch\n", P);
+      bad++;
+   }
+   if (!chip.pinMode<P>(MCP23008::INPUT) || !chip.pullUp<P>(MCP23008::PULLDOWN))
+      return -1;
+   if constexpr (P < 7)
+   {
+      int rest = checkPins<P + 1>(chip);
+      return rest < 0 ? rest : bad + rest;
+   }
+   return bad;
+}
+
+//
+// Words taken by a general option (itself and any argument), 0 for a command
+static int option(const char *word)
+{
+   if (strcmp(word, "-d") == 0 || strcmp(word, "-device") == 0 ||
+       strcmp(word, "-a") == 0 || strcmp(word, "-address") == 0 ||
+       strcmp(word, "-b") == 0 || strcmp(word, "-batch") == 0)
+      return 2;
+   if (strcmp(word, "-coalesce") == 0 || strcmp(word, "-time") == 0)
+      return 1;
+   return 0;
+}
+
+//=============================================================================
+// runCommand: Carry out the command at argv[i]. Returns the index of the last
+//             word it used, or -1 if it failed or was not understood.
+//
+static int runCommand(MCP23008 &chip, int argc, char *argv[], int i)
 {
-   int i;
    uint8_t pin;
    uint8_t value;
-   const char *device = "/dev/i2c-1";
    char *eptr;
-   uint8_t address = 0;
-   MCP23008 chip;
 
-//
-// First parse through the arguments looking or the general ones
-   for (i = 1 ; i < argc ; ++i)
+   if (is(argv[i], "-w")) // Write a bit
    {
-      if (strcmp(argv[i], "-d") == 0 ||
-          strcmp(argv[i], "-device") == 0)
+      if (i+2 >= argc) // Missing a required argument
       {
-         if (i+1 >= argc) // Missing a required argument
-         {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
-         }
-         device = argv[++i];
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         return -1;
       }
-      else if (strcmp(argv[i], "-a") == 0 ||
-               strcmp(argv[i], "-address") == 0)
+      pin = atoi(argv[++i]);
+      ++i;
+      if (strcmp(argv[i], "HIGH") == 0 ||
+          strcmp(argv[i], "H") == 0 ||
+          strcmp(argv[i], "1") == 0 ||
+          strcmp(argv[i], "TRUE") == 0 ||
+          strcmp(argv[i], "T") == 0)
+      {
+         value = MCP23008::HIGH;
+      }
+      else if (strcmp(argv[i], "LOW") == 0 ||
+          strcmp(argv[i], "L") == 0 ||
+          strcmp(argv[i], "0") == 0 ||
+          strcmp(argv[i], "FALSE") == 0 ||
+          strcmp(argv[i], "F") == 0)
       {
-         if (i+1 >= argc) // Missing a required argument
+         value = MCP23008::LOW;
+      }
+      else
+      {
+          fprintf (stderr,"ERROR: Unknown pin state %s.\n", argv[i]);
+          return -1;
+      }
+      if (coalesce)
+      {
+         if (pin >= 8)
          {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
+            fputs("ERROR: Invalid pin specified.\n", stderr);
+            return -1;
          }
-         address = strtol(argv[++i], &eptr, 0);
+         if (!pending)
+            pendingLatch = chip.getLatch();
+         pending = true;
+         pendingLatch = value == MCP23008::HIGH ? pendingLatch | (1 << pin) : pendingLatch & ~(1 << pin);
       }
+      else if (!ChipLog::check(chip.tryDigitalWrite(pin, value)))
+         return -1;
    }
+   else if (is(argv[i], "-W")) // Write all bits
+   {
+      if (i+1 >= argc) // Missing a required argument
+      {
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         return -1;
+      }
+      value = strtol(argv[++i], &eptr, 0);
+      if (coalesce)
+      {
+         pending = true;
+         pendingLatch = value;
+      }
+      else if (!ChipLog::check(chip.tryWritePins(value)))
+         return -1;
+   }
+   else if (is(argv[i], "-r")) // Read a pin
+   {
+      if (i+1 >= argc) // Missing a required argument
+      {
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         return -1;
+      }
+      pin = atoi(argv[++i]);
+      if (pin >= 8)
+      {
+         fputs("ERROR: Invalid pin specified.\n", stderr);
+         return -1;
+      }
+      Result<uint8_t> bit = chip.tryDigitalRead(pin);
+      if (!bit)
+      {
+         ChipLog::report(bit.error());
+         return -1;
+      }
+      printf ("Pin %d is %s\n", pin, bit.value() == MCP23008::HIGH ? "HIGH" : "LOW");
+   }
+   else if (is(argv[i], "-R")) // Read all bits
+   {
+      int j;
 
-   if (!chip.begin(device, address)) // Open up our connection
-      exit(1);
+      Result<uint8_t> bits = chip.tryReadPins();
+      if (!bits)
+      {
+         ChipLog::report(bits.error());
+         return -1;
+      }
+      value = bits.value();
+      printf("Pins = 0x%x ", value);
 
-//
-// Now run through the command line treating the remainder of the options like commands to
-// be done in sequence.
-   for (i = 1 ; i < argc ; ++i)
+      for (j = 0x80 ; j != 0 ; j >>= 1)
+         putchar(j&value ? '1' : '0');
+      putchar('\n');
+   }
+   else if (is(argv[i], "-io")) // Set direction for pin
    {
-      if (strcmp(argv[i], "-w") == 0) // Write a bit
+      if (i+2 >= argc) // Missing a required argument
       {
-         if (i+2 >= argc) // Missing a required argument
-         {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
-         }
-         pin = atoi(argv[++i]);
-         ++i;
-         if (strcmp(argv[i], "HIGH") == 0 ||
-             strcmp(argv[i], "H") == 0 ||
-             strcmp(argv[i], "1") == 0 ||
-             strcmp(argv[i], "TRUE") == 0 ||
-             strcmp(argv[i], "T") == 0)
-         {
-            value = MCP23008::HIGH;
-         }
-         else if (strcmp(argv[i], "LOW") == 0 ||
-             strcmp(argv[i], "L") == 0 ||
-             strcmp(argv[i], "0") == 0 ||
-             strcmp(argv[i], "FALSE") == 0 ||
-             strcmp(argv[i], "F") == 0)
-         {
-            value = MCP23008::LOW;
-         }
-         else
-         {
-             fprintf (stderr,"ERROR: Unknown pin state %s.\n", argv[i]);
-             exit(1);
-         }
-         if (!chip.digitalWrite(pin, value))
-            exit(1);
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         return -1;
       }
-      else if (strcmp(argv[i], "-W") == 0) // Write all bits
+      pin = atoi(argv[++i]);
+      ++i;
+      if (strcmp(argv[i], "IN") == 0 ||
+          strcmp(argv[i], "INPUT") == 0)
       {
-         if (i+1 >= argc) // Missing a required argument
-         {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
-         }
-         value = strtol(argv[++i], &eptr, 0);
-         if (!chip.writePins(value))
-            exit(1);
+         value = MCP23008::INPUT;
       }
-      else if (strcmp(argv[i], "-r") == 0) // Read a pin
+      else if (strcmp(argv[i], "OUT") == 0 ||
+               strcmp(argv[i], "OUTPUT") == 0)
       {
-         if (i+1 >= argc) // Missing a required argument
-         {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
-         }
-         pin = atoi(argv[++i]);
-         if (pin < 0 || pin >= 8)
+         value = MCP23008::OUTPUT;
+      }
+      else
+      {
+          fprintf (stderr,"ERROR: Unknown pin direction %s.\n", argv[i]);
+          return -1;
+      }
+      if (!ChipLog::check(chip.tryPinMode(pin, value)))
+         return -1;
+   }
+   else if (is(argv[i], "-pullup")) // Set pullup on an output pin
+   {
+      if (i+2 >= argc) // Missing a required argument
+      {
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         return -1;
+      }
+      pin = atoi(argv[++i]);
+      ++i;
+      if (strcmp(argv[i], "ON") == 0 ||
+          strcmp(argv[i], "UP") == 0)
+      {
+         value = MCP23008::PULLUP;
+      }
+      else if (strcmp(argv[i], "OFF") == 0 ||
+               strcmp(argv[i], "DOWN") == 0)
+      {
+         value = MCP23008::PULLDOWN;
+      }
+      else
+      {
+          fprintf (stderr,"ERROR: Unknown pullup setting %s.\n", argv[i]);
+          return -1;
+      }
+      if (!ChipLog::check(chip.tryPullUp(pin, value)))
+         return -1;
+   }
+   else if (is(argv[i], "-pins")) // Setup pins
+   {
+      int j, b;
+      uint8_t iodir = 0;
+      uint8_t ipol = 0;
+      uint8_t gppu = 0;
+
+      if (i+1 >= argc) // Missing a required argument
+      {
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         return -1;
+      }
+      ++i;
+//
+// parse the descriptive string
+      for (j = 0, b = 0x100 ; argv[i][j] != '\0' && b != 0 ; j++)
+         switch(argv[i][j])
          {
-            fputs("ERROR: Invalid pin specified.\n", stderr);
-            exit(1);
+         case 'I': // Input line
+            b >>= 1;
+            iodir &= ~b;
+            break;
+
+         case 'O': // Output line
+            b >>= 1;
+            iodir |= b;
+            break;
+
+         case '-': // Invert the input
+            ipol |= b;
+            break;
+
+         case 'p': // Pullup
+            gppu |= b;
+            break;
+
+         default:
+            fprintf (stderr, "ERROR: Unknown pin specifier \'%c\'\n", argv[i][j]);
+            return -1;
          }
-         printf ("Pin %d is %s\n", pin,
-                 chip.digitalRead(pin) == MCP23008::HIGH ? "HIGH" : "LOW");
+
+      if (!ChipLog::check(chip.trySetupPins(iodir, gppu, ipol)))
+         return -1;
+   }
+   else if (is(argv[i], "-check")) // Loop back every pin
+   {
+      int bad = checkPins<0>(chip);
+
+      if (bad != 0)
+         return -1;
+      puts("All pins follow their output latches");
+   }
+   else if (is(argv[i], "-sleep")) // Pause
+   {
+      if (i+1 >= argc) // Missing a required argument
+      {
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         return -1;
       }
-      else if (strcmp(argv[i], "-R") == 0) // Read all bits
+      Timing::sleepUntil(Timing::now() + (uint64_t) (atof(argv[++i]) * 1e6));
+   }
+   else
+   {
+      fprintf (stderr, "ERROR: Unknown command %s\n", argv[i]);
+      return -1;
+   }
+   return i;
+}
+
+//
+// Run the commands in argv[first..argc), timing each if asked. Returns the
+// number that failed, which is one at most as a failure skips the rest. On
+// the command line the general options are passed over.
+static int runCommands(MCP23008 &chip, int argc, char *argv[], int first, bool commandLine)
+{
+   for (int i = first ; i < argc ; ++i)
+   {
+      if (commandLine && option(argv[i]) > 0)
       {
-         int j;
+         i += option(argv[i]) - 1;
+         continue;
+      }
+
+//
+// Held back writes go out ahead of any other command, timed on their own
+      bool write = is(argv[i], "-w") || is(argv[i], "-W");
+      if (!write && !flush(chip))
+         return 1;
 
-         chip.readPins(value);
-         printf("Pins = 0x%x ", value);
+      uint64_t start = Timing::now();
+      int last = runCommand(chip, argc, argv, i);
+      uint64_t elapsed = Timing::now() - start;
 
-         for (j = 0x80 ; j != 0 ; j >>= 1)
-            putchar(j&value ? '1' : '0');
-         putchar('\n');
+      if (last < 0)
+         return 1;
+      if (timed && !is(argv[i], "-sleep"))
+      {
+         commandTime.record(elapsed);
+         printf ("%9.3f ms ", elapsed / 1e6);
+         for (int k = i ; k <= last ; ++k)
+            printf (" %s", argv[k]);
+         puts(pending && write ? "  (held)" : "");
       }
-      else if (strcmp(argv[i], "-io") == 0) // Set direction for pin
+      i = last;
+   }
+   return 0;
+}
+
+//
+// Commands from a file or stdin, a line at a time, with a prompt if a person
+// is typing them
+static int runBatch(MCP23008 &chip, const char *path)
+{
+   FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+   char line[LINE_SIZE];
+   char *words[MAX_WORDS];
+   int failed = 0;
+   bool interactive;
+
+   if (in == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to open %s\n", path);
+      return 1;
+   }
+   interactive = isatty(fileno(in));
+
+   while (true)
+   {
+      if (interactive)
       {
-         if (i+2 >= argc) // Missing a required argument
-         {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
-         }
-         pin = atoi(argv[++i]);
-         ++i;
-         if (strcmp(argv[i], "IN") == 0 ||
-             strcmp(argv[i], "INPUT") == 0)
-         {
-            value = MCP23008::INPUT;
-         }
-         else if (strcmp(argv[i], "OUT") == 0 ||
-                  strcmp(argv[i], "OUTPUT") == 0)
-         {
-            value = MCP23008::OUTPUT;
-         }
-         else
-         {
-             fprintf (stderr,"ERROR: Unknown pin direction %s.\n", argv[i]);
-             exit(1);
-         }
-         if (!chip.pinMode(pin, value))
-            exit(1);
+         fputs("> ", stdout);
+         fflush(stdout);
       }
-      else if (strcmp(argv[i], "-pullup") == 0) // Set pullup on an output pin
+      if (fgets(line, sizeof(line), in) == NULL)
+         break;
+
+      char *comment = strchr(line, '#');
+      if (comment != NULL)
+         *comment = '\0';
+      int count = 0;
+      for (char *word = strtok(line, " \t\r\n") ; word != NULL && count < MAX_WORDS ;
+           word = strtok(NULL, " \t\r\n"))
+         words[count++] = word;
+
+      failed += runCommands(chip, count, words, 0, false);
+      if (interactive && !flush(chip)) // Someone is watching the outputs
+         failed++;
+   }
+
+   if (in != stdin)
+      fclose(in);
+   return failed;
+}
+
+int main(int argc, char *argv[])
+{
+   int i;
+   const char *device = "/dev/i2c-1";
+   const char *batch = NULL;
+   char *eptr;
+   uint8_t address = 0;
+   MCP23008 chip;
+
+//
+// First parse through the arguments looking or the general ones
+   for (i = 1 ; i < argc ; ++i)
+   {
+      int words = option(argv[i]);
+
+      if (words > 1 && i+1 >= argc) // Missing a required argument
       {
-         if (i+2 >= argc) // Missing a required argument
-         {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
-         }
-         pin = atoi(argv[++i]);
-         ++i;
-         if (strcmp(argv[i], "ON") == 0 ||
-             strcmp(argv[i], "UP") == 0)
-         {
-            value = MCP23008::PULLUP;
-         }
-         else if (strcmp(argv[i], "OFF") == 0 ||
-                  strcmp(argv[i], "DOWN") == 0)
-         {
-            value = MCP23008::PULLDOWN;
-         }
-         else
-         {
-             fprintf (stderr,"ERROR: Unknown pullup setting %s.\n", argv[i]);
-             exit(1);
-         }
-         if (!chip.pullUp(pin, value))
-            exit(1);
+         fprintf (stderr, "ERROR: Required argument for option %s omitted.\n", argv[i]);
+         exit(1);
       }
-      else if (strcmp(argv[i], "-pins") == 0) // Setup pins
+      if (strcmp(argv[i], "-d") == 0 ||
+          strcmp(argv[i], "-device") == 0)
+         device = argv[i+1];
+      else if (strcmp(argv[i], "-a") == 0 ||
+               strcmp(argv[i], "-address") == 0)
+         address = strtol(argv[i+1], &eptr, 0);
+      else if (strcmp(argv[i], "-b") == 0 ||
+               strcmp(argv[i], "-batch") == 0)
+         batch = argv[i+1];
+      else if (strcmp(argv[i], "-coalesce") == 0)
+         coalesce = true;
+      else if (strcmp(argv[i], "-time") == 0)
+         timed = true;
+      else if (strcmp(argv[i], "-?") == 0 ||
+               strcmp(argv[i], "-help") == 0)
       {
-         int j, b;
-         uint8_t iodir = 0;
-         uint8_t ipol = 0;
-         uint8_t gppu = 0;
-
-         if (i+1 >= argc) // Missing a required argument
-         {
-            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
-            exit(1);
-         }
+         usage();
+         exit(0);
+      }
+      if (words > 1)
          ++i;
+   }
+
+   if (!chip.begin(device, address)) // Open up our connection
+      exit(1);
+
 //
-// parse the descriptive string
-         for (j = 0, b = 0x100 ; argv[i][j] != '\0' && b != 0 ; j++)
-            switch(argv[i][j])
-            {
-            case 'I': // Input line
-               b >>= 1;
-               iodir &= ~b;
-               break;
-
-            case 'O': // Output line
-               b >>= 1;
-               iodir |= b;
-               break;
-
-            case '-': // Invert the input
-               ipol |= b;
-               break;
-
-            case 'p': // Pullup
-               gppu |= b;
-               break;
-
-            default:
-               fprintf (stderr, "ERROR: Unknown pin specifier \'%c\'\n", argv[i][j]);
-               exit(1);
-            }
-
-         if (!chip.setupPins(iodir, gppu, ipol))
-            exit(1);
-      }
-      else if (strcmp(argv[i], "-d") != 0 &&
-               strcmp(argv[i], "-a") != 0)
-      {
-         if (strcmp(argv[i], "-?") != 0 &&
-             strcmp(argv[i], "-help") != 0)
-            fprintf (stderr, "ERROR: Unknown argument %s\n", argv[i]);
-         puts ("Usage: MCP23008-test [options] [commands]");
-         puts ("   Options: -d device_name                    Specify device bus");
-         puts ("            -a address                        Specify device address on bus");
-         puts ("            -help                             Print message");
-         puts ("  Commands: -w pin HIGH|LOW|TRUE|FALSE|1|0    Write single output line");
-         puts ("            -W bits                           Write all eight output lines at once");
-         puts ("            -r pin                            Read single input line");
-         puts ("            -R                                Read all eight input lines at once");
-         puts ("            -io pin INPUT|OUTPUT              Set direction of line");
-         puts ("            -pullup pin UP|DOWN               Set pullup resister on individual input line");
-         puts ("            -pins I|O[p-]...                  Set pin direction (I|O), pullup (p), and polarity(-)");
-      }
-   } // End of second pass through arguments list
+// Now run through the command line treating the remainder of the options like
+// commands to be done in sequence, then any batch
+   int failed = runCommands(chip, argc, argv, 1, true);
+   if (failed == 0 && batch != NULL)
+      failed = runBatch(chip, batch);
+   if (!flush(chip))
+      failed++;
+
+   if (timed && commandTime.count() > 0)
+      commandTime.print(stdout, "per command");
+   if (failed != 0 && batch != NULL)
+      fprintf (stderr, "%d commands failed\n", failed);
 
    chip.end();
+   exit(failed ? 1 : 0);
 }
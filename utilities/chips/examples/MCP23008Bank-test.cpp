@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <MCP23008Bank.h>
+#include <Timing.h>
+
+static MCP23008Bank bank;
+
+static LatencyStats readTime;
+static LatencyStats writeTime;
+
+static void printState()
+{
+   uint64_t bits;
+
+   printf ("present  0x%02x\n", bank.getPresent());
+   printf ("outputs  0x%016llx\n", (unsigned long long) bank.getDirections());
+   printf ("pullups  0x%016llx\n", (unsigned long long) bank.getPullups());
+   printf ("latches  0x%016llx\n", (unsigned long long) bank.getOutputs());
+   if (bank.readPort(bits))
+      printf ("port     0x%016llx\n", (unsigned long long) bits);
+}
+
+int main(int argc, char *argv[])
+{
+   const char *device = "/dev/i2c-1";
+   int present = 0x01;
+   bool setup = false;
+   uint64_t directions = 0;
+   uint64_t pullups = 0;
+   bool write = false;
+   uint64_t bits = 0;
+   int output = -1, input = -1, pullup = -1;
+   int high = -1, low = -1;
+   int sweeps = 0;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "device",   1, 0, 'd' },
+                  { "present",  1, 0, 'p' },
+                  { "setup",    1, 0, 's' },
+                  { "pullups",  1, 0, 'u' },
+                  { "write",    1, 0, 'w' },
+                  { "output",   1, 0, 'o' },
+                  { "input",    1, 0, 'i' },
+                  { "pullup",   1, 0, 'U' },
+                  { "high",     1, 0, 'H' },
+                  { "low",      1, 0, 'L' },
+                  { "sweeps",   1, 0, 'n' },
+                  { "help",     0, 0, '?' },
+                  { NULL,       0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:p:s:u:w:o:i:U:H:L:n:?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': device = optarg; break;
+      case 'p': present = strtol(optarg, NULL, 0); break;
+      case 's': setup = true; directions = strtoull(optarg, NULL, 0); break;
+      case 'u': pullups = strtoull(optarg, NULL, 0); break;
+      case 'w': write = true; bits = strtoull(optarg, NULL, 0); break;
+      case 'o': output = atoi(optarg); break;
+      case 'i': input = atoi(optarg); break;
+      case 'U': pullup = atoi(optarg); break;
+      case 'H': high = atoi(optarg); break;
+      case 'L': low = atoi(optarg); break;
+      case 'n': sweeps = atoi(optarg); break;
+
+      case '?':
+      default:
+         puts("Usage: MCP23008Bank-test [options]");
+         puts("   Options: -d --device device_name");
+         puts("            -p --present mask          Devices in the bank, bit n for 0x20 + n (default 0x01)");
+         puts("            -s --setup mask            Set every pin's direction (1 = output)");
+         puts("            -u --pullups mask          Pullups to set along with --setup (default none)");
+         puts("            -w --write bits            Write the whole port");
+         puts("            -o --output pin            Make one pin an output");
+         puts("            -i --input pin             Make one pin an input");
+         puts("            -U --pullup pin            Turn on one pin's pullup");
+         puts("            -H --high pin              Set one output high");
+         puts("            -L --low pin               Set one output low");
+         puts("            -n --sweeps count          Time port reads, and writes toggling the outputs");
+         puts("            -? --help");
+         puts("   Pins are numbered 0 - 63 across the bank. Changes apply in the order listed,");
+         puts("   then the bank state and port are printed.");
+         exit(1);
+      }
+   }
+
+   if (!bank.begin(device, present))
+      exit(1);
+
+   bool ok = true;
+   if (setup)
+      ok = bank.setupPins(directions, pullups) && ok;
+   if (write)
+      ok = bank.writePort(bits) && ok;
+   if (output >= 0)
+      ok = bank.pinMode(output, MCP23008Bank::OUTPUT) && ok;
+   if (input >= 0)
+      ok = bank.pinMode(input, MCP23008Bank::INPUT) && ok;
+   if (pullup >= 0)
+      ok = bank.pullUp(pullup, MCP23008Bank::HIGH) && ok;
+   if (high >= 0)
+      ok = bank.digitalWrite(high, MCP23008Bank::HIGH) && ok;
+   if (low >= 0)
+      ok = bank.digitalWrite(low, MCP23008Bank::LOW) && ok;
+
+   printState();
+
+//
+// Toggling every output each sweep writes every device that has one, so the
+// write time is the worst case for the bank
+   if (sweeps > 0)
+   {
+      uint64_t outputs = bank.getDirections();
+      uint64_t latches = bank.getOutputs();
+      uint64_t port;
+
+      for (int n = 0 ; n < sweeps && ok ; ++n)
+      {
+         uint64_t start = Timing::now();
+         ok = bank.readPort(port);
+         readTime.record(Timing::now() - start);
+
+         latches ^= outputs;
+         start = Timing::now();
+         ok = bank.writePort(latches) && ok;
+         writeTime.record(Timing::now() - start);
+      }
+      readTime.print(stdout, "port read");
+      writeTime.print(stdout, "port write");
+   }
+
+   bank.end();
+   exit(ok ? 0 : 2);
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
+#include <MCP23008Input.h>
+#include <Timing.h>
+
+static volatile bool stop = false;
+
+static void onSignal(int sig)
+{
+   stop = true;
+}
+
+static const char *eventName(uint8_t type)
+{
+   switch (type)
+   {
+   case MCP23008Input::EVENT_PRESS:      return "pressed";
+   case MCP23008Input::EVENT_RELEASE:    return "released";
+   case MCP23008Input::EVENT_LONG_PRESS: return "long press";
+   }
+   return "?";
+}
+
+int main(int argc, char *argv[])
+{
+   const char *device = "/dev/i2c-1";
+   int address = 0;
+   int bank = 0;
+   int rate = 200;
+   int long_ms = 1000;
+   bool bench = false;
+   MCP23008 chip;
+   MCP23008Bank port;
+   MCP23008Input input;
+   MCP23008Input::Event e;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "device",  1, 0, 'd' },
+                  { "address", 1, 0, 'a' },
+                  { "bank",    1, 0, 'b' },
+                  { "rate",    1, 0, 'r' },
+                  { "long",    1, 0, 'l' },
+                  { "bench",   0, 0, 'B' },
+                  { "help",    0, 0, '?' },
+                  { NULL,      0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:a:b:r:l:B?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': device = optarg; break;
+      case 'a': address = strtol(optarg, NULL, 0); break;
+      case 'b': bank = strtol(optarg, NULL, 0); break;
+      case 'r': rate = atoi(optarg); break;
+      case 'l': long_ms = atoi(optarg); break;
+      case 'B': bench = true; break;
+
+      case '?':
+      default:
+         puts("Usage: MCP23008Input-test [options]");
+         puts("   Options: -d --device device_name");
+         puts("            -a --address i2c_address     Single expander");
+         puts("            -b --bank mask               Bank of expanders (bit n for 0x20 + n)");
+         puts("            -r --rate hz                 Sampling rate (default 200)");
+         puts("            -l --long ms                 Long press time (default 1000)");
+         puts("            -B --bench                   Time the debouncer on 64 bouncing inputs");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   if (rate <= 0)
+   {
+      fputs("ERROR: Rate must be positive.\n", stderr);
+      exit(1);
+   }
+
+   if (bench)
+   {
+//
+// Every pin bounces for a few ticks each time it changes
+      static uint64_t raw[4096];
+      uint64_t level = 0;
+      uint64_t events = 0;
+
+      for (int i = 0 ; i < 4096 ; ++i)
+      {
+         if (i % 64 == 0)
+            level = ~level;
+         raw[i] = i % 64 < 3 ? level ^ ((uint64_t) rand() << 32 | rand()) : level;
+      }
+
+      input.configure(~0ULL, 100);
+      uint64_t start = Timing::now(CLOCK_THREAD_CPUTIME_ID);
+      for (int r = 0 ; r < 1000 ; ++r)
+      {
+         for (int i = 0 ; i < 4096 ; ++i)
+            input.tick(raw[i], i);
+         while (input.nextEvent(e))
+            events++;
+      }
+      uint64_t elapsed = Timing::now(CLOCK_THREAD_CPUTIME_ID) - start;
+      printf ("%.1f ns per tick for 64 inputs, %llu events\n",
+              (double) elapsed / (1000 * 4096), (unsigned long long) events);
+      exit(0);
+   }
+
+   if (bank != 0 ? !port.begin(device, bank) : !chip.begin(device, address))
+      exit(1);
+   signal(SIGINT, onSignal);
+
+//
+// Buttons are wired to ground against the pullups
+   input.configure(~0ULL, (uint32_t) ((uint64_t) long_ms * rate / 1000));
+
+   uint64_t period = Timing::NSEC_PER_SEC / rate;
+   uint64_t deadline = Timing::now();
+   while (!stop)
+   {
+      uint64_t now = Timing::now();
+      if (!(bank != 0 ? input.sample(port, now) : input.sample(chip, now)))
+         break;
+
+      while (input.nextEvent(e))
+         printf ("%.3f: pin %d %s\n", e.time / 1e9, e.pin, eventName(e.type));
+      fflush(stdout);
+
+      deadline += period;
+      Timing::sleepUntil(deadline);
+   }
+
+   if (bank != 0)
+      port.end();
+   else
+      chip.end();
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
+#include <MCP23008.h>
+#include <MCP23008Pwm.h>
+
+//
+// Stand-in for the chip that costs what an OLAT write costs on the wire:
+// start, address, register, data and stop come to 29 bit times, plus a fixed
+// per-write driver overhead.
+class SimExpander
+{
+public:
+   SimExpander(uint32_t bus_speed, uint32_t overhead_nanos)
+   {
+      cost_ = 29ULL * Timing::NSEC_PER_SEC / bus_speed + overhead_nanos;
+      writes_ = 0;
+   }
+
+   bool writePins(uint8_t bits)
+   {
+      uint64_t until = Timing::now() + cost_;
+      while (Timing::now() < until) // Spin; sleeping is far coarser than a write
+         ;
+      writes_++;
+      return true;
+   }
+
+   uint64_t cost_;
+   uint64_t writes_;
+};
+
+static volatile bool stop = false;
+
+static void onSignal(int sig)
+{
+   stop = true;
+}
+
+//
+// Run the engine at a given resolution and frequency with every slice needing
+// a write, and report what it actually managed.
+static void sweepOne(uint32_t bus_speed, uint32_t overhead, int bits)
+{
+   SimExpander sim(bus_speed, overhead);
+   MCP23008Pwm<SimExpander> pwm(sim);
+   double limit = 1e9 / (sim.cost_ * ((1 << bits) - 1)); // Shortest slice == one write
+   uint32_t freq = (uint32_t) (limit * 0.9);
+
+   if (freq == 0 || !pwm.configure(bits, freq))
+   {
+      printf ("%8u %4d %10.1f          -\n", bus_speed, bits, limit);
+      return;
+   }
+   for (int p = 0 ; p < 8 ; ++p) // Alternating bits so every slice changes
+      pwm.setDuty(p, (p & 1 ? 0x5555 : 0xaaaa) & ((1 << bits) - 1));
+
+   uint64_t start = Timing::now();
+   pwm.start();
+   usleep(500000);
+   pwm.stop();
+   double secs = (Timing::now() - start) / 1e9;
+
+   printf ("%8u %4d %10.1f %10.1f %8.2f%%\n", bus_speed, bits, limit, pwm.getPeriods() / secs,
+           pwm.getPeriods() ? 100.0 * pwm.getOverruns() / (pwm.getPeriods() * bits) : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+   const char *device = "/dev/i2c-1";
+   int address = 0;
+   int bits = 6;
+   int freq = 100;
+   int seconds = 0;
+   int overhead = 20000;
+   bool realtime = false;
+   bool simulate = false;
+   bool sweep = false;
+   uint32_t bus_speed = 400000;
+   uint16_t duty[8] = {0};
+   uint8_t mask = 0;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "device",    1, 0, 'd' },
+                  { "address",   1, 0, 'a' },
+                  { "bits",      1, 0, 'b' },
+                  { "frequency", 1, 0, 'f' },
+                  { "duty",      1, 0, 'p' },
+                  { "seconds",   1, 0, 't' },
+                  { "realtime",  0, 0, 'R' },
+                  { "simulate",  0, 0, 'S' },
+                  { "bus-speed", 1, 0, 'B' },
+                  { "overhead",  1, 0, 'o' },
+                  { "sweep",     0, 0, 'w' },
+                  { "help",      0, 0, '?' },
+                  { NULL,        0, 0, 0 } };
+      int c, pin;
+      char *eptr;
+
+      c = getopt_long(argc, argv, "d:a:b:f:p:t:RSB:o:w?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': device = optarg; break;
+      case 'a': address = strtol(optarg, NULL, 0); break;
+      case 'b': bits = atoi(optarg); break;
+      case 'f': freq = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'R': realtime = true; break;
+      case 'S': simulate = true; break;
+      case 'B': bus_speed = atoi(optarg); break;
+      case 'o': overhead = atoi(optarg); break;
+      case 'w': sweep = true; break;
+
+      case 'p': // pin=duty
+         pin = strtol(optarg, &eptr, 0);
+         if (*eptr != '=' || pin < 0 || pin > 7)
+         {
+            fprintf (stderr, "ERROR: Expected pin=duty, got %s.\n", optarg);
+            exit(1);
+         }
+         duty[pin] = strtol(eptr + 1, NULL, 0);
+         mask |= 1 << pin;
+         break;
+
+      case '?':
+      default:
+         puts("Usage: MCP23008Pwm-test [options]");
+         puts("   Options: -d --device device_name");
+         puts("            -a --address i2c_address");
+         puts("            -b --bits resolution          Duty resolution in bits (default 6)");
+         puts("            -f --frequency hz             PWM frequency (default 100)");
+         puts("            -p --duty pin=duty            Duty for a pin, repeat for more pins");
+         puts("            -t --seconds count            Run time (0 until interrupted)");
+         puts("            -R --realtime                 Run the engine at SCHED_FIFO");
+         puts("            -S --simulate                 Use a simulated bus instead of the chip");
+         puts("            -B --bus-speed hz             Simulated bus speed (default 400000)");
+         puts("            -o --overhead ns              Simulated per-write overhead (default 20000)");
+         puts("            -w --sweep                    Tabulate achievable frequency on the simulated bus");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   if (sweep)
+   {
+      static const uint32_t speeds[] = {100000, 400000, 1000000};
+
+      puts ("bus (Hz) bits limit (Hz) achieved (Hz) late slices");
+      for (int s = 0 ; s < 3 ; ++s)
+         for (int b = 4 ; b <= 10 ; b += 2)
+            sweepOne(speeds[s], overhead, b);
+      exit(0);
+   }
+
+   signal(SIGINT, onSignal);
+
+   MCP23008 chip;
+   SimExpander sim(bus_speed, overhead);
+   MCP23008Pwm<MCP23008> pwm(chip);
+   MCP23008Pwm<SimExpander> simPwm(sim);
+
+   if (!simulate)
+   {
+      if (!chip.begin(device, address) || !chip.setupPins(mask))
+         exit(1);
+   }
+
+   if (!(simulate ? simPwm.configure(bits, freq) : pwm.configure(bits, freq)))
+      exit(1);
+   for (int p = 0 ; p < 8 ; ++p)
+   {
+      if (simulate)
+         simPwm.setDuty(p, duty[p]);
+      else
+         pwm.setDuty(p, duty[p]);
+   }
+   if (simulate)
+      simPwm.setMask(mask);
+   else
+      pwm.setMask(mask);
+
+   if (!(simulate ? simPwm.start(realtime) : pwm.start(realtime)))
+      exit(1);
+   for (int t = 0 ; !stop && (seconds == 0 || t < seconds * 10) ; ++t)
+      usleep(100000);
+   if (simulate)
+      simPwm.stop();
+   else
+      pwm.stop();
+
+   uint64_t periods = simulate ? simPwm.getPeriods() : pwm.getPeriods();
+   printf ("Periods %llu, writes %llu, skipped slices %llu, late slices %llu\n",
+           (unsigned long long) periods,
+           (unsigned long long) (simulate ? simPwm.getWrites() : pwm.getWrites()),
+           (unsigned long long) (simulate ? simPwm.getSkipped() : pwm.getSkipped()),
+           (unsigned long long) (simulate ? simPwm.getOverruns() : pwm.getOverruns()));
+
+   if (!simulate)
+   {
+      chip.writePins(0);
+      chip.end();
+   }
+}
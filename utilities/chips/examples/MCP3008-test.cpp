@@ -1,16 +1,235 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <MCP3008.h>
+#include <MCP3008ScanPlan.h>
+#include <MCP3008Clock.h>
+
+//
+// Parse a plan of the form channel[d][:rate],... e.g. "0:4,2d:1"
+static bool parsePlan(const char *spec, MCP3008ScanPlan &plan)
+{
+   while (*spec != '\0')
+   {
+      char *eptr;
+      int channel = strtol(spec, &eptr, 10);
+      int mode = MCP3008::INPUT_MODE_SINGLE;
+      int rate = 1;
+
+      if (eptr == spec)
+         return false;
+      if (*eptr == 'd' || *eptr == 'D')
+      {
+         mode = MCP3008::INPUT_MODE_DIFFERENTIAL;
+         eptr++;
+      }
+      if (*eptr == ':')
+         rate = strtol(eptr + 1, &eptr, 10);
+      if (*eptr == ',')
+         eptr++;
+      else if (*eptr != '\0')
+         return false;
+
+      if (plan.add(channel, mode, rate) < 0)
+         return false;
+      spec = eptr;
+   }
+   return true;
+}
+
+static MCP3008Clock tuner; // Too big for the stack
+static uint16_t block[1 << 16];
+
+static const char *FRAMING_NAMES[] = {"bytes", "word", "short"};
+
+//
+// Parse a channel list of the form 0,2,4-7
+static int parseChannels(const char *spec, uint8_t *channels)
+{
+   int count = 0;
+
+   while (*spec != '\0')
+   {
+      char *eptr;
+      int first = strtol(spec, &eptr, 10);
+      int last = first;
+
+      if (eptr == spec)
+         return -1;
+      if (*eptr == '-')
+         last = strtol(eptr + 1, &eptr, 10);
+      if (*eptr == ',')
+         eptr++;
+      else if (*eptr != '\0')
+         return -1;
+      if (first < 0 || last > 7 || first > last || count + last - first + 1 > 8)
+         return -1;
+      for (int c = first ; c <= last ; ++c)
+         channels[count++] = c;
+      spec = eptr;
+   }
+   return count;
+}
+
+//
+// Read channels CH to 7, each through the accessor for a channel fixed at
+// compile time
+template <uint8_t CH, int MODE>
+static bool printChannels(MCP3008 &adc)
+{
+   int value = adc.getValue<CH, MODE>();
+
+   if (value < 0)
+      return false;
+   printf ("%sChannel %d: %d", CH ? ", " : "", CH, value);
+   if constexpr (CH < 7)
+      return printChannels<CH + 1, MODE>(adc);
+   putchar('\n');
+   return true;
+}
+
+static LatencyStats transferTime;
+static LatencyStats sweepTime;
+
+//
+// Sweep the channels at rate sweeps a second (0 for flat out) for duration
+// seconds, optionally writing every sample to output, then report what the
+// board sustained. Returns false if any conversion failed.
+static bool capture(MCP3008 &adc, int input_mode, const uint8_t *channels, int count,
+                    double rate, double duration, FILE *output)
+{
+   uint64_t period = rate > 0 ? (uint64_t) (Timing::NSEC_PER_SEC / rate) : 0;
+   uint64_t samples = 0;
+   uint64_t failures = 0;
+   uint64_t missed = 0;
+   uint64_t sweeps = 0;
+   TransferStamp stamp;
+
+   uint64_t cpu = Timing::now(CLOCK_PROCESS_CPUTIME_ID);
+   uint64_t start = Timing::now();
+   uint64_t end = start + (uint64_t) (duration * Timing::NSEC_PER_SEC);
+   uint64_t deadline = start;
+   uint64_t origin = Timing::raw(); // Stamps are on the raw clock
+
+   while (Timing::now() < end)
+   {
+      uint64_t began = Timing::now();
+
+      for (int i = 0 ; i < count ; ++i)
+      {
+         Result<int> value = adc.tryGetValue(channels[i], input_mode, stamp);
+
+         if (!value)
+         {
+            if (failures++ == 0)
+               ChipLog::report(value.error());
+            continue;
+         }
+         samples++;
+         transferTime.record(stamp.width());
+         if (output != NULL)
+            fprintf (output, "%llu,%d,%d\n", (unsigned long long) (stamp.mid() - origin), channels[i],
+                     value.value());
+      }
+      sweeps++;
+      sweepTime.record(Timing::now() - began);
+
+      if (period == 0)
+         continue;
+//
+// Skip whole periods already missed rather than bursting to catch up
+      deadline += period;
+      uint64_t now = Timing::now();
+      if (now > deadline)
+      {
+         uint64_t behind = (now - deadline) / period + 1;
+         missed += behind;
+         deadline += behind * period;
+      }
+      Timing::sleepUntil(deadline < end ? deadline : end);
+   }
+
+   double secs = (Timing::now() - start) / 1e9;
+   double cpuSecs = (Timing::now(CLOCK_PROCESS_CPUTIME_ID) - cpu) / 1e9;
+
+   printf ("%llu sweeps of %d channel%s in %.2f s at %u Hz (%s framing)\n", (unsigned long long) sweeps,
+           count, count == 1 ? "" : "s", secs, adc.getSpeed(), FRAMING_NAMES[adc.getFraming()]);
+   printf ("%.0f samples/s", samples / secs);
+   if (period != 0)
+      printf (" of %.0f requested, %llu deadlines missed", rate * count, (unsigned long long) missed);
+   printf (", %llu failed conversions, %.1f%% CPU\n", (unsigned long long) failures, 100.0 * cpuSecs / secs);
+   transferTime.print(stdout, "transfer");
+   sweepTime.print(stdout, "sweep");
+   return failures == 0;
+}
+
+//
+// Every channel read in blocks with each framing, against a plain 3 byte
+// frame read of the same channel. Short frames lose B0, so compare without it.
+static bool validate(MCP3008 &adc, int input_mode)
+{
+   bool ok = true;
+
+   for (int f = MCP3008::FRAME_BYTES ; f <= MCP3008::FRAME_SHORT ; ++f)
+   {
+      uint16_t mask = f == MCP3008::FRAME_SHORT ? 0x3fe : 0x3ff;
+      uint64_t nulls = adc.getNullErrors();
+      int mismatches = 0;
+      int c;
+
+      for (c = 0 ; c < 8 ; ++c)
+      {
+         adc.setFraming(MCP3008::FRAME_BYTES);
+         int expect = adc.getValue(c, input_mode);
+
+         if (!adc.setFraming(f))
+            break;
+         if (adc.getValues(c, input_mode, block, 256) != 256)
+            return false;
+         for (int i = 0 ; i < 256 ; ++i)
+            mismatches += (block[i] & mask) != (expect & mask);
+      }
+      adc.setFraming(MCP3008::FRAME_BYTES);
+
+      if (c < 8)
+      {
+         printf ("%-5s framing: not taken by the controller\n", FRAMING_NAMES[f]);
+         continue;
+      }
+      nulls = adc.getNullErrors() - nulls;
+      printf ("%-5s framing: %d mismatches, %llu null bit errors\n", FRAMING_NAMES[f], mismatches,
+              (unsigned long long) nulls);
+      ok = ok && mismatches == 0 && nulls == 0;
+   }
+   return ok;
+}
 
 int main(int argc, char *argv[])
 {
    MCP3008 adc;
+   MCP3008ScanPlan plan;
+   const char *plan_spec = NULL;
+   int cycles = 1;
    const char *device = "/dev/spidev0.0";
    int channel = 0;
    int speed = 1000000;
    int input_mode = MCP3008::INPUT_MODE_SINGLE;
    int value;
+   bool tune = false;
+   bool check = false;
+   bool all = false;
+   int framing = MCP3008::FRAME_BYTES;
+   int block_count = 0;
+   bool saved = false;
+   char clock_file[256];
+   uint8_t channels[8];
+   int channel_count = 0;
+   double rate = -1;
+   double duration = 0;
+   const char *output_file = NULL;
+
+   snprintf(clock_file, sizeof(clock_file), "%s/.mcp3008-clock", getenv("HOME") ? getenv("HOME") : ".");
 
    while (1)
    {
@@ -20,11 +239,24 @@ int main(int argc, char *argv[])
                   { "speed",     1, 0, 's' },
                   { "differential", 0, 0, 'D' },
                   { "single",    0, 0, 'S' },
+                  { "plan",      1, 0, 'p' },
+                  { "cycles",    1, 0, 'n' },
+                  { "tune",      0, 0, 'T' },
+                  { "saved-speed", 0, 0, 'A' },
+                  { "clock-file", 1, 0, 'F' },
+                  { "framing",   1, 0, 'f' },
+                  { "block",     1, 0, 'B' },
+                  { "validate",  0, 0, 'V' },
+                  { "rate",      1, 0, 'r' },
+                  { "channels",  1, 0, 'C' },
+                  { "duration",  1, 0, 't' },
+                  { "output",    1, 0, 'o' },
+                  { "all-channels", 0, 0, 'a' },
                   { "help",      0, 0, '?' },
                   { NULL,        0, 0, 0 } };
       int c;
      
-      c = getopt_long(argc, argv, "d:c:s:DS?", lopts, NULL);
+      c = getopt_long(argc, argv, "d:c:s:DSp:n:TAF:f:B:Vr:C:t:o:a?", lopts, NULL);
       if (c == -1)
          break;
      
@@ -50,23 +282,193 @@ int main(int argc, char *argv[])
          input_mode = MCP3008::INPUT_MODE_SINGLE;
          break;
 
+      case 'p':
+         plan_spec = optarg;
+         break;
+
+      case 'n':
+         cycles = atoi(optarg);
+         break;
+
+      case 'T':
+         tune = true;
+         break;
+
+      case 'A':
+         saved = true;
+         break;
+
+      case 'F':
+         snprintf(clock_file, sizeof(clock_file), "%s", optarg);
+         break;
+
+      case 'f':
+         for (framing = MCP3008::FRAME_SHORT ; framing > 0 ; --framing)
+            if (strcmp(optarg, FRAMING_NAMES[framing]) == 0)
+               break;
+         break;
+
+      case 'B':
+         block_count = atoi(optarg);
+         break;
+
+      case 'V':
+         check = true;
+         break;
+
+      case 'r':
+         rate = atof(optarg);
+         break;
+
+      case 'C':
+         channel_count = parseChannels(optarg, channels);
+         if (channel_count <= 0)
+         {
+            fprintf (stderr, "ERROR: Bad channel list \"%s\".\n", optarg);
+            exit(1);
+         }
+         break;
+
+      case 't':
+         duration = atof(optarg);
+         break;
+
+      case 'o':
+         output_file = optarg;
+         break;
+
+      case 'a':
+         all = true;
+         break;
+
       case '?':
       default:
          puts("Usage: MCP3008-test [options]");
          puts("   Options: -d --device device_name");
          puts("            -c --channel input_channel");
+         puts("            -a --all-channels           Read all eight channels once");
          puts("            -s --speed speed");
          puts("            -D --differential");
          puts("            -S --single");
+         puts("            -p --plan ch[d][:rate],...  Scan several channels at relative rates");
+         puts("            -n --cycles count           Number of plan replays to print");
+         puts("            -T --tune                   Find the fastest reliable clock, reading the");
+         puts("                                        channel given as a steady reference, and save it");
+         puts("            -A --saved-speed            Open at the saved clock rather than --speed");
+         puts("            -F --clock-file path        Saved clocks (default ~/.mcp3008-clock)");
+         puts("            -f --framing bytes|word|short  Conversion framing (default bytes)");
+         puts("            -B --block count            Time a block of conversions on the channel");
+         puts("            -V --validate               Check every framing against 3 byte frames");
+         puts("            -r --rate sweeps            Capture continuously at sweeps/s, 0 flat out,");
+         puts("                                        and report throughput, latency and CPU use");
+         puts("            -C --channels list          Channels to sweep, e.g. 0,2,4-7 (default --channel)");
+         puts("            -t --duration seconds       Length of the capture (default 10)");
+         puts("            -o --output path            Write each sample as ns,channel,value");
          puts("            -? --help");
          exit(1);
       }
    }
 
-   if (!adc.begin(device, speed))
+   if (saved ? !MCP3008Clock::begin(adc, device, clock_file, speed) : !adc.begin(device, speed))
       exit(1);
 
-   if ((value = adc.getValue(channel, input_mode)) >= 0)
+   if (tune)
+   {
+      tuner.setCheck(channel, 512, 2);
+      uint32_t hz = tuner.tune(adc);
+      tuner.report(stdout);
+      if (hz == 0 || !MCP3008Clock::save(clock_file, device, hz))
+         exit(1);
+      printf ("Saved to %s\n", clock_file);
+   }
+   else if (saved)
+      printf ("Clock %u Hz\n", adc.getSpeed());
+
+   if (framing != MCP3008::FRAME_BYTES && !adc.setFraming(framing))
+      framing = adc.getFraming();
+
+   if (check)
+   {
+      bool ok = validate(adc, input_mode);
+      puts(ok ? "All framings agree" : "Framings disagree");
+      exit(ok ? 0 : 2);
+   }
+
+   if (rate >= 0 || duration > 0 || output_file != NULL || channel_count > 0)
+   {
+      static char buffer[1 << 20]; // So writes to the output rarely stall a sweep
+      FILE *output = NULL;
+
+      if (channel_count == 0)
+         channels[channel_count++] = channel;
+      if (output_file != NULL)
+      {
+         if ((output = fopen(output_file, "w")) == NULL)
+         {
+            fprintf (stderr, "ERROR: Unable to open %s.\n", output_file);
+            exit(1);
+         }
+         setvbuf(output, buffer, _IOFBF, sizeof(buffer));
+      }
+      bool ok = capture(adc, input_mode, channels, channel_count, rate < 0 ? 0 : rate,
+                        duration > 0 ? duration : 10, output);
+      if (output != NULL)
+         fclose(output);
+      adc.end();
+      exit(ok ? 0 : 2);
+   }
+   else if (block_count > 0)
+   {
+      int n = block_count < (int) (sizeof(block) / sizeof(block[0])) ? block_count : sizeof(block) / sizeof(block[0]);
+      uint64_t start = Timing::now();
+
+      if (adc.getValues(channel, input_mode, block, n) != n)
+      {
+         fputs("ERROR: Conversion failed.\n", stderr);
+         exit(1);
+      }
+      double secs = (Timing::now() - start) / 1e9;
+      printf ("%d %s frames (%d clocks) at %u Hz: %.0f samples/s, %llu null bit errors, last %d\n", n,
+              FRAMING_NAMES[framing], MCP3008::frameClocks(framing), adc.getSpeed(), n / secs,
+              (unsigned long long) adc.getNullErrors(), block[n - 1]);
+   }
+   else if (plan_spec != NULL)
+   {
+      static uint16_t values[MCP3008ScanPlan::MAX_SLOTS];
+
+      if (!parsePlan(plan_spec, plan) || !plan.compile(adc.getSpeed()))
+      {
+         fprintf (stderr, "ERROR: Bad scan plan \"%s\".\n", plan_spec);
+         exit(1);
+      }
+
+      printf ("Schedule:");
+      for (int s = 0 ; s < plan.slotsPerCycle() ; ++s)
+         printf (" %d%s", plan.channelOf(plan.entryOf(s)),
+                 plan.modeOf(plan.entryOf(s)) == MCP3008::INPUT_MODE_DIFFERENTIAL ? "d" : "");
+      printf (" (x%d per transfer)\n", plan.slots() / plan.slotsPerCycle());
+
+      for (int n = 0 ; n < cycles ; ++n)
+      {
+         if (plan.acquire(adc, values) < 0)
+         {
+            fputs("ERROR: Conversion failed.\n", stderr);
+            break;
+         }
+         for (int e = 0 ; e < plan.entries() ; ++e)
+            printf ("%sChannel %d: %d", e ? ", " : "", plan.channelOf(e), plan.latest(e));
+         putchar('\n');
+      }
+   }
+   else if (all)
+   {
+      bool ok = input_mode == MCP3008::INPUT_MODE_DIFFERENTIAL ?
+                printChannels<0, MCP3008::INPUT_MODE_DIFFERENTIAL>(adc) :
+                printChannels<0, MCP3008::INPUT_MODE_SINGLE>(adc);
+      if (!ok)
+         fputs("ERROR: Conversion failed.\n", stderr);
+   }
+   else if ((value = adc.getValue(channel, input_mode)) >= 0)
       printf ("Input value: %d\n", value);
 
    adc.end();
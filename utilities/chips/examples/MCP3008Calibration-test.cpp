@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <MCP3008Calibration.h>
+#include <Timing.h>
+
+static MCP3008Calibration cal; // Too big for the stack
+
+static const int BENCH_BLOCK = 4096;
+
+//
+// Table kernel against the same correction done per sample in floating point
+static void bench(uint8_t channel, int rounds)
+{
+   static uint16_t codes[BENCH_BLOCK];
+   static int32_t values[BENCH_BLOCK];
+   static int32_t slow[BENCH_BLOCK];
+   const int32_t *t = cal.table(channel);
+   double gain = (t[1023] - t[0]) / 1023.0;
+   double offset = t[0];
+   uint32_t seed = 12345;
+
+   for (int i = 0 ; i < BENCH_BLOCK ; ++i)
+   {
+      seed = seed * 1103515245 + 12345;
+      codes[i] = (seed >> 16) & 0x3ff;
+   }
+
+   uint64_t start = Timing::now();
+   for (int r = 0 ; r < rounds ; ++r)
+      cal.apply(channel, codes, values, BENCH_BLOCK);
+   uint64_t table = Timing::now() - start;
+
+   start = Timing::now();
+   for (int r = 0 ; r < rounds ; ++r)
+      for (int i = 0 ; i < BENCH_BLOCK ; ++i)
+         slow[i] = (int32_t) lround(codes[i] * gain + offset);
+   uint64_t per = Timing::now() - start;
+
+   double samples = (double) rounds * BENCH_BLOCK;
+   printf ("table kernel:      %7.2f Msamples/s\n", samples / table * 1000.0);
+   printf ("per-sample float:  %7.2f Msamples/s (end-point line only)\n", samples / per * 1000.0);
+   if (values[0] == 0 && slow[0] == 0)
+      putchar('\n'); // Keep both results live
+}
+
+int main(int argc, char *argv[])
+{
+   MCP3008 adc;
+   const char *device = "/dev/spidev0.0";
+   const char *file = "mcp3008.cal";
+   int speed = 1000000;
+   int input_mode = MCP3008::INPUT_MODE_SINGLE;
+   int samples = 1024;
+   int channel = -1;
+   int count = 16;
+   int rounds = 0;
+   bool list = false;
+   bool changed = false;
+   bool opened = false;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "device",       1, 0, 'd' },
+                  { "speed",        1, 0, 's' },
+                  { "differential", 0, 0, 'D' },
+                  { "file",         1, 0, 'f' },
+                  { "samples",      1, 0, 'n' },
+                  { "reference",    1, 0, 'r' },
+                  { "linear",       1, 0, 'L' },
+                  { "clear",        1, 0, 'x' },
+                  { "channel",      1, 0, 'c' },
+                  { "count",        1, 0, 'N' },
+                  { "list",         0, 0, 'l' },
+                  { "bench",        1, 0, 'B' },
+                  { "help",         0, 0, '?' },
+                  { NULL,           0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:s:Df:n:r:L:x:c:N:lB:?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': device = optarg; break;
+      case 's': speed = atoi(optarg); break;
+      case 'D': input_mode = MCP3008::INPUT_MODE_DIFFERENTIAL; break;
+      case 'f':
+         file = optarg;
+         if (access(file, F_OK) == 0 && !cal.load(file))
+            exit(1);
+         break;
+      case 'n': samples = atoi(optarg); break;
+      case 'c': channel = atoi(optarg); break;
+      case 'N': count = atoi(optarg); break;
+      case 'l': list = true; break;
+      case 'B': rounds = atoi(optarg); break;
+      case 'x':
+         cal.clear(atoi(optarg));
+         changed = true;
+         break;
+
+      case 'r':
+      {
+         int ch, value;
+         if (sscanf(optarg, "%d=%d", &ch, &value) != 2 || ch < 0 || ch > 7)
+         {
+            fputs("ERROR: Reference is channel=value.\n", stderr);
+            exit(1);
+         }
+         if (!opened && !adc.begin(device, speed))
+            exit(1);
+         opened = true;
+
+         MCP3008Calibration::Point point;
+         point.code = MCP3008Calibration::measure(adc, ch, input_mode, samples);
+         point.value = value;
+         if (point.code < 0 || !cal.addPoint(ch, point))
+            exit(1);
+         printf ("Channel %d: code %.2f = %d\n", ch, point.code, value);
+         changed = true;
+         break;
+      }
+
+      case 'L':
+      {
+         int ch, gain, offset = 0;
+         if (sscanf(optarg, "%d=%d,%d", &ch, &gain, &offset) < 2 || !cal.setLinear(ch, gain, offset))
+         {
+            fputs("ERROR: Linear calibration is channel=gain[,offset], gain in 1/65536ths.\n", stderr);
+            exit(1);
+         }
+         changed = true;
+         break;
+      }
+
+      case '?':
+      default:
+         puts("Usage: MCP3008Calibration-test [options]");
+         puts("   Options: -d --device device_name");
+         puts("            -s --speed speed");
+         puts("            -D --differential");
+         puts("            -f --file path             Calibration file to load if it exists and save changes to");
+         puts("                                       (default mcp3008.cal, not loaded unless given)");
+         puts("            -n --samples count         Conversions averaged per reference point (default 1024)");
+         puts("            -r --reference ch=value    Measure a channel held at a known input and add the point");
+         puts("            -L --linear ch=gain[,off]  Fixed-point coefficients, value = code*gain/65536 + off");
+         puts("            -x --clear channel         Drop a channel's calibration");
+         puts("            -c --channel channel       Print raw and corrected readings from a channel");
+         puts("            -N --count readings        Readings to print (default 16)");
+         puts("            -l --list                  Print the calibrated channels");
+         puts("            -B --bench rounds          Time the table kernel on 4096-sample blocks");
+         puts("            -? --help");
+         puts("   Options are acted on in order, so -f comes before changes to the file.");
+         exit(1);
+      }
+   }
+
+   if (changed && !cal.save(file))
+      exit(1);
+   if (list)
+      cal.report(stdout);
+
+   if (channel >= 0)
+   {
+      uint16_t code[MCP3008::BLOCK_TRANSFERS];
+      int32_t value[MCP3008::BLOCK_TRANSFERS];
+
+      if (channel > 7)
+      {
+         fputs("ERROR: Invalid channel.\n", stderr);
+         exit(1);
+      }
+      if (!opened && !adc.begin(device, speed))
+         exit(1);
+      opened = true;
+      if (count > MCP3008::BLOCK_TRANSFERS)
+         count = MCP3008::BLOCK_TRANSFERS;
+      if (adc.getValues(channel, input_mode, code, count) != count)
+         exit(1);
+      cal.apply(channel, code, value, count);
+      for (int i = 0 ; i < count ; ++i)
+         printf ("%4d -> %d\n", code[i], value[i]);
+   }
+
+   if (rounds > 0)
+      bench(channel >= 0 ? channel : 0, rounds);
+
+   if (opened)
+      adc.end();
+   exit(0);
+}
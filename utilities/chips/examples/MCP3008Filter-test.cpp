@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <MCP3008.h>
+#include <MCP3008Filter.h>
+#include <Timing.h>
+
+static const int BLOCK = 4096;
+
+int main(int argc, char *argv[])
+{
+   MCP3008 adc;
+   MCP3008Filter filter;
+   const char *device = "/dev/spidev0.0";
+   int channel = 0;
+   int speed = 1000000;
+   int input_mode = MCP3008::INPUT_MODE_SINGLE;
+   int extra_bits = 2;
+   int type = MCP3008Filter::FILTER_AVERAGE;
+   int cic_order = 3;
+   int median = 0;
+   int count = 16;
+   bool bench = false;
+   static uint16_t raw[BLOCK];
+   static uint16_t filtered[BLOCK];
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "device",       1, 0, 'd' },
+                  { "channel",      1, 0, 'c' },
+                  { "speed",        1, 0, 's' },
+                  { "differential", 0, 0, 'D' },
+                  { "bits",         1, 0, 'b' },
+                  { "cic",          1, 0, 'C' },
+                  { "median",       1, 0, 'm' },
+                  { "count",        1, 0, 'n' },
+                  { "bench",        0, 0, 'B' },
+                  { "help",         0, 0, '?' },
+                  { NULL,           0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:c:s:Db:C:m:n:B?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': device = optarg; break;
+      case 'c': channel = atoi(optarg); break;
+      case 's': speed = atoi(optarg); break;
+      case 'D': input_mode = MCP3008::INPUT_MODE_DIFFERENTIAL; break;
+      case 'b': extra_bits = atoi(optarg); break;
+      case 'C': type = MCP3008Filter::FILTER_CIC; cic_order = atoi(optarg); break;
+      case 'm': median = atoi(optarg); break;
+      case 'n': count = atoi(optarg); break;
+      case 'B': bench = true; break;
+
+      case '?':
+      default:
+         puts("Usage: MCP3008Filter-test [options]");
+         puts("   Options: -d --device device_name");
+         puts("            -c --channel input_channel");
+         puts("            -s --speed speed");
+         puts("            -D --differential");
+         puts("            -b --bits extra_bits       Resolution gained by oversampling");
+         puts("            -C --cic order             Use a CIC decimator of the given order");
+         puts("            -m --median length         Median spike rejection (3, 5 or 7)");
+         puts("            -n --count outputs         Number of filtered values to print");
+         puts("            -B --bench                 Measure filter throughput on synthetic data");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   if (!filter.configure(extra_bits, type, median, cic_order))
+      exit(1);
+
+   if (bench)
+   {
+//
+// Noisy mid scale signal with the odd spike
+      for (int i = 0 ; i < BLOCK ; ++i)
+         raw[i] = (uint16_t) (i % 97 == 0 ? 1023 : 500 + rand() % 8);
+
+      uint64_t samples = 0;
+      uint64_t start = Timing::now(CLOCK_THREAD_CPUTIME_ID);
+      uint64_t elapsed;
+      uint32_t check = 0;
+
+      do
+      {
+         for (int r = 0 ; r < 64 ; ++r)
+         {
+            int n = filter.process(raw, BLOCK, filtered);
+            check += n ? filtered[n-1] : 0;
+            samples += BLOCK;
+         }
+         elapsed = Timing::now(CLOCK_THREAD_CPUTIME_ID) - start;
+      } while (elapsed < Timing::NSEC_PER_SEC);
+
+      printf ("%d-bit output, ratio %d, %s%s: %.1f Msamples/sec per core (check %u)\n",
+              filter.outputBits(), filter.ratio(),
+              type == MCP3008Filter::FILTER_CIC ? "CIC" : "average",
+              median ? " + median" : "",
+              samples * 1e3 / elapsed, check);
+      exit(0);
+   }
+
+   if (!adc.begin(device, speed))
+      exit(1);
+
+   for (int printed = 0 ; printed < count ; )
+   {
+      int n = adc.getValues(channel, input_mode, raw, filter.ratio() < BLOCK ? filter.ratio() : BLOCK);
+      if (n < 0)
+      {
+         fputs("ERROR: Conversion failed.\n", stderr);
+         break;
+      }
+      n = filter.process(raw, n, filtered);
+      for (int i = 0 ; i < n && printed < count ; ++i, ++printed)
+         printf ("Input value: %u (%d bits)\n", filtered[i], filter.outputBits());
+   }
+
+   adc.end();
+}
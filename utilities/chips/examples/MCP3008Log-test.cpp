@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <MCP3008.h>
+#include <MCP3008Log.h>
+
+static volatile bool stop = false;
+
+static void onSignal(int sig)
+{
+   stop = true;
+}
+
+static void printRecord(const MCP3008LogReader::Record &rec, const uint16_t *values)
+{
+   for (int i = 0 ; i < rec.count ; ++i)
+      printf ("%llu,%d,%u\n", (unsigned long long) MCP3008LogReader::timeOf(rec, i),
+              rec.channel, values[i]);
+}
+
+//
+// Fill a 12K ring so the next record leaves only 8 bytes before the wrap,
+// forcing the shortest pad, then check a reader walks across it and gets
+// back every record still in the ring, in order and intact.
+static bool wrapTest(const char *file)
+{
+   static const uint64_t RING = 12288;
+   MCP3008Log log;
+   MCP3008LogReader reader;
+   MCP3008LogReader::Record rec;
+   static uint16_t values[MCP3008Log::MAX_BLOCK];
+   uint16_t block[2];
+   uint64_t n = 0;
+   int r;
+
+   unlink(file);
+   if (!log.begin(file, RING))
+      return false;
+   for ( ; n < 250 ; ++n) // 48 byte records
+   {
+      block[0] = n;
+      log.append(0, block, 1, n, n);
+   }
+   for ( ; n < 255 ; ++n) // 56 byte records
+   {
+      block[0] = n;
+      block[1] = n + 1;
+      log.append(1, block, 2, n, n);
+   }
+   uint64_t head = log.getHead();
+   block[0] = n;
+   block[1] = n + 1;
+   log.append(2, block, 2, n, n);
+   n++;
+   log.end();
+   printf ("Ring of %llu bytes, %llu left before the wrap\n", (unsigned long long) RING,
+           (unsigned long long) (RING - head % RING));
+
+//
+// Leave a hole the size of the log just below an inaccessible page, which is
+// where the kernel will usually put the reader's mapping, so reading past the
+// end of the ring faults rather than passing unnoticed
+   size_t size = MCP3008Log::HEADER_SIZE + RING;
+   uint8_t *guard = (uint8_t *) mmap(NULL, size + 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (guard != MAP_FAILED)
+      munmap(guard, size);
+
+   if (!reader.begin(file))
+      return false;
+   uint64_t expect = 0;
+   int count = 0;
+   bool ok = true;
+   while ((r = reader.next(rec, values)) > 0)
+   {
+      if (count++ == 0)
+         expect = rec.seq;
+      if (rec.seq != expect || values[0] != (uint16_t) expect ||
+          (rec.count == 2 && values[1] != (uint16_t) (expect + 1)))
+         ok = false;
+      expect++;
+   }
+   reader.end();
+   if (guard != MAP_FAILED)
+      munmap(guard + size, 4096);
+   printf ("Read %d records, %llu to %llu%s\n", count, (unsigned long long) (expect - count),
+           (unsigned long long) (expect - 1), r < 0 ? ", then a corrupt record" : "");
+   return ok && r == 0 && expect == n && head % RING == RING - 8;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *file = NULL;
+   const char *device = "/dev/spidev0.0";
+   int channel = 0;
+   int speed = 1000000;
+   int input_mode = MCP3008::INPUT_MODE_SINGLE;
+   long long ring_size = 64LL << 20;
+   int block = 1024;
+   long long blocks = 0;
+   enum { NONE, CAPTURE, GENERATE, EXPORT, TAIL, INFO, WRAP } action = NONE;
+   static uint16_t values[MCP3008Log::MAX_BLOCK];
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "file",         1, 0, 'f' },
+                  { "device",       1, 0, 'd' },
+                  { "channel",      1, 0, 'c' },
+                  { "speed",        1, 0, 's' },
+                  { "differential", 0, 0, 'D' },
+                  { "ring-size",    1, 0, 'z' },
+                  { "block",        1, 0, 'b' },
+                  { "blocks",       1, 0, 'n' },
+                  { "capture",      0, 0, 'C' },
+                  { "generate",     0, 0, 'G' },
+                  { "export",       0, 0, 'E' },
+                  { "tail",         0, 0, 'T' },
+                  { "info",         0, 0, 'I' },
+                  { "wrap-test",    0, 0, 'W' },
+                  { "help",         0, 0, '?' },
+                  { NULL,           0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "f:d:c:s:Dz:b:n:CGETIW?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'f': file = optarg; break;
+      case 'd': device = optarg; break;
+      case 'c': channel = atoi(optarg); break;
+      case 's': speed = atoi(optarg); break;
+      case 'D': input_mode = MCP3008::INPUT_MODE_DIFFERENTIAL; break;
+      case 'z': ring_size = strtoll(optarg, NULL, 0); break;
+      case 'b': block = atoi(optarg); break;
+      case 'n': blocks = strtoll(optarg, NULL, 0); break;
+      case 'C': action = CAPTURE; break;
+      case 'G': action = GENERATE; break;
+      case 'E': action = EXPORT; break;
+      case 'T': action = TAIL; break;
+      case 'I': action = INFO; break;
+      case 'W': action = WRAP; break;
+
+      case '?':
+      default:
+         action = NONE;
+         file = NULL;
+         break;
+      }
+   }
+
+   if (file == NULL || action == NONE || block < 1 || block > MCP3008Log::MAX_BLOCK)
+   {
+      puts("Usage: MCP3008Log-test -f file action [options]");
+      puts("   Actions: -C --capture              Log conversions from the chip");
+      puts("            -G --generate             Log a synthetic signal");
+      puts("            -E --export               Print the log as time_ns,channel,value");
+      puts("            -T --tail                 Follow the log as it is written");
+      puts("            -I --info                 Print the log header");
+      puts("            -W --wrap-test            Check reading across the shortest pad (overwrites file)");
+      puts("   Options: -d --device device_name");
+      puts("            -c --channel input_channel");
+      puts("            -s --speed speed");
+      puts("            -D --differential");
+      puts("            -z --ring-size bytes      Size of the ring (default 64M)");
+      puts("            -b --block conversions    Conversions per record (default 1024)");
+      puts("            -n --blocks count         Records to write (0 until interrupted)");
+      puts("            -? --help");
+      exit(1);
+   }
+   signal(SIGINT, onSignal);
+
+   if (action == WRAP)
+   {
+      bool ok = wrapTest(file);
+      puts(ok ? "Wrap test passed" : "Wrap test FAILED");
+      exit(ok ? 0 : 1);
+   }
+   else if (action == CAPTURE || action == GENERATE)
+   {
+      MCP3008 adc;
+      MCP3008Log log;
+      uint64_t samples = 0;
+
+      if (!log.begin(file, ring_size))
+         exit(1);
+      if (action == CAPTURE && !adc.begin(device, speed))
+         exit(1);
+
+      uint64_t start = Timing::now();
+      for (long long n = 0 ; (blocks == 0 || n < blocks) && !stop ; ++n)
+      {
+         uint64_t first = Timing::now();
+         int count = block;
+
+         if (action == CAPTURE)
+            count = adc.getValues(channel, input_mode, values, block);
+         else
+            for (int i = 0 ; i < block ; ++i)
+               values[i] = (uint16_t) (512 + ((samples + i) % 200) - 100 + rand() % 4);
+         if (count < 0)
+         {
+            fputs("ERROR: Conversion failed.\n", stderr);
+            break;
+         }
+         log.append(channel, values, count, first, Timing::now());
+         samples += count;
+      }
+
+      double secs = (Timing::now() - start) / 1e9;
+      printf ("Logged %llu conversions in %llu records, %.0f conversions/sec\n",
+              (unsigned long long) samples, (unsigned long long) log.getRecords(),
+              secs > 0 ? samples / secs : 0.0);
+      adc.end();
+      log.end();
+   }
+   else
+   {
+      MCP3008LogReader reader;
+      MCP3008LogReader::Record rec;
+      MCP3008LogReader::Slot slot;
+      int r;
+
+      if (!reader.begin(file))
+         exit(1);
+
+      if (action == INFO)
+      {
+         if (!reader.getSlot(slot))
+         {
+            fputs("ERROR: Log header is corrupt.\n", stderr);
+            exit(1);
+         }
+         printf ("Records written %llu, head %llu, tail %llu, %llu bytes live\n",
+                 (unsigned long long) slot.records, (unsigned long long) slot.head,
+                 (unsigned long long) slot.tail, (unsigned long long) (slot.head - slot.tail));
+         exit(0);
+      }
+
+      if (action == TAIL)
+         reader.seekEnd();
+
+      while (!stop)
+      {
+         while ((r = reader.next(rec, values)) > 0)
+            printRecord(rec, values);
+         if (r < 0)
+         {
+            fputs("ERROR: Log is corrupt.\n", stderr);
+            exit(1);
+         }
+         if (action == EXPORT)
+            break;
+         fflush(stdout);
+         usleep(10000);
+      }
+      if (reader.getLost() != 0)
+         fprintf (stderr, "Lost %llu bytes of log to the writer\n",
+                  (unsigned long long) reader.getLost());
+   }
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <MCP4725.h>
+#include <MCP4725Array.h>
+#include <Timing.h>
+
+static LatencyStats arraySkew;
+static LatencyStats singleSkew;
+
+//
+// Next set of outputs: a ramp per DAC, phase shifted by DAC number, with only
+// the DACs in the changing mask stepping
+static void nextValues(uint16_t *values, int step, uint8_t changing)
+{
+   for (int d = 0 ; d < MCP4725Array::DEVICES ; ++d)
+      if (changing & (1 << d))
+         values[d] = (step * 37 + d * 512) & MCP4725Array::MAX_VALUE;
+}
+
+//
+// The same updates through one MCP4725 per address, for comparison. The skew
+// is from the first write starting to the last one finishing.
+static bool singles(const char *device, uint8_t present, uint8_t changing, int updates)
+{
+   MCP4725 dac[MCP4725Array::DEVICES];
+   uint16_t values[MCP4725Array::DEVICES];
+
+   for (int d = 0 ; d < MCP4725Array::DEVICES ; ++d)
+   {
+      values[d] = 0;
+      if ((present & (1 << d)) && !dac[d].begin(device, d))
+         return false;
+   }
+
+   singleSkew.reset();
+   for (int u = 0 ; u < updates ; ++u)
+   {
+      nextValues(values, u, changing);
+      uint64_t start = Timing::now();
+      for (int d = 0 ; d < MCP4725Array::DEVICES ; ++d)
+         if (changing & present & (1 << d))
+            dac[d].setValue(values[d]);
+      singleSkew.record(Timing::now() - start);
+   }
+   for (int d = 0 ; d < MCP4725Array::DEVICES ; ++d)
+      dac[d].end();
+   return true;
+}
+
+int main(int argc, char *argv[])
+{
+   MCP4725Array dacs;
+   const char *device = "/dev/i2c-1";
+   uint16_t values[MCP4725Array::DEVICES];
+   uint8_t set = 0;
+   int present = 0xff;
+   int changing = 0xff;
+   int powerdown_mode = 0;
+   int updates = 0;
+   bool compare = false;
+
+   memset(values, 0, sizeof(values));
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "device",    1, 0, 'd' },
+                  { "present",   1, 0, 'p' },
+                  { "values",    1, 0, 'v' },
+                  { "powerdown", 1, 0, 'P' },
+                  { "updates",   1, 0, 'n' },
+                  { "changing",  1, 0, 'c' },
+                  { "compare",   0, 0, 'C' },
+                  { "help",      0, 0, '?' },
+                  { NULL,        0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:p:v:P:n:c:C?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': device = optarg; break;
+      case 'p': present = strtol(optarg, NULL, 0); break;
+      case 'P': powerdown_mode = atoi(optarg); break;
+      case 'n': updates = atoi(optarg); break;
+      case 'c': changing = strtol(optarg, NULL, 0); break;
+      case 'C': compare = true; break;
+
+      case 'v':
+      {
+         char *p = optarg;
+         for (int d = 0 ; d < MCP4725Array::DEVICES && *p != '\0' ; ++d)
+         {
+            char *end;
+            long v = strtol(p, &end, 0);
+            if (end != p)
+            {
+               values[d] = v;
+               set |= 1 << d;
+            }
+            p = *end == ',' ? end + 1 : end;
+         }
+         break;
+      }
+
+      case '?':
+      default:
+         puts("Usage: MCP4725Array-test [options]");
+         puts("   Options: -d --device device_name");
+         puts("            -p --present mask          DACs fitted, bit n for 0x60 + n (default 0xff)");
+         puts("            -v --values v0,v1,...      Set DAC n to vn in one transfer; empty fields are left");
+         puts("            -P --powerdown mode        Power down every DAC (1 = 1k, 2 = 100k, 3 = 500k)");
+         puts("            -n --updates count         Run a ramp through count updates and time them");
+         puts("            -c --changing mask         DACs that change on each ramp update (default 0xff)");
+         puts("            -C --compare               Then run the ramp with one MCP4725 per address");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   if (!dacs.begin(device, present))
+      exit(1);
+
+   for (int d = 0 ; d < MCP4725Array::DEVICES ; ++d)
+      if (present & (1 << d))
+         printf ("DAC %d (0x%02x): %u\n", d, 0x60 + d, dacs.getValue(d));
+
+   if (set != 0 && !dacs.setValues(values, set))
+      exit(1);
+   if (powerdown_mode != 0 && !dacs.powerDown(present, powerdown_mode))
+      exit(1);
+
+   if (updates > 0)
+   {
+      for (int d = 0 ; d < MCP4725Array::DEVICES ; ++d)
+         values[d] = dacs.getValue(d);
+      for (int u = 0 ; u < updates ; ++u)
+      {
+         nextValues(values, u, changing);
+         uint64_t start = Timing::now();
+         if (!dacs.setValues(values))
+            exit(1);
+         arraySkew.record(Timing::now() - start);
+      }
+      printf ("%llu fast writes, %llu skipped as unchanged\n", (unsigned long long) dacs.getWrites(),
+              (unsigned long long) dacs.getSkipped());
+      arraySkew.print(stdout, "one transfer per update, skew");
+   }
+   dacs.end();
+
+   if (compare && updates > 0)
+   {
+      if (!singles(device, present, changing, updates))
+         exit(1);
+      singleSkew.print(stdout, "one write() per DAC, skew");
+   }
+   exit(0);
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <SampleGroup.h>
+
+static SampleGroup group; // Too big for the stack
+static LatencyStats looseSkew;
+
+static MCP3008 adc;
+static TSL2561 light;
+
+//
+// The same readings one driver call at a time, each channel its own transfer,
+// for comparison
+static void loose(const int *channels, int count, bool withLight, int groups)
+{
+   TransferStamp stamp;
+   int ir_vis, ir;
+
+   looseSkew.reset();
+   for (int g = 0 ; g < groups ; ++g)
+   {
+      uint64_t first = UINT64_MAX, last = 0;
+
+      for (int c = 0 ; c < count ; ++c)
+      {
+         adc.getValue(channels[c], MCP3008::INPUT_MODE_SINGLE, stamp);
+         if (stamp.mid() < first) first = stamp.mid();
+         if (stamp.mid() > last) last = stamp.mid();
+      }
+      if (withLight)
+      {
+         light.getReading(ir_vis, ir, stamp);
+         if (stamp.mid() < first) first = stamp.mid();
+         if (stamp.mid() > last) last = stamp.mid();
+      }
+      looseSkew.record(last - first);
+   }
+   looseSkew.print(stdout, "one call per reading, skew");
+}
+
+int main(int argc, char *argv[])
+{
+   const char *spi = "/dev/spidev0.0";
+   const char *i2c = "/dev/i2c-1";
+   uint8_t addr = TSL2561::ADDR_29;
+   uint32_t speed = 1000000;
+   int mask = 0x0f;
+   int groups = 1000;
+   double rate = 100;
+   bool withLight = true;
+   bool print = false;
+   bool compare = false;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "spi",      1, 0, 's' },
+                  { "speed",    1, 0, 'S' },
+                  { "channels", 1, 0, 'c' },
+                  { "i2c",      1, 0, 'i' },
+                  { "address",  1, 0, 'a' },
+                  { "no-light", 0, 0, 'L' },
+                  { "groups",   1, 0, 'n' },
+                  { "rate",     1, 0, 'r' },
+                  { "print",    0, 0, 'p' },
+                  { "compare",  0, 0, 'C' },
+                  { "help",     0, 0, '?' },
+                  { NULL,       0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "s:S:c:i:a:Ln:r:pC?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 's': spi = optarg; break;
+      case 'S': speed = strtoul(optarg, NULL, 0); break;
+      case 'c': mask = strtol(optarg, NULL, 0); break;
+      case 'i': i2c = optarg; break;
+      case 'a': addr = strtol(optarg, NULL, 0); break;
+      case 'L': withLight = false; break;
+      case 'n': groups = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'p': print = true; break;
+      case 'C': compare = true; break;
+
+      case '?':
+      default:
+         puts("Usage: SampleGroup-test [options]");
+         puts("   Options: -s --spi device           MCP3008 device (default /dev/spidev0.0)");
+         puts("            -S --speed hz             SPI clock (default 1000000)");
+         puts("            -c --channels mask        MCP3008 channels in the group (default 0x0f)");
+         puts("            -i --i2c device           TSL2561 device (default /dev/i2c-1)");
+         puts("            -a --address addr         TSL2561 address (default 0x29)");
+         puts("            -L --no-light             Leave the TSL2561 out");
+         puts("            -n --groups count         Groups to sample (default 1000)");
+         puts("            -r --rate groups          Groups per second, 0 flat out (default 100)");
+         puts("            -p --print                Print every group, times in seconds on the raw clock");
+         puts("            -C --compare              Then read the same way with a driver call each");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   int channels[8];
+   int count = 0;
+   for (int c = 0 ; c < 8 ; ++c)
+      if (mask & (1 << c))
+         channels[count++] = c;
+   if (count == 0 && !withLight)
+   {
+      fputs("ERROR: Nothing to sample.\n", stderr);
+      exit(1);
+   }
+
+   if ((count > 0 && !adc.begin(spi, speed)) || (withLight && !light.begin(i2c, addr)))
+      exit(1);
+   for (int c = 0 ; c < count ; ++c)
+      group.add(adc, channels[c]);
+   if (withLight)
+      group.add(light);
+
+   uint64_t period = rate > 0 ? (uint64_t) (Timing::NSEC_PER_SEC / rate) : 0;
+   uint64_t due = Timing::now();
+   int failed = 0;
+
+   for (int g = 0 ; g < groups ; ++g)
+   {
+      if (period != 0)
+         Timing::sleepUntil(due);
+      due += period;
+      if (!group.sample())
+         failed++;
+      if (print)
+      {
+         printf ("%.9f", group.time() / 1e9);
+         for (int m = 0 ; m < group.members() ; ++m)
+         {
+            const SampleGroup::Sample &s = group.get(m);
+            printf (" %d", s.value);
+            if (withLight && m == group.members() - 1)
+               printf (" %d", s.infrared);
+            printf (" @%+.1fus", ((int64_t) (s.stamp.mid() - group.time())) / 1000.0);
+         }
+         putchar('\n');
+      }
+   }
+   group.report(stdout);
+   if (failed != 0)
+      printf ("%d groups had a failed read\n", failed);
+
+   if (compare)
+      loose(channels, count, withLight, groups);
+
+   adc.end();
+   light.end();
+   exit(failed ? 2 : 0);
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <SensorDaemon.h>
+
+static volatile bool stop = false;
+
+static void onSignal(int sig)
+{
+   stop = true;
+}
+
+static SensorDaemon daemon_; // Too big for the stack
+
+//
+// kind:device:address@rate[:name], e.g. adc:/dev/spidev0.0:0x0f@1000
+static bool addSource(const char *spec)
+{
+   char buffer[128];
+   char *device, *address, *rate, *name;
+   uint8_t kind;
+
+   snprintf(buffer, sizeof(buffer), "%s", spec);
+   if ((device = strchr(buffer, ':')) == NULL || (address = strchr(device + 1, ':')) == NULL ||
+       (rate = strchr(address + 1, '@')) == NULL)
+   {
+      fprintf (stderr, "ERROR: Source %s is not kind:device:address@rate.\n", spec);
+      return false;
+   }
+   *device++ = '\0';
+   *address++ = '\0';
+   *rate++ = '\0';
+   if ((name = strchr(rate, ':')) != NULL)
+      *name++ = '\0';
+
+   if (strcmp(buffer, "adc") == 0)
+      kind = SensorDaemon::KIND_ADC;
+   else if (strcmp(buffer, "light") == 0)
+      kind = SensorDaemon::KIND_LIGHT;
+   else if (strcmp(buffer, "gpio") == 0)
+      kind = SensorDaemon::KIND_GPIO;
+   else
+   {
+      fprintf (stderr, "ERROR: Unknown source kind %s.\n", buffer);
+      return false;
+   }
+   return daemon_.addSource(kind, device, strtol(address, NULL, 0), atof(rate), name) >= 0;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *ring = "/chips";
+   int slots = 1024;
+   int seconds = 0;
+   bool realtime = false;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "source",   1, 0, 's' },
+                  { "ring",     1, 0, 'r' },
+                  { "slots",    1, 0, 'z' },
+                  { "time",     1, 0, 't' },
+                  { "realtime", 0, 0, 'R' },
+                  { "help",     0, 0, '?' },
+                  { NULL,       0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "s:r:z:t:R?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 's':
+         if (!addSource(optarg))
+            exit(1);
+         break;
+      case 'r': ring = optarg; break;
+      case 'z': slots = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'R': realtime = true; break;
+
+      case '?':
+      default:
+         puts("Usage: SensorDaemon-test [options]");
+         puts("   Options: -s --source kind:device:address@rate[:name]");
+         puts("                                      Sample a chip: adc (address is the channel mask),");
+         puts("                                      light or gpio (address is the I2C address)");
+         puts("            -r --ring name            Shared memory name (default /chips)");
+         puts("            -z --slots count          Readings kept per source, a power of two (default 1024)");
+         puts("            -t --time seconds         Run time (0 until interrupted)");
+         puts("            -R --realtime             Sample at SCHED_FIFO priority");
+         puts("            -? --help");
+         puts("   With no sources: adc:/dev/spidev0.0:0xff@1000 light:/dev/i2c-1:0x29@10");
+         puts("                    gpio:/dev/i2c-1:0x20@100");
+         exit(1);
+      }
+   }
+
+   if (daemon_.sources() == 0 && (!addSource("adc:/dev/spidev0.0:0xff@1000") ||
+                                  !addSource("light:/dev/i2c-1:0x29@10") ||
+                                  !addSource("gpio:/dev/i2c-1:0x20@100")))
+      exit(1);
+
+   signal(SIGINT, onSignal);
+   signal(SIGTERM, onSignal);
+   if (!daemon_.start(ring, slots, realtime))
+      exit(1);
+   printf ("Publishing %d sources on %d buses to %s\n", daemon_.sources(), daemon_.buses(), ring);
+   fflush(stdout);
+
+   uint64_t end = Timing::now() + seconds * Timing::NSEC_PER_SEC;
+   while (!stop && (seconds == 0 || Timing::now() < end))
+      usleep(100000);
+   daemon_.stop();
+
+   for (int s = 0 ; s < daemon_.sources() ; ++s)
+   {
+      printf ("%-8s %10llu readings %6llu failed %6llu late\n", daemon_.nameOf(s),
+              (unsigned long long) daemon_.getSamples(s), (unsigned long long) daemon_.getFailures(s),
+              (unsigned long long) daemon_.getLate(s));
+      daemon_.getReadTime(s).print(stdout, "   read");
+   }
+}
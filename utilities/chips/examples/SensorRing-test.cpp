@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <SensorRing.h>
+
+typedef SensorRingClient::Reading Reading;
+
+static volatile bool stop = false;
+
+static void onSignal(int sig)
+{
+   stop = true;
+}
+
+static LatencyStats seen, sampled; // Too big for the stack
+
+static void printReading(const SensorRingClient &client, int s, const Reading &r, uint64_t n)
+{
+   printf ("%-8s %8llu %14.6f%s", client.source(s).name, (unsigned long long) n, r.time / 1e9,
+           r.status == SensorRingClient::STATUS_OK ? "" : " failed");
+   for (int v = 0 ; v < r.count ; ++v)
+      printf (" %u", r.value[v]);
+   putchar('\n');
+}
+
+static void list(const SensorRingClient &client)
+{
+   Reading r;
+
+   printf ("%d sources, %u readings each, writer %s\n", client.sources(), client.slots(),
+           client.isRunning() ? "running" : "stopped");
+   for (int s = 0 ; s < client.sources() ; ++s)
+   {
+      const SensorRingClient::Source &src = client.source(s);
+
+      printf ("%-8s %-5s %-16s 0x%02x %9.3f/s %10llu published", src.name,
+              SensorRingClient::kindName(src.kind), src.device, src.address, src.rate / 1000.0,
+              (unsigned long long) client.head(s));
+      if (client.latest(s, r))
+      {
+         printf (", latest %.1fms ago:", (Timing::now() - r.time) / 1e6);
+         for (int v = 0 ; v < r.count ; ++v)
+            printf (" %u", r.value[v]);
+      }
+      putchar('\n');
+   }
+}
+
+//
+// Print readings as they arrive, polling between them
+static void follow(const SensorRingClient &client, int s, bool history)
+{
+   SensorRingClient::Cursor c = client.follow(s, history);
+   Reading r;
+
+   while (!stop && client.isRunning())
+   {
+      if (client.next(c, r))
+         printReading(client, s, r, c.next - 1);
+      else
+      {
+         fflush(stdout);
+         usleep(1000);
+      }
+   }
+   if (c.lost != 0)
+      fprintf (stderr, "Lost %llu readings to the writer\n", (unsigned long long) c.lost);
+}
+
+//
+// Spin on a live source and time each reading from the daemon's publish, and
+// from when it read the chip, to this process seeing it
+static void latency(const SensorRingClient &client, int s, int seconds)
+{
+   SensorRingClient::Cursor c = client.follow(s, false);
+   Reading r;
+   uint64_t end = Timing::now() + seconds * Timing::NSEC_PER_SEC;
+
+   seen.reset();
+   sampled.reset();
+   while (!stop && client.isRunning() && Timing::now() < end)
+      if (client.next(c, r))
+      {
+         uint64_t now = Timing::now();
+         seen.record(now - r.published);
+         sampled.record(now - r.time);
+      }
+   printf ("%s: %llu readings, %llu lost\n", client.source(s).name,
+           (unsigned long long) seen.count(), (unsigned long long) c.lost);
+   seen.print(stdout, "   publish to read");
+   sampled.print(stdout, "   chip to read   ");
+}
+
+//
+// In process benchmark: a publisher thread and the main thread as reader
+struct Bench
+{
+   SensorRing ring;
+   double     rate;
+   uint64_t   count;
+   int        done;
+};
+
+static void *publisher(void *arg)
+{
+   Bench &b = *(Bench *) arg;
+   Reading r;
+   uint64_t due = Timing::now();
+   uint64_t period = b.rate > 0 ? (uint64_t) (Timing::NSEC_PER_SEC / b.rate) : 0;
+
+   memset(&r, 0, sizeof(r));
+   r.count = SensorRingClient::MAX_VALUES;
+   for (uint64_t n = 0 ; n < b.count && !stop ; ++n)
+   {
+      if (period != 0) // Paced like the daemon, sleeping between readings
+         Timing::sleepUntil(due);
+      due += period;
+      r.time = Timing::now();
+      r.value[0] = n;
+      b.ring.publish(0, r);
+   }
+   __atomic_store_n(&b.done, 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+static Bench bench_;
+
+static bool benchmark(double rate, int seconds)
+{
+   static const char *NAME = "/sensorring-bench";
+   static const int CALLS = 1000000;
+   SensorRingClient client;
+   Reading r;
+   pthread_t thread;
+
+   if (!bench_.ring.begin(NAME, 1, 1024))
+      return false;
+   bench_.ring.describe(0, "bench", "-", SensorRingClient::KIND_ADC, SensorRingClient::MAX_VALUES, 0, rate);
+   if (!client.begin(NAME))
+   {
+      bench_.ring.end();
+      return false;
+   }
+
+//
+// Cost of each side on its own
+   memset(&r, 0, sizeof(r));
+   uint64_t start = Timing::now(CLOCK_THREAD_CPUTIME_ID);
+   for (int i = 0 ; i < CALLS ; ++i)
+      bench_.ring.publish(0, r);
+   double publish = (double) (Timing::now(CLOCK_THREAD_CPUTIME_ID) - start) / CALLS;
+
+   uint64_t sum = 0;
+   start = Timing::now(CLOCK_THREAD_CPUTIME_ID);
+   for (int i = 0 ; i < CALLS ; ++i)
+   {
+      client.latest(0, r);
+      sum += r.value[0];
+   }
+   double latest = (double) (Timing::now(CLOCK_THREAD_CPUTIME_ID) - start) / CALLS;
+   printf ("publish %.1fns, latest %.1fns per call (%llu)\n", publish, latest, (unsigned long long) (sum & 1));
+
+//
+// Publish to read across threads, the reader spinning
+   SensorRingClient::Cursor c = client.follow(0, false);
+   bench_.rate = rate;
+   bench_.count = rate > 0 ? (uint64_t) (rate * seconds) : (uint64_t) seconds * 10000000;
+   bench_.done = 0;
+   seen.reset();
+   if (pthread_create(&thread, NULL, publisher, &bench_) != 0)
+   {
+      fputs("ERROR: Unable to start publisher.\n", stderr);
+      client.end();
+      bench_.ring.end();
+      return false;
+   }
+   start = Timing::now();
+   while (true)
+   {
+      bool finished = __atomic_load_n(&bench_.done, __ATOMIC_ACQUIRE);
+      while (client.next(c, r))
+         seen.record(Timing::now() - r.published);
+      if (finished)
+         break;
+   }
+   double secs = (Timing::now() - start) / 1e9;
+   pthread_join(thread, NULL);
+
+   printf ("%llu readings in %.2fs (%.0f/s), %llu lost to the writer\n",
+           (unsigned long long) seen.count(), secs, seen.count() / secs, (unsigned long long) c.lost);
+   seen.print(stdout, "publish to read");
+   client.end();
+   bench_.ring.end();
+   return true;
+}
+
+int main(int argc, char *argv[])
+{
+   enum { NONE, LIST, FOLLOW, LATENCY, BENCH } action = NONE;
+   const char *ring = "/chips";
+   const char *name = NULL;
+   bool history = false;
+   int seconds = 5;
+   double rate = 10000;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "list",    0, 0, 'l' },
+                  { "follow",  1, 0, 'f' },
+                  { "history", 0, 0, 'H' },
+                  { "latency", 1, 0, 'L' },
+                  { "bench",   0, 0, 'B' },
+                  { "ring",    1, 0, 'r' },
+                  { "time",    1, 0, 't' },
+                  { "rate",    1, 0, 'R' },
+                  { "help",    0, 0, '?' },
+                  { NULL,      0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "lf:HL:Br:t:R:?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'l': action = LIST; break;
+      case 'f': action = FOLLOW; name = optarg; break;
+      case 'H': history = true; break;
+      case 'L': action = LATENCY; name = optarg; break;
+      case 'B': action = BENCH; break;
+      case 'r': ring = optarg; break;
+      case 't': seconds = atoi(optarg); break;
+      case 'R': rate = atof(optarg); break;
+
+      case '?':
+      default:
+         action = NONE;
+         optind = argc;
+         break;
+      }
+   }
+
+   if (action == NONE)
+   {
+      puts("Usage: SensorRing-test action [options]");
+      puts("   Actions: -l --list                 Sources and their latest readings");
+      puts("            -f --follow source        Print a source's readings as they arrive");
+      puts("            -L --latency source       Publish to read latency from a live daemon");
+      puts("            -B --bench                Publish and read costs, and latency across threads");
+      puts("   Options: -r --ring name            Shared memory name (default /chips)");
+      puts("            -H --history              Follow from the oldest reading held");
+      puts("            -t --time seconds         Latency and bench run time (default 5)");
+      puts("            -R --rate readings        Bench publish rate per second, 0 flat out (default 10000)");
+      puts("            -? --help");
+      exit(1);
+   }
+   signal(SIGINT, onSignal);
+
+   if (action == BENCH)
+      exit(benchmark(rate, seconds) ? 0 : 1);
+
+   SensorRingClient client;
+   if (!client.begin(ring))
+      exit(1);
+
+   int s = name != NULL ? client.find(name) : 0;
+   if (s < 0)
+   {
+      fprintf (stderr, "ERROR: No source %s in %s.\n", name, ring);
+      exit(1);
+   }
+
+   switch (action)
+   {
+   case LIST:    list(client); break;
+   case FOLLOW:  follow(client, s, history); break;
+   case LATENCY: latency(client, s, seconds); break;
+   default:      break;
+   }
+   client.end();
+}
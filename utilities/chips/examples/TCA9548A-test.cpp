@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <TCA9548A.h>
+#include <TSL2561.h>
+#include <Timing.h>
+
+static const uint8_t ADDRESSES[3] = {TSL2561::ADDR_29, TSL2561::ADDR_39, TSL2561::ADDR_49};
+static const int MAX_SENSORS = TCA9548A::CHANNELS * 3;
+
+struct Sensor
+{
+   TSL2561     chip;
+   const char *device;
+   uint8_t     channel;
+   uint8_t     addr;
+   int         ir_vis, ir;
+};
+
+static TCA9548A mux;
+static Sensor sensors[MAX_SENSORS];
+static int sensorCount = 0;
+
+static LatencyStats groupedTime;
+static LatencyStats naiveTime;
+
+static bool beginSensor(void *arg)
+{
+   Sensor *s = (Sensor *) arg;
+   return s->chip.begin(s->device, s->addr);
+}
+
+static bool readSensor(void *arg)
+{
+   Sensor *s = (Sensor *) arg;
+   TransferStamp stamp;
+   return s->chip.getReading(s->ir_vis, s->ir, stamp);
+}
+
+//
+// Each sensor in turn with its own select, as without the switch driver
+static bool naiveSweep()
+{
+   bool ok = true;
+
+   for (int i = 0 ; i < sensorCount ; ++i)
+   {
+      mux.invalidate();
+      ok = mux.select(sensors[i].channel) && readSensor(&sensors[i]) && ok;
+   }
+   return ok;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *device = "/dev/i2c-1";
+   int addr = TCA9548A::ADDRESS;
+   int channels = 0xff;
+   int sweeps = 100;
+   bool compare = false;
+   bool print = false;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "device",   1, 0, 'd' },
+                  { "address",  1, 0, 'a' },
+                  { "channels", 1, 0, 'c' },
+                  { "sweeps",   1, 0, 'n' },
+                  { "compare",  0, 0, 'C' },
+                  { "print",    0, 0, 'p' },
+                  { "help",     0, 0, '?' },
+                  { NULL,       0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "d:a:c:n:Cp?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'd': device = optarg; break;
+      case 'a': addr = strtol(optarg, NULL, 0); break;
+      case 'c': channels = strtol(optarg, NULL, 0); break;
+      case 'n': sweeps = atoi(optarg); break;
+      case 'C': compare = true; break;
+      case 'p': print = true; break;
+
+      case '?':
+      default:
+         puts("Usage: TCA9548A-test [options]");
+         puts("   Options: -d --device device_name");
+         puts("            -a --address addr          Switch address (default 0x70)");
+         puts("            -c --channels mask         Channels to look for TSL2561s on (default 0xff)");
+         puts("            -n --sweeps count          Sweeps of every sensor to time (default 100)");
+         puts("            -C --compare               Then sweep with a select before every sensor");
+         puts("            -p --print                 Print the readings of the last sweep");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   if (!mux.begin(device, addr))
+      exit(1);
+
+//
+// Look for a sensor at every address on every channel. Sensors are listed
+// address first, the way an array is usually numbered, so a plain sweep in
+// list order changes channel on every sensor.
+   for (int a = 0 ; a < 3 ; ++a)
+      for (int c = 0 ; c < TCA9548A::CHANNELS ; ++c)
+         if (channels & (1 << c))
+         {
+            Sensor &s = sensors[sensorCount++];
+            s.device = device;
+            s.channel = c;
+            s.addr = ADDRESSES[a];
+            mux.queue(c, beginSensor, &s);
+         }
+   mux.run();
+
+   int found = 0;
+   for (int i = 0 ; i < sensorCount ; ++i)
+      if (mux.result(i))
+         sensors[found++] = sensors[i];
+   sensorCount = found;
+   mux.clear();
+   printf ("%d TSL2561s found behind the switch at 0x%02x\n", sensorCount, addr);
+   if (sensorCount == 0)
+      exit(1);
+
+   for (int i = 0 ; i < sensorCount ; ++i)
+      mux.queue(sensors[i].channel, readSensor, &sensors[i]);
+
+   int failed = 0;
+   mux.resetStats();
+   for (int n = 0 ; n < sweeps ; ++n)
+   {
+      uint64_t start = Timing::now();
+      if (!mux.run())
+         failed++;
+      groupedTime.record(Timing::now() - start);
+   }
+   printf ("grouped by channel: %.1f selects and %.1f skipped per sweep\n",
+           (double) mux.getSelects() / sweeps, (double) mux.getSkipped() / sweeps);
+   groupedTime.print(stdout, "grouped sweep");
+
+   if (print)
+      for (int i = 0 ; i < sensorCount ; ++i)
+         printf ("channel %d 0x%02x: IR+VIS= %d, IR= %d\n", sensors[i].channel, sensors[i].addr,
+                 sensors[i].ir_vis, sensors[i].ir);
+
+   if (compare)
+   {
+      mux.resetStats();
+      for (int n = 0 ; n < sweeps ; ++n)
+      {
+         uint64_t start = Timing::now();
+         if (!naiveSweep())
+            failed++;
+         naiveTime.record(Timing::now() - start);
+      }
+      printf ("select per sensor: %.1f selects per sweep\n", (double) mux.getSelects() / sweeps);
+      naiveTime.print(stdout, "plain sweep");
+   }
+
+   for (int i = 0 ; i < sensorCount ; ++i)
+      sensors[i].chip.end();
+   mux.end();
+   if (failed != 0)
+      printf ("%d sweeps had a failed read\n", failed);
+   exit(failed ? 2 : 0);
+}
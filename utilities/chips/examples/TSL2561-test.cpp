@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <TSL2561.h>
+#include <TSL2561Lux.h>
 
 int main (int argc, char *argv[])
 {
@@ -14,6 +15,7 @@ int main (int argc, char *argv[])
    bool agc = false;
    bool sweep = false;
    bool once = false;
+   uint32_t manual = 0;
 
 //
 // First parse through the arguments
@@ -64,6 +66,16 @@ int main (int argc, char *argv[])
       {
          once = true;
       }
+      else if (strcmp(argv[i], "-M") == 0 ||
+          strcmp(argv[i], "--manual") == 0)
+      {
+         if (i+1 >= argc) // Missing a required argument
+         {
+            fprintf (stderr, "ERROR: Required argument for option %s omitted.", argv[i]);
+            exit(1);
+         }
+         manual = strtoul(argv[++i], NULL, 0);
+      }
       else if (strcmp(argv[i], "--sweep") == 0)
       {
          sweep = true;
@@ -81,6 +93,8 @@ int main (int argc, char *argv[])
          puts ("                -m|--medium_integration    Use a 101ms integration time");
          puts ("                -L|--long_integration      Use a 402ms integration time");
          puts ("                -a|--agc                   Automatically search for best gain and time");
+         puts ("                -M|--manual micros         Manual integrations of this length; with -a the");
+         puts ("                                           length then follows the light (1ms - 1s)");
          puts ("                -o|--once                  Only take a single reading");
          puts ("                --sweep                    Sweep through all combinations of gain and time");
          exit(1);
@@ -95,6 +109,8 @@ int main (int argc, char *argv[])
    chip.enable(true);
    chip.setGain(gain);
    chip.setIntegrationTime(time);
+   if (manual == 0)
+      chip.startCycles(); // Read each cycle as it completes from here on
 
    int vis_ir, ir;
    const char *gain_names[] = {"1x", "16x"};
@@ -107,10 +123,23 @@ int main (int argc, char *argv[])
    static const int AGC_INTEG_TIMES[] = {TSL2561::INTEG_TIME_13_7MS, TSL2561::INTEG_TIME_101MS,
                                                TSL2561::INTEG_TIME_13_7MS, TSL2561::INTEG_TIME_402MS,
                                                TSL2561::INTEG_TIME_101MS, TSL2561::INTEG_TIME_402MS};
-   static const int INTEG_MICROS[3] = {50000, 110000, 410000};
    do
    {
-      usleep(INTEG_MICROS[chip.getIntegrationTime()]); // Sleep long enough to insure proper reading
+      if (manual != 0)
+      {
+//
+// Manual integration: counts come back normalised to 402ms, so the lux
+// calculation and the next exposure work the same whatever the length
+         if (!chip.integrate(manual, vis_ir, ir))
+            exit(1);
+         printf ("IR+VIS= %d, IR= %d normalised (gain=%s, integration time=%.1fms), lux= %u\n",
+                 vis_ir, ir, gain_names[chip.getGain() >> 4], manual / 1000.0,
+                 TSL2561Lux::calculateManual(vis_ir, ir, chip.getGain()));
+         if (agc)
+            manual = TSL2561::exposureFor(vis_ir, 32768, 1000, 1000000);
+         continue;
+      }
+
       if (sweep)
       {
          int i;
@@ -118,15 +147,14 @@ int main (int argc, char *argv[])
 //
 // Sweep through the various combinations of gain and integration time in order
 // from least sensitive to most.
+         chip.waitCycle(); // Wake just after the chip latches a cycle's counts
          puts ("--------------------");
          for (i = 0 ; i < 6 ; ++i)
          {
             chip.setGain(AGC_GAINS[i]);
             chip.setIntegrationTime(AGC_INTEG_TIMES[i]);
-            chip.enable(false);
-            chip.enable(true);
 
-            usleep(INTEG_MICROS[AGC_INTEG_TIMES[i]]);
+            chip.waitCycle(); // The first whole cycle at the new settings
             chip.getReading(vis_ir, ir, false);
              printf ("IR+VIS= %d, IR= %d (gain=%s, integration time=%s)\n",
                      vis_ir, ir,
@@ -137,8 +165,15 @@ int main (int argc, char *argv[])
       else
       {
 //
-// Just take a simple reading
-         chip.getReading(vis_ir, ir, agc);
+// Just take a simple reading, as each cycle's counts are latched
+         TransferStamp stamp;
+         if (agc)
+         {
+            chip.waitCycle();
+            chip.getReading(vis_ir, ir, agc);
+         }
+         else
+            chip.readCycle(vis_ir, ir, stamp);
  
          if (agc)
              printf ("IR+VIS= %d, IR= %d (gain=%s, integration time=%s)\n",
@@ -150,5 +185,10 @@ int main (int argc, char *argv[])
       }
    } while (!once);
 
+   if (chip.getMissed() != 0)
+      printf ("%llu integration cycles went unread\n", (unsigned long long) chip.getMissed());
+   if (chip.getEarly() != 0)
+      printf ("%llu reads came before the latch and were taken again\n",
+              (unsigned long long) chip.getEarly());
    chip.end();
 }
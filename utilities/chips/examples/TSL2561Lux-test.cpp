@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <getopt.h>
+#include <TSL2561Lux.h>
+#include <Timing.h>
+
+static const int MAX_SENSORS = 4096;
+
+static uint16_t ch0[MAX_SENSORS];
+static uint16_t ch1[MAX_SENSORS];
+static uint8_t  gain[MAX_SENSORS];
+static uint8_t  integ[MAX_SENSORS];
+static uint32_t lux[MAX_SENSORS];
+static float    luxf[MAX_SENSORS];
+
+//
+// The datasheet's floating point formula for the T package, which is what a
+// per-reading conversion usually looks like; only used as a speed baseline.
+static float floatLux(uint16_t c0, uint16_t c1, uint8_t g, uint8_t t)
+{
+   static const float SCALE[4] = {322.0f / 11, 322.0f / 81, 1.0f, 1.0f};
+   float scale = SCALE[t & 3] * (g == TSL2561::GAIN_1X ? 16.0f : 1.0f);
+   float v0 = c0 * scale, v1 = c1 * scale;
+
+   if (v0 == 0)
+      return 0;
+   float ratio = v1 / v0;
+   if (ratio <= 0.50f)
+      return 0.0304f * v0 - 0.062f * v0 * powf(ratio, 1.4f);
+   if (ratio <= 0.61f)
+      return 0.0224f * v0 - 0.031f * v1;
+   if (ratio <= 0.80f)
+      return 0.0128f * v0 - 0.0153f * v1;
+   if (ratio <= 1.30f)
+      return 0.00146f * v0 - 0.00112f * v1;
+   return 0;
+}
+
+//
+// Random readings over every gain and integration time, including some
+// saturated ones and plenty of IR heavy light
+static void randomReadings(int n)
+{
+   for (int i = 0 ; i < n ; ++i)
+   {
+      gain[i] = rand() & 1 ? TSL2561::GAIN_16X : TSL2561::GAIN_1X;
+      integ[i] = rand() & 3;
+      uint32_t limit = TSL2561Lux::fullScale(integ[i]) + 2;
+      ch0[i] = rand() % limit;
+      ch1[i] = rand() % 4 == 0 ? rand() % limit : (uint32_t) ch0[i] * (rand() % 1400) / 1000 % limit;
+   }
+}
+
+//
+// Compare the batch kernel with the scalar reference on random readings and
+// on readings either side of every step in both ratio tables
+static bool validate(long long count, int package)
+{
+   long long checked = 0, wrong = 0;
+
+   for (long long done = 0 ; done < count ; done += MAX_SENSORS)
+   {
+      randomReadings(MAX_SENSORS);
+      if (done == 0) // First block probes the table boundaries
+      {
+         int i = 0;
+         for (int k = 1 ; k <= 0x29a + 1 && i + 7 <= MAX_SENSORS ; ++k)
+         {
+            uint32_t c0 = 1 + rand() % 5000;
+            for (int d = -3 ; d <= 3 ; ++d, ++i)
+            {
+               gain[i] = TSL2561::GAIN_16X;
+               integ[i] = TSL2561::INTEG_TIME_402MS;
+               ch0[i] = c0;
+               long c1 = ((2L * k - 1) * c0 >> 10) + d; // Where the ratio rounds to k
+               ch1[i] = c1 < 0 ? 0 : c1;
+            }
+         }
+      }
+
+      TSL2561Lux::calculate(ch0, ch1, gain, integ, lux, MAX_SENSORS, package);
+      for (int i = 0 ; i < MAX_SENSORS ; ++i)
+      {
+         uint32_t want = TSL2561Lux::calculate(ch0[i], ch1[i], gain[i], integ[i], package);
+         if (lux[i] != want && wrong++ < 10)
+            printf ("Mismatch: ch0=%u ch1=%u gain=0x%02x integ=%u batch=%u scalar=%u\n",
+                    ch0[i], ch1[i], gain[i], integ[i], lux[i], want);
+      }
+      checked += MAX_SENSORS;
+   }
+   printf ("%lld readings checked, %lld mismatches\n", checked, wrong);
+   return wrong == 0;
+}
+
+//
+// Convert the same n readings over and over for about a second
+static double rate(int method, int n, int package)
+{
+   uint64_t conversions = 0;
+   uint64_t start = Timing::now(CLOCK_THREAD_CPUTIME_ID);
+   uint64_t elapsed;
+   uint32_t check = 0;
+
+   do
+   {
+      for (int r = 0 ; r < 256 ; ++r)
+      {
+         if (method == 0)
+         {
+            for (int i = 0 ; i < n ; ++i)
+               luxf[i] = floatLux(ch0[i], ch1[i], gain[i], integ[i]);
+            check += (uint32_t) luxf[r % n];
+         }
+         else if (method == 1)
+         {
+            for (int i = 0 ; i < n ; ++i)
+               lux[i] = TSL2561Lux::calculate(ch0[i], ch1[i], gain[i], integ[i], package);
+            check += lux[r % n];
+         }
+         else
+         {
+            TSL2561Lux::calculate(ch0, ch1, gain, integ, lux, n, package);
+            check += lux[r % n];
+         }
+         ch0[r % n] ^= check & 1; // Keep the compiler from hoisting the work
+         conversions += n;
+      }
+      elapsed = Timing::now(CLOCK_THREAD_CPUTIME_ID) - start;
+   } while (elapsed < Timing::NSEC_PER_SEC);
+
+   return conversions * 1000.0 / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+   int package = TSL2561Lux::PACKAGE_T;
+   uint8_t g = TSL2561::GAIN_1X;
+   uint8_t t = TSL2561::INTEG_TIME_402MS;
+   long long validate_count = 0;
+   int sensors = 64;
+   bool bench = false;
+   const char *reading = NULL;
+
+   while (1)
+   {
+      static const struct option lopts[] = {
+                  { "convert",     1, 0, 'c' },
+                  { "high-gain",   0, 0, 'h' },
+                  { "integration", 1, 0, 'i' },
+                  { "cs-package",  0, 0, 'P' },
+                  { "validate",    1, 0, 'V' },
+                  { "bench",       0, 0, 'B' },
+                  { "sensors",     1, 0, 'n' },
+                  { "help",        0, 0, '?' },
+                  { NULL,          0, 0, 0 } };
+      int c;
+
+      c = getopt_long(argc, argv, "c:hi:PV:Bn:?", lopts, NULL);
+      if (c == -1)
+         break;
+
+      switch (c)
+      {
+      case 'c': reading = optarg; break;
+      case 'h': g = TSL2561::GAIN_16X; break;
+      case 'i': t = atoi(optarg) & TSL2561::INTEG_TIME_MASK; break;
+      case 'P': package = TSL2561Lux::PACKAGE_CS; break;
+      case 'V': validate_count = atoll(optarg); break;
+      case 'B': bench = true; break;
+      case 'n': sensors = atoi(optarg); break;
+
+      case '?':
+      default:
+         puts("Usage: TSL2561Lux-test [options]");
+         puts("   Options: -c --convert ir_vis,ir        Convert one reading to lux");
+         puts("            -h --high-gain                Reading was taken at 16x");
+         puts("            -i --integration code         0 13.7ms, 1 101ms, 2 402ms (default), 3 manual");
+         puts("            -P --cs-package               Use the ChipScale coefficients");
+         puts("            -V --validate count           Check the batch kernel against the scalar one");
+         puts("            -B --bench                    Conversion rate in sensors/us");
+         puts("            -n --sensors count            Sensors per batch for --bench (default 64)");
+         puts("            -? --help");
+         exit(1);
+      }
+   }
+
+   if (sensors < 1 || sensors > MAX_SENSORS)
+   {
+      fprintf (stderr, "ERROR: Sensor count must be 1 to %d.\n", MAX_SENSORS);
+      exit(1);
+   }
+
+   if (reading != NULL)
+   {
+      char *eptr;
+      uint16_t c0 = strtol(reading, &eptr, 0);
+      uint16_t c1 = *eptr == ',' ? strtol(eptr + 1, NULL, 0) : 0;
+      uint32_t l = TSL2561Lux::calculate(c0, c1, g, t, package);
+
+      if (l == TSL2561Lux::LUX_SATURATED)
+         puts("Saturated");
+      else
+         printf ("%u lux\n", l);
+   }
+
+   if (validate_count > 0 && !validate(validate_count, package))
+      exit(2);
+
+   if (bench)
+   {
+      static const char *names[3] = {"float formula", "fixed point", "fixed point batch"};
+
+      randomReadings(sensors);
+      for (int m = 0 ; m < 3 ; ++m)
+         printf ("%-18s %8.1f sensors/us (%d sensors)\n", names[m], rate(m, sensors, package), sensors);
+   }
+}
@@ -0,0 +1,596 @@
+// LD_PRELOAD shim that records or replays the bus traffic of a program.
+//
+// Recording passes every call on /dev/i2c-* and /dev/spidev* through to the
+// next library (the kernel, or ChipSim.so stacked after this one) and writes
+// what happened to a BusTrace.h trace:
+//
+//    BUSTRACE_RECORD=tsl.trace LD_PRELOAD=sim/BusTrace.so examples/TSL2561-test -a -o
+//
+// Replaying serves the same program from the trace with no bus at all. Reads
+// get the recorded bytes, writes are checked against the recorded ones and
+// every difference is reported, so a changed driver shows up as mismatches:
+//
+//    BUSTRACE_REPLAY=tsl.trace LD_PRELOAD=sim/BusTrace.so examples/TSL2561-test -a -o
+//
+// With BUSTRACE_TIMING set each replayed call also takes as long as it did
+// when recorded, which reproduces field timing. At exit replay reports the
+// calls served, the mismatches and the process CPU time per call.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/spi/spidev.h>
+#include <Timing.h>
+#include <sim/BusTrace.h>
+
+static const int MAX_FILES = 1024;
+static const int MAX_REPORTED = 10;   // Mismatches printed in full
+
+struct File
+{
+   bool     active;
+   bool     spi;
+   int      stream;
+   uint32_t cursor;     // Replay position in the trace
+   uint16_t addr;
+   uint8_t  mode;
+   uint8_t  bits;
+   uint32_t speed;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool ready = false;
+static bool replay = false;
+static bool timing = false;
+
+static File           files[MAX_FILES];
+static BusTraceWriter writer;
+static BusTraceReader reader;
+static bool           claimed[BusTraceWriter::MAX_STREAMS];
+static uint64_t       calls = 0;
+static uint64_t       mismatches = 0;
+static uint64_t       cpuStart = 0;
+
+static int     (*realOpen)(const char *, int, ...);
+static int     (*realOpen64)(const char *, int, ...);
+static int     (*realClose)(int);
+static ssize_t (*realRead)(int, void *, size_t);
+static ssize_t (*realWrite)(int, const void *, size_t);
+static int     (*realIoctl)(int, unsigned long, ...);
+
+typedef BusTraceFormat::Record Record;
+
+static bool isBusNode(const char *path)
+{
+   return path != NULL && (strncmp(path, "/dev/i2c-", 9) == 0 || strncmp(path, "/dev/spidev", 11) == 0);
+}
+
+static File *findFile(int fd)
+{
+   return fd >= 0 && fd < MAX_FILES && files[fd].active ? &files[fd] : NULL;
+}
+
+//=============================================================================
+// report: Summary printed when the program exits
+//
+static void report()
+{
+   if (replay)
+   {
+      uint64_t cpu = Timing::now(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+      fprintf (stderr, "BusTrace: %llu calls replayed, %llu mismatches, %.2f us CPU per call\n",
+               (unsigned long long) calls, (unsigned long long) mismatches,
+               calls ? cpu / 1000.0 / calls : 0.0);
+   }
+   else if (writer.isOpen())
+   {
+      fprintf (stderr, "BusTrace: %llu records written\n", (unsigned long long) writer.getRecords());
+      writer.end();
+   }
+}
+
+static void setup()
+{
+   const char *env;
+
+   if (ready)
+      return;
+   ready = true;
+
+   realOpen = (int (*)(const char *, int, ...)) dlsym(RTLD_NEXT, "open");
+   realOpen64 = (int (*)(const char *, int, ...)) dlsym(RTLD_NEXT, "open64");
+   realClose = (int (*)(int)) dlsym(RTLD_NEXT, "close");
+   realRead = (ssize_t (*)(int, void *, size_t)) dlsym(RTLD_NEXT, "read");
+   realWrite = (ssize_t (*)(int, const void *, size_t)) dlsym(RTLD_NEXT, "write");
+   realIoctl = (int (*)(int, unsigned long, ...)) dlsym(RTLD_NEXT, "ioctl");
+
+   timing = getenv("BUSTRACE_TIMING") != NULL;
+   if ((env = getenv("BUSTRACE_REPLAY")) != NULL)
+   {
+      if (!reader.begin(env))
+         exit(1);
+      replay = true;
+   }
+   else if ((env = getenv("BUSTRACE_RECORD")) != NULL)
+   {
+      if (!writer.begin(env, Timing::now()))
+         exit(1);
+   }
+   else
+      fputs("BusTrace: Set BUSTRACE_RECORD or BUSTRACE_REPLAY; passing calls through.\n", stderr);
+
+   cpuStart = Timing::now(CLOCK_PROCESS_CPUTIME_ID);
+   atexit(report);
+}
+
+//=============================================================================
+// Recording
+//
+static void recordMessages(File *f, const struct i2c_msg *msgs, int count,
+                           uint64_t start, uint32_t latency, int result, int error)
+{
+   pthread_mutex_lock(&lock);
+   for (int i = 0 ; i < count ; ++i)
+   {
+      bool rd = msgs[i].flags & I2C_M_RD;
+      Record rec = writer.makeRecord(f->stream, rd ? BusTraceFormat::TYPE_I2C_READ :
+                                     BusTraceFormat::TYPE_I2C_WRITE, start, i == 0 ? latency : 0);
+      rec.addr = msgs[i].addr;
+      rec.len = msgs[i].len;
+      if (i < count - 1)
+         rec.flags |= BusTraceFormat::FLAG_MORE;
+      if (result < 0)
+      {
+         rec.flags |= BusTraceFormat::FLAG_FAILED;
+         rec.error = error;
+      }
+      writer.add(rec, rd && result < 0 ? NULL : msgs[i].buf, NULL);
+   }
+   pthread_mutex_unlock(&lock);
+}
+
+static void recordTransfers(File *f, const struct spi_ioc_transfer *xfers, int count,
+                            uint64_t start, uint32_t latency, int result, int error)
+{
+   pthread_mutex_lock(&lock);
+   for (int i = 0 ; i < count ; ++i)
+   {
+      Record rec = writer.makeRecord(f->stream, BusTraceFormat::TYPE_SPI, start, i == 0 ? latency : 0);
+      rec.len = xfers[i].len;
+      rec.speed = xfers[i].speed_hz ? xfers[i].speed_hz : f->speed;
+      if (i < count - 1)
+         rec.flags |= BusTraceFormat::FLAG_MORE;
+      if (xfers[i].cs_change)
+         rec.flags |= BusTraceFormat::FLAG_CS_CHANGE;
+      if (xfers[i].tx_buf == 0)
+         rec.flags |= BusTraceFormat::FLAG_NO_TX;
+      if (xfers[i].rx_buf == 0 || result < 0)
+         rec.flags |= BusTraceFormat::FLAG_NO_RX;
+      if (result < 0)
+      {
+         rec.flags |= BusTraceFormat::FLAG_FAILED;
+         rec.error = error;
+      }
+      writer.add(rec, (const void *) (uintptr_t) xfers[i].tx_buf,
+                 result < 0 ? NULL : (const void *) (uintptr_t) xfers[i].rx_buf);
+   }
+   pthread_mutex_unlock(&lock);
+}
+
+//=============================================================================
+// Replaying
+//
+// Next record of a stream, or -1 once the stream has been used up
+static int nextRecord(File *f)
+{
+   while (f->cursor < reader.count())
+   {
+      uint32_t i = f->cursor++;
+      const Record &rec = reader.record(i);
+      if (rec.stream != f->stream || rec.type == BusTraceFormat::TYPE_OPEN)
+         continue;
+      if (rec.type == BusTraceFormat::TYPE_CLOSE)
+         break;
+      return i;
+   }
+   f->cursor = reader.count();
+   return -1;
+}
+
+static void mismatch(File *f, int i, const char *what)
+{
+   mismatches++;
+   if (mismatches <= (uint64_t) MAX_REPORTED)
+      fprintf (stderr, "BusTrace: Stream %d call %llu: %s (trace record %d)\n", f->stream,
+               (unsigned long long) calls, what, i);
+   else if (mismatches == MAX_REPORTED + 1)
+      fputs("BusTrace: Further mismatches not shown.\n", stderr);
+}
+
+//
+// Serve one message; returns the recorded errno or 0
+static int replayMessage(File *f, struct i2c_msg &msg)
+{
+   bool rd = msg.flags & I2C_M_RD;
+   int i = nextRecord(f);
+
+   if (i < 0)
+   {
+      mismatch(f, reader.count(), "trace exhausted");
+      return EIO;
+   }
+
+   const Record &rec = reader.record(i);
+   uint8_t want = rd ? BusTraceFormat::TYPE_I2C_READ : BusTraceFormat::TYPE_I2C_WRITE;
+   int len = msg.len < rec.len ? msg.len : rec.len;
+
+   if (rec.type != want || rec.addr != msg.addr || rec.len != msg.len)
+      mismatch(f, i, "different message");
+   else if (!rd && memcmp(msg.buf, reader.payload(i), len) != 0)
+      mismatch(f, i, "different bytes written");
+
+   if (rd)
+   {
+      memcpy(msg.buf, reader.payload(i), len);
+      memset(msg.buf + len, 0, msg.len - len);
+   }
+   return rec.flags & BusTraceFormat::FLAG_FAILED ? rec.error : 0;
+}
+
+static int replayTransfer(File *f, const struct spi_ioc_transfer &xfer)
+{
+   int i = nextRecord(f);
+
+   if (i < 0)
+   {
+      mismatch(f, reader.count(), "trace exhausted");
+      return EIO;
+   }
+
+   const Record &rec = reader.record(i);
+   const uint8_t *tx = reader.payload(i);
+   uint8_t *rxBuf = (uint8_t *) (uintptr_t) xfer.rx_buf;
+   uint32_t len = xfer.len < rec.len ? xfer.len : rec.len;
+
+   if (rec.type != BusTraceFormat::TYPE_SPI || rec.len != xfer.len)
+      mismatch(f, i, "different transfer");
+   else if (xfer.tx_buf != 0 && !(rec.flags & BusTraceFormat::FLAG_NO_TX) &&
+            memcmp((const void *) (uintptr_t) xfer.tx_buf, tx, len) != 0)
+      mismatch(f, i, "different bytes sent");
+
+   if (rxBuf != NULL && rec.type == BusTraceFormat::TYPE_SPI)
+   {
+      memcpy(rxBuf, tx + rec.len, len);
+      memset(rxBuf + len, 0, xfer.len - len);
+   }
+   return rec.flags & BusTraceFormat::FLAG_FAILED ? rec.error : 0;
+}
+
+//
+// Hold the call for as long as it took when it was recorded
+static void replayLatency(File *f, uint64_t start)
+{
+   if (!timing || f->cursor == 0 || f->cursor > reader.count())
+      return;
+
+//
+// The cursor has moved past the whole call; its first record has the latency
+   uint32_t i = f->cursor - 1;
+   while (i > 0 && (reader.record(i - 1).flags & BusTraceFormat::FLAG_MORE))
+      i--;
+   uint64_t until = start + reader.record(i).latency;
+   if (reader.record(i).latency > 200 * Timing::NSEC_PER_USEC)
+      Timing::sleepUntil(until);
+   while (Timing::now() < until)
+      ;
+}
+
+static int replayOpen(const char *path)
+{
+   int fd;
+
+   for (uint32_t i = 0 ; i < reader.count() ; ++i)
+   {
+      const Record &rec = reader.record(i);
+      char recPath[256];
+
+      if (rec.type != BusTraceFormat::TYPE_OPEN || claimed[rec.stream])
+         continue;
+      reader.pathOf(i, recPath, sizeof(recPath));
+      if (strcmp(recPath, path) != 0)
+         continue;
+      if (rec.flags & BusTraceFormat::FLAG_FAILED)
+      {
+         claimed[rec.stream] = true;
+         errno = rec.error;
+         return -1;
+      }
+      if ((fd = realOpen("/dev/null", O_RDWR)) < 0)
+         return -1;
+      if (fd >= MAX_FILES)
+      {
+         realClose(fd);
+         errno = EMFILE;
+         return -1;
+      }
+      claimed[rec.stream] = true;
+      memset(&files[fd], 0, sizeof(File));
+      files[fd].active = true;
+      files[fd].spi = strncmp(path, "/dev/spidev", 11) == 0;
+      files[fd].stream = rec.stream;
+      files[fd].cursor = i + 1;
+      files[fd].bits = 8;
+      return fd;
+   }
+   fprintf (stderr, "BusTrace: No recorded open of %s left.\n", path);
+   errno = ENOENT;
+   return -1;
+}
+
+//=============================================================================
+// Calls common to both modes
+//
+static int traceOpen(const char *path, int (*real)(const char *, int, ...), int flags, va_list ap)
+{
+   mode_t mode = (flags & O_CREAT) ? va_arg(ap, mode_t) : 0;
+
+   setup();
+   if (!isBusNode(path))
+      return real(path, flags, mode);
+   if (replay)
+   {
+      pthread_mutex_lock(&lock);
+      int fd = replayOpen(path);
+      pthread_mutex_unlock(&lock);
+      return fd;
+   }
+
+   uint64_t start = Timing::now();
+   int fd = real(path, flags, mode);
+   int error = errno;
+   uint32_t latency = Timing::now() - start;
+
+   pthread_mutex_lock(&lock);
+   int stream = writer.openStream(path, start, latency, fd, error);
+   if (fd >= 0 && fd < MAX_FILES && stream >= 0)
+   {
+      memset(&files[fd], 0, sizeof(File));
+      files[fd].active = true;
+      files[fd].spi = strncmp(path, "/dev/spidev", 11) == 0;
+      files[fd].stream = stream;
+   }
+   pthread_mutex_unlock(&lock);
+   errno = error;
+   return fd;
+}
+
+static ssize_t traceData(File *f, int fd, void *buf, size_t count, bool rd)
+{
+   uint64_t start = Timing::now();
+
+   if (!f->spi) // Plain read and write are one I2C message
+   {
+      struct i2c_msg msg;
+      msg.addr = f->addr;
+      msg.flags = rd ? I2C_M_RD : 0;
+      msg.len = count;
+      msg.buf = (uint8_t *) buf;
+
+      if (replay)
+      {
+         pthread_mutex_lock(&lock);
+         calls++;
+         int error = replayMessage(f, msg);
+         replayLatency(f, start);
+         pthread_mutex_unlock(&lock);
+         errno = error;
+         return error ? -1 : (ssize_t) count;
+      }
+
+      ssize_t n = rd ? realRead(fd, buf, count) : realWrite(fd, buf, count);
+      int error = errno;
+      recordMessages(f, &msg, 1, start, Timing::now() - start, n < 0 ? -1 : 0, error);
+      errno = error;
+      return n;
+   }
+
+   struct spi_ioc_transfer xfer;
+   memset(&xfer, 0, sizeof(xfer));
+   xfer.len = count;
+   if (rd)
+      xfer.rx_buf = (uintptr_t) buf;
+   else
+      xfer.tx_buf = (uintptr_t) buf;
+
+   if (replay)
+   {
+      pthread_mutex_lock(&lock);
+      calls++;
+      int error = replayTransfer(f, xfer);
+      replayLatency(f, start);
+      pthread_mutex_unlock(&lock);
+      errno = error;
+      return error ? -1 : (ssize_t) count;
+   }
+
+   ssize_t n = rd ? realRead(fd, buf, count) : realWrite(fd, buf, count);
+   int error = errno;
+   recordTransfers(f, &xfer, 1, start, Timing::now() - start, n < 0 ? -1 : 0, error);
+   errno = error;
+   return n;
+}
+
+static int traceIoctl(File *f, int fd, unsigned long request, void *arg)
+{
+   uint64_t start = Timing::now();
+   int result = 0;
+   int error = 0;
+
+   if (!f->spi && request == I2C_RDWR)
+   {
+      struct i2c_rdwr_ioctl_data *data = (struct i2c_rdwr_ioctl_data *) arg;
+
+      if (replay)
+      {
+         pthread_mutex_lock(&lock);
+         calls++;
+         for (uint32_t i = 0 ; i < data->nmsgs ; ++i)
+            if ((error = replayMessage(f, data->msgs[i])) != 0)
+               break;
+         replayLatency(f, start);
+         pthread_mutex_unlock(&lock);
+         errno = error;
+         return error ? -1 : (int) data->nmsgs;
+      }
+      result = realIoctl(fd, request, arg);
+      error = errno;
+      recordMessages(f, data->msgs, data->nmsgs, start, Timing::now() - start, result, error);
+      errno = error;
+      return result;
+   }
+
+   if (f->spi && _IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0 &&
+       _IOC_DIR(request) == _IOC_WRITE)
+   {
+      const struct spi_ioc_transfer *xfers = (const struct spi_ioc_transfer *) arg;
+      int count = _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer);
+
+      if (replay)
+      {
+         pthread_mutex_lock(&lock);
+         calls++;
+         for (int i = 0 ; i < count ; ++i)
+         {
+            if ((error = replayTransfer(f, xfers[i])) != 0)
+               break;
+            result += xfers[i].len;
+         }
+         replayLatency(f, start);
+         pthread_mutex_unlock(&lock);
+         errno = error;
+         return error ? -1 : result;
+      }
+      result = realIoctl(fd, request, arg);
+      error = errno;
+      recordTransfers(f, xfers, count, start, Timing::now() - start, result, error);
+      errno = error;
+      return result;
+   }
+
+//
+// Configuration calls are not traced, but the settings are tracked so
+// records can carry them and so replay can answer the matching reads.
+   if (request == I2C_SLAVE || request == I2C_SLAVE_FORCE)
+      f->addr = (uint32_t) (uintptr_t) arg;
+   else if (request == SPI_IOC_WR_MAX_SPEED_HZ)
+      f->speed = *(uint32_t *) arg;
+   else if (request == SPI_IOC_WR_MODE)
+      f->mode = *(uint8_t *) arg;
+   else if (request == SPI_IOC_WR_BITS_PER_WORD)
+      f->bits = *(uint8_t *) arg;
+
+   if (!replay)
+      return realIoctl(fd, request, arg);
+
+   if (request == SPI_IOC_RD_MAX_SPEED_HZ)
+      *(uint32_t *) arg = f->speed;
+   else if (request == SPI_IOC_RD_MODE)
+      *(uint8_t *) arg = f->mode;
+   else if (request == SPI_IOC_RD_BITS_PER_WORD)
+      *(uint8_t *) arg = f->bits;
+   else if (request == I2C_FUNCS)
+      *(unsigned long *) arg = I2C_FUNC_I2C;
+   return 0;
+}
+
+//=============================================================================
+// The interposed calls
+//
+extern "C" {
+
+int open(const char *path, int flags, ...)
+{
+   va_list ap;
+
+   va_start(ap, flags);
+   setup(); // Resolves the real calls passed on below
+   int fd = traceOpen(path, realOpen, flags, ap);
+   va_end(ap);
+   return fd;
+}
+
+int open64(const char *path, int flags, ...)
+{
+   va_list ap;
+
+   va_start(ap, flags);
+   setup(); // Resolves the real calls passed on below
+   int fd = traceOpen(path, realOpen64, flags, ap);
+   va_end(ap);
+   return fd;
+}
+
+int close(int fd)
+{
+   File *f;
+
+   setup();
+   if ((f = findFile(fd)) != NULL)
+   {
+      pthread_mutex_lock(&lock);
+      if (!replay)
+         writer.add(writer.makeRecord(f->stream, BusTraceFormat::TYPE_CLOSE, Timing::now(), 0), NULL, NULL);
+      f->active = false;
+      pthread_mutex_unlock(&lock);
+   }
+   return realClose(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+   File *f;
+
+   setup();
+   if ((f = findFile(fd)) == NULL)
+      return realRead(fd, buf, count);
+   return traceData(f, fd, buf, count, true);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+   File *f;
+
+   setup();
+   if ((f = findFile(fd)) == NULL)
+      return realWrite(fd, buf, count);
+   return traceData(f, fd, (void *) buf, count, false);
+}
+
+int ioctl(int fd, unsigned long request, ...) __THROW
+{
+   va_list ap;
+   File *f;
+
+   va_start(ap, request);
+   void *arg = va_arg(ap, void *);
+   va_end(ap);
+
+   setup();
+   if ((f = findFile(fd)) == NULL)
+      return realIoctl(fd, request, arg);
+   return traceIoctl(f, fd, request, arg);
+}
+
+}
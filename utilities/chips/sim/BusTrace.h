@@ -0,0 +1,316 @@
+// Compact binary trace of the transactions the drivers issue on I2C and SPI.
+//
+// BusTraceFormat: On-disk layout shared by the writer and the reader
+// BusTraceWriter: Appends records through stdio buffering
+// BusTraceReader: Loads a whole trace for printing, statistics and replay
+//
+// A trace is a FileHeader followed by records, each a fixed 24 byte Record
+// and then its payload, padded to a multiple of eight bytes so records stay
+// aligned when the trace is read into memory. Every open() of a bus node
+// gets a stream number and an OPEN record carrying the path; transactions on
+// that descriptor carry the same number. Messages of one I2C_RDWR or
+// SPI_IOC_MESSAGE are consecutive records chained with FLAG_MORE, and the
+// first carries the latency of the whole call.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef BUSTRACE_H
+#define BUSTRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+class BusTraceFormat
+{
+public:
+   static const uint32_t VERSION = 1;
+
+   static const uint8_t TYPE_OPEN      = 1;  // Payload is the device path
+   static const uint8_t TYPE_CLOSE     = 2;
+   static const uint8_t TYPE_I2C_WRITE = 3;  // Payload is the bytes written
+   static const uint8_t TYPE_I2C_READ  = 4;  // Payload is the bytes read
+   static const uint8_t TYPE_SPI       = 5;  // Payload is len tx bytes then len rx bytes
+
+   static const uint8_t FLAG_MORE      = 0x01; // Next record is part of the same call
+   static const uint8_t FLAG_FAILED    = 0x02; // The call failed with error
+   static const uint8_t FLAG_CS_CHANGE = 0x04;
+   static const uint8_t FLAG_NO_TX     = 0x08; // SPI transfer had no tx buffer
+   static const uint8_t FLAG_NO_RX     = 0x10;
+
+   struct FileHeader
+   {
+      char     magic[8];
+      uint32_t version;
+      uint32_t reserved;
+      uint64_t start;      // CLOCK_MONOTONIC at the start of the capture
+   };
+
+   struct Record
+   {
+      uint64_t time;       // Nanoseconds since start when the call was made
+      uint32_t latency;    // Nanoseconds the call took
+      uint32_t speed;      // SPI clock in Hz
+      uint16_t len;
+      uint16_t addr;       // I2C slave address
+      uint8_t  stream;
+      uint8_t  type;
+      uint8_t  flags;
+      uint8_t  error;      // errno when FLAG_FAILED is set
+   };
+
+   static const char *magic() { return "BUSTRC\r\n"; }
+
+   static uint32_t payloadSize(const Record &rec)
+   {
+      return rec.type == TYPE_SPI ? 2 * rec.len : rec.len;
+   }
+
+   static uint32_t paddedSize(const Record &rec)
+   {
+      return (payloadSize(rec) + 7) & ~7;
+   }
+
+   static const char *typeName(uint8_t type)
+   {
+      switch (type)
+      {
+      case TYPE_OPEN:      return "open";
+      case TYPE_CLOSE:     return "close";
+      case TYPE_I2C_WRITE: return "write";
+      case TYPE_I2C_READ:  return "read";
+      case TYPE_SPI:       return "spi";
+      }
+      return "?";
+   }
+};
+
+//=============================================================================
+// BusTraceWriter
+//
+class BusTraceWriter : public BusTraceFormat
+{
+public:
+   static const int MAX_STREAMS = 256;
+
+   BusTraceWriter()
+   {
+      fp_ = NULL;
+      streams_ = 0;
+      records_ = 0;
+   }
+
+   bool begin(const char *path, uint64_t start)
+   {
+      FileHeader header;
+
+      if (fp_ != NULL)
+      {
+         fputs("BusTraceWriter: Trace already open.\n", stderr);
+         return false;
+      }
+      if ((fp_ = fopen(path, "wb")) == NULL)
+      {
+         fprintf (stderr, "BusTraceWriter: Unable to create %s.\n", path);
+         return false;
+      }
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, magic(), sizeof(header.magic));
+      header.version = VERSION;
+      header.start = start;
+      start_ = start;
+      fwrite(&header, sizeof(header), 1, fp_);
+      return true;
+   }
+
+   void end()
+   {
+      if (fp_ != NULL)
+         fclose(fp_);
+      fp_ = NULL;
+   }
+
+   bool isOpen() const { return fp_ != NULL; }
+   uint64_t getRecords() const { return records_; }
+   void flush() { if (fp_ != NULL) fflush(fp_); }
+
+//
+// Start a new stream for an open of a bus node, fd and error being what the
+// open returned and left in errno; returns its number or -1. A failed open
+// gets a stream too, so replay fails it the same way.
+   int openStream(const char *path, uint64_t time, uint32_t latency, int fd, int error)
+   {
+      if (fp_ == NULL || streams_ >= MAX_STREAMS)
+         return -1;
+
+      Record rec = makeRecord(streams_, TYPE_OPEN, time, latency);
+      rec.len = strlen(path);
+      if (fd < 0)
+      {
+         rec.flags |= FLAG_FAILED;
+         rec.error = error;
+      }
+      add(rec, path, NULL);
+      return streams_++;
+   }
+
+   Record makeRecord(int stream, uint8_t type, uint64_t time, uint32_t latency) const
+   {
+      Record rec;
+
+      memset(&rec, 0, sizeof(rec));
+      rec.time = time - start_;
+      rec.latency = latency;
+      rec.stream = stream;
+      rec.type = type;
+      return rec;
+   }
+
+//
+// Append a record; for SPI data is the tx side and rx the receive side
+   void add(const Record &rec, const void *data, const void *rx)
+   {
+      static const uint8_t zeros[256] = {0};
+
+      if (fp_ == NULL)
+         return;
+      fwrite(&rec, sizeof(rec), 1, fp_);
+      writePadded(data, rec.len, zeros, sizeof(zeros));
+      if (rec.type == TYPE_SPI)
+         writePadded(rx, rec.len, zeros, sizeof(zeros));
+      writePadded(NULL, paddedSize(rec) - payloadSize(rec), zeros, sizeof(zeros));
+      records_++;
+   }
+
+private:
+   void writePadded(const void *data, uint32_t len, const uint8_t *zeros, uint32_t size)
+   {
+      if (data != NULL)
+      {
+         fwrite(data, 1, len, fp_);
+         return;
+      }
+      for ( ; len > 0 ; len -= len < size ? len : size)
+         fwrite(zeros, 1, len < size ? len : size, fp_);
+   }
+
+   FILE    *fp_;
+   uint64_t start_;
+   int      streams_;
+   uint64_t records_;
+};
+
+//=============================================================================
+// BusTraceReader: Holds the whole trace in memory with an index of records
+//
+class BusTraceReader : public BusTraceFormat
+{
+public:
+   BusTraceReader()
+   {
+      data_ = NULL;
+      index_ = NULL;
+      count_ = 0;
+   }
+
+   bool begin(const char *path)
+   {
+      FILE *fp;
+      long size;
+
+      if (data_ != NULL)
+      {
+         fputs("BusTraceReader: Trace already open.\n", stderr);
+         return false;
+      }
+      if ((fp = fopen(path, "rb")) == NULL)
+      {
+         fprintf (stderr, "BusTraceReader: Unable to open %s.\n", path);
+         return false;
+      }
+      fseek(fp, 0, SEEK_END);
+      size = ftell(fp);
+      fseek(fp, 0, SEEK_SET);
+      if (size < (long) sizeof(FileHeader) || (data_ = (uint8_t *) malloc(size)) == NULL ||
+          fread(data_, 1, size, fp) != (size_t) size)
+      {
+         fclose(fp);
+         fprintf (stderr, "BusTraceReader: Unable to read %s.\n", path);
+         end();
+         return false;
+      }
+      fclose(fp);
+
+      memcpy(&header_, data_, sizeof(header_));
+      if (memcmp(header_.magic, magic(), sizeof(header_.magic)) != 0 || header_.version != VERSION)
+      {
+         fprintf (stderr, "BusTraceReader: %s is not a bus trace.\n", path);
+         end();
+         return false;
+      }
+
+//
+// Two passes: count the complete records, then index them. A capture cut off
+// mid-record just loses the tail.
+      for (int pass = 0 ; pass < 2 ; ++pass)
+      {
+         long pos = sizeof(FileHeader);
+         uint32_t n = 0;
+
+         while (pos + (long) sizeof(Record) <= size)
+         {
+            Record rec;
+            memcpy(&rec, data_ + pos, sizeof(rec));
+            long next = pos + sizeof(rec) + paddedSize(rec);
+            if (next > size)
+               break;
+            if (pass == 1)
+               index_[n] = pos;
+            n++;
+            pos = next;
+         }
+         if (pass == 0 && (index_ = (long *) malloc((n + 1) * sizeof(long))) == NULL)
+         {
+            fputs("BusTraceReader: Out of memory.\n", stderr);
+            end();
+            return false;
+         }
+         count_ = n;
+      }
+      return true;
+   }
+
+   void end()
+   {
+      free(data_);
+      free(index_);
+      data_ = NULL;
+      index_ = NULL;
+      count_ = 0;
+   }
+
+   uint32_t count() const { return count_; }
+   uint64_t getStart() const { return header_.start; }
+
+   const Record &record(uint32_t i) const { return *(const Record *) (data_ + index_[i]); }
+   const uint8_t *payload(uint32_t i) const { return data_ + index_[i] + sizeof(Record); }
+
+//
+// For an OPEN record, copy the path into a string
+   void pathOf(uint32_t i, char *path, int size) const
+   {
+      int len = record(i).len < size - 1 ? record(i).len : size - 1;
+      memcpy(path, payload(i), len);
+      path[len] = '\0';
+   }
+
+private:
+   uint8_t   *data_;
+   long      *index_;
+   uint32_t   count_;
+   FileHeader header_;
+};
+
+#endif
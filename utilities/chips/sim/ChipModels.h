@@ -0,0 +1,757 @@
+// Register-level behavioural models of the supported chips, for running and
+// benchmarking the drivers without a Pi.
+//
+// MCP23008Model: Register map, IOCON sequential mode and interrupt capture
+// MCP4725Model:  Fast, DAC and DAC+EEPROM writes, read back and EEPROM busy time
+// TSL2561Model:  Command register, integration cycles, gain and saturation
+// MCP3008Model:  Bit level SPI conversation including the null and LSB-first bits
+// TCA9548AModel: Channel switch whose selection takes effect at the stop
+// SimI2CBus:     Routes i2c_msg transfers to the models attached to it, and
+//                to those behind a mux channel while it is switched in
+//
+// Models are plain classes; the bus dispatches to them through per-type
+// function templates so nothing here needs RTTI or the C++ runtime.
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#ifndef CHIPMODELS_H
+#define CHIPMODELS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/i2c.h>
+#include <linux/spi/spidev.h>
+#include <Timing.h>
+
+//=============================================================================
+// MCP23008Model
+//
+class MCP23008Model
+{
+public:
+   static const uint8_t IODIR = 0x00, IPOL = 0x01, GPINTEN = 0x02, DEFVAL = 0x03;
+   static const uint8_t INTCON = 0x04, IOCON = 0x05, GPPU = 0x06, INTF = 0x07;
+   static const uint8_t INTCAP = 0x08, GPIO = 0x09, OLAT = 0x0A;
+   static const int     REGISTERS = 11;
+
+   static const uint8_t IOCON_SEQOP  = 0x20; // Set disables address increment
+   static const uint8_t IOCON_ODR    = 0x04;
+   static const uint8_t IOCON_INTPOL = 0x02;
+
+   MCP23008Model() { reset(); }
+
+   void reset()
+   {
+      memset(regs_, 0, sizeof(regs_));
+      regs_[IODIR] = 0xff;
+      pointer_ = 0;
+      pins_ = 0xff; // Inputs idle high, as with pullups
+   }
+
+//
+// Drive the external side of the input pins and run the interrupt logic
+   void setInputs(uint8_t levels)
+   {
+      uint8_t inputs = regs_[IODIR];
+      uint8_t changed = (levels ^ pins_) & inputs;
+      uint8_t vsDefault = (levels ^ regs_[DEFVAL]) & inputs;
+
+      pins_ = levels;
+
+      uint8_t fire = regs_[GPINTEN] &
+                     ((regs_[INTCON] & vsDefault) | (~regs_[INTCON] & changed));
+      if (fire != 0 && regs_[INTF] == 0) // Captured state holds until cleared
+      {
+         regs_[INTF] = fire;
+         regs_[INTCAP] = gpio();
+      }
+   }
+
+   uint8_t getOutputs() const { return regs_[OLAT] & ~regs_[IODIR]; }
+   uint8_t getRegister(int r) const { return r == GPIO ? gpio() : regs_[r]; }
+
+//
+// Level of the INT pin; open drain only ever pulls low
+   bool interruptPin() const
+   {
+      bool active = regs_[INTF] != 0;
+      if (regs_[IOCON] & IOCON_ODR)
+         return !active;
+      return (regs_[IOCON] & IOCON_INTPOL) ? active : !active;
+   }
+
+   int write(const uint8_t *buf, int len)
+   {
+      if (len < 1)
+         return 0;
+      pointer_ = buf[0] % REGISTERS;
+      for (int i = 1 ; i < len ; ++i)
+      {
+         writeReg(pointer_, buf[i]);
+         advance();
+      }
+      return 0;
+   }
+
+   int read(uint8_t *buf, int len)
+   {
+      for (int i = 0 ; i < len ; ++i)
+      {
+         buf[i] = readReg(pointer_);
+         advance();
+      }
+      return 0;
+   }
+
+private:
+   uint8_t gpio() const
+   {
+      uint8_t inputs = regs_[IODIR];
+      return ((pins_ ^ regs_[IPOL]) & inputs) | (regs_[OLAT] & ~inputs);
+   }
+
+   void advance()
+   {
+      if (!(regs_[IOCON] & IOCON_SEQOP))
+         pointer_ = (pointer_ + 1) % REGISTERS;
+   }
+
+   void writeReg(uint8_t r, uint8_t v)
+   {
+      switch (r)
+      {
+      case INTF:
+      case INTCAP:
+         break; // Read only
+      case GPIO:
+         regs_[OLAT] = v;
+         break;
+      default:
+         regs_[r] = v;
+      }
+   }
+
+   uint8_t readReg(uint8_t r)
+   {
+      uint8_t v = getRegister(r);
+      if (r == GPIO || r == INTCAP) // Either read clears the interrupt
+         regs_[INTF] = 0;
+      return v;
+   }
+
+   uint8_t regs_[REGISTERS];
+   uint8_t pointer_;
+   uint8_t pins_;
+};
+
+//=============================================================================
+// MCP4725Model
+//
+class MCP4725Model
+{
+public:
+   static const uint64_t EEPROM_WRITE_NANOS = 25000000ULL; // Typical write time
+
+   MCP4725Model()
+   {
+      eepromValue_ = 0x800; // Factory default is mid scale
+      eepromPd_ = 0;
+      busyUntil_ = 0;
+      powerOn();
+   }
+
+//
+// What the chip does at power on: reload the DAC from EEPROM
+   void powerOn()
+   {
+      value_ = eepromValue_;
+      pd_ = eepromPd_;
+   }
+
+   uint16_t getValue() const    { return value_; }
+   uint8_t  getPowerDown() const { return pd_; }
+   uint16_t getEepromValue() const { return eepromValue_; }
+   bool     busy() const { return Timing::now() < busyUntil_; }
+
+   double getOutput(double vdd) const { return pd_ ? 0.0 : vdd * value_ / 4096.0; }
+
+   int write(const uint8_t *buf, int len)
+   {
+      if (len < 2)
+         return 0;
+
+      if ((buf[0] & 0xc0) == 0x00) // Fast mode, repeatable in one transaction
+      {
+         for (int i = 0 ; i + 1 < len ; i += 2)
+         {
+            pd_ = (buf[i] >> 4) & 0x03;
+            value_ = ((buf[i] & 0x0f) << 8) | buf[i+1];
+         }
+         return 0;
+      }
+
+      if (len < 3)
+         return 0;
+      uint8_t command = buf[0] & 0xe0;
+      uint8_t pd = (buf[0] >> 1) & 0x03;
+      uint16_t value = (buf[1] << 4) | (buf[2] >> 4);
+
+      if (command == 0x40) // Write DAC register
+      {
+         pd_ = pd;
+         value_ = value;
+      }
+      else if (command == 0x60) // Write DAC register and EEPROM
+      {
+         pd_ = pd;
+         value_ = value;
+         if (!busy()) // A write already in progress swallows new EEPROM writes
+         {
+            eepromPd_ = pd;
+            eepromValue_ = value;
+            busyUntil_ = Timing::now() + EEPROM_WRITE_NANOS;
+         }
+      }
+      return 0;
+   }
+
+   int read(uint8_t *buf, int len)
+   {
+      uint8_t data[5];
+
+      data[0] = (busy() ? 0x00 : 0x80) | (pd_ << 1); // RDY/BSY, POR clear
+      data[1] = value_ >> 4;
+      data[2] = (value_ & 0x0f) << 4;
+      data[3] = (eepromPd_ << 5) | (eepromValue_ >> 8);
+      data[4] = eepromValue_ & 0xff;
+      for (int i = 0 ; i < len ; ++i)
+         buf[i] = data[i % 5];
+      return 0;
+   }
+
+private:
+   uint16_t value_;
+   uint8_t  pd_;
+   uint16_t eepromValue_;
+   uint8_t  eepromPd_;
+   uint64_t busyUntil_;
+};
+
+//=============================================================================
+// TSL2561Model
+//
+class TSL2561Model
+{
+public:
+   static const uint8_t REG_CONTROL = 0x00, REG_TIMING = 0x01, REG_ID = 0x0A;
+   static const uint8_t REG_DATA0 = 0x0C, REG_DATA1 = 0x0E;
+   static const uint8_t ID_VALUE = 0x50; // TSL2561, revision 0
+
+   TSL2561Model()
+   {
+      memset(regs_, 0, sizeof(regs_));
+      regs_[REG_TIMING] = 0x02; // 402ms, 1x
+      regs_[REG_ID] = ID_VALUE;
+      pointer_ = 0;
+      command_ = 0;
+      cycleStart_ = 0;
+      manualStart_ = 0;
+      ppm_ = 0;
+      step_ = 0;
+      setLight(10.0, 2.0);
+   }
+
+//
+// Light falling on the two photodiodes, in counts per millisecond at 1x gain
+   void setLight(double broadband, double infrared)
+   {
+      rate0_ = broadband;
+      rate1_ = infrared;
+   }
+
+//
+// Oscillator error, and a count added to broadband each cycle (wrapping after
+// 64 cycles) so a reader can tell every cycle's counts apart
+   void setCycle(double ppm, uint16_t step)
+   {
+      ppm_ = ppm;
+      step_ = step;
+   }
+
+   bool poweredUp() const { return (regs_[REG_CONTROL] & 0x03) == 0x03; }
+
+//
+// Nominal cycle length and full scale count for each integration setting
+   static double integMillis(uint8_t integ)
+   {
+      static const double MILLIS[3] = {13.7, 101.0, 402.0};
+      return integ < 3 ? MILLIS[integ] : 0.0;
+   }
+
+   static uint16_t saturation(uint8_t integ)
+   {
+      static const uint16_t MAX_COUNT[3] = {5047, 37177, 65535};
+      return integ < 3 ? MAX_COUNT[integ] : 65535;
+   }
+
+   int write(const uint8_t *buf, int len)
+   {
+      if (len < 1)
+         return 0;
+
+      update();
+      command_ = buf[0];
+      if (!(command_ & 0x80))
+         return 0; // Not a command; see read()
+      pointer_ = command_ & 0x0f;
+
+      for (int i = 1 ; i < len ; ++i)
+      {
+         writeReg(pointer_, buf[i]);
+         pointer_ = (pointer_ + 1) & 0x0f;
+      }
+      return 0;
+   }
+
+   int read(uint8_t *buf, int len)
+   {
+      update();
+//
+// A byte without the CMD bit does not address a register; reading then
+// returns the byte written. TSL2561::begin relies on that for its ID check.
+      if (!(command_ & 0x80))
+      {
+         for (int i = 0 ; i < len ; ++i)
+            buf[i] = command_;
+         return 0;
+      }
+      for (int i = 0 ; i < len ; ++i)
+      {
+         buf[i] = regs_[pointer_];
+         pointer_ = (pointer_ + 1) & 0x0f;
+      }
+      return 0;
+   }
+
+private:
+   uint16_t counts(double rate, double millis, uint16_t limit) const
+   {
+      double gain = (regs_[REG_TIMING] & 0x10) ? 16.0 : 1.0;
+      double c = rate * millis * gain;
+      return c >= limit ? limit : (uint16_t) c;
+   }
+
+   void setData(uint16_t ch0, uint16_t ch1)
+   {
+      regs_[REG_DATA0] = ch0 & 0xff;
+      regs_[REG_DATA0 + 1] = ch0 >> 8;
+      regs_[REG_DATA1] = ch1 & 0xff;
+      regs_[REG_DATA1 + 1] = ch1 >> 8;
+   }
+
+//
+// Latch the result of the most recent complete integration cycle
+   void update()
+   {
+      uint8_t integ = regs_[REG_TIMING] & 0x03;
+
+      if (!poweredUp() || integ == 3)
+         return;
+
+      double millis = integMillis(integ);
+      uint64_t cycle = (uint64_t) (millis * (1e6 + ppm_));
+      uint64_t done = (Timing::now() - cycleStart_) / cycle;
+      if (done == 0)
+         return; // First cycle not finished yet
+
+      uint16_t limit = saturation(integ);
+      uint32_t ch0 = counts(rate0_, millis, limit) + step_ * (done % 64);
+      setData(ch0 < limit ? ch0 : limit, counts(rate1_, millis, limit));
+   }
+
+   void writeReg(uint8_t r, uint8_t v)
+   {
+      uint64_t now = Timing::now();
+
+      if (r == REG_CONTROL)
+      {
+         if (!poweredUp() && (v & 0x03) == 0x03)
+            cycleStart_ = now; // Integration starts at power up
+         regs_[r] = v & 0x03;
+      }
+      else if (r == REG_TIMING)
+      {
+         uint8_t was = regs_[r];
+         regs_[r] = v & 0x1b;
+         if ((v & 0x03) == 0x03) // Manual integration, framed by the MANUAL bit
+         {
+            if ((v & 0x08) && !(was & 0x08))
+               manualStart_ = now;
+            else if (!(v & 0x08) && (was & 0x08))
+            {
+               double millis = (now - manualStart_) / 1e6;
+               setData(counts(rate0_, millis, 65535), counts(rate1_, millis, 65535));
+            }
+         }
+         else
+            cycleStart_ = now;
+      }
+      else if (r != REG_ID && r < REG_DATA0)
+         regs_[r] = v;
+   }
+
+   uint8_t  regs_[16];
+   uint8_t  pointer_;
+   uint8_t  command_;
+   uint64_t cycleStart_;
+   uint64_t manualStart_;
+   double   rate0_;
+   double   rate1_;
+   double   ppm_;
+   uint16_t step_;
+};
+
+//=============================================================================
+// MCP3008Model: Follows the conversation a clock at a time. Counting from the
+// start bit, the chip takes SGL/DIFF and three channel bits, samples for a
+// clock, drives a null bit, B9..B0, then B1..B9 again LSB first, then zeros.
+// DOUT is high impedance until the null bit; it reads as ones here.
+//
+// Above the maximum clock set, DOUT settles too late for some clock edges and
+// the controller samples the previous bit instead, more often the further
+// over the limit, as a board whose wiring cannot take the speed would.
+//
+class MCP3008Model
+{
+public:
+   MCP3008Model()
+   {
+      for (int c = 0 ; c < 8 ; ++c)
+         inputs_[c] = 0;
+      maxHz_ = 0;
+      lateOdds_ = 0;
+      random_ = 0x2545f491;
+      lastBit_ = 1;
+      chipSelect(false);
+   }
+
+//
+// Fastest clock the chip and its wiring keep up with; zero is no limit
+   void setMaxClock(uint32_t hz) { maxHz_ = hz; }
+
+   void setInput(int channel, uint16_t code) { inputs_[channel & 7] = code > 1023 ? 1023 : code; }
+   uint16_t getInput(int channel) const     { return inputs_[channel & 7]; }
+
+//
+// Dropping chip select starts a fresh conversation
+   void chipSelect(bool active)
+   {
+      if (!active)
+      {
+         clock_ = -1;
+         command_ = 0;
+         value_ = 0;
+      }
+   }
+
+//
+// Clock len bytes through the chip MSB first with chip select held low
+   void transfer(const uint8_t *tx, uint8_t *rx, int len)
+   {
+      for (int i = 0 ; i < len ; ++i)
+      {
+         uint8_t in = tx != NULL ? tx[i] : 0;
+         uint8_t out = 0;
+
+         for (int b = 7 ; b >= 0 ; --b)
+            out |= clockOut((in >> b) & 1) << b;
+         if (rx != NULL)
+            rx[i] = out;
+      }
+   }
+
+//
+// Clock len bytes of words wider than 8 bits, each held in the 2 or 4 bytes
+// spidev uses for it in native byte order, low bits bits MSB first
+   void transferWords(const uint8_t *tx, uint8_t *rx, int len, int bits)
+   {
+      int size = bits > 16 ? 4 : 2;
+
+      for (int i = 0 ; i + size <= len ; i += size)
+      {
+         uint32_t in = 0, out = 0;
+
+         if (tx != NULL)
+         {
+            if (size == 4) memcpy(&in, tx + i, 4);
+            else { uint16_t w; memcpy(&w, tx + i, 2); in = w; }
+         }
+         for (int b = bits - 1 ; b >= 0 ; --b)
+            out |= (uint32_t) clockOut((in >> b) & 1) << b;
+         if (rx != NULL)
+         {
+            if (size == 4) memcpy(rx + i, &out, 4);
+            else { uint16_t w = out; memcpy(rx + i, &w, 2); }
+         }
+      }
+   }
+
+//
+// Run a whole SPI_IOC_MESSAGE; chip select drops between transfers marked
+// cs_change and at the end. Transfers without a speed or word size of their
+// own run at hz and bits. Returns the byte count, as the ioctl does.
+   int message(const struct spi_ioc_transfer *xfers, int count, uint32_t hz = 0, int bits = 8)
+   {
+      int total = 0;
+
+      for (int i = 0 ; i < count ; ++i)
+      {
+         int width = xfers[i].bits_per_word != 0 ? xfers[i].bits_per_word : bits;
+
+         lateOdds_ = lateOdds(xfers[i].speed_hz != 0 ? xfers[i].speed_hz : hz);
+         if (width > 8)
+            transferWords((const uint8_t *) (uintptr_t) xfers[i].tx_buf,
+                          (uint8_t *) (uintptr_t) xfers[i].rx_buf, xfers[i].len, width);
+         else
+            transfer((const uint8_t *) (uintptr_t) xfers[i].tx_buf,
+                     (uint8_t *) (uintptr_t) xfers[i].rx_buf, xfers[i].len);
+         total += xfers[i].len;
+         if (xfers[i].cs_change || i == count - 1)
+            chipSelect(false);
+      }
+      return total;
+   }
+
+   static uint16_t convert(const uint16_t *inputs, uint8_t command)
+   {
+      int channel = command & 0x07;
+
+      if (command & 0x08) // Single ended
+         return inputs[channel];
+
+      int plus = inputs[channel ^ (channel & 1)];       // Even input of the pair
+      int minus = inputs[(channel ^ (channel & 1)) + 1];
+      int v = (channel & 1) ? minus - plus : plus - minus;
+      return v < 0 ? 0 : v;
+   }
+
+private:
+//
+// Chance in 65536 of a bit coming late: none up to the limit, then rising
+// to always at a third over it
+   uint32_t lateOdds(uint32_t hz) const
+   {
+      if (maxHz_ == 0 || hz <= maxHz_)
+         return 0;
+      uint64_t over = (uint64_t) (hz - maxHz_) * 3 * 65536 / maxHz_;
+      return over > 65536 ? 65536 : (uint32_t) over;
+   }
+
+   uint32_t nextRandom()
+   {
+      random_ ^= random_ << 13;
+      random_ ^= random_ >> 17;
+      random_ ^= random_ << 5;
+      return random_;
+   }
+
+//
+// One clock as the controller sees it, DOUT possibly late
+   int clockOut(int in)
+   {
+      int bit = clockBit(in);
+
+      if (lateOdds_ != 0 && (nextRandom() & 0xffff) < lateOdds_)
+         bit = lastBit_;
+      lastBit_ = bit;
+      return bit;
+   }
+
+   int clockBit(int in)
+   {
+      int out = 1; // High impedance
+
+      if (clock_ < 0) // Waiting for the start bit
+      {
+         if (in)
+            clock_ = 0;
+         return out;
+      }
+
+      clock_++;
+      if (clock_ <= 4)
+      {
+         command_ = (command_ << 1) | in;
+         if (clock_ == 4)
+            value_ = convert(inputs_, command_);
+      }
+      else if (clock_ == 6)
+         out = 0; // Null bit
+      else if (clock_ >= 7 && clock_ <= 16)
+         out = (value_ >> (16 - clock_)) & 1;
+      else if (clock_ >= 17 && clock_ <= 25)
+         out = (value_ >> (clock_ - 16)) & 1;
+      else if (clock_ > 25)
+         out = 0;
+      return out;
+   }
+
+   uint16_t inputs_[8];
+   int      clock_;    // Clocks since the start bit, -1 before it
+   uint8_t  command_;
+   uint16_t value_;
+   uint32_t maxHz_;
+   uint32_t lateOdds_; // For the transfer under way
+   uint32_t random_;
+   int      lastBit_;
+};
+
+//=============================================================================
+// TCA9548AModel
+//
+class TCA9548AModel
+{
+public:
+   TCA9548AModel() { control_ = pending_ = 0; }
+
+//
+// Channels switched in; a write only takes effect at the end of the transfer
+   const uint8_t *channels() const { return &control_; }
+   void stop() { control_ = pending_; }
+
+   int write(const uint8_t *buf, int len)
+   {
+      if (len > 0)
+         pending_ = buf[len - 1];
+      return 0;
+   }
+
+   int read(uint8_t *buf, int len)
+   {
+      for (int i = 0 ; i < len ; ++i)
+         buf[i] = control_;
+      return 0;
+   }
+
+private:
+   uint8_t control_;
+   uint8_t pending_;
+};
+
+//=============================================================================
+// SimI2CBus: Up to MAX_DEVICES models on one bus. A message to an address
+// with nothing attached fails with ENXIO, as the adapter reports a NAK, and
+// so does one to a model behind a mux channel that is not switched in.
+//
+class SimI2CBus
+{
+public:
+   static const int MAX_DEVICES = 32;
+   static const int MAX_MUXES   = 4;
+
+   SimI2CBus()
+   {
+      count_ = 0;
+      muxes_ = 0;
+      bitRate_ = 0;
+   }
+
+//
+// A model on the bus itself, or behind a channel of the last mux attached
+   template <class MODEL>
+   bool attach(uint8_t addr, MODEL &model, int channel = -1)
+   {
+      if (count_ >= MAX_DEVICES || (channel >= 0 && (muxes_ == 0 || channel > 7)))
+         return false;
+      devices_[count_].addr = addr;
+      devices_[count_].model = &model;
+      devices_[count_].write = &writeThunk<MODEL>;
+      devices_[count_].read = &readThunk<MODEL>;
+      devices_[count_].gate = channel >= 0 ? mux_[muxes_ - 1]->channels() : NULL;
+      devices_[count_].gateBit = channel >= 0 ? 1 << channel : 0;
+      count_++;
+      return true;
+   }
+
+   bool attachMux(uint8_t addr, TCA9548AModel &mux)
+   {
+      if (muxes_ >= MAX_MUXES || !attach(addr, mux))
+         return false;
+      mux_[muxes_++] = &mux;
+      return true;
+   }
+
+   bool present(uint8_t addr) const { return find(addr) >= 0; }
+
+//
+// Optionally charge wire time (9 bits per byte plus start and stop) so timing
+// measurements on the simulated bus mean something. Zero is instantaneous.
+// The caller sleeps it out, as it would waiting on the adapter's interrupt.
+   void setBitRate(uint32_t hz) { bitRate_ = hz; }
+
+//
+// Returns 0 or a negative errno, like the kernel
+   int transfer(struct i2c_msg *msgs, int count)
+   {
+      uint64_t bits = 0;
+
+      for (int i = 0 ; i < count ; ++i)
+      {
+         int d = find(msgs[i].addr);
+         if (d < 0)
+            return -ENXIO;
+         if (msgs[i].flags & I2C_M_RD)
+            devices_[d].read(devices_[d].model, msgs[i].buf, msgs[i].len);
+         else
+            devices_[d].write(devices_[d].model, msgs[i].buf, msgs[i].len);
+         bits += 9 * (msgs[i].len + 1) + 2;
+      }
+      for (int m = 0 ; m < muxes_ ; ++m)
+         mux_[m]->stop();
+      if (bitRate_ != 0)
+         Timing::sleepUntil(Timing::now() + bits * Timing::NSEC_PER_SEC / bitRate_);
+      return 0;
+   }
+
+private:
+   struct Device
+   {
+      uint8_t addr;
+      void   *model;
+      int   (*write)(void *model, const uint8_t *buf, int len);
+      int   (*read)(void *model, uint8_t *buf, int len);
+      const uint8_t *gate;  // Mux channels switched in, for a model behind one
+      uint8_t gateBit;
+   };
+
+   template <class MODEL>
+   static int writeThunk(void *model, const uint8_t *buf, int len)
+   {
+      return ((MODEL *) model)->write(buf, len);
+   }
+
+   template <class MODEL>
+   static int readThunk(void *model, uint8_t *buf, int len)
+   {
+      return ((MODEL *) model)->read(buf, len);
+   }
+
+   int find(uint8_t addr) const
+   {
+      for (int i = 0 ; i < count_ ; ++i)
+         if (devices_[i].addr == addr && (devices_[i].gate == NULL || (*devices_[i].gate & devices_[i].gateBit)))
+            return i;
+      return -1;
+   }
+
+   Device   devices_[MAX_DEVICES];
+   int      count_;
+   TCA9548AModel *mux_[MAX_MUXES];
+   int      muxes_;
+   uint32_t bitRate_;
+};
+
+#endif
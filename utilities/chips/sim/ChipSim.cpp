@@ -0,0 +1,504 @@
+// LD_PRELOAD stand-in for /dev/i2c-* and /dev/spidev* backed by ChipModels.h,
+// so the example programs run unmodified without a Pi:
+//
+//    LD_PRELOAD=sim/ChipSim.so examples/MCP23008-test -R
+//
+// open() of a simulated node hands back a descriptor on /dev/null to hold
+// the number; read, write, ioctl and close on it go to the models instead.
+// Everything else passes straight through to the C library.
+//
+// Environment:
+//    CHIPSIM_DEVICES  Bus layout, default
+//                     "i2c-1:0x20=MCP23008,0x29=TSL2561,0x62=MCP4725;spidev0.0=MCP3008"
+//                     An address written addr/n puts the chip behind channel n
+//                     of the last TCA9548A listed before it on the bus.
+//    CHIPSIM_GPIO     Input levels on every MCP23008 (default 0xff)
+//    CHIPSIM_ADC      Codes on the MCP3008 inputs, e.g. "512,1023,0"
+//    CHIPSIM_LIGHT    TSL2561 broadband,infrared counts per ms at 1x (default 10,2)
+//    CHIPSIM_LIGHT_CYCLE TSL2561 oscillator error in ppm, and a count to step
+//                     broadband by each cycle, e.g. "8000,1"
+//    CHIPSIM_I2C_HZ   Charge I2C transfers their wire time at this bit rate
+//    CHIPSIM_SPI_WIRE Set to charge SPI transfers their wire time at the
+//                     speed each asks for
+//    CHIPSIM_SPI_MAX_HZ Clock above which MCP3008 reads start to corrupt
+//    CHIPSIM_SPI_WORD_BITS Widest SPI word the controller takes (default 8,
+//                     as the BCM2835)
+//    CHIPSIM_TRACE    Set to log every transfer to stderr
+//
+// Code by Ignus Porkus/Gray Lorig
+// License: LGPL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/spi/spidev.h>
+#include <sim/ChipModels.h>
+
+static const int MAX_BUSES  = 8;
+static const int MAX_MODELS = 32;
+static const int MAX_FILES  = 1024;
+static const int MAX_MSGS   = 42;   // I2C_RDRW_IOCTL_MAX_MSGS in the kernel
+
+static const char *DEFAULT_DEVICES =
+   "i2c-1:0x20=MCP23008,0x29=TSL2561,0x62=MCP4725;spidev0.0=MCP3008";
+
+struct Bus
+{
+   char          name[32];  // Node name without /dev/
+   SimI2CBus     i2c;
+   MCP3008Model *adc;       // Set for an spidev node
+   pthread_mutex_t lock;    // One transaction at a time, as on a real adapter
+};
+
+struct File
+{
+   Bus     *bus;
+   uint16_t addr;           // I2C_SLAVE target
+   uint8_t  mode;
+   uint8_t  bits;
+   uint32_t speed;
+};
+
+static bool ready = false;
+static bool trace = false;
+static bool spiWire = false;
+static int  spiWordBits = 8;
+
+static Bus  buses[MAX_BUSES];
+static int  busCount = 0;
+static File files[MAX_FILES];
+
+static MCP23008Model expanders[MAX_MODELS];
+static MCP4725Model  dacs[MAX_MODELS];
+static TSL2561Model  lights[MAX_MODELS];
+static MCP3008Model  adcs[MAX_MODELS];
+static TCA9548AModel muxes[SimI2CBus::MAX_MUXES * MAX_BUSES];
+static int expanderCount = 0, dacCount = 0, lightCount = 0, adcCount = 0, muxCount = 0;
+
+static int     (*realOpen)(const char *, int, ...);
+static int     (*realOpen64)(const char *, int, ...);
+static int     (*realClose)(int);
+static ssize_t (*realRead)(int, void *, size_t);
+static ssize_t (*realWrite)(int, const void *, size_t);
+static int     (*realIoctl)(int, unsigned long, ...);
+
+//=============================================================================
+// attachModel: Put a new model of the named type on a bus
+//
+static bool attachModel(Bus &bus, uint8_t addr, const char *type, int channel = -1)
+{
+   if (strcasecmp(type, "MCP23008") == 0 && expanderCount < MAX_MODELS)
+      return bus.i2c.attach(addr, expanders[expanderCount++], channel);
+   if (strcasecmp(type, "MCP4725") == 0 && dacCount < MAX_MODELS)
+      return bus.i2c.attach(addr, dacs[dacCount++], channel);
+   if (strcasecmp(type, "TSL2561") == 0 && lightCount < MAX_MODELS)
+      return bus.i2c.attach(addr, lights[lightCount++], channel);
+   if (strcasecmp(type, "TCA9548A") == 0 && channel < 0 && muxCount < SimI2CBus::MAX_MUXES * MAX_BUSES)
+      return bus.i2c.attachMux(addr, muxes[muxCount++]);
+   if (strcasecmp(type, "MCP3008") == 0 && adcCount < MAX_MODELS)
+   {
+      bus.adc = &adcs[adcCount++];
+      return true;
+   }
+   return false;
+}
+
+//=============================================================================
+// parseDevices: "bus:addr=type,addr/channel=type;bus=type" into buses[]
+//
+static void parseDevices(const char *spec)
+{
+   char copy[1024];
+   char *save = NULL;
+
+   strncpy(copy, spec, sizeof(copy) - 1);
+   copy[sizeof(copy) - 1] = '\0';
+
+   for (char *b = strtok_r(copy, ";", &save) ; b != NULL && busCount < MAX_BUSES ;
+        b = strtok_r(NULL, ";", &save))
+   {
+      Bus &bus = buses[busCount];
+      char *rest = strpbrk(b, ":=");
+      if (rest == NULL)
+         continue;
+      char sep = *rest;
+      *rest++ = '\0';
+      strncpy(bus.name, b, sizeof(bus.name) - 1);
+      pthread_mutex_init(&bus.lock, NULL);
+
+      if (sep == '=') // spidevB.C=TYPE
+      {
+         if (!attachModel(bus, 0, rest) || bus.adc == NULL)
+            fprintf (stderr, "ChipSim: Unknown SPI device \"%s\".\n", rest);
+      }
+      else
+      {
+         char *save2 = NULL;
+         for (char *d = strtok_r(rest, ",", &save2) ; d != NULL ; d = strtok_r(NULL, ",", &save2))
+         {
+            char *eptr;
+            long addr = strtol(d, &eptr, 0);
+            long channel = -1;
+            if (*eptr == '/')
+               channel = strtol(eptr + 1, &eptr, 0);
+            if (*eptr != '=' || addr < 0 || addr > 0x7f || !attachModel(bus, addr, eptr + 1, channel))
+               fprintf (stderr, "ChipSim: Bad device \"%s\" on %s.\n", d, bus.name);
+         }
+      }
+      busCount++;
+   }
+}
+
+//=============================================================================
+// setup: Look up the real calls and build the simulated buses, once
+//
+static void setup()
+{
+   const char *env;
+
+   if (ready)
+      return;
+
+   realOpen = (int (*)(const char *, int, ...)) dlsym(RTLD_NEXT, "open");
+   realOpen64 = (int (*)(const char *, int, ...)) dlsym(RTLD_NEXT, "open64");
+   realClose = (int (*)(int)) dlsym(RTLD_NEXT, "close");
+   realRead = (ssize_t (*)(int, void *, size_t)) dlsym(RTLD_NEXT, "read");
+   realWrite = (ssize_t (*)(int, const void *, size_t)) dlsym(RTLD_NEXT, "write");
+   realIoctl = (int (*)(int, unsigned long, ...)) dlsym(RTLD_NEXT, "ioctl");
+
+   trace = getenv("CHIPSIM_TRACE") != NULL;
+   spiWire = getenv("CHIPSIM_SPI_WIRE") != NULL;
+   if ((env = getenv("CHIPSIM_SPI_WORD_BITS")) != NULL && atoi(env) >= 8 && atoi(env) <= 32)
+      spiWordBits = atoi(env);
+   env = getenv("CHIPSIM_DEVICES");
+   parseDevices(env != NULL ? env : DEFAULT_DEVICES);
+
+   if ((env = getenv("CHIPSIM_GPIO")) != NULL)
+      for (int i = 0 ; i < expanderCount ; ++i)
+         expanders[i].setInputs(strtol(env, NULL, 0));
+
+   if ((env = getenv("CHIPSIM_ADC")) != NULL)
+   {
+      const char *p = env;
+      for (int c = 0 ; c < 8 && *p != '\0' ; ++c)
+      {
+         char *eptr;
+         uint16_t code = strtol(p, &eptr, 0);
+         for (int i = 0 ; i < adcCount ; ++i)
+            adcs[i].setInput(c, code);
+         p = *eptr == ',' ? eptr + 1 : eptr;
+      }
+   }
+
+   if ((env = getenv("CHIPSIM_LIGHT")) != NULL)
+   {
+      char *eptr;
+      double broadband = strtod(env, &eptr);
+      double infrared = *eptr == ',' ? strtod(eptr + 1, NULL) : broadband / 5;
+      for (int i = 0 ; i < lightCount ; ++i)
+         lights[i].setLight(broadband, infrared);
+   }
+
+   if ((env = getenv("CHIPSIM_LIGHT_CYCLE")) != NULL)
+   {
+      char *eptr;
+      double ppm = strtod(env, &eptr);
+      uint16_t step = *eptr == ',' ? strtoul(eptr + 1, NULL, 0) : 0;
+      for (int i = 0 ; i < lightCount ; ++i)
+         lights[i].setCycle(ppm, step);
+   }
+
+   if ((env = getenv("CHIPSIM_SPI_MAX_HZ")) != NULL)
+      for (int i = 0 ; i < adcCount ; ++i)
+         adcs[i].setMaxClock(strtoul(env, NULL, 0));
+
+   if ((env = getenv("CHIPSIM_I2C_HZ")) != NULL)
+      for (int b = 0 ; b < busCount ; ++b)
+         buses[b].i2c.setBitRate(strtoul(env, NULL, 0));
+
+   ready = true;
+}
+
+static Bus *findBus(const char *path)
+{
+   if (path == NULL || strncmp(path, "/dev/", 5) != 0)
+      return NULL;
+   for (int b = 0 ; b < busCount ; ++b)
+      if (strcmp(path + 5, buses[b].name) == 0)
+         return &buses[b];
+   return NULL;
+}
+
+static File *findFile(int fd)
+{
+   return fd >= 0 && fd < MAX_FILES && files[fd].bus != NULL ? &files[fd] : NULL;
+}
+
+static void traceMsg(const Bus *bus, const struct i2c_msg &msg, int result)
+{
+   fprintf (stderr, "ChipSim: %s 0x%02x %c", bus->name, msg.addr, msg.flags & I2C_M_RD ? 'R' : 'W');
+   for (int i = 0 ; i < msg.len ; ++i)
+      fprintf (stderr, " %02x", msg.buf[i]);
+   fputs(result < 0 ? " NAK\n" : "\n", stderr);
+}
+
+//=============================================================================
+// i2cTransfer: Run messages on a bus, setting errno like the adapter would
+//
+static int i2cTransfer(File *f, struct i2c_msg *msgs, int count)
+{
+   int result;
+
+   pthread_mutex_lock(&f->bus->lock);
+   result = f->bus->i2c.transfer(msgs, count);
+   if (trace)
+      for (int i = 0 ; i < count ; ++i)
+         traceMsg(f->bus, msgs[i], result);
+   pthread_mutex_unlock(&f->bus->lock);
+
+   if (result < 0)
+   {
+      errno = -result;
+      return -1;
+   }
+   return 0;
+}
+
+static int simIoctl(File *f, unsigned long request, void *arg)
+{
+   if (f->bus->adc == NULL) // I2C adapter
+   {
+      switch (request)
+      {
+      case I2C_SLAVE:
+      case I2C_SLAVE_FORCE:
+      {
+         uint32_t addr = (uint32_t) (uintptr_t) arg; // Passed as an int
+         if (addr > 0x7f)
+         {
+            errno = EINVAL;
+            return -1;
+         }
+         f->addr = addr;
+         return 0;
+      }
+
+      case I2C_FUNCS:
+         *(unsigned long *) arg = I2C_FUNC_I2C;
+         return 0;
+
+      case I2C_TIMEOUT:
+      case I2C_RETRIES:
+         return 0;
+
+      case I2C_RDWR:
+      {
+         struct i2c_rdwr_ioctl_data *data = (struct i2c_rdwr_ioctl_data *) arg;
+         if (data->nmsgs > (unsigned) MAX_MSGS)
+         {
+            errno = EINVAL;
+            return -1;
+         }
+         return i2cTransfer(f, data->msgs, data->nmsgs) < 0 ? -1 : (int) data->nmsgs;
+      }
+      }
+      errno = ENOTTY;
+      return -1;
+   }
+
+   switch (request)
+   {
+   case SPI_IOC_WR_MODE: f->mode = *(uint8_t *) arg; return 0;
+   case SPI_IOC_RD_MODE: *(uint8_t *) arg = f->mode; return 0;
+   case SPI_IOC_WR_MAX_SPEED_HZ: f->speed = *(uint32_t *) arg; return 0;
+   case SPI_IOC_RD_MAX_SPEED_HZ: *(uint32_t *) arg = f->speed; return 0;
+   case SPI_IOC_RD_BITS_PER_WORD: *(uint8_t *) arg = f->bits; return 0;
+   case SPI_IOC_WR_BITS_PER_WORD:
+      if (*(uint8_t *) arg > spiWordBits || (*(uint8_t *) arg < 8 && *(uint8_t *) arg != 0))
+      {
+         errno = EINVAL;
+         return -1;
+      }
+      f->bits = *(uint8_t *) arg != 0 ? *(uint8_t *) arg : 8;
+      return 0;
+   }
+
+   if (_IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0 &&
+       _IOC_DIR(request) == _IOC_WRITE && _IOC_SIZE(request) % sizeof(struct spi_ioc_transfer) == 0)
+   {
+      const struct spi_ioc_transfer *xfers = (const struct spi_ioc_transfer *) arg;
+      int count = _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer);
+
+      for (int i = 0 ; i < count ; ++i)
+         if (xfers[i].bits_per_word > spiWordBits ||
+             (xfers[i].bits_per_word < 8 && xfers[i].bits_per_word != 0))
+         {
+            errno = EINVAL;
+            return -1;
+         }
+
+      pthread_mutex_lock(&f->bus->lock);
+      int total = f->bus->adc->message(xfers, count, f->speed, f->bits);
+      if (spiWire)
+      {
+         uint64_t nanos = 0;
+         for (int i = 0 ; i < count ; ++i)
+         {
+            uint32_t hz = xfers[i].speed_hz != 0 ? xfers[i].speed_hz : f->speed;
+            int bits = xfers[i].bits_per_word != 0 ? xfers[i].bits_per_word : f->bits;
+            uint64_t clocks = bits > 8 ? xfers[i].len / (bits > 16 ? 4 : 2) * bits : xfers[i].len * 8;
+            if (hz != 0)
+               nanos += clocks * Timing::NSEC_PER_SEC / hz;
+         }
+         Timing::sleepUntil(Timing::now() + nanos);
+      }
+      if (trace)
+         fprintf (stderr, "ChipSim: %s %d transfers, %d bytes\n", f->bus->name, count, total);
+      pthread_mutex_unlock(&f->bus->lock);
+      return total;
+   }
+
+   errno = ENOTTY;
+   return -1;
+}
+
+static int simOpen(const char *path, int (*real)(const char *, int, ...), int flags, va_list ap)
+{
+   mode_t mode = (flags & O_CREAT) ? va_arg(ap, mode_t) : 0;
+   Bus *bus;
+   int fd;
+
+   setup();
+   if ((bus = findBus(path)) == NULL)
+      return real(path, flags, mode);
+
+   if ((fd = realOpen("/dev/null", O_RDWR)) < 0)
+      return fd;
+   if (fd >= MAX_FILES)
+   {
+      realClose(fd);
+      errno = EMFILE;
+      return -1;
+   }
+   files[fd].bus = bus;
+   files[fd].addr = 0;
+   files[fd].mode = 0;
+   files[fd].bits = 8;
+   files[fd].speed = 500000;
+   return fd;
+}
+
+//=============================================================================
+// The interposed calls
+//
+extern "C" {
+
+int open(const char *path, int flags, ...)
+{
+   va_list ap;
+
+   va_start(ap, flags);
+   setup(); // Resolves the real calls passed on below
+   int fd = simOpen(path, realOpen, flags, ap);
+   va_end(ap);
+   return fd;
+}
+
+int open64(const char *path, int flags, ...)
+{
+   va_list ap;
+
+   va_start(ap, flags);
+   setup(); // Resolves the real calls passed on below
+   int fd = simOpen(path, realOpen64, flags, ap);
+   va_end(ap);
+   return fd;
+}
+
+int close(int fd)
+{
+   setup();
+   if (findFile(fd) != NULL)
+      files[fd].bus = NULL;
+   return realClose(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+   File *f;
+
+   setup();
+   if ((f = findFile(fd)) == NULL)
+      return realRead(fd, buf, count);
+   if (f->bus->adc != NULL) // spidev reads are half duplex transfers
+   {
+      struct spi_ioc_transfer xfer;
+      memset(&xfer, 0, sizeof(xfer));
+      xfer.rx_buf = (uintptr_t) buf;
+      xfer.len = count;
+      pthread_mutex_lock(&f->bus->lock);
+      f->bus->adc->message(&xfer, 1, f->speed, f->bits);
+      pthread_mutex_unlock(&f->bus->lock);
+      return count;
+   }
+
+   struct i2c_msg msg;
+   msg.addr = f->addr;
+   msg.flags = I2C_M_RD;
+   msg.len = count;
+   msg.buf = (uint8_t *) buf;
+   return i2cTransfer(f, &msg, 1) < 0 ? -1 : (ssize_t) count;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+   File *f;
+
+   setup();
+   if ((f = findFile(fd)) == NULL)
+      return realWrite(fd, buf, count);
+   if (f->bus->adc != NULL)
+   {
+      struct spi_ioc_transfer xfer;
+      memset(&xfer, 0, sizeof(xfer));
+      xfer.tx_buf = (uintptr_t) buf;
+      xfer.len = count;
+      pthread_mutex_lock(&f->bus->lock);
+      f->bus->adc->message(&xfer, 1, f->speed, f->bits);
+      pthread_mutex_unlock(&f->bus->lock);
+      return count;
+   }
+
+   struct i2c_msg msg;
+   msg.addr = f->addr;
+   msg.flags = 0;
+   msg.len = count;
+   msg.buf = (uint8_t *) buf;
+   return i2cTransfer(f, &msg, 1) < 0 ? -1 : (ssize_t) count;
+}
+
+int ioctl(int fd, unsigned long request, ...) __THROW
+{
+   va_list ap;
+   File *f;
+
+   va_start(ap, request);
+   void *arg = va_arg(ap, void *);
+   va_end(ap);
+
+   setup();
+   if ((f = findFile(fd)) == NULL)
+      return realIoctl(fd, request, arg);
+   return simIoctl(f, request, arg);
+}
+
+}